@@ -21,12 +21,16 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
 
 // #include <unistr.h>
 #include <unictype.h>
 #include <unicase.h>
+#include <uninorm.h>
 
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT1
@@ -218,6 +222,12 @@ sqlext_daap_unicode_xcollation(void *notused, int llen, const void *left, int rl
   int rpp;
   int ret;
 
+  /* Empty strings sort first; must be handled here so that the
+   * collation stays consistent when used in an index
+   */
+  if ((llen == 0) || (rlen == 0))
+    return llen - rlen;
+
   /* Extract first utf-8 character */
   ret = u8_mbtoucr(&lch, (const uint8_t *)left, llen);
   if (ret < 0)
@@ -244,6 +254,135 @@ sqlext_daap_unicode_xcollation(void *notused, int llen, const void *left, int rl
   return rpp;
 }
 
+/* Sort key matching the DAAP collation under plain binary comparison:
+ * a leading byte puts strings starting with a letter before the others,
+ * followed by the case folded NFD form of the string.
+ */
+static void
+sqlext_daap_sortkey_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  const uint8_t *str;
+  uint8_t *folded;
+  char *key;
+  size_t foldedlen;
+  ucs4_t ch;
+  int len;
+  int ret;
+
+  if (n != 1)
+    {
+      sqlite3_result_error(pv, "daap_sortkey() requires 1 parameter", -1);
+      return;
+    }
+
+  if (sqlite3_value_type(ppv[0]) != SQLITE_TEXT)
+    {
+      sqlite3_result_null(pv);
+      return;
+    }
+
+  str = sqlite3_value_text(ppv[0]);
+  len = sqlite3_value_bytes(ppv[0]);
+
+  if (len == 0)
+    {
+      sqlite3_result_text(pv, "", 0, SQLITE_STATIC);
+      return;
+    }
+
+  ret = u8_mbtoucr(&ch, str, len);
+  if (ret < 0)
+    {
+      /* Invalid UTF-8, sort it raw after everything else */
+      key = sqlite3_mprintf("\x7f%.*s", len, str);
+      if (!key)
+	{
+	  sqlite3_result_error_nomem(pv);
+	  return;
+	}
+
+      sqlite3_result_text(pv, key, -1, sqlite3_free);
+      return;
+    }
+
+  folded = u8_casefold(str, len, NULL, UNINORM_NFD, NULL, &foldedlen);
+  if (!folded)
+    {
+      sqlite3_result_error_nomem(pv);
+      return;
+    }
+
+  key = sqlite3_malloc(foldedlen + 1);
+  if (!key)
+    {
+      free(folded);
+
+      sqlite3_result_error_nomem(pv);
+      return;
+    }
+
+  key[0] = (uc_is_alpha(ch)) ? '0' : '1';
+  memcpy(key + 1, folded, foldedlen);
+
+  free(folded);
+
+  sqlite3_result_text(pv, key, foldedlen + 1, sqlite3_free);
+}
+
+/* Index letter of the DAAP sort headers: the first character of the NFD
+ * form of the string, upper case, if it is an ASCII letter; 0 otherwise.
+ */
+static void
+sqlext_daap_sortletter_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  const uint8_t *str;
+  uint8_t *norm;
+  size_t normlen;
+  int letter;
+  int len;
+
+  if (n != 1)
+    {
+      sqlite3_result_error(pv, "daap_sortletter() requires 1 parameter", -1);
+      return;
+    }
+
+  if (sqlite3_value_type(ppv[0]) != SQLITE_TEXT)
+    {
+      sqlite3_result_int(pv, 0);
+      return;
+    }
+
+  str = sqlite3_value_text(ppv[0]);
+  len = sqlite3_value_bytes(ppv[0]);
+
+  if (len == 0)
+    {
+      sqlite3_result_int(pv, 0);
+      return;
+    }
+
+  norm = u8_normalize(UNINORM_NFD, str, len, NULL, &normlen);
+  if (!norm)
+    {
+      if (errno == ENOMEM)
+	sqlite3_result_error_nomem(pv);
+      else
+	sqlite3_result_int(pv, 0); /* Invalid UTF-8 */
+
+      return;
+    }
+
+  if ((normlen > 0) && isascii(norm[0]) && isalpha(norm[0]))
+    letter = toupper(norm[0]);
+  else
+    letter = 0;
+
+  free(norm);
+
+  sqlite3_result_int(pv, letter);
+}
+
 
 int
 sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
@@ -260,6 +399,24 @@ sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines
       return -1;
     }
 
+  ret = sqlite3_create_function(db, "daap_sortkey", 1, SQLITE_UTF8, NULL, sqlext_daap_sortkey_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      if (pzErrMsg)
+	*pzErrMsg = sqlite3_mprintf("Could not create daap_sortkey function: %s\n", sqlite3_errmsg(db));
+
+      return -1;
+    }
+
+  ret = sqlite3_create_function(db, "daap_sortletter", 1, SQLITE_UTF8, NULL, sqlext_daap_sortletter_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      if (pzErrMsg)
+	*pzErrMsg = sqlite3_mprintf("Could not create daap_sortletter function: %s\n", sqlite3_errmsg(db));
+
+      return -1;
+    }
+
   ret = sqlite3_create_collation(db, "DAAP", SQLITE_UTF8, NULL, sqlext_daap_unicode_xcollation);
   if (ret != SQLITE_OK)
     {
@@ -94,7 +94,7 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 			pANTLR3_UINT8 escaped;
 			ANTLR3_UINT8 op;
 			int neg_op;
-			struct dmap_query_field_map *dqfm;
+			const struct dmap_query_field_map *dqfm;
 			char *end;
 			long long llval;
 
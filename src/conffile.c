@@ -46,6 +46,14 @@ static cfg_opt_t sec_general[] =
     CFG_STR("admin_password", NULL, CFGF_NONE),
     CFG_STR("logfile", STATEDIR "/log/" PACKAGE ".log", CFGF_NONE),
     CFG_STR("db_path", STATEDIR "/cache/" PACKAGE "/songs3.db", CFGF_NONE),
+    CFG_INT("db_batch_size", 500, CFGF_NONE),
+    CFG_INT("db_batch_latency", 1000, CFGF_NONE),
+    CFG_INT("db_pragma_synchronous", 1, CFGF_NONE),
+    CFG_INT("db_pragma_cache_size", -1, CFGF_NONE),
+    CFG_INT("db_pragma_mmap_size", -1, CFGF_NONE),
+    CFG_INT("db_wal_checkpoint", 1000, CFGF_NONE),
+    CFG_BOOL("db_profile", cfg_true, CFGF_NONE),
+    CFG_INT("db_slow_query", 0, CFGF_NONE),
     CFG_INT_CB("loglevel", E_LOG, CFGF_NONE, &cb_loglevel),
     CFG_END()
   };
@@ -61,6 +69,8 @@ static cfg_opt_t sec_library[] =
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_STR_LIST("no_transcode", NULL, CFGF_NONE),
     CFG_STR_LIST("force_transcode", NULL, CFGF_NONE),
+    CFG_INT("songlist_stream_tracks", 10000, CFGF_NONE),
+    CFG_INT("reply_cache_size", 32, CFGF_NONE),
     CFG_END()
   };
 
@@ -23,9 +23,6 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
-#include <errno.h>
-
-#include <avl.h>
 
 #include "logger.h"
 #include "misc.h"
@@ -36,71 +33,14 @@
 #include "DAAP2SQL.h"
 
 
-static struct dmap_query_field_map dmap_query_fields[] =
-{
-  { 0, 0, "dmap.itemname",              "title" },
-  { 0, 1, "dmap.itemid",                "id" },
-  { 0, 0, "daap.songalbum",             "album" },
-  { 0, 1, "daap.songalbumid",           "songalbumid" },
-  { 0, 0, "daap.songartist",            "artist" },
-  { 0, 0, "daap.songalbumartist",       "album_artist" },
-  { 0, 1, "daap.songbitrate",           "bitrate" },
-  { 0, 0, "daap.songcomment",           "comment" },
-  { 0, 1, "daap.songcompilation",       "compilation" },
-  { 0, 0, "daap.songcomposer",          "composer" },
-  { 0, 1, "daap.songdatakind",          "data_kind" },
-  { 0, 0, "daap.songdataurl",           "url" },
-  { 0, 1, "daap.songdateadded",         "time_added" },
-  { 0, 1, "daap.songdatemodified",      "time_modified" },
-  { 0, 0, "daap.songdescription",       "description" },
-  { 0, 1, "daap.songdisccount",         "total_discs" },
-  { 0, 1, "daap.songdiscnumber",        "disc" },
-  { 0, 0, "daap.songformat",            "type" },
-  { 0, 0, "daap.songgenre",             "genre" },
-  { 0, 1, "daap.songsamplerate",        "samplerate" },
-  { 0, 1, "daap.songsize",              "file_size" },
-  { 0, 1, "daap.songstoptime",          "song_length" },
-  { 0, 1, "daap.songtime",              "song_length" },
-  { 0, 1, "daap.songtrackcount",        "total_tracks" },
-  { 0, 1, "daap.songtracknumber",       "track" },
-  { 0, 1, "daap.songyear",              "year" },
-  { 0, 1, "com.apple.itunes.mediakind", "media_kind" },
-
-  { -1, -1, NULL, NULL }
-};
+/* Generated from dmap_fields.def */
+#include "dmap_query_fields_hash.h"
 
-static avl_tree_t *dmap_query_fields_hash;
 
-
-static int
-dmap_query_field_map_compare(const void *aa, const void *bb)
-{
-  struct dmap_query_field_map *a = (struct dmap_query_field_map *)aa;
-  struct dmap_query_field_map *b = (struct dmap_query_field_map *)bb;
-
-  if (a->hash < b->hash)
-    return -1;
-
-  if (a->hash > b->hash)
-    return 1;
-
-  return 0;
-}
-
-
-struct dmap_query_field_map *
+const struct dmap_query_field_map *
 daap_query_field_lookup(char *field)
 {
-  struct dmap_query_field_map dqfm;
-  avl_node_t *node;
-
-  dqfm.hash = djb_hash(field, strlen(field));
-
-  node = avl_search(dmap_query_fields_hash, &dqfm);
-  if (!node)
-    return NULL;
-
-  return (struct dmap_query_field_map *)node->item;
+  return dmap_query_fields_find(field);
 }
 
 char *
@@ -214,56 +154,3 @@ daap_query_parse_sql(const char *daap_query)
 
   return ret;
 }
-
-int
-daap_query_init(void)
-{
-  avl_node_t *node;
-  struct dmap_query_field_map *dqfm;
-  int i;
-
-  dmap_query_fields_hash = avl_alloc_tree(dmap_query_field_map_compare, NULL);
-  if (!dmap_query_fields_hash)
-    {
-      DPRINTF(E_FATAL, L_DAAP, "DAAP query init could not allocate AVL tree\n");
-
-      return -1;
-    }
-
-  for (i = 0; dmap_query_fields[i].hash == 0; i++)
-    {
-      dmap_query_fields[i].hash = djb_hash(dmap_query_fields[i].dmap_field, strlen(dmap_query_fields[i].dmap_field));
-
-      node = avl_insert(dmap_query_fields_hash, &dmap_query_fields[i]);
-      if (!node)
-        {
-          if (errno != EEXIST)
-            DPRINTF(E_FATAL, L_DAAP, "DAAP query init failed; AVL insert error: %s\n", strerror(errno));
-          else
-            {
-              node = avl_search(dmap_query_fields_hash, &dmap_query_fields[i]);
-              dqfm = node->item;
-
-              DPRINTF(E_FATAL, L_DAAP, "DAAP query init failed; WARNING: duplicate hash key\n");
-              DPRINTF(E_FATAL, L_DAAP, "Hash %x, string %s\n", dmap_query_fields[i].hash, dmap_query_fields[i].dmap_field);
-
-              DPRINTF(E_FATAL, L_DAAP, "Hash %x, string %s\n", dqfm->hash, dqfm->dmap_field);
-            }
-
-          goto avl_insert_fail;
-        }
-    }
-
-  return 0;
-
- avl_insert_fail:
-  avl_free_tree(dmap_query_fields_hash);
-
-  return -1;
-}
-
-void
-daap_query_deinit(void)
-{
-  avl_free_tree(dmap_query_fields_hash);
-}
@@ -27,11 +27,13 @@
 #include <time.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include <assert.h>
 
-#include <pthread.h>
 
 #include <sqlite3.h>
 
@@ -52,12 +54,28 @@ enum group_type {
   G_ALBUMS = 1,
 };
 
-struct db_unlock {
-  int proceed;
-  pthread_cond_t cond;
-  pthread_mutex_t lck;
+/* Must match the type values used in the browse triggers */
+enum browse_type {
+  B_ARTISTS = 1,
+  B_ALBUMS = 2,
+  B_GENRES = 3,
+  B_COMPOSERS = 4,
+  B_ALBUM_ARTISTS = 5,
 };
 
+/* How long a writer waits for another writer to commit, in milliseconds */
+#define DB_BUSY_TIMEOUT 10000
+
+/* WAL pages before a checkpoint if db_wal_checkpoint is 0, as SQLite */
+#define DB_WAL_AUTOCHECKPOINT 1000
+
+/* Library revisions back that a delta can be answered from; the change log
+ * keeps a few more, so a revision sealed between the check and the query
+ * doesn't prune rows the delta needs
+ */
+#define DB_CHANGES_HORIZON 1000
+#define DB_CHANGES_KEEP    (DB_CHANGES_HORIZON + 100)
+
 #define DB_TYPE_CHAR    1
 #define DB_TYPE_INT     2
 #define DB_TYPE_INT64   3
@@ -123,6 +141,11 @@ static const struct col_type_map mfi_cols_map[] =
     { mfi_offsetof(tv_episode_sort),    DB_TYPE_INT },
     { mfi_offsetof(tv_season_num),      DB_TYPE_INT },
     { mfi_offsetof(songalbumid),        DB_TYPE_INT64 },
+    { mfi_offsetof(title_sort),         DB_TYPE_STRING },
+    { mfi_offsetof(artist_sort),        DB_TYPE_STRING },
+    { mfi_offsetof(album_sort),         DB_TYPE_STRING },
+    { mfi_offsetof(album_artist_sort),  DB_TYPE_STRING },
+    { mfi_offsetof(title_letter),       DB_TYPE_INT },
   };
 
 /* This list must be kept in sync with
@@ -146,59 +169,64 @@ static const struct col_type_map pli_cols_map[] =
 
 /* This list must be kept in sync with
  * - the order of the columns in the files table
- * - the name of the fields in struct db_media_file_info
+ * - the type and name of the fields in struct db_media_file_info
  */
-static const ssize_t dbmfi_cols_map[] =
+static const struct col_type_map dbmfi_cols_map[] =
   {
-    dbmfi_offsetof(id),
-    dbmfi_offsetof(path),
-    dbmfi_offsetof(fname),
-    dbmfi_offsetof(title),
-    dbmfi_offsetof(artist),
-    dbmfi_offsetof(album),
-    dbmfi_offsetof(genre),
-    dbmfi_offsetof(comment),
-    dbmfi_offsetof(type),
-    dbmfi_offsetof(composer),
-    dbmfi_offsetof(orchestra),
-    dbmfi_offsetof(conductor),
-    dbmfi_offsetof(grouping),
-    dbmfi_offsetof(url),
-    dbmfi_offsetof(bitrate),
-    dbmfi_offsetof(samplerate),
-    dbmfi_offsetof(song_length),
-    dbmfi_offsetof(file_size),
-    dbmfi_offsetof(year),
-    dbmfi_offsetof(track),
-    dbmfi_offsetof(total_tracks),
-    dbmfi_offsetof(disc),
-    dbmfi_offsetof(total_discs),
-    dbmfi_offsetof(bpm),
-    dbmfi_offsetof(compilation),
-    dbmfi_offsetof(rating),
-    dbmfi_offsetof(play_count),
-    dbmfi_offsetof(data_kind),
-    dbmfi_offsetof(item_kind),
-    dbmfi_offsetof(description),
-    dbmfi_offsetof(time_added),
-    dbmfi_offsetof(time_modified),
-    dbmfi_offsetof(time_played),
-    dbmfi_offsetof(db_timestamp),
-    dbmfi_offsetof(disabled),
-    dbmfi_offsetof(sample_count),
-    dbmfi_offsetof(codectype),
-    dbmfi_offsetof(idx),
-    dbmfi_offsetof(has_video),
-    dbmfi_offsetof(contentrating),
-    dbmfi_offsetof(bits_per_sample),
-    dbmfi_offsetof(album_artist),
-    dbmfi_offsetof(media_kind),
-    dbmfi_offsetof(tv_series_name),
-    dbmfi_offsetof(tv_episode_num_str),
-    dbmfi_offsetof(tv_network_name),
-    dbmfi_offsetof(tv_episode_sort),
-    dbmfi_offsetof(tv_season_num),
-    dbmfi_offsetof(songalbumid),
+    { dbmfi_offsetof(id),                 DB_TYPE_INT64 },
+    { dbmfi_offsetof(path),               DB_TYPE_STRING },
+    { dbmfi_offsetof(fname),              DB_TYPE_STRING },
+    { dbmfi_offsetof(title),              DB_TYPE_STRING },
+    { dbmfi_offsetof(artist),             DB_TYPE_STRING },
+    { dbmfi_offsetof(album),              DB_TYPE_STRING },
+    { dbmfi_offsetof(genre),              DB_TYPE_STRING },
+    { dbmfi_offsetof(comment),            DB_TYPE_STRING },
+    { dbmfi_offsetof(type),               DB_TYPE_STRING },
+    { dbmfi_offsetof(composer),           DB_TYPE_STRING },
+    { dbmfi_offsetof(orchestra),          DB_TYPE_STRING },
+    { dbmfi_offsetof(conductor),          DB_TYPE_STRING },
+    { dbmfi_offsetof(grouping),           DB_TYPE_STRING },
+    { dbmfi_offsetof(url),                DB_TYPE_STRING },
+    { dbmfi_offsetof(bitrate),            DB_TYPE_INT64 },
+    { dbmfi_offsetof(samplerate),         DB_TYPE_INT64 },
+    { dbmfi_offsetof(song_length),        DB_TYPE_INT64 },
+    { dbmfi_offsetof(file_size),          DB_TYPE_INT64 },
+    { dbmfi_offsetof(year),               DB_TYPE_INT64 },
+    { dbmfi_offsetof(track),              DB_TYPE_INT64 },
+    { dbmfi_offsetof(total_tracks),       DB_TYPE_INT64 },
+    { dbmfi_offsetof(disc),               DB_TYPE_INT64 },
+    { dbmfi_offsetof(total_discs),        DB_TYPE_INT64 },
+    { dbmfi_offsetof(bpm),                DB_TYPE_INT64 },
+    { dbmfi_offsetof(compilation),        DB_TYPE_INT64 },
+    { dbmfi_offsetof(rating),             DB_TYPE_INT64 },
+    { dbmfi_offsetof(play_count),         DB_TYPE_INT64 },
+    { dbmfi_offsetof(data_kind),          DB_TYPE_INT64 },
+    { dbmfi_offsetof(item_kind),          DB_TYPE_INT64 },
+    { dbmfi_offsetof(description),        DB_TYPE_STRING },
+    { dbmfi_offsetof(time_added),         DB_TYPE_INT64 },
+    { dbmfi_offsetof(time_modified),      DB_TYPE_INT64 },
+    { dbmfi_offsetof(time_played),        DB_TYPE_INT64 },
+    { dbmfi_offsetof(db_timestamp),       DB_TYPE_INT64 },
+    { dbmfi_offsetof(disabled),           DB_TYPE_INT64 },
+    { dbmfi_offsetof(sample_count),       DB_TYPE_INT64 },
+    { dbmfi_offsetof(codectype),          DB_TYPE_STRING },
+    { dbmfi_offsetof(idx),                DB_TYPE_INT64 },
+    { dbmfi_offsetof(has_video),          DB_TYPE_INT64 },
+    { dbmfi_offsetof(contentrating),      DB_TYPE_INT64 },
+    { dbmfi_offsetof(bits_per_sample),    DB_TYPE_INT64 },
+    { dbmfi_offsetof(album_artist),       DB_TYPE_STRING },
+    { dbmfi_offsetof(media_kind),         DB_TYPE_INT64 },
+    { dbmfi_offsetof(tv_series_name),     DB_TYPE_STRING },
+    { dbmfi_offsetof(tv_episode_num_str), DB_TYPE_STRING },
+    { dbmfi_offsetof(tv_network_name),    DB_TYPE_STRING },
+    { dbmfi_offsetof(tv_episode_sort),    DB_TYPE_INT64 },
+    { dbmfi_offsetof(tv_season_num),      DB_TYPE_INT64 },
+    { dbmfi_offsetof(songalbumid),        DB_TYPE_INT64 },
+    { dbmfi_offsetof(title_sort),         DB_TYPE_STRING },
+    { dbmfi_offsetof(artist_sort),        DB_TYPE_STRING },
+    { dbmfi_offsetof(album_sort),         DB_TYPE_STRING },
+    { dbmfi_offsetof(album_artist_sort),  DB_TYPE_STRING },
+    { dbmfi_offsetof(title_letter),       DB_TYPE_INT64 },
   };
 
 /* This list must be kept in sync with
@@ -246,24 +274,187 @@ static const struct col_type_map wi_cols_map[] =
 
 /* Sort clauses */
 /* Keep in sync with enum sort_type */
-static const char *sort_clause[] =
+/* Columns results are ordered by; the last one is unique, which makes the
+ * order total so a paged query can resume after the last row of a page
+ */
+static const char *sort_keys[][QC_MAX_KEYS + 1] =
   {
-    "",
-    "ORDER BY title COLLATE DAAP ASC",
-    "ORDER BY album COLLATE DAAP ASC, disc ASC, track ASC",
-    "ORDER BY artist COLLATE DAAP ASC",
+    { "id", NULL },
+    { "title_sort", "id", NULL },
+    { "album_sort", "disc", "track", "id", NULL },
+    { "artist_sort", "id", NULL },
   };
 
+static const char *plitems_keys[] = { "playlistitems.id", NULL };
+static const char *browse_keys[] = { "sort_key", NULL };
+
+/* Cached prepared statements, see db_stmt_get() */
+enum db_stmt_id {
+  DB_STMT_PURGE_PLITEMS = 0,
+  DB_STMT_PURGE_PL,
+  DB_STMT_PURGE_FILES,
+
+  DB_STMT_FILE_COUNT,
+  DB_STMT_FILE_INC_PLAYCOUNT,
+  DB_STMT_FILE_PING_BYID,
+  DB_STMT_FILE_PATH_BYID,
+  DB_STMT_FILE_ID_BYPATH,
+  DB_STMT_FILE_ID_BYFILEBASE,
+  DB_STMT_FILE_ID_BYFILE,
+  DB_STMT_FILE_ID_BYURL,
+  DB_STMT_FILE_STAMP_BYPATH,
+  DB_STMT_FILE_FETCH_BYID,
+  DB_STMT_FILE_DBMFI_BYID,
+  DB_STMT_FILE_ADD,
+  DB_STMT_FILE_UPDATE,
+  DB_STMT_FILE_DELETE_BYPATH,
+  DB_STMT_FILE_DISABLE_BYPATH,
+  DB_STMT_FILE_DISABLE_BYMATCH,
+  DB_STMT_FILE_ENABLE_BYCOOKIE,
+
+  DB_STMT_PL_COUNT,
+  DB_STMT_PL_COUNT_ITEMS,
+  DB_STMT_PL_PING,
+  DB_STMT_PL_ID_BYPATH,
+  DB_STMT_PL_FETCH_BYPATH,
+  DB_STMT_PL_FETCH_BYID,
+  DB_STMT_PL_FETCH_BYTITLEPATH,
+  DB_STMT_PL_DUP,
+  DB_STMT_PL_ADD,
+  DB_STMT_PL_ADD_ITEM_BYPATH,
+  DB_STMT_PL_ADD_ITEM_BYID,
+  DB_STMT_PL_CLEAR_ITEMS,
+  DB_STMT_PL_DELETE,
+  DB_STMT_PL_DISABLE_BYPATH,
+  DB_STMT_PL_DISABLE_BYMATCH,
+  DB_STMT_PL_ENABLE_BYCOOKIE,
+
+  DB_STMT_GROUP_TYPE_BYID,
+
+  DB_STMT_LIBRARY_REV,
+  DB_STMT_LIBRARY_REV_SEAL,
+  DB_STMT_CHANGES_PRUNE,
+  DB_STMT_CHANGES_IDS,
+
+  DB_STMT_PAIRING_DELETE_BYREMOTE,
+  DB_STMT_PAIRING_ADD,
+  DB_STMT_PAIRING_FETCH_BYGUID,
+
+  DB_STMT_SPEAKER_SAVE,
+  DB_STMT_SPEAKER_GET,
+
+  DB_STMT_WATCH_ADD,
+  DB_STMT_WATCH_DELETE_BYWD,
+  DB_STMT_WATCH_DELETE_BYPATH,
+  DB_STMT_WATCH_DELETE_BYMATCH,
+  DB_STMT_WATCH_DELETE_BYCOOKIE,
+  DB_STMT_WATCH_GET_BYWD,
+  DB_STMT_WATCH_MARK_BYPATH,
+  DB_STMT_WATCH_MARK_BYMATCH,
+  DB_STMT_WATCH_MOVE_BYCOOKIE,
+  DB_STMT_WATCH_COOKIE_KNOWN,
+
+  DB_STMT_MAX
+};
+
 static char *db_path;
+static int db_batch_size;
+static int db_batch_latency;
+static int db_pragma_synchronous;
+static int db_pragma_cache_size;
+static int64_t db_pragma_mmap_size;
+static int db_wal_checkpoint;
 static __thread sqlite3 *hdl;
+static __thread sqlite3_stmt *db_stmts[DB_STMT_MAX];
+static __thread uint64_t db_stmt_hits;
+static __thread uint64_t db_stmt_misses;
+
+/* Scan batching, see db_scan_batch_begin() */
+static __thread int batch_active;
+static __thread int batch_count;
+static __thread struct timespec batch_start;
+
+/* Scan generation, see db_scan_generation_begin() */
+static __thread int gen_active;
+static __thread int gen_failed;
+static __thread uint8_t *gen_seen;
+static __thread int gen_seen_size;
+
+/* Library revision, bumped after each commit that changed files or
+ * playlists; see db_wal_hook(). Only tracked in WAL mode. This is not the
+ * library_revision clients see: it is in-process only and keys the count
+ * caches, so it has to move on every commit, mid-scan included.
+ */
+static int db_rev_enabled;
+static uint32_t db_rev;
+static __thread int db_rev_dirty;
+static pthread_mutex_t db_rev_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called when a new library revision is sealed, under db_rev_lck */
+static db_library_handler library_update_handler;
+
+/* Set once the files_fts search index is usable, see db_search_init() */
+static int db_search_enabled;
+
+/* Playlist item counts, valid for pl_count_rev */
+#define PL_COUNT_BUCKETS 64
+
+struct pl_count {
+  int id;
+  int items;
+
+  struct pl_count *next;
+};
+
+static struct pl_count *pl_counts[PL_COUNT_BUCKETS];
+static uint32_t pl_count_rev;
+
+/* Active files count, valid for files_count_rev */
+static int files_count = -1;
+static uint32_t files_count_rev;
+
+/* SQL profiling, see db_profile_step() */
+#define PROFILE_SHAPES  256
+#define PROFILE_SQL_MAX 512
+#define PROFILE_RUNS    8
+
+struct profile_shape {
+  char *shape;
+  uint32_t hash;
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint32_t hist[DB_PROFILE_BUCKETS];
+  char *plan;
+};
+
+/* Statement being stepped, ns accumulated so far */
+struct profile_run {
+  sqlite3_stmt *stmt;
+  uint64_t ns;
+  char shape[PROFILE_SQL_MAX];
+};
+
+static int db_profile;
+static int db_slow_query;
+static struct profile_shape profile_shapes[PROFILE_SHAPES];
+static struct profile_shape profile_other;
+static int profile_nshapes;
+static pthread_mutex_t profile_lck = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct profile_run profile_runs[PROFILE_RUNS];
+static __thread int profile_evict;
+static __thread int profile_explaining;
 
 
 /* Forward */
 static int
-db_pl_count_items(int id);
+db_pl_count_cached(int id, int type, const char *smartpl_query, uint32_t rev);
 
-static int
-db_smartpl_count_items(const char *smartpl_query);
+static void
+db_profile_step(sqlite3_stmt *stmt, struct timespec *start, int done);
+
+static void
+db_profile_end(sqlite3_stmt *stmt);
 
 struct playlist_info *
 db_pl_fetch_byid(int id);
@@ -365,6 +556,18 @@ free_mfi(struct media_file_info *mfi, int content_only)
   if (mfi->tv_network_name)
     free(mfi->tv_network_name);
 
+  if (mfi->title_sort)
+    free(mfi->title_sort);
+
+  if (mfi->artist_sort)
+    free(mfi->artist_sort);
+
+  if (mfi->album_sort)
+    free(mfi->album_sort);
+
+  if (mfi->album_artist_sort)
+    free(mfi->album_artist_sort);
+
   if (!content_only)
     free(mfi);
 }
@@ -420,71 +623,35 @@ free_pli(struct playlist_info *pli, int content_only)
 }
 
 
-/* Unlock notification support */
-static void
-unlock_notify_cb(void **args, int nargs)
-{
-  struct db_unlock *u;
-  int i;
-
-  for (i = 0; i < nargs; i++)
-    {
-      u = (struct db_unlock *)args[i];
-
-      pthread_mutex_lock(&u->lck);
-
-      u->proceed = 1;
-      pthread_cond_signal(&u->cond);
-
-      pthread_mutex_unlock(&u->lck);
-    }
-}
-
+/* Each thread has a private connection and the database runs in WAL mode:
+ * readers work on a snapshot and never wait, writers wait on each other
+ * through the busy handler installed in db_perthread_init().
+ */
 static int
-db_wait_unlock(void)
+db_blocking_step(sqlite3_stmt *stmt)
 {
-  struct db_unlock u;
+  struct timespec start;
   int ret;
 
-  u.proceed = 0;
-  pthread_mutex_init(&u.lck, NULL);
-  pthread_cond_init(&u.cond, NULL);
+  if (db_profile)
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-  ret = sqlite3_unlock_notify(hdl, unlock_notify_cb, &u);
-  if (ret == SQLITE_OK)
-    {
-      pthread_mutex_lock(&u.lck);
-
-      if (!u.proceed)
-	pthread_cond_wait(&u.cond, &u.lck);
-
-      pthread_mutex_unlock(&u.lck);
-    }
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_BUSY)
+    DPRINTF(E_LOG, L_DB, "Database still busy after %d ms, giving up\n", DB_BUSY_TIMEOUT);
 
-  pthread_cond_destroy(&u.cond);
-  pthread_mutex_destroy(&u.lck);
+  if (db_profile)
+    db_profile_step(stmt, &start, (ret != SQLITE_ROW));
 
   return ret;
 }
 
-static int
-db_blocking_step(sqlite3_stmt *stmt)
+static void
+db_stmt_finalize(sqlite3_stmt *stmt)
 {
-  int ret;
-
-  while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
-    {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
-	}
-
-      sqlite3_reset(stmt);
-    }
+  db_profile_end(stmt);
 
-  return ret;
+  sqlite3_finalize(stmt);
 }
 
 static int
@@ -492,15 +659,9 @@ db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const ch
 {
   int ret;
 
-  while ((ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_LOCKED)
-    {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
-	}
-    }
+  ret = sqlite3_prepare_v2(hdl, query, len, stmt, end);
+  if (ret == SQLITE_BUSY)
+    DPRINTF(E_LOG, L_DB, "Database still busy after %d ms, giving up\n", DB_BUSY_TIMEOUT);
 
   return ret;
 }
@@ -529,51 +690,172 @@ db_exec(const char *query, char **errmsg)
     {
       *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
+      db_stmt_finalize(stmt);
       return ret;
     }
 
-  sqlite3_finalize(stmt);
+  db_stmt_finalize(stmt);
+
+  return SQLITE_OK;
+}
+
+
+/* Prepared statements cache
+ * Fixed-shape queries are prepared once per thread and reused with
+ * bound parameters; statements are finalized in db_perthread_deinit().
+ */
+static sqlite3_stmt *
+db_stmt_get(enum db_stmt_id id, const char *query)
+{
+  int ret;
+
+  if (db_stmts[id])
+    {
+      db_stmt_hits++;
+      return db_stmts[id];
+    }
+
+  db_stmt_misses++;
+
+  ret = db_blocking_prepare_v2(query, -1, &db_stmts[id], NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmts[id] = NULL;
+      return NULL;
+    }
+
+  return db_stmts[id];
+}
+
+static void
+db_stmt_reset(sqlite3_stmt *stmt)
+{
+  db_profile_end(stmt);
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+/* Modelled after db_exec(), for cached statements */
+static int
+db_stmt_exec(sqlite3_stmt *stmt, char **errmsg)
+{
+  int ret;
+
+  *errmsg = NULL;
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    ; /* EMPTY */
+
+  if (ret != SQLITE_DONE)
+    {
+      *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(hdl));
+
+      db_stmt_reset(stmt);
+      return ret;
+    }
+
+  db_stmt_reset(stmt);
 
   return SQLITE_OK;
 }
 
+static int
+db_stmt_get_count(enum db_stmt_id id, const char *query)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(id, query);
+  if (!stmt)
+    return -1;
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_reset(stmt);
+      return -1;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_reset(stmt);
+
+  return ret;
+}
+
+void
+db_stmt_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+  *hits = db_stmt_hits;
+  *misses = db_stmt_misses;
+}
+
+/* Current library revision; returns -1 if revisions aren't tracked */
+int
+db_revision(uint32_t *rev)
+{
+  int enabled;
+
+  pthread_mutex_lock(&db_rev_lck);
+
+  *rev = db_rev;
+  enabled = db_rev_enabled;
+
+  pthread_mutex_unlock(&db_rev_lck);
+
+  return (enabled) ? 0 : -1;
+}
+
 
 void
 db_purge_cruft(time_t ref)
 {
+  sqlite3_stmt *stmt;
   char *errmsg;
   int i;
   int ret;
-  char *queries[3] = { NULL, NULL, NULL };
-  char *queries_tmpl[3] =
+  const enum db_stmt_id ids[3] =
+    {
+      DB_STMT_PURGE_PLITEMS,
+      DB_STMT_PURGE_PL,
+      DB_STMT_PURGE_FILES,
+    };
+  const char *queries[3] =
     {
-      "DELETE FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists WHERE type <> 1 AND db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlists WHERE type <> 1 AND db_timestamp < %" PRIi64 ";",
-      "DELETE FROM files WHERE db_timestamp < %" PRIi64 ";"
+      "DELETE FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists WHERE type <> 1 AND db_timestamp < ?);",
+      "DELETE FROM playlists WHERE type <> 1 AND db_timestamp < ?;",
+      "DELETE FROM files WHERE db_timestamp < ? AND NOT scan_seen(id);"
     };
 
-  if (sizeof(queries) != sizeof(queries_tmpl))
+  if (sizeof(queries) / sizeof(queries[0]) != sizeof(ids) / sizeof(ids[0]))
     {
-      DPRINTF(E_LOG, L_DB, "db_purge_cruft(): queries out of sync with queries_tmpl\n");
+      DPRINTF(E_LOG, L_DB, "db_purge_cruft(): queries out of sync with ids\n");
       return;
     }
 
-  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
+  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
     {
-      queries[i] = sqlite3_mprintf(queries_tmpl[i], (int64_t)ref);
-      if (!queries[i])
+      /* Files that couldn't be marked as seen would be purged while still there */
+      if ((ids[i] == DB_STMT_PURGE_FILES) && gen_failed)
 	{
-	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-	  goto purge_fail;
+	  DPRINTF(E_LOG, L_DB, "Scan generation incomplete, not purging files after this scan\n");
+	  continue;
 	}
-    }
 
-  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
-    {
-      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", queries[i]);
+      DPRINTF(E_DBG, L_DB, "Running purge query '%s' (ref %" PRIi64 ")\n", queries[i], (int64_t)ref);
+
+      stmt = db_stmt_get(ids[i], queries[i]);
+      if (!stmt)
+	continue;
 
-      ret = db_exec(queries[i], &errmsg);
+      sqlite3_bind_int64(stmt, 1, (int64_t)ref);
+
+      ret = db_stmt_exec(stmt, &errmsg);
       if (ret != SQLITE_OK)
 	{
 	  DPRINTF(E_LOG, L_DB, "Purge query %d error: %s\n", i, errmsg);
@@ -583,13 +865,6 @@ db_purge_cruft(time_t ref)
       else
 	DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
     }
-
- purge_fail:
-  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
-    {
-      sqlite3_free(queries[i]);
-    }
-
 }
 
 static int
@@ -612,429 +887,533 @@ db_get_count(char *query)
     {
       DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
 
-      sqlite3_finalize(stmt);
+      db_stmt_finalize(stmt);
       return -1;
     }
 
   ret = sqlite3_column_int(stmt, 0);
 
-  sqlite3_finalize(stmt);
+  db_stmt_finalize(stmt);
 
   return ret;
 }
 
 
-/* Queries */
+/* Scan batching
+ * During a bulk scan, file adds, updates and pings are grouped in a single
+ * transaction instead of running as one autocommit transaction each. The
+ * transaction is committed and reopened every db_batch_size writes or every
+ * db_batch_latency milliseconds, whichever comes first, so writers on other
+ * threads don't wait on the scanner for too long. Readers are not held up,
+ * they keep working on the last committed snapshot.
+ */
 static int
-db_build_query_index_clause(struct query_params *qp, char **i)
+db_scan_batch_open(void)
 {
-  char *idx;
+  char *errmsg;
+  int ret;
 
-  switch (qp->idx_type)
+  /* Take the write lock upfront; a deferred transaction would fail to
+   * upgrade if another connection committed since our first read
+   */
+  ret = db_exec("BEGIN IMMEDIATE TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
     {
-      case I_FIRST:
-	idx = sqlite3_mprintf("LIMIT %d", qp->limit);
-	break;
-
-      case I_LAST:
-	idx = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->limit, qp->results - qp->limit);
-	break;
-
-      case I_SUB:
-	idx = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
-	break;
-
-      case I_NONE:
-	*i = NULL;
-	return 0;
-
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown index type\n");
-	return -1;
-    }
+      DPRINTF(E_LOG, L_DB, "Could not begin scan batch: %s\n", errmsg);
 
-  if (!idx)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not build index string; out of memory");
+      sqlite3_free(errmsg);
       return -1;
     }
 
-  *i = idx;
+  batch_count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &batch_start);
 
   return 0;
 }
 
 static int
-db_build_query_items(struct query_params *qp, char **q)
+db_scan_batch_close(void)
 {
-  char *query;
-  char *count;
-  char *idx;
-  const char *sort;
+  char *errmsg;
   int ret;
 
-  if (qp->filter)
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files WHERE disabled = 0 AND %s;", qp->filter);
-  else
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files WHERE disabled = 0;");
-
-  if (!count)
+  ret = db_exec("COMMIT TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+      DPRINTF(E_WARN, L_DB, "Could not commit scan batch, retrying: %s\n", errmsg);
 
-      return -1;
+      sqlite3_free(errmsg);
+      ret = db_exec("COMMIT TRANSACTION;", &errmsg);
     }
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
-
-  if (qp->results < 0)
-    return -1;
-
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
-
-  sort = sort_clause[qp->sort];
+  /* Don't leave the transaction open, later writes would pile into it and
+   * the write lock would be held for the rest of the scan
+   */
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not commit scan batch, %d writes rolled back: %s\n", batch_count, errmsg);
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT * FROM files WHERE disabled = 0 AND %s %s %s;", qp->filter, sort, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT * FROM files WHERE disabled = 0 %s %s;", sort, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT * FROM files WHERE disabled = 0 AND %s %s;", qp->filter, sort);
-  else
-    query = sqlite3_mprintf("SELECT * FROM files WHERE disabled = 0 %s;", sort);
+      sqlite3_free(errmsg);
+      sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      /* Files updated in the batch lost their new db_timestamp */
+      gen_failed = 1;
       return -1;
     }
 
-  *q = query;
+  DPRINTF(E_DBG, L_DB, "Committed scan batch of %d writes\n", batch_count);
 
   return 0;
 }
 
-static int
-db_build_query_pls(struct query_params *qp, char **q)
+/* Called after each write; commits the current batch and opens a new one
+ * once it is full or too old.
+ */
+static void
+db_scan_batch_account(void)
 {
-  char *query;
-  char *idx;
+  struct timespec now;
+  int64_t elapsed;
   int ret;
 
-  qp->results = db_get_count("SELECT COUNT(*) FROM playlists WHERE disabled = 0;");
-  if (qp->results < 0)
-    return -1;
-
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+  if (!batch_active)
+    return;
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT * FROM playlists WHERE disabled = 0 AND %s %s;", qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT * FROM playlists WHERE disabled = 0 %s;", idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT * FROM playlists WHERE disabled = 0 AND %s;", qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT * FROM playlists WHERE disabled = 0;");
+  batch_count++;
 
-  if (!query)
+  if (batch_count < db_batch_size)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
-
-  *q = query;
+      clock_gettime(CLOCK_MONOTONIC, &now);
 
-  return 0;
-}
-
-static int
-db_build_query_plitems_plain(struct query_params *qp, char **q)
-{
-  char *query;
-  char *count;
-  char *idx;
-  int ret;
+      elapsed = (int64_t)(now.tv_sec - batch_start.tv_sec) * 1000 + (now.tv_nsec - batch_start.tv_nsec) / 1000000;
+      if (elapsed < db_batch_latency)
+	return;
+    }
 
-  if (qp->filter)
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files JOIN playlistitems ON files.path = playlistitems.filepath"
-			    " WHERE playlistitems.playlistid = %d AND files.disabled = 0 AND %s;", qp->id, qp->filter);
-  else
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files JOIN playlistitems ON files.path = playlistitems.filepath"
-			    " WHERE playlistitems.playlistid = %d AND files.disabled = 0;", qp->id);
+  ret = db_scan_batch_close();
+  if (ret == 0)
+    ret = db_scan_batch_open();
 
-  if (!count)
+  if (ret < 0)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+      DPRINTF(E_LOG, L_DB, "Scan batching disabled for the rest of this scan\n");
 
-      return -1;
+      batch_active = 0;
     }
+}
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+int
+db_scan_batch_begin(void)
+{
+  int ret;
 
-  if (qp->results < 0)
-    return -1;
+  if (batch_active || (db_batch_size <= 1))
+    return 0;
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
+  ret = db_scan_batch_open();
   if (ret < 0)
     return -1;
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT files.* FROM files JOIN playlistitems ON files.path = playlistitems.filepath"
-			    " WHERE playlistitems.playlistid = %d AND files.disabled = 0 AND %s ORDER BY playlistitems.id ASC %s;",
-			    qp->id, qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT files.* FROM files JOIN playlistitems ON files.path = playlistitems.filepath"
-			    " WHERE playlistitems.playlistid = %d AND files.disabled = 0 ORDER BY playlistitems.id ASC %s;",
-			    qp->id, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT files.* FROM files JOIN playlistitems ON files.path = playlistitems.filepath"
-			    " WHERE playlistitems.playlistid = %d AND files.disabled = 0 AND %s ORDER BY playlistitems.id ASC;",
-			    qp->id, qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT files.* FROM files JOIN playlistitems ON files.path = playlistitems.filepath"
-			    " WHERE playlistitems.playlistid = %d AND files.disabled = 0 ORDER BY playlistitems.id ASC;",
-			    qp->id);
-
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
-
-  *q = query;
+  batch_active = 1;
 
   return 0;
 }
 
-static int
-db_build_query_plitems_smart(struct query_params *qp, char *smartpl_query, char **q)
+int
+db_scan_batch_commit(void)
 {
-  char *query;
-  char *count;
-  char *filter;
-  char *idx;
-  const char *sort;
-  int ret;
+  if (!batch_active)
+    return 0;
 
-  if (qp->filter)
-    filter = qp->filter;
-  else
-    filter = "1 = 1";
+  batch_active = 0;
 
-  count = sqlite3_mprintf("SELECT COUNT(*) FROM files WHERE disabled = 0 AND %s AND %s;", filter, smartpl_query);
-  if (!count)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
-      return -1;
-    }
+  return db_scan_batch_close();
+}
 
-  qp->results = db_get_count(count);
 
-  sqlite3_free(count);
+/* Scan generation
+ * During a bulk scan, the files found unchanged are only marked as seen in
+ * a bitmap indexed by file id instead of having their db_timestamp bumped,
+ * so a rescan that finds nothing new writes nothing. db_purge_cruft() then
+ * deletes the files that are neither seen nor added or updated since the
+ * start of the scan, through the scan_seen() SQL function. If a file can't
+ * be marked or a scan batch was rolled back, no files are purged after
+ * that scan.
+ */
+void
+db_scan_generation_begin(void)
+{
+  db_scan_generation_end();
 
-  if (qp->results < 0)
-    return -1;
+  gen_active = 1;
+}
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+void
+db_scan_generation_end(void)
+{
+  if (gen_seen)
+    free(gen_seen);
+
+  gen_active = 0;
+  gen_failed = 0;
+  gen_seen = NULL;
+  gen_seen_size = 0;
+}
 
-  if (!idx)
-    idx = "";
+void
+db_scan_generation_mark(int id)
+{
+  uint8_t *seen;
+  int size;
 
-  sort = sort_clause[qp->sort];
+  if (!gen_active || (id <= 0))
+    return;
 
-  query = sqlite3_mprintf("SELECT * FROM files WHERE disabled = 0 AND %s AND %s %s %s;", smartpl_query, filter, sort, idx);
-  if (!query)
+  if (id / 8 >= INT_MAX / 2)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "File id %d out of range for scan generation, files won't be purged\n", id);
+
+      gen_failed = 1;
+      return;
     }
 
-  *q = query;
+  if (id / 8 >= gen_seen_size)
+    {
+      size = (id / 8 + 1) * 2;
 
-  return 0;
+      seen = (uint8_t *)realloc(gen_seen, size);
+      if (!seen)
+	{
+	  if (!gen_failed)
+	    DPRINTF(E_LOG, L_DB, "Out of memory for scan generation, files won't be purged\n");
+
+	  gen_failed = 1;
+	  return;
+	}
+
+      memset(seen + gen_seen_size, 0, size - gen_seen_size);
+
+      gen_seen = seen;
+      gen_seen_size = size;
+    }
+
+  gen_seen[id / 8] |= (1 << (id % 8));
 }
 
-static int
-db_build_query_plitems(struct query_params *qp, char **q)
+static void
+db_scan_seen_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
 {
-  struct playlist_info *pli;
-  int ret;
+  int64_t id;
 
-  if (qp->id <= 0)
-    {
-      DPRINTF(E_LOG, L_DB, "No playlist id specified in playlist items query\n");
-      return -1;
-    }
+  id = sqlite3_value_int64(ppv[0]);
 
-  pli = db_pl_fetch_byid(qp->id);
-  if (!pli)
-    return -1;
+  if ((id > 0) && (id / 8 < gen_seen_size))
+    sqlite3_result_int(pv, (gen_seen[id / 8] >> (id % 8)) & 1);
+  else
+    sqlite3_result_int(pv, 0);
+}
 
-  switch (pli->type)
+
+/* Queries */
+
+/* The index window (LIMIT/OFFSET) is applied while stepping through the
+ * results instead of in SQL, so the whole result set is walked once and
+ * qp->results can be filled in without a separate COUNT query. Queries
+ * with a cursor are paged in SQL instead, see db_build_query_ordered().
+ */
+static int
+db_query_window(struct query_params *qp)
+{
+  switch (qp->idx_type)
     {
-      case PL_SMART:
-	ret = db_build_query_plitems_smart(qp, pli->query, q);
+      case I_FIRST:
+	qp->start = 0;
+	qp->end = qp->limit;
 	break;
 
-      case PL_PLAIN:
-	ret = db_build_query_plitems_plain(qp, q);
+      case I_LAST:
+	/* Needs the total, see db_query_start() */
+	qp->start = 0;
+	qp->end = INT_MAX;
 	break;
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d in playlist items query\n", pli->type);
-	ret = -1;
+      case I_SUB:
+	qp->start = qp->offset;
+	if ((qp->limit < 0) || (qp->limit > INT_MAX - qp->offset))
+	  qp->end = INT_MAX;
+	else
+	  qp->end = qp->offset + qp->limit;
 	break;
-    }
 
-  free_pli(pli, 0);
+      case I_NONE:
+	qp->start = 0;
+	qp->end = INT_MAX;
+	break;
 
-  return ret;
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown index type\n");
+	return -1;
+    }
+
+  return 0;
 }
 
-static int
-db_build_query_groups(struct query_params *qp, char **q)
+/* Moves the cursor to the current row, the last one of the page; its sort
+ * keys are the trailing qp->keys columns of the row
+ */
+static void
+db_query_cursor_save(struct query_params *qp)
 {
-  char *query;
-  char *idx;
-  int ret;
+  struct query_cursor *qc;
+  const char *text;
+  int col;
+  int i;
 
-  qp->results = db_get_count("SELECT COUNT(DISTINCT songalbumid) FROM files WHERE disabled = 0;");
-  if (qp->results < 0)
-    return -1;
+  qc = qp->cursor;
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+  db_query_cursor_clear(qc);
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f JOIN groups g ON f.songalbumid = g.persistentid GROUP BY f.album COLLATE DAAP, g.name HAVING g.type = %d AND disabled = 0 AND %s %s;", G_ALBUMS, qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f JOIN groups g ON f.songalbumid = g.persistentid GROUP BY f.album COLLATE DAAP, g.name HAVING g.type = %d AND disabled = 0 %s;", G_ALBUMS, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f JOIN groups g ON f.songalbumid = g.persistentid GROUP BY f.album COLLATE DAAP, g.name HAVING g.type = %d AND disabled = 0 AND %s;", G_ALBUMS, qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f JOIN groups g ON f.songalbumid = g.persistentid GROUP BY f.album COLLATE DAAP, g.name HAVING g.type = %d AND disabled = 0;", G_ALBUMS);
+  col = sqlite3_column_count(qp->stmt) - qp->keys;
+  for (i = 0; i < qp->keys; i++, col++)
+    {
+      switch (sqlite3_column_type(qp->stmt, col))
+	{
+	  case SQLITE_INTEGER:
+	    qc->keys[i].num = sqlite3_column_int64(qp->stmt, col);
+	    break;
 
-  if (!query)
+	  case SQLITE_TEXT:
+	    text = (const char *)sqlite3_column_text(qp->stmt, col);
+
+	    qc->keys[i].text = strdup(text);
+	    if (!qc->keys[i].text)
+	      goto invalid;
+	    break;
+
+	  default:
+	    /* NULL keys sort first and can't be compared against; leave the
+	     * next page to OFFSET
+	     */
+	    goto invalid;
+	}
+
+      qc->nkeys++;
+    }
+
+  if (qp->filter)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      qc->filter = strdup(qp->filter);
+      if (!qc->filter)
+	goto invalid;
     }
 
-  *q = query;
+  qc->type = qp->type;
+  qc->sort = qp->sort;
+  qc->id = qp->id;
+  qc->delta = qp->delta;
+  qc->pos = qp->pos;
+  qc->results = qp->results;
+  qc->rev = qp->rev;
 
-  return 0;
+  return;
+
+ invalid:
+  db_query_cursor_clear(qc);
 }
 
+/* Steps to the next row inside the index window. Rows outside the window
+ * are stepped over without being looked at; once SQLITE_DONE is returned
+ * qp->results holds the total number of rows.
+ */
 static int
-db_build_query_groupitems(struct query_params *qp, char **q)
+db_query_step(struct query_params *qp)
 {
-  char *query;
-  char *count;
-  enum group_type gt;
-
-  gt = db_group_type_byid(qp->id);
+  int ret;
 
-  switch (gt)
+  while (qp->pos < qp->start)
     {
-      case G_ALBUMS:
-	count = sqlite3_mprintf("SELECT COUNT(*) FROM files JOIN groups ON files.songalbumid = groups.persistentid"
-				" WHERE groups.id = %d AND files.disabled = 0;", qp->id);
-	break;
+      ret = db_blocking_step(qp->stmt);
+      if (ret != SQLITE_ROW)
+	goto out;
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
-	return -1;
+      qp->pos++;
     }
 
-  if (!count)
+  if (qp->pos >= qp->end)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+      /* Past the window, count what's left */
+      while ((ret = db_blocking_step(qp->stmt)) == SQLITE_ROW)
+	qp->pos++;
 
-      return -1;
+      goto out;
     }
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_ROW)
+    {
+      qp->pos++;
 
-  if (qp->results < 0)
-    return -1;
+      /* Last row of a keyset page, remember where the next page starts */
+      if (qp->keys && (qp->pos == qp->end))
+	db_query_cursor_save(qp);
 
-  switch (gt)
-    {
-      case G_ALBUMS:
-	query = sqlite3_mprintf("SELECT files.* FROM files JOIN groups ON files.songalbumid = groups.persistentid"
-				" WHERE groups.id = %d AND files.disabled = 0;", qp->id);
-	break;
+      return ret;
     }
 
-  if (!query)
+ out:
+  /* Keyset queries stop at the end of the page, the total was counted
+   * beforehand
+   */
+  if ((ret == SQLITE_DONE) && !qp->keys)
+    qp->results = qp->pos;
+
+  return ret;
+}
+
+/* Builds the condition selecting the rows sorting after the cursor:
+ * k1 > v1 OR (k1 = v1 AND (k2 > v2 OR (k2 = v2 AND ...)))
+ */
+static char *
+db_query_seek_clause(struct query_cursor *qc, const char **keys)
+{
+  char *cond;
+  char *val;
+  int i;
+
+  cond = NULL;
+  for (i = qc->nkeys - 1; i >= 0; i--)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      if (qc->keys[i].text)
+	val = sqlite3_mprintf("%Q", qc->keys[i].text);
+      else
+	val = sqlite3_mprintf("%lld", (long long)qc->keys[i].num);
+
+      if (!val)
+	{
+	  sqlite3_free(cond);
+	  return NULL;
+	}
+
+      if (!cond)
+	cond = sqlite3_mprintf("%s > %s", keys[i], val);
+      else if (i > 0)
+	cond = sqlite3_mprintf("%s > %s OR (%s = %s AND (%z))", keys[i], val, keys[i], val, cond);
+      else /* Leading >= so an index on the first key can be used */
+	cond = sqlite3_mprintf("%s >= %s AND (%s > %s OR (%s = %s AND (%z)))", keys[i], val, keys[i], val, keys[i], val, cond);
+
+      sqlite3_free(val);
+
+      if (!cond)
+	return NULL;
     }
 
-  *q = query;
+  return cond;
+}
 
-  return 0;
+static int
+db_query_cursor_match(struct query_params *qp, int nkeys)
+{
+  struct query_cursor *qc;
+
+  qc = qp->cursor;
+
+  if ((qc->pos <= 0) || (qc->pos != qp->start) || (qc->nkeys != nkeys))
+    return 0;
+
+  if ((qc->type != qp->type) || (qc->sort != qp->sort) || (qc->id != qp->id) || (qc->delta != qp->delta))
+    return 0;
+
+  if (qc->filter && qp->filter)
+    return (strcmp(qc->filter, qp->filter) == 0);
+
+  return (!qc->filter && !qp->filter);
 }
 
+/* Finishes a query given its select list and its FROM ... WHERE part,
+ * ordering the results by keys; an unsorted query is only ordered when
+ * paged with a cursor, a full list in storage order is cheaper.
+ *
+ * With a cursor and a limit, the index window goes into the query itself:
+ * if the cursor is at the start of the page, the rows before it are
+ * skipped by seeking past the sort keys of the last row of the previous
+ * page, otherwise with OFFSET. The sort keys are appended to the select
+ * list so the cursor can be moved to the end of the page, and the total
+ * comes from a COUNT query as the rows after the page are never stepped,
+ * unless the caller already knows it (count >= 0). The following pages
+ * take the total from the cursor while the library hasn't changed.
+ */
 static int
-db_build_query_group_dirs(struct query_params *qp, char **q)
+db_build_query_ordered(struct query_params *qp, const char *cols, const char *from, const char **keys, int sorted, int count, char **q)
 {
   char *query;
-  char *count;
-  enum group_type gt;
-
-  gt = db_group_type_byid(qp->id);
+  char *order;
+  char *extra;
+  char *seek;
+  int nkeys;
+  int match;
 
-  switch (gt)
+  order = NULL;
+  extra = NULL;
+  for (nkeys = 0; keys[nkeys]; nkeys++)
     {
-      case G_ALBUMS:
-	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(files.path, 1, LENGTH(files.path) - LENGTH(files.fname) - 1)))"
-				" FROM files JOIN groups ON files.songalbumid = groups.persistentid"
-				" WHERE groups.id = %d AND files.disabled = 0;", qp->id);
-	break;
+      order = sqlite3_mprintf("%z%s%s ASC", order, (nkeys == 0) ? "ORDER BY " : ", ", keys[nkeys]);
+      extra = sqlite3_mprintf("%z, %s", extra, keys[nkeys]);
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
-	return -1;
+      if (!order || !extra)
+	goto oom;
     }
 
-  if (!count)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+  qp->keys = 0;
 
-      return -1;
+  if (!qp->cursor || (qp->limit <= 0) || ((qp->idx_type != I_FIRST) && (qp->idx_type != I_SUB)))
+    {
+      query = sqlite3_mprintf("SELECT %s FROM %s %s;", cols, from, (sorted) ? order : "");
+      goto out;
     }
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+  match = db_query_cursor_match(qp, nkeys);
+
+  if (count >= 0)
+    qp->results = count;
+  else if (match && (qp->cursor->results >= 0) && (qp->cursor->rev == qp->rev))
+    qp->results = qp->cursor->results;
+  else
+    {
+      query = sqlite3_mprintf("SELECT COUNT(*) FROM %s;", from);
+      if (!query)
+	goto oom;
+
+      qp->results = db_get_count(query);
+      sqlite3_free(query);
+    }
 
   if (qp->results < 0)
-    return -1;
+    {
+      sqlite3_free(order);
+      sqlite3_free(extra);
+      return -1;
+    }
 
-  switch (gt)
+  if (match)
     {
-      case G_ALBUMS:
-	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(files.path, 1, LENGTH(files.path) - LENGTH(files.fname) - 1))"
-				" FROM files JOIN groups ON files.songalbumid = groups.persistentid"
-				" WHERE groups.id = %d AND files.disabled = 0;", qp->id);
-	break;
+      seek = db_query_seek_clause(qp->cursor, keys);
+      if (!seek)
+	goto oom;
+
+      query = sqlite3_mprintf("SELECT %s%s FROM %s AND (%z) %s LIMIT %d;",
+			      cols, extra, from, seek, order, qp->end - qp->start);
     }
+  else
+    query = sqlite3_mprintf("SELECT %s%s FROM %s %s LIMIT %d OFFSET %d;",
+			    cols, extra, from, order, qp->end - qp->start, qp->start);
+
+  /* The window is applied by the query, nothing to step over */
+  qp->keys = nkeys;
+  qp->pos = qp->start;
+
+ out:
+  sqlite3_free(order);
+  sqlite3_free(extra);
 
   if (!query)
     {
@@ -1045,1220 +1424,1366 @@ db_build_query_group_dirs(struct query_params *qp, char **q)
   *q = query;
 
   return 0;
+
+ oom:
+  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+  sqlite3_free(order);
+  sqlite3_free(extra);
+  return -1;
 }
 
-static int
-db_build_query_browse(struct query_params *qp, char *field, char **q)
-{
-  char *query;
-  char *count;
-  char *idx;
-  int ret;
+static const char *search_cols[] =
+  {
+    "title", "artist", "album", "album_artist", "composer", "genre", NULL
+  };
 
-  if (qp->filter)
-    count = sqlite3_mprintf("SELECT COUNT(DISTINCT %s COLLATE DAAP) FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != '' AND %s;",
-			    field, field, qp->filter);
-  else
-    count = sqlite3_mprintf("SELECT COUNT(DISTINCT %s COLLATE DAAP) FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != '';",
-			    field, field);
+/* The longest run of characters between wildcards in a LIKE pattern, as
+ * an FTS5 phrase; NULL if it is under 3 characters, too short for the
+ * trigram index. lit is the SQL-escaped pattern, quotes excluded.
+ */
+static char *
+db_search_phrase(const char *lit, const char *end)
+{
+  const char *seg;
+  const char *best;
+  char *phrase;
+  int nchars;
+  int bestchars;
+  int bestlen;
+  int i;
+  int j;
 
-  if (!count)
+  seg = lit;
+  best = NULL;
+  bestlen = 0;
+  bestchars = 0;
+  nchars = 0;
+  for (; lit <= end; lit++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
-
-      return -1;
-    }
+      if ((lit == end) || (*lit == '%') || (*lit == '_'))
+	{
+	  if (nchars > bestchars)
+	    {
+	      best = seg;
+	      bestlen = lit - seg;
+	      bestchars = nchars;
+	    }
+
+	  seg = lit + 1;
+	  nchars = 0;
+	  continue;
+	}
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+      /* Count characters, not UTF-8 bytes nor escaped quotes */
+      if ((*lit & 0xc0) != 0x80)
+	nchars++;
 
-  if (qp->results < 0)
-    return -1;
+      if (*lit == '\'')
+	lit++;
+    }
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+  if (bestchars < 3)
+    return NULL;
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT DISTINCT %s COLLATE DAAP FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != ''"
-			    " AND %s %s;", field, field, qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT DISTINCT %s COLLATE DAAP FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != ''"
-			    " %s;", field, field, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT DISTINCT %s COLLATE DAAP FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != ''"
-			    " AND %s;", field, field, qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT DISTINCT %s COLLATE DAAP FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != ''",
-			    field, field);
+  /* Double quotes are doubled in an FTS5 string */
+  phrase = (char *)malloc(2 * bestlen + 1);
+  if (!phrase)
+    return NULL;
 
-  if (!query)
+  for (i = 0, j = 0; i < bestlen; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+      if (best[i] == '"')
+	phrase[j++] = '"';
 
-  *q = query;
+      phrase[j++] = best[i];
+    }
+  phrase[j] = '\0';
 
-  return 0;
+  return phrase;
 }
 
-int
-db_query_start(struct query_params *qp)
+/* Substring searches from Remote (DAAP2SQL) and RSP (RSP2SQL) end up as
+ * <col> LIKE '<pattern>' in the filter. For the columns in files_fts,
+ * add a lookup of the pattern's longest literal part in the search index
+ * so SQLite no longer has to scan the files table. The LIKE stays: the
+ * index folds case beyond ASCII and the lookup may match more rows than
+ * the LIKE. Negated matches are left alone. Only for filters on the
+ * files table. Returns a new filter, to be freed with sqlite3_free().
+ */
+static char *
+db_filter_search(const char *filter)
 {
-  char *query;
-  int ret;
+  const char *copied;
+  const char *ident;
+  const char *lit;
+  const char *p;
+  char *phrase;
+  char *out;
+  int len;
+  int i;
 
-  qp->stmt = NULL;
+  if (!db_search_enabled)
+    return sqlite3_mprintf("%s", filter);
 
-  switch (qp->type)
+  out = sqlite3_mprintf("");
+  copied = filter;
+  p = filter;
+  while (out && *p)
     {
-      case Q_ITEMS:
-	ret = db_build_query_items(qp, &query);
-	break;
-
-      case Q_PL:
-	ret = db_build_query_pls(qp, &query);
-	break;
+      /* Skip string literals */
+      if (*p == '\'')
+	{
+	  for (p++; *p; p++)
+	    {
+	      if ((p[0] == '\'') && (p[1] == '\''))
+		p++;
+	      else if (*p == '\'')
+		break;
+	    }
+
+	  if (*p)
+	    p++;
+	  continue;
+	}
 
-      case Q_PLITEMS:
-	ret = db_build_query_plitems(qp, &query);
-	break;
+      if (!(isalpha((unsigned char)*p) || (*p == '_'))
+	  || ((p > filter) && (isalnum((unsigned char)p[-1]) || (p[-1] == '_') || (p[-1] == '.'))))
+	{
+	  p++;
+	  continue;
+	}
 
-      case Q_GROUPS:
-	ret = db_build_query_groups(qp, &query);
-	break;
+      ident = p;
+      while (isalnum((unsigned char)*p) || (*p == '_'))
+	p++;
+      len = p - ident;
 
-      case Q_GROUPITEMS:
-	ret = db_build_query_groupitems(qp, &query);
-	break;
+      if (strncmp(p, " LIKE '", strlen(" LIKE '")) != 0)
+	continue;
 
-      case Q_GROUP_DIRS:
-	ret = db_build_query_group_dirs(qp, &query);
-	break;
+      if ((ident - filter >= strlen("NOT ")) && (strncasecmp(ident - strlen("NOT "), "NOT ", strlen("NOT ")) == 0))
+	continue;
 
-      case Q_BROWSE_ALBUMS:
-	ret = db_build_query_browse(qp, "album", &query);
-	break;
+      for (i = 0; search_cols[i]; i++)
+	{
+	  if ((strlen(search_cols[i]) == len) && (strncmp(search_cols[i], ident, len) == 0))
+	    break;
+	}
 
-      case Q_BROWSE_ARTISTS:
-	ret = db_build_query_browse(qp, "artist", &query);
-	break;
+      if (!search_cols[i])
+	continue;
 
-      case Q_BROWSE_GENRES:
-	ret = db_build_query_browse(qp, "genre", &query);
-	break;
+      /* Find the end of the literal */
+      lit = p + strlen(" LIKE '");
+      for (p = lit; *p; p++)
+	{
+	  if ((p[0] == '\'') && (p[1] == '\''))
+	    p++;
+	  else if (*p == '\'')
+	    break;
+	}
 
-      case Q_BROWSE_COMPOSERS:
-	ret = db_build_query_browse(qp, "composer", &query);
+      if (!*p)
 	break;
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown query type\n");
-	return -1;
-    }
-
-  if (ret < 0)
-    return -1;
+      p++;
 
-  DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
+      phrase = db_search_phrase(lit, p - 1);
+      if (!phrase)
+	continue;
 
-  ret = db_blocking_prepare_v2(query, -1, &qp->stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      out = sqlite3_mprintf("%z%.*s(%.*s AND files.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH '{%.*s} : \"%s\"'))",
+			    out, (int)(ident - copied), copied, (int)(p - ident), ident, len, ident, phrase);
+      copied = p;
 
-      sqlite3_free(query);
-      return -1;
+      free(phrase);
     }
 
-  sqlite3_free(query);
+  if (out)
+    out = sqlite3_mprintf("%z%s", out, copied);
 
-  return 0;
+  if (!out)
+    DPRINTF(E_LOG, L_DB, "Out of memory for query filter\n");
+
+  return out;
 }
 
-void
-db_query_end(struct query_params *qp)
+/* Restricts a delta query to the rows changed after qp->delta, see
+ * db_library_revision_seal(). Returns a new condition to append to the
+ * WHERE clause, empty for a full query, to be freed with sqlite3_free().
+ */
+static char *
+db_filter_delta(struct query_params *qp, enum change_kind kind, const char *col)
 {
-  if (!qp->stmt)
-    return;
+  char *out;
 
-  qp->results = -1;
+  if (qp->delta > 0)
+    out = sqlite3_mprintf(" AND %s IN (SELECT id FROM changes WHERE kind = %d AND rev > %d)", col, kind, qp->delta);
+  else
+    out = sqlite3_mprintf("");
 
-  sqlite3_finalize(qp->stmt);
-  qp->stmt = NULL;
+  if (!out)
+    DPRINTF(E_LOG, L_DB, "Out of memory for query filter\n");
+
+  return out;
 }
 
-int
-db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
+static int
+db_build_query_items(struct query_params *qp, char **q)
 {
-  int ncols;
-  char **strcol;
-  int i;
+  char *filter;
+  char *delta;
+  char *from;
   int ret;
 
-  memset(dbmfi, 0, sizeof(struct db_media_file_info));
+  delta = db_filter_delta(qp, CH_FILE, "id");
+  if (!delta)
+    return -1;
 
-  if (!qp->stmt)
+  if (qp->filter)
     {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+      filter = db_filter_search(qp->filter);
+      if (!filter)
+	{
+	  sqlite3_free(delta);
+	  return -1;
+	}
 
-  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUPITEMS))
-    {
-      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
-      return -1;
-    }
+      from = sqlite3_mprintf("files WHERE disabled = 0%s AND %s", delta, filter);
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      dbmfi->id = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-      return -1;
+      sqlite3_free(filter);
     }
+  else
+    from = sqlite3_mprintf("files WHERE disabled = 0%s", delta);
 
-  ncols = sqlite3_column_count(qp->stmt);
+  sqlite3_free(delta);
 
-  if (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]) != ncols)
+  if (!from)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with schema\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  for (i = 0; i < ncols; i++)
-    {
-      strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i]);
+  ret = db_build_query_ordered(qp, "*", from, sort_keys[qp->sort], (qp->sort != S_NONE), -1, q);
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
-    }
+  sqlite3_free(from);
 
-  return 0;
+  return ret;
 }
 
-int
-db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli)
+/* Smart playlists change with the files they match, which isn't logged;
+ * delta queries always include them
+ */
+static int
+db_build_query_pls(struct query_params *qp, char **q)
 {
-  int ncols;
-  char **strcol;
-  int id;
-  int type;
-  int nitems;
-  int i;
-  int ret;
-
-  memset(dbpli, 0, sizeof(struct db_playlist_info));
+  char *delta;
+  char *query;
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  if (qp->delta > 0)
+    delta = sqlite3_mprintf(" AND (type = %d OR id IN (SELECT id FROM changes WHERE kind = %d AND rev > %d))", PL_SMART, CH_PL, qp->delta);
+  else
+    delta = sqlite3_mprintf("");
 
-  if (qp->type != Q_PL)
+  if (!delta)
     {
-      DPRINTF(E_LOG, L_DB, "Not a playlist query!\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for query filter\n");
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      dbpli->id = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-      return -1;
-    }
+  if (qp->filter)
+    query = sqlite3_mprintf("SELECT * FROM playlists WHERE disabled = 0%s AND %s;", delta, qp->filter);
+  else
+    query = sqlite3_mprintf("SELECT * FROM playlists WHERE disabled = 0%s;", delta);
 
-  ncols = sqlite3_column_count(qp->stmt);
+  sqlite3_free(delta);
 
-  if (sizeof(dbpli_cols_map) / sizeof(dbpli_cols_map[0]) != ncols)
+  if (!query)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: dbpli column map out of sync with schema\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  for (i = 0; i < ncols; i++)
-    {
-      strcol = (char **) ((char *)dbpli + dbpli_cols_map[i]);
+  *q = query;
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
-    }
+  return 0;
+}
 
-  type = sqlite3_column_int(qp->stmt, 2);
+static int
+db_build_query_plitems_plain(struct query_params *qp, int count, char **q)
+{
+  char *filter;
+  char *delta;
+  char *from;
+  int ret;
 
-  switch (type)
+  delta = db_filter_delta(qp, CH_FILE, "files.id");
+  if (!delta)
+    return -1;
+
+  if (qp->filter)
     {
-      case PL_PLAIN:
-	id = sqlite3_column_int(qp->stmt, 0);
-	nitems = db_pl_count_items(id);
-	break;
+      filter = db_filter_search(qp->filter);
+      if (!filter)
+	{
+	  sqlite3_free(delta);
+	  return -1;
+	}
 
-      case PL_SMART:
-	nitems = db_smartpl_count_items(dbpli->query);
-	break;
+      from = sqlite3_mprintf("files JOIN playlistitems ON files.path = playlistitems.filepath"
+			     " WHERE playlistitems.playlistid = %d AND files.disabled = 0%s AND %s",
+			     qp->id, delta, filter);
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", type);
-	return -1;
+      sqlite3_free(filter);
     }
+  else
+    from = sqlite3_mprintf("files JOIN playlistitems ON files.path = playlistitems.filepath"
+			   " WHERE playlistitems.playlistid = %d AND files.disabled = 0%s",
+			   qp->id, delta);
 
-  dbpli->items = qp->buf;
-  ret = snprintf(qp->buf, sizeof(qp->buf), "%d", nitems);
-  if ((ret < 0) || (ret >= sizeof(qp->buf)))
-    {
-      DPRINTF(E_LOG, L_DB, "Could not convert items, buffer too small\n");
+  sqlite3_free(delta);
 
-      strcpy(qp->buf, "0");
+  if (!from)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  return 0;
+  ret = db_build_query_ordered(qp, "files.*", from, plitems_keys, 1, count, q);
+
+  sqlite3_free(from);
+
+  return ret;
 }
 
-int
-db_query_fetch_group(struct query_params *qp, struct db_group_info *dbgri)
+static int
+db_build_query_plitems_smart(struct query_params *qp, char *smartpl_query, int count, char **q)
 {
-  int ncols;
-  char **strcol;
-  int i;
+  char *from;
+  char *filter;
+  char *delta;
   int ret;
 
-  memset(dbgri, 0, sizeof(struct db_group_info));
+  delta = db_filter_delta(qp, CH_FILE, "id");
+  if (!delta)
+    return -1;
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  if (qp->filter)
+    filter = db_filter_search(qp->filter);
+  else
+    filter = sqlite3_mprintf("1 = 1");
 
-  if (qp->type != Q_GROUPS)
+  if (!filter)
     {
-      DPRINTF(E_LOG, L_DB, "Not a groups query!\n");
+      sqlite3_free(delta);
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      return 1;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
+  from = sqlite3_mprintf("files WHERE disabled = 0%s AND %s AND %s", delta, smartpl_query, filter);
 
-  ncols = sqlite3_column_count(qp->stmt);
+  sqlite3_free(filter);
+  sqlite3_free(delta);
 
-  if (sizeof(dbgri_cols_map) / sizeof(dbgri_cols_map[0]) != ncols)
+  if (!from)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: dbgri column map out of sync with schema\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  for (i = 0; i < ncols; i++)
-    {
-      strcol = (char **) ((char *)dbgri + dbgri_cols_map[i]);
+  ret = db_build_query_ordered(qp, "*", from, sort_keys[qp->sort], (qp->sort != S_NONE), count, q);
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
-    }
+  sqlite3_free(from);
 
-  return 0;
+  return ret;
 }
 
-int
-db_query_fetch_string(struct query_params *qp, char **string)
+static int
+db_build_query_plitems(struct query_params *qp, char **q)
 {
+  struct playlist_info *pli;
+  int count;
   int ret;
 
-  *string = NULL;
-
-  if (!qp->stmt)
+  if (qp->id <= 0)
     {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      DPRINTF(E_LOG, L_DB, "No playlist id specified in playlist items query\n");
       return -1;
     }
 
-  if (!(qp->type & Q_F_BROWSE))
-    {
-      DPRINTF(E_LOG, L_DB, "Not a browse query!\n");
-      return -1;
-    }
+  pli = db_pl_fetch_byid(qp->id);
+  if (!pli)
+    return -1;
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
+  /* Without a filter the items are those counted in pli->items */
+  count = (qp->filter || (qp->delta > 0)) ? -1 : pli->items;
+
+  switch (pli->type)
     {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      *string = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-      return -1;
-    }
+      case PL_SMART:
+	ret = db_build_query_plitems_smart(qp, pli->query, count, q);
+	break;
 
-  *string = (char *)sqlite3_column_text(qp->stmt, 0);
+      case PL_PLAIN:
+	ret = db_build_query_plitems_plain(qp, count, q);
+	break;
 
-  return 0;
-}
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d in playlist items query\n", pli->type);
+	ret = -1;
+	break;
+    }
 
+  free_pli(pli, 0);
 
-/* Files */
-int
-db_files_get_count(void)
-{
-  return db_get_count("SELECT COUNT(*) FROM files WHERE disabled = 0;");
+  return ret;
 }
 
-void
-db_files_update_songalbumid(void)
+static int
+db_build_query_groups(struct query_params *qp, char **q)
 {
-#define Q_SONGALBUMID "UPDATE files SET songalbumid = daap_songalbumid(album_artist, album);"
-  char *errmsg;
-  int ret;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_SONGALBUMID);
-
-  ret = db_exec(Q_SONGALBUMID, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error updating songalbumid: %s\n", errmsg);
+  char *filter;
+  char *query;
 
-  sqlite3_free(errmsg);
+  /* items is maintained by the update_groups_* triggers; a filter selects
+   * the albums with at least one matching enabled item
+   */
+  if (qp->filter)
+    {
+      filter = db_filter_search(qp->filter);
+      if (!filter)
+	return -1;
 
-#undef Q_SONGALBUMID
-}
+      query = sqlite3_mprintf("SELECT g.items, g.id, g.persistentid, g.album_artist, g.name FROM groups g WHERE g.type = %d AND g.items > 0"
+			      " AND g.persistentid IN (SELECT songalbumid FROM files WHERE disabled = 0 AND %s) ORDER BY g.album_sort, g.name;", G_ALBUMS, filter);
 
-void
-db_file_inc_playcount(int id)
-{
-#define Q_TMPL "UPDATE files SET play_count = play_count + 1, time_played = %" PRIi64 " WHERE id = %d;"
-  char *query;
-  char *errmsg;
-  int ret;
+      sqlite3_free(filter);
+    }
+  else
+    query = sqlite3_mprintf("SELECT g.items, g.id, g.persistentid, g.album_artist, g.name FROM groups g WHERE g.type = %d AND g.items > 0"
+			    " ORDER BY g.album_sort, g.name;", G_ALBUMS);
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
+      return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error incrementing play count on %d: %s\n", id, errmsg);
-
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  *q = query;
 
-#undef Q_TMPL
+  return 0;
 }
 
-void
-db_file_ping(char *path)
+static int
+db_build_query_groupitems(struct query_params *qp, char **q)
 {
-#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE path = '%q';"
   char *query;
-  char *errmsg;
-  int ret;
+  enum group_type gt;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), path);
-  if (!query)
+  gt = db_group_type_byid(qp->id);
+
+  switch (gt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      case G_ALBUMS:
+	query = sqlite3_mprintf("SELECT files.* FROM files JOIN groups ON files.songalbumid = groups.persistentid"
+				" WHERE groups.id = %d AND files.disabled = 0;", qp->id);
+	break;
 
-      return;
+      default:
+	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
+	return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error pinging file '%s': %s\n", path, errmsg);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  *q = query;
 
-#undef Q_TMPL
+  return 0;
 }
 
-char *
-db_file_path_byid(int id)
+static int
+db_build_query_group_dirs(struct query_params *qp, char **q)
 {
-#define Q_TMPL "SELECT path FROM files WHERE id = %d;"
   char *query;
-  sqlite3_stmt *stmt;
-  char *res;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
-    }
+  enum group_type gt;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  gt = db_group_type_byid(qp->id);
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  switch (gt)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      case G_ALBUMS:
+	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(files.path, 1, LENGTH(files.path) - LENGTH(files.fname) - 1))"
+				" FROM files JOIN groups ON files.songalbumid = groups.persistentid"
+				" WHERE groups.id = %d AND files.disabled = 0;", qp->id);
+	break;
 
-      sqlite3_free(query);
-      return NULL;
+      default:
+	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
+	return -1;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  if (!query)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  res = (char *)sqlite3_column_text(stmt, 0);
-  if (res)
-    res = strdup(res);
-
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
-
-  return res;
+  *q = query;
 
-#undef Q_TMPL
+  return 0;
 }
 
 static int
-db_file_id_byquery(char *query)
+db_build_query_browse(struct query_params *qp, enum browse_type bt, char *field, char *key, char **q)
 {
-  sqlite3_stmt *stmt;
+  char *filter;
+  char *from;
   int ret;
 
-  if (!query)
-    return 0;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  /* Browse is served from the browse table, kept up to date by triggers
+   * on the files table; a filter only selects which sort keys to return
+   */
+  if (!qp->filter)
+    from = sqlite3_mprintf("browse WHERE type = %d", bt);
+  else
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      filter = db_filter_search(qp->filter);
+      if (!filter)
+	return -1;
 
-      return 0;
+      from = sqlite3_mprintf("browse WHERE type = %d AND sort_key IN"
+			     " (SELECT %s FROM files WHERE data_kind = 0 AND disabled = 0 AND %s != '' AND %s)",
+			     bt, key, field, filter);
+
+      sqlite3_free(filter);
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  if (!from)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-
-      sqlite3_finalize(stmt);
-      return 0;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  ret = sqlite3_column_int(stmt, 0);
+  ret = db_build_query_ordered(qp, "name", from, browse_keys, 1, -1, q);
 
-  sqlite3_finalize(stmt);
+  sqlite3_free(from);
 
   return ret;
 }
 
-int
-db_file_id_bypath(char *path)
+/* Query plan as one line, steps separated by "; ". Full scans of the
+ * files table are expected for unfiltered listings, anything else
+ * showing one is missing an index.
+ */
+static char *
+db_query_explain(const char *query)
 {
-#define Q_TMPL "SELECT id FROM files WHERE path = '%q';"
-  char *query;
+  sqlite3_stmt *stmt;
+  char *eqp;
+  char *plan;
+  const char *detail;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  eqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", query);
+  if (!eqp)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query plan string\n");
+      return NULL;
     }
 
-  ret = db_file_id_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
-
-#undef Q_TMPL
-}
-
-int
-db_file_id_byfilebase(char *filename, char *base)
-{
-#define Q_TMPL "SELECT id FROM files WHERE path LIKE '%q/%%/%q';"
-  char *query;
-  int ret;
+  ret = db_blocking_prepare_v2(eqp, -1, &stmt, NULL);
+  sqlite3_free(eqp);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare query plan statement: %s\n", sqlite3_errmsg(hdl));
+      return NULL;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, base, filename);
-  if (!query)
+  plan = NULL;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      /* Plan detail is always the last column */
+      detail = (const char *)sqlite3_column_text(stmt, sqlite3_column_count(stmt) - 1);
+      if (!detail)
+	continue;
 
-      return 0;
+      plan = sqlite3_mprintf("%z%s%s", plan, (plan) ? "; " : "", detail);
+      if (!plan)
+	break;
     }
 
-  ret = db_file_id_byquery(query);
-
-  sqlite3_free(query);
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step query plan: %s\n", sqlite3_errmsg(hdl));
 
-  return ret;
+  db_stmt_finalize(stmt);
 
-#undef Q_TMPL
+  return plan;
 }
 
-int
-db_file_id_byfile(char *filename)
+/* Plan of a started query, see db_query_explain(); the caller frees it */
+char *
+db_query_plan(struct query_params *qp)
 {
-#define Q_TMPL "SELECT id FROM files WHERE fname = '%q';"
-  char *query;
-  int ret;
+  char *plan;
+  char *ret;
 
-  query = sqlite3_mprintf(Q_TMPL, filename);
-  if (!query)
+  if (!qp->stmt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return NULL;
     }
 
-  ret = db_file_id_byquery(query);
+  profile_explaining = 1;
+  plan = db_query_explain(sqlite3_sql(qp->stmt));
+  profile_explaining = 0;
 
-  sqlite3_free(query);
+  if (!plan)
+    return NULL;
 
-  return ret;
+  ret = strdup(plan);
 
-#undef Q_TMPL
+  sqlite3_free(plan);
+
+  return ret;
 }
 
 int
-db_file_id_byurl(char *url)
+db_query_start(struct query_params *qp)
 {
-#define Q_TMPL "SELECT id FROM files WHERE url = '%q';"
   char *query;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, url);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  qp->stmt = NULL;
+  qp->results = -1;
+  qp->pos = 0;
+  qp->keys = 0;
 
-      return 0;
-    }
+  /* Taken before anything is read; stays 0 if revisions aren't tracked */
+  db_revision(&qp->rev);
 
-  ret = db_file_id_byquery(query);
+  ret = db_query_window(qp);
+  if (ret < 0)
+    return -1;
 
-  sqlite3_free(query);
+  switch (qp->type)
+    {
+      case Q_ITEMS:
+	ret = db_build_query_items(qp, &query);
+	break;
 
-  return ret;
+      case Q_PL:
+	ret = db_build_query_pls(qp, &query);
+	break;
 
-#undef Q_TMPL
-}
+      case Q_PLITEMS:
+	ret = db_build_query_plitems(qp, &query);
+	break;
 
-time_t
-db_file_stamp_bypath(char *path)
-{
-#define Q_TMPL "SELECT db_timestamp FROM files WHERE path = '%q';"
-  char *query;
-  sqlite3_stmt *stmt;
-  time_t stamp;
-  int ret;
+      case Q_GROUPS:
+	ret = db_build_query_groups(qp, &query);
+	break;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      case Q_GROUPITEMS:
+	ret = db_build_query_groupitems(qp, &query);
+	break;
 
-      return 0;
+      case Q_GROUP_DIRS:
+	ret = db_build_query_group_dirs(qp, &query);
+	break;
+
+      case Q_BROWSE_ALBUMS:
+	ret = db_build_query_browse(qp, B_ALBUMS, "album", "album_sort", &query);
+	break;
+
+      case Q_BROWSE_ARTISTS:
+	ret = db_build_query_browse(qp, B_ARTISTS, "artist", "artist_sort", &query);
+	break;
+
+      case Q_BROWSE_GENRES:
+	ret = db_build_query_browse(qp, B_GENRES, "genre", "daap_sortkey(genre)", &query);
+	break;
+
+      case Q_BROWSE_COMPOSERS:
+	ret = db_build_query_browse(qp, B_COMPOSERS, "composer", "daap_sortkey(composer)", &query);
+	break;
+
+      case Q_BROWSE_ALBUM_ARTISTS:
+	ret = db_build_query_browse(qp, B_ALBUM_ARTISTS, "album_artist", "album_artist_sort", &query);
+	break;
+
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown query type\n");
+	return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (ret < 0)
+    return -1;
+
+  DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_blocking_prepare_v2(query, -1, &qp->stmt, NULL);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
       sqlite3_free(query);
-      return 0;
+      return -1;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  sqlite3_free(query);
+
+  /* Last n entries: count them all first, then start over */
+  if (qp->idx_type == I_LAST)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      while ((ret = db_blocking_step(qp->stmt)) == SQLITE_ROW)
+	qp->pos++;
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return 0;
-    }
+      if (ret != SQLITE_DONE)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-  stamp = (time_t)sqlite3_column_int64(stmt, 0);
+	  db_query_end(qp);
+	  return -1;
+	}
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+      sqlite3_reset(qp->stmt);
 
-  return stamp;
+      if (qp->pos > qp->limit)
+	qp->start = qp->pos - qp->limit;
+      qp->pos = 0;
+    }
 
-#undef Q_TMPL
+  return 0;
 }
 
-static struct media_file_info *
-db_file_fetch_byquery(char *query)
+/* Queries run between these two read the same snapshot of the library; the
+ * snapshot is held until db_read_end(), don't keep it across event loop passes
+ */
+int
+db_read_begin(void)
 {
-  struct media_file_info *mfi;
-  sqlite3_stmt *stmt;
-  int ncols;
-  char *cval;
-  uint32_t *ival;
-  uint64_t *i64val;
-  char **strval;
-  uint64_t disabled;
-  int i;
+  char *errmsg;
   int ret;
 
-  if (!query)
-    return NULL;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  mfi = (struct media_file_info *)malloc(sizeof(struct media_file_info));
-  if (!mfi)
+  ret = db_exec("BEGIN TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Could not begin read transaction: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
     }
-  memset(mfi, 0, sizeof(struct media_file_info));
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  return 0;
+}
+
+void
+db_read_end(void)
+{
+  char *errmsg;
+  int ret;
+
+  ret = db_exec("COMMIT TRANSACTION;", &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not end read transaction: %s\n", errmsg);
 
-      free(mfi);
-      return NULL;
+      sqlite3_free(errmsg);
+      sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
     }
+}
 
-  ret = db_blocking_step(stmt);
+void
+db_query_end(struct query_params *qp)
+{
+  if (!qp->stmt)
+    return;
 
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+  qp->results = -1;
 
-      sqlite3_finalize(stmt);
-      free(mfi);
-      return NULL;
-    }
+  db_stmt_finalize(qp->stmt);
+  qp->stmt = NULL;
+}
 
-  ncols = sqlite3_column_count(stmt);
+void
+db_query_cursor_clear(struct query_cursor *qc)
+{
+  int i;
 
-  if (sizeof(mfi_cols_map) / sizeof(mfi_cols_map[0]) != ncols)
-    {
-      DPRINTF(E_LOG, L_DB, "BUG: mfi column map out of sync with schema\n");
+  if (qc->filter)
+    free(qc->filter);
 
-      sqlite3_finalize(stmt);
-      /* Can't risk free()ing what's inside the mfi in this case... */
-      free(mfi);
-      return NULL;
+  for (i = 0; i < qc->nkeys; i++)
+    {
+      if (qc->keys[i].text)
+	free(qc->keys[i].text);
     }
 
-  for (i = 0; i < ncols; i++)
-    {
-      switch (mfi_cols_map[i].type)
-	{
-	  case DB_TYPE_CHAR:
-	    cval = (char *)mfi + mfi_cols_map[i].offset;
+  memset(qc, 0, sizeof(struct query_cursor));
 
-	    *cval = sqlite3_column_int(stmt, i);
-	    break;
+  qc->pos = -1;
+  qc->results = -1;
+}
 
-	  case DB_TYPE_INT:
-	    ival = (uint32_t *) ((char *)mfi + mfi_cols_map[i].offset);
+/* Fills dbmfi from the first ncols columns of the current row of stmt */
+static int
+db_dbmfi_fill(sqlite3_stmt *stmt, int ncols, struct db_media_file_info *dbmfi)
+{
+  char **strcol;
+  int64_t *intcol;
+  int i;
 
-	    if (mfi_cols_map[i].offset == mfi_offsetof(disabled))
-	      {
-		disabled = sqlite3_column_int64(stmt, i);
-		*ival = (disabled != 0);
-	      }
-	    else
-	      *ival = sqlite3_column_int(stmt, i);
-	    break;
+  if (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with schema\n");
+      return -1;
+    }
 
+  for (i = 0; i < ncols; i++)
+    {
+      switch (dbmfi_cols_map[i].type)
+	{
 	  case DB_TYPE_INT64:
-	    i64val = (uint64_t *) ((char *)mfi + mfi_cols_map[i].offset);
+	    intcol = (int64_t *) ((char *)dbmfi + dbmfi_cols_map[i].offset);
 
-	    *i64val = sqlite3_column_int64(stmt, i);
+	    *intcol = sqlite3_column_int64(stmt, i);
 	    break;
 
 	  case DB_TYPE_STRING:
-	    strval = (char **) ((char *)mfi + mfi_cols_map[i].offset);
+	    strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i].offset);
 
-	    cval = (char *)sqlite3_column_text(stmt, i);
-	    if (cval)
-	      *strval = strdup(cval);
+	    *strcol = (char *)sqlite3_column_text(stmt, i);
 	    break;
 
 	  default:
-	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in mfi column map\n", mfi_cols_map[i].type);
-
-	    free_mfi(mfi, 0);
-	    sqlite3_finalize(stmt);
-	    return NULL;
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in dbmfi column map\n", dbmfi_cols_map[i].type);
+	    return -1;
 	}
     }
 
-  sqlite3_finalize(stmt);
-
-  return mfi;
+  return 0;
 }
 
-struct media_file_info *
-db_file_fetch_byid(int id)
+int
+db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
 {
-#define Q_TMPL "SELECT * FROM files WHERE id = %d;"
-  struct media_file_info *mfi;
-  char *query;
+  int ncols;
+  int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
+  memset(dbmfi, 0, sizeof(struct db_media_file_info));
+
+  if (!qp->stmt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
 
-      return NULL;
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUPITEMS))
+    {
+      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
+      return -1;
     }
 
-  mfi = db_file_fetch_byquery(query);
+  ret = db_query_step(qp);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      dbmfi->id = 0;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
+    }
 
-  sqlite3_free(query);
+  ncols = sqlite3_column_count(qp->stmt);
 
-  return mfi;
+  /* Sort keys of a keyset query come after the files columns */
+  ncols -= qp->keys;
 
-#undef Q_TMPL
+  return db_dbmfi_fill(qp->stmt, ncols, dbmfi);
 }
 
 int
-db_file_add(struct media_file_info *mfi)
+db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli)
 {
-#define Q_TMPL "INSERT INTO files (id, path, fname, title, artist, album, genre, comment, type, composer," \
-               " orchestra, conductor, grouping, url, bitrate, samplerate, song_length, file_size, year, track," \
-               " total_tracks, disc, total_discs, bpm, compilation, rating, play_count, data_kind, item_kind," \
-               " description, time_added, time_modified, time_played, db_timestamp, disabled, sample_count," \
-               " codectype, idx, has_video, contentrating, bits_per_sample, album_artist," \
-               " media_kind, tv_series_name, tv_episode_num_str, tv_network_name, tv_episode_sort, tv_season_num, " \
-               " songalbumid" \
-               " ) " \
-               " VALUES (NULL, '%q', '%q', %Q, %Q, %Q, %Q, %Q, %Q, %Q," \
-               " %Q, %Q, %Q, %Q, %d, %d, %d, %" PRIi64 ", %d, %d," \
-               " %d, %d, %d, %d, %d, %d, %d, %d, %d," \
-               " %Q, %" PRIi64 ", %" PRIi64 ", %" PRIi64 ", %" PRIi64 ", %d, %" PRIi64 "," \
-               " %Q, %d, %d, %d, %d, %Q, %d, %Q, %Q, %Q, %d, %d, daap_songalbumid(%Q, %Q));"
-  char *query;
-  char *errmsg;
+  int ncols;
+  char **strcol;
+  int id;
+  int type;
+  int nitems;
+  int i;
   int ret;
 
+  memset(dbpli, 0, sizeof(struct db_playlist_info));
 
-  if (mfi->id != 0)
+  if (!qp->stmt)
     {
-      DPRINTF(E_WARN, L_DB, "Trying to add file with non-zero id; use db_file_update()?\n");
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
       return -1;
     }
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
-  mfi->time_added = mfi->db_timestamp;
-
-  if (mfi->time_modified == 0)
-    mfi->time_modified = mfi->db_timestamp;
-
-  ensure_all_utf8(mfi);
-
-  query = sqlite3_mprintf(Q_TMPL,
-			  STR(mfi->path), STR(mfi->fname), mfi->title, mfi->artist, mfi->album,
-			  mfi->genre, mfi->comment, mfi->type, mfi->composer,
-			  mfi->orchestra, mfi->conductor, mfi->grouping, mfi->url, mfi->bitrate,
-			  mfi->samplerate, mfi->song_length, mfi->file_size, mfi->year, mfi->track,
-			  mfi->total_tracks, mfi->disc, mfi->total_discs, mfi->bpm, mfi->compilation,
-			  mfi->rating, mfi->play_count, mfi->data_kind, mfi->item_kind,
-			  mfi->description, (int64_t)mfi->time_added, (int64_t)mfi->time_modified,
-			  (int64_t)mfi->time_played, (int64_t)mfi->db_timestamp, mfi->disabled, mfi->sample_count,
-			  mfi->codectype, mfi->index, mfi->has_video,
-			  mfi->contentrating, mfi->bits_per_sample, mfi->album_artist,
-                          mfi->media_kind, mfi->tv_series_name, mfi->tv_episode_num_str, 
-                          mfi->tv_network_name, mfi->tv_episode_sort, mfi->tv_season_num,
-			  mfi->album_artist, mfi->album);
-  if (!query)
+  if (qp->type != Q_PL)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Not a playlist query!\n");
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ret = db_query_step(qp);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      dbpli->id = NULL;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
+    }
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  ncols = sqlite3_column_count(qp->stmt);
+
+  if (sizeof(dbpli_cols_map) / sizeof(dbpli_cols_map[0]) != ncols)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "BUG: dbpli column map out of sync with schema\n");
+      return -1;
+    }
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+  for (i = 0; i < ncols; i++)
+    {
+      strcol = (char **) ((char *)dbpli + dbpli_cols_map[i]);
+
+      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+    }
+
+  id = sqlite3_column_int(qp->stmt, 0);
+  type = sqlite3_column_int(qp->stmt, 2);
+
+  nitems = db_pl_count_cached(id, type, dbpli->query, qp->rev);
+  if (nitems < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", type);
       return -1;
     }
 
-  sqlite3_free(query);
+  dbpli->items = qp->buf;
+  ret = snprintf(qp->buf, sizeof(qp->buf), "%d", nitems);
+  if ((ret < 0) || (ret >= sizeof(qp->buf)))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not convert items, buffer too small\n");
 
-  return 0;
+      strcpy(qp->buf, "0");
+    }
 
-#undef Q_TMPL
+  return 0;
 }
 
 int
-db_file_update(struct media_file_info *mfi)
+db_query_fetch_group(struct query_params *qp, struct db_group_info *dbgri)
 {
-#define Q_TMPL "UPDATE files SET path = '%q', fname = '%q', title = %Q, artist = %Q, album = %Q, genre = %Q," \
-               " comment = %Q, type = %Q, composer = %Q, orchestra = %Q, conductor = %Q, grouping = %Q," \
-               " url = %Q, bitrate = %d, samplerate = %d, song_length = %d, file_size = %" PRIi64 "," \
-               " year = %d, track = %d, total_tracks = %d, disc = %d, total_discs = %d, bpm = %d," \
-               " compilation = %d, rating = %d, data_kind = %d, item_kind = %d," \
-               " description = %Q, time_modified = %" PRIi64 "," \
-               " db_timestamp = %" PRIi64 ", sample_count = %" PRIi64 "," \
-               " codectype = %Q, idx = %d, has_video = %d," \
-               " bits_per_sample = %d, album_artist = %Q," \
-               " media_kind = %d, tv_series_name = %Q, tv_episode_num_str = %Q," \
-               " tv_network_name = %Q, tv_episode_sort = %d, tv_season_num = %d," \
-               " songalbumid = daap_songalbumid(%Q, %Q) " \
-               " WHERE id = %d;"
-  char *query;
-  char *errmsg;
+  int ncols;
+  char **strcol;
+  int i;
   int ret;
 
-  if (mfi->id == 0)
+  memset(dbgri, 0, sizeof(struct db_group_info));
+
+  if (!qp->stmt)
     {
-      DPRINTF(E_WARN, L_DB, "Trying to update file with id 0; use db_file_add()?\n");
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
       return -1;
     }
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
-
-  if (mfi->time_modified == 0)
-    mfi->time_modified = mfi->db_timestamp;
-
-  ensure_all_utf8(mfi);
-
-  query = sqlite3_mprintf(Q_TMPL,
-			  STR(mfi->path), STR(mfi->fname), mfi->title, mfi->artist, mfi->album, mfi->genre,
-			  mfi->comment, mfi->type, mfi->composer, mfi->orchestra, mfi->conductor, mfi->grouping, 
-			  mfi->url, mfi->bitrate, mfi->samplerate, mfi->song_length, mfi->file_size,
-			  mfi->year, mfi->track, mfi->total_tracks, mfi->disc, mfi->total_discs, mfi->bpm,
-			  mfi->compilation, mfi->rating, mfi->data_kind, mfi->item_kind,
-			  mfi->description, (int64_t)mfi->time_modified,
-			  (int64_t)mfi->db_timestamp, mfi->sample_count,
-			  mfi->codectype, mfi->index, mfi->has_video,
-			  mfi->bits_per_sample, mfi->album_artist,
-			  mfi->media_kind, mfi->tv_series_name, mfi->tv_episode_num_str, 
-			  mfi->tv_network_name, mfi->tv_episode_sort, mfi->tv_season_num,
-			  mfi->album_artist, mfi->album,
-			  mfi->id);
+  if (qp->type != Q_GROUPS)
+    {
+      DPRINTF(E_LOG, L_DB, "Not a groups query!\n");
+      return -1;
+    }
 
-  if (!query)
+  ret = db_query_step(qp);
+  if (ret == SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      return 1;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ncols = sqlite3_column_count(qp->stmt);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  if (sizeof(dbgri_cols_map) / sizeof(dbgri_cols_map[0]) != ncols)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      DPRINTF(E_LOG, L_DB, "BUG: dbgri column map out of sync with schema\n");
       return -1;
     }
 
-  sqlite3_free(query);
+  for (i = 0; i < ncols; i++)
+    {
+      strcol = (char **) ((char *)dbgri + dbgri_cols_map[i]);
 
-  return 0;
+      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+    }
 
-#undef Q_TMPL
+  return 0;
 }
 
-void
-db_file_delete_bypath(char *path)
+int
+db_query_fetch_string(struct query_params *qp, char **string)
 {
-#define Q_TMPL "DELETE FROM files WHERE path = '%q';"
-  char *query;
-  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  *string = NULL;
+
+  if (!qp->stmt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
 
-      return;
+  if (!(qp->type & Q_F_BROWSE))
+    {
+      DPRINTF(E_LOG, L_DB, "Not a browse query!\n");
+      return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ret = db_query_step(qp);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      *string = NULL;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
+    }
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error deleting file: %s\n", errmsg);
+  *string = (char *)sqlite3_column_text(qp->stmt, 0);
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  return 0;
+}
 
-#undef Q_TMPL
+
+/* Files */
+int
+db_files_get_count(void)
+{
+  return db_stmt_get_count(DB_STMT_FILE_COUNT, "SELECT COUNT(*) FROM files WHERE disabled = 0;");
 }
 
-static void
-db_file_disable_byquery(char *query)
+/* Same as db_files_get_count(), but counted once per library revision;
+ * same rules as db_pl_count_cached(). Must not be called while another
+ * statement is being read on this connection.
+ */
+int
+db_files_get_count_cached(void)
 {
-  char *errmsg;
-  int ret;
+  uint32_t rev;
+  int enabled;
+  int count;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  pthread_mutex_lock(&db_rev_lck);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error disabling file: %s\n", errmsg);
+  rev = db_rev;
+  enabled = db_rev_enabled && sqlite3_get_autocommit(hdl);
 
-  sqlite3_free(errmsg);
-}
+  count = -1;
+  if (enabled && (files_count_rev == rev))
+    count = files_count;
 
-void
-db_file_disable_bypath(char *path, char *strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE files SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  pthread_mutex_unlock(&db_rev_lck);
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  if (count >= 0)
+    return count;
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  count = db_files_get_count();
+  if (!enabled || (count < 0))
+    return count;
 
-      return;
-    }
+  pthread_mutex_lock(&db_rev_lck);
 
-  db_file_disable_byquery(query);
+  if (db_rev == rev)
+    {
+      files_count = count;
+      files_count_rev = rev;
+    }
 
-  sqlite3_free(query);
+  pthread_mutex_unlock(&db_rev_lck);
 
-#undef Q_TMPL
+  return count;
 }
 
 void
-db_file_disable_bymatch(char *path, char *strip, uint32_t cookie)
+db_files_update_songalbumid(void)
 {
-#define Q_TMPL "UPDATE files SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+#define Q_SONGALBUMID "UPDATE files SET songalbumid = daap_songalbumid(album_artist, album);"
+#define Q_GROUPS_COUNT "UPDATE groups SET items = (SELECT COUNT(*) FROM files f WHERE f.songalbumid = groups.persistentid AND f.disabled = 0) WHERE type = 1;"
+  char *errmsg;
+  int ret;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_SONGALBUMID);
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  ret = db_exec(Q_SONGALBUMID, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error updating songalbumid: %s\n", errmsg);
 
-      return;
-    }
+  sqlite3_free(errmsg);
 
-  db_file_disable_byquery(query);
+  /* The triggers only count changes; groups rebuilt after a
+   * db_groups_clear() start out empty
+   */
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_GROUPS_COUNT);
 
-  sqlite3_free(query);
+  ret = db_exec(Q_GROUPS_COUNT, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error counting group items: %s\n", errmsg);
 
-#undef Q_TMPL
+  sqlite3_free(errmsg);
+
+#undef Q_GROUPS_COUNT
+#undef Q_SONGALBUMID
 }
 
-int
-db_file_enable_bycookie(uint32_t cookie, char *path)
+void
+db_file_inc_playcount(int id)
 {
-#define Q_TMPL "UPDATE files SET path = '%q' || path, disabled = 0 WHERE disabled = %" PRIi64 ";"
-  char *query;
+#define Q_TMPL "UPDATE files SET play_count = play_count + 1, time_played = ? WHERE id = ?;"
+  sqlite3_stmt *stmt;
   char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_get(DB_STMT_FILE_INC_PLAYCOUNT, Q_TMPL);
+  if (!stmt)
+    return;
 
-      return -1;
-    }
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
 
-  ret = db_exec(query, &errmsg);
+  ret = db_stmt_exec(stmt, &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Error enabling files: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Error incrementing play count on %d: %s\n", id, errmsg);
 
       sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
+      return;
     }
 
-  sqlite3_free(query);
-
-  return sqlite3_changes(hdl);
+  /* Logged as a change by the changes_update_file trigger */
+  db_library_revision_seal();
 
 #undef Q_TMPL
 }
 
-
-/* Playlists */
-int
-db_pl_get_count(void)
-{
-  return db_get_count("SELECT COUNT(*) FROM playlists WHERE disabled = 0;");
-}
-
-static int
-db_pl_count_items(int id)
+/* Only re-enables the file if needed; the scan generation takes care of
+ * keeping it from being purged
+ */
+void
+db_file_ping_byid(int id)
 {
-#define Q_TMPL "SELECT COUNT(*) FROM playlistitems JOIN files" \
-               " ON playlistitems.filepath = files.path WHERE files.disabled = 0 AND playlistitems.playlistid = %d;"
-  char *query;
+#define Q_TMPL "UPDATE files SET db_timestamp = ?, disabled = 0 WHERE id = ? AND disabled <> 0;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
+  db_scan_generation_mark(id);
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return 0;
-    }
+  stmt = db_stmt_get(DB_STMT_FILE_PING_BYID, Q_TMPL);
+  if (!stmt)
+    return;
 
-  ret = db_get_count(query);
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
 
-  sqlite3_free(query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
 
-  return ret;
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error pinging file id %d: %s\n", id, errmsg);
+  else if (sqlite3_changes(hdl) > 0)
+    db_scan_batch_account();
+
+  sqlite3_free(errmsg);
 
 #undef Q_TMPL
 }
 
-static int
-db_smartpl_count_items(const char *smartpl_query)
+char *
+db_file_path_byid(int id)
 {
-#define Q_TMPL "SELECT COUNT(*) FROM files WHERE disabled = 0 AND %s;"
-  char *query;
+#define Q_TMPL "SELECT path FROM files WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  char *res;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, smartpl_query);
+  stmt = db_stmt_get(DB_STMT_FILE_PATH_BYID, Q_TMPL);
+  if (!stmt)
+    return NULL;
 
-  if (!query)
+  sqlite3_bind_int(stmt, 1, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return 0;
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+
+      db_stmt_reset(stmt);
+      return NULL;
     }
 
-  ret = db_get_count(query);
+  res = (char *)sqlite3_column_text(stmt, 0);
+  if (res)
+    res = strdup(res);
 
-  sqlite3_free(query);
+  db_stmt_reset(stmt);
 
-  return ret;
+  return res;
 
 #undef Q_TMPL
 }
 
-void
-db_pl_ping(int id)
+/* Steps a cached statement with its parameters bound, returns the id in
+ * the first column of the first row, or 0 if not found.
+ */
+static int
+db_file_id_bystmt(sqlite3_stmt *stmt)
 {
-#define Q_TMPL "UPDATE playlists SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
-  char *query;
-  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
-  if (!query)
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
 
-      return;
+      db_stmt_reset(stmt);
+      return 0;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ret = sqlite3_column_int(stmt, 0);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error pinging playlist %d: %s\n", id, errmsg);
+  db_stmt_reset(stmt);
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  return ret;
+}
+
+int
+db_file_id_bypath(char *path)
+{
+#define Q_TMPL "SELECT id FROM files WHERE path = ?;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_FILE_ID_BYPATH, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
 }
 
-static int
-db_pl_id_bypath(char *path, int *id)
+/* The file name is looked up in idx_fname, case-insensitively like the
+ * LIKE, which then only has to check the base path
+ */
+int
+db_file_id_byfilebase(char *filename, char *base)
 {
-#define Q_TMPL "SELECT id FROM playlists WHERE path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT id FROM files WHERE fname = ?2 COLLATE NOCASE AND path LIKE ?1 || '/%/' || ?2;"
   sqlite3_stmt *stmt;
-  int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_get(DB_STMT_FILE_ID_BYFILEBASE, Q_TMPL);
+  if (!stmt)
+    return 0;
 
-      return -1;
-    }
+  sqlite3_bind_text(stmt, 1, base, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (base '%s', file '%s')\n", Q_TMPL, base, filename);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  return db_file_id_bystmt(stmt);
 
-      sqlite3_free(query);
-      return -1;
-    }
+#undef Q_TMPL
+}
+
+/* The name is matched exactly, the NOCASE term is for idx_fname */
+int
+db_file_id_byfile(char *filename)
+{
+#define Q_TMPL "SELECT id FROM files WHERE fname = ?1 COLLATE NOCASE AND fname = ?1;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_FILE_ID_BYFILE, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (file '%s')\n", Q_TMPL, filename);
+
+  return db_file_id_bystmt(stmt);
+
+#undef Q_TMPL
+}
+
+int
+db_file_id_byurl(char *url)
+{
+#define Q_TMPL "SELECT id FROM files WHERE url = ?;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_FILE_ID_BYURL, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (url '%s')\n", Q_TMPL, url);
+
+  return db_file_id_bystmt(stmt);
+
+#undef Q_TMPL
+}
+
+time_t
+db_file_stamp_bypath(char *path, int *id, int64_t *size)
+{
+#define Q_TMPL "SELECT id, db_timestamp, file_size FROM files WHERE path = ?;"
+  sqlite3_stmt *stmt;
+  time_t stamp;
+  int ret;
+
+  *id = 0;
+  *size = 0;
+
+  stmt = db_stmt_get(DB_STMT_FILE_STAMP_BYPATH, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
 
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
@@ -2268,57 +2793,49 @@ db_pl_id_bypath(char *path, int *id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
+      db_stmt_reset(stmt);
+      return 0;
     }
 
   *id = sqlite3_column_int(stmt, 0);
+  stamp = (time_t)sqlite3_column_int64(stmt, 1);
+  *size = sqlite3_column_int64(stmt, 2);
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_stmt_reset(stmt);
 
-  return 0;
+  return stamp;
 
 #undef Q_TMPL
 }
 
-static struct playlist_info *
-db_pl_fetch_byquery(char *query)
+/* Steps a cached statement with its parameters bound, returns a new mfi
+ * filled with the first row of results.
+ */
+static struct media_file_info *
+db_file_fetch_bystmt(sqlite3_stmt *stmt)
 {
-  struct playlist_info *pli;
-  sqlite3_stmt *stmt;
+  struct media_file_info *mfi;
   int ncols;
   char *cval;
   uint32_t *ival;
+  uint64_t *i64val;
   char **strval;
   uint64_t disabled;
   int i;
   int ret;
 
-  if (!query)
-    return NULL;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  pli = (struct playlist_info *)malloc(sizeof(struct playlist_info));
-  if (!pli)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not allocate struct playlist_info, out of memory\n");
-      return NULL;
-    }
-  memset(pli, 0, sizeof(struct playlist_info));
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  mfi = (struct media_file_info *)malloc(sizeof(struct media_file_info));
+  if (!mfi)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
 
-      free(pli);
+      db_stmt_reset(stmt);
       return NULL;
     }
+  memset(mfi, 0, sizeof(struct media_file_info));
 
   ret = db_blocking_step(stmt);
+
   if (ret != SQLITE_ROW)
     {
       if (ret == SQLITE_DONE)
@@ -2326,31 +2843,37 @@ db_pl_fetch_byquery(char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      free(pli);
+      db_stmt_reset(stmt);
+      free(mfi);
       return NULL;
     }
 
   ncols = sqlite3_column_count(stmt);
 
-  if (sizeof(pli_cols_map) / sizeof(pli_cols_map[0]) != ncols)
+  if (sizeof(mfi_cols_map) / sizeof(mfi_cols_map[0]) != ncols)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: pli column map out of sync with schema\n");
+      DPRINTF(E_LOG, L_DB, "BUG: mfi column map out of sync with schema\n");
 
-      sqlite3_finalize(stmt);
-      /* Can't risk free()ing what's inside the pli in this case... */
-      free(pli);
+      db_stmt_reset(stmt);
+      /* Can't risk free()ing what's inside the mfi in this case... */
+      free(mfi);
       return NULL;
     }
 
   for (i = 0; i < ncols; i++)
     {
-      switch (pli_cols_map[i].type)
+      switch (mfi_cols_map[i].type)
 	{
+	  case DB_TYPE_CHAR:
+	    cval = (char *)mfi + mfi_cols_map[i].offset;
+
+	    *cval = sqlite3_column_int(stmt, i);
+	    break;
+
 	  case DB_TYPE_INT:
-	    ival = (uint32_t *) ((char *)pli + pli_cols_map[i].offset);
+	    ival = (uint32_t *) ((char *)mfi + mfi_cols_map[i].offset);
 
-	    if (pli_cols_map[i].offset == pli_offsetof(disabled))
+	    if (mfi_cols_map[i].offset == mfi_offsetof(disabled))
 	      {
 		disabled = sqlite3_column_int64(stmt, i);
 		*ival = (disabled != 0);
@@ -2359,8 +2882,14 @@ db_pl_fetch_byquery(char *query)
 	      *ival = sqlite3_column_int(stmt, i);
 	    break;
 
+	  case DB_TYPE_INT64:
+	    i64val = (uint64_t *) ((char *)mfi + mfi_cols_map[i].offset);
+
+	    *i64val = sqlite3_column_int64(stmt, i);
+	    break;
+
 	  case DB_TYPE_STRING:
-	    strval = (char **) ((char *)pli + pli_cols_map[i].offset);
+	    strval = (char **) ((char *)mfi + mfi_cols_map[i].offset);
 
 	    cval = (char *)sqlite3_column_text(stmt, i);
 	    if (cval)
@@ -2368,432 +2897,1557 @@ db_pl_fetch_byquery(char *query)
 	    break;
 
 	  default:
-	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in pli column map\n", pli_cols_map[i].type);
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in mfi column map\n", mfi_cols_map[i].type);
 
-	    sqlite3_finalize(stmt);
-	    free_pli(pli, 0);
+	    free_mfi(mfi, 0);
+	    db_stmt_reset(stmt);
 	    return NULL;
 	}
     }
 
-  ret = db_blocking_step(stmt);
-  sqlite3_finalize(stmt);
+  db_stmt_reset(stmt);
 
-  if (ret != SQLITE_DONE)
-    {
-      DPRINTF(E_WARN, L_DB, "Query had more than a single result!\n");
+  return mfi;
+}
 
-      free_pli(pli, 0);
-      return NULL;
-    }
+struct media_file_info *
+db_file_fetch_byid(int id)
+{
+#define Q_TMPL "SELECT * FROM files WHERE id = ?;"
+  sqlite3_stmt *stmt;
 
-  switch (pli->type)
-    {
-      case PL_PLAIN:
-	pli->items = db_pl_count_items(pli->id);
-	break;
+  stmt = db_stmt_get(DB_STMT_FILE_FETCH_BYID, Q_TMPL);
+  if (!stmt)
+    return NULL;
 
-      case PL_SMART:
-	pli->items = db_smartpl_count_items(pli->query);
-	break;
+  sqlite3_bind_int(stmt, 1, id);
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", pli->type);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
 
-	free_pli(pli, 0);
-	return NULL;
-    }
+  return db_file_fetch_bystmt(stmt);
 
-  return pli;
+#undef Q_TMPL
 }
 
-struct playlist_info *
-db_pl_fetch_bypath(char *path)
+/* As db_query_fetch_file(), for a single file whether it is disabled or
+ * not; dbmfi->id is 0 if there's no such file. The row stays current until
+ * the next call or db_file_fetch_dbmfi_end(), which must come before going
+ * back to the event loop so no read transaction is left open.
+ */
+int
+db_file_fetch_dbmfi_byid(int id, struct db_media_file_info *dbmfi)
 {
-#define Q_TMPL "SELECT * FROM playlists WHERE path = '%q';"
-  struct playlist_info *pli;
-  char *query;
-
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
-    }
+#define Q_TMPL "SELECT * FROM files WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
 
-  pli = db_pl_fetch_byquery(query);
+  memset(dbmfi, 0, sizeof(struct db_media_file_info));
 
-  sqlite3_free(query);
+  stmt = db_stmt_get(DB_STMT_FILE_DBMFI_BYID, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-  return pli;
+  /* Done with the previous row */
+  db_stmt_reset(stmt);
 
-#undef Q_TMPL
-}
+  sqlite3_bind_int(stmt, 1, id);
 
-struct playlist_info *
-db_pl_fetch_byid(int id)
-{
-#define Q_TMPL "SELECT * FROM playlists WHERE id = %d;"
-  struct playlist_info *pli;
-  char *query;
+  DPRINTF(E_SPAM, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
+      db_stmt_reset(stmt);
+      return 0;
     }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-  pli = db_pl_fetch_byquery(query);
+      db_stmt_reset(stmt);
+      return -1;
+    }
 
-  sqlite3_free(query);
+  ret = db_dbmfi_fill(stmt, sqlite3_column_count(stmt), dbmfi);
+  if (ret < 0)
+    {
+      db_stmt_reset(stmt);
+      memset(dbmfi, 0, sizeof(struct db_media_file_info));
+      return -1;
+    }
 
-  return pli;
+  return 0;
 
 #undef Q_TMPL
 }
 
-struct playlist_info *
-db_pl_fetch_bytitlepath(char *title, char *path)
+void
+db_file_fetch_dbmfi_end(void)
 {
-#define Q_TMPL "SELECT * FROM playlists WHERE title = '%q' AND path = '%q';"
-  struct playlist_info *pli;
-  char *query;
+  if (db_stmts[DB_STMT_FILE_DBMFI_BYID])
+    db_stmt_reset(db_stmts[DB_STMT_FILE_DBMFI_BYID]);
+}
 
-  query = sqlite3_mprintf(Q_TMPL, title, path);
-  if (!query)
+/* Binds the fields of the mfi to the statement parameters; parameter ?N is
+ * bound to entry N - 1 of mfi_cols_map, so the files table column order is
+ * also the parameter order. songalbumid, the sort keys and the title
+ * letter are always computed in SQL.
+ */
+static void
+db_file_bind_mfi(sqlite3_stmt *stmt, struct media_file_info *mfi)
+{
+  char *cval;
+  uint32_t *ival;
+  uint64_t *i64val;
+  char **strval;
+  int i;
+
+  for (i = 0; i < (sizeof(mfi_cols_map) / sizeof(mfi_cols_map[0])); i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      if ((mfi_cols_map[i].offset == mfi_offsetof(songalbumid))
+	  || (mfi_cols_map[i].offset == mfi_offsetof(title_sort))
+	  || (mfi_cols_map[i].offset == mfi_offsetof(artist_sort))
+	  || (mfi_cols_map[i].offset == mfi_offsetof(album_sort))
+	  || (mfi_cols_map[i].offset == mfi_offsetof(album_artist_sort))
+	  || (mfi_cols_map[i].offset == mfi_offsetof(title_letter)))
+	continue;
 
-      return NULL;
-    }
+      switch (mfi_cols_map[i].type)
+	{
+	  case DB_TYPE_CHAR:
+	    cval = (char *)mfi + mfi_cols_map[i].offset;
 
-  pli = db_pl_fetch_byquery(query);
+	    sqlite3_bind_int(stmt, i + 1, *cval);
+	    break;
 
-  sqlite3_free(query);
+	  case DB_TYPE_INT:
+	    ival = (uint32_t *) ((char *)mfi + mfi_cols_map[i].offset);
 
-  return pli;
+	    sqlite3_bind_int64(stmt, i + 1, (int64_t)*ival);
+	    break;
 
-#undef Q_TMPL
+	  case DB_TYPE_INT64:
+	    i64val = (uint64_t *) ((char *)mfi + mfi_cols_map[i].offset);
+
+	    sqlite3_bind_int64(stmt, i + 1, *i64val);
+	    break;
+
+	  case DB_TYPE_STRING:
+	    strval = (char **) ((char *)mfi + mfi_cols_map[i].offset);
+
+	    /* path and fname are NOT NULL */
+	    if ((mfi_cols_map[i].offset == mfi_offsetof(path)) || (mfi_cols_map[i].offset == mfi_offsetof(fname)))
+	      sqlite3_bind_text(stmt, i + 1, STR(*strval), -1, SQLITE_STATIC);
+	    else
+	      sqlite3_bind_text(stmt, i + 1, *strval, -1, SQLITE_STATIC);
+	    break;
+	}
+    }
 }
 
 int
-db_pl_add(char *title, char *path, int *id)
+db_file_add(struct media_file_info *mfi)
 {
-#define QDUP_TMPL "SELECT COUNT(*) FROM playlists WHERE title = '%q' AND path = '%q';"
-#define QADD_TMPL "INSERT INTO playlists (title, type, query, db_timestamp, disabled, path, idx, special_id)" \
-                  " VALUES ('%q', 0, NULL, %" PRIi64 ", 0, '%q', 0, 0);"
-  char *query;
+#define Q_TMPL "INSERT INTO files (id, path, fname, title, artist, album, genre, comment, type, composer," \
+               " orchestra, conductor, grouping, url, bitrate, samplerate, song_length, file_size, year, track," \
+               " total_tracks, disc, total_discs, bpm, compilation, rating, play_count, data_kind, item_kind," \
+               " description, time_added, time_modified, time_played, db_timestamp, disabled, sample_count," \
+               " codectype, idx, has_video, contentrating, bits_per_sample, album_artist," \
+               " media_kind, tv_series_name, tv_episode_num_str, tv_network_name, tv_episode_sort, tv_season_num, " \
+               " songalbumid, title_sort, artist_sort, album_sort, album_artist_sort, title_letter" \
+               " ) " \
+               " VALUES (NULL, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10," \
+               " ?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20," \
+               " ?21, ?22, ?23, ?24, ?25, ?26, ?27, ?28, ?29," \
+               " ?30, ?31, ?32, ?33, ?34, ?35, ?36," \
+               " ?37, ?38, ?39, ?40, ?41, ?42, ?43, ?44, ?45, ?46, ?47, ?48, daap_songalbumid(?42, ?6)," \
+               " daap_sortkey(?4), daap_sortkey(?5), daap_sortkey(?6), daap_sortkey(?42), daap_sortletter(?4));"
+  sqlite3_stmt *stmt;
   char *errmsg;
   int ret;
 
-  /* Check duplicates */
-  query = sqlite3_mprintf(QDUP_TMPL, title, path);
-  if (!query)
+
+  if (mfi->id != 0)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_WARN, L_DB, "Trying to add file with non-zero id; use db_file_update()?\n");
       return -1;
     }
 
-  ret = db_get_count(query);
+  mfi->db_timestamp = (uint64_t)time(NULL);
+  mfi->time_added = mfi->db_timestamp;
 
-  sqlite3_free(query);
+  if (mfi->time_modified == 0)
+    mfi->time_modified = mfi->db_timestamp;
 
-  if (ret > 0)
+  ensure_all_utf8(mfi);
+
+  stmt = db_stmt_get(DB_STMT_FILE_ADD, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  db_file_bind_mfi(stmt, mfi);
+
+  DPRINTF(E_DBG, L_DB, "Running file add query (path '%s')\n", mfi->path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_WARN, L_DB, "Duplicate playlist with title '%s' path '%s'\n", title, path);
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
       return -1;
     }
 
-  /* Add */
-  query = sqlite3_mprintf(QADD_TMPL, title, (int64_t)time(NULL), path);
-  if (!query)
+  mfi->id = (uint32_t)sqlite3_last_insert_rowid(hdl);
+
+  db_scan_batch_account();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_file_update(struct media_file_info *mfi)
+{
+#define Q_TMPL "UPDATE files SET path = ?2, fname = ?3, title = ?4, artist = ?5, album = ?6, genre = ?7," \
+               " comment = ?8, type = ?9, composer = ?10, orchestra = ?11, conductor = ?12, grouping = ?13," \
+               " url = ?14, bitrate = ?15, samplerate = ?16, song_length = ?17, file_size = ?18," \
+               " year = ?19, track = ?20, total_tracks = ?21, disc = ?22, total_discs = ?23, bpm = ?24," \
+               " compilation = ?25, rating = ?26, data_kind = ?28, item_kind = ?29," \
+               " description = ?30, time_modified = ?32," \
+               " db_timestamp = ?34, sample_count = ?36," \
+               " codectype = ?37, idx = ?38, has_video = ?39," \
+               " bits_per_sample = ?41, album_artist = ?42," \
+               " media_kind = ?43, tv_series_name = ?44, tv_episode_num_str = ?45," \
+               " tv_network_name = ?46, tv_episode_sort = ?47, tv_season_num = ?48," \
+               " songalbumid = daap_songalbumid(?42, ?6)," \
+               " title_sort = daap_sortkey(?4), artist_sort = daap_sortkey(?5)," \
+               " album_sort = daap_sortkey(?6), album_artist_sort = daap_sortkey(?42)," \
+               " title_letter = daap_sortletter(?4)" \
+               " WHERE id = ?1;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  if (mfi->id == 0)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_WARN, L_DB, "Trying to update file with id 0; use db_file_add()?\n");
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  mfi->db_timestamp = (uint64_t)time(NULL);
 
-  ret = db_exec(query, &errmsg);
+  if (mfi->time_modified == 0)
+    mfi->time_modified = mfi->db_timestamp;
+
+  ensure_all_utf8(mfi);
+
+  stmt = db_stmt_get(DB_STMT_FILE_UPDATE, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  db_file_bind_mfi(stmt, mfi);
+
+  DPRINTF(E_DBG, L_DB, "Running file update query (id %d, path '%s')\n", mfi->id, mfi->path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
 
       sqlite3_free(errmsg);
-      sqlite3_free(query);
       return -1;
     }
 
-  sqlite3_free(query);
+  db_scan_batch_account();
 
-  *id = (int)sqlite3_last_insert_rowid(hdl);
-  if (*id == 0)
+  return 0;
+
+#undef Q_TMPL
+}
+
+void
+db_file_delete_bypath(char *path)
+{
+#define Q_TMPL "DELETE FROM files WHERE path = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_FILE_DELETE_BYPATH, Q_TMPL);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error deleting file: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+
+#undef Q_TMPL
+}
+
+/* Shared by the disable_bypath/bymatch functions below; parameters are
+ * bound as (striplen, disabled, path).
+ */
+static void
+db_file_disable_bystmt(sqlite3_stmt *stmt, char *path, char *strip, uint32_t cookie)
+{
+  char *errmsg;
+  int64_t disabled;
+  int striplen;
+  int ret;
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  sqlite3_bind_int(stmt, 1, striplen);
+  sqlite3_bind_int64(stmt, 2, disabled);
+  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", sqlite3_sql(stmt), path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error disabling file: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+}
+
+void
+db_file_disable_bypath(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE files SET path = substr(path, ?1), disabled = ?2 WHERE path = ?3;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_FILE_DISABLE_BYPATH, Q_TMPL);
+  if (!stmt)
+    return;
+
+  db_file_disable_bystmt(stmt, path, strip, cookie);
+
+#undef Q_TMPL
+}
+
+/* Everything below path/ as an index range: '0' sorts right after '/' */
+void
+db_file_disable_bymatch(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE files SET path = substr(path, ?1), disabled = ?2 WHERE path >= ?3 || '/' AND path < ?3 || '0';"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_FILE_DISABLE_BYMATCH, Q_TMPL);
+  if (!stmt)
+    return;
+
+  db_file_disable_bystmt(stmt, path, strip, cookie);
+
+#undef Q_TMPL
+}
+
+int
+db_file_enable_bycookie(uint32_t cookie, char *path)
+{
+#define Q_TMPL "UPDATE files SET path = ? || path, disabled = 0 WHERE disabled = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_FILE_ENABLE_BYCOOKIE, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)cookie);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Successful insert but no last_insert_rowid!\n");
+      DPRINTF(E_LOG, L_DB, "Error enabling files: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return sqlite3_changes(hdl);
+
+#undef Q_TMPL
+}
+
+
+/* Playlists */
+int
+db_pl_get_count(void)
+{
+  return db_stmt_get_count(DB_STMT_PL_COUNT, "SELECT COUNT(*) FROM playlists WHERE disabled = 0;");
+}
+
+static int
+db_pl_count_items(int id)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM playlistitems JOIN files" \
+               " ON playlistitems.filepath = files.path WHERE files.disabled = 0 AND playlistitems.playlistid = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_PL_COUNT_ITEMS, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_reset(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_reset(stmt);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+static int
+db_smartpl_count_items(const char *smartpl_query)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM files WHERE disabled = 0 AND %s;"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, smartpl_query);
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return 0;
+    }
+
+  ret = db_get_count(query);
+
+  sqlite3_free(query);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+static void
+db_pl_count_flush(void)
+{
+  struct pl_count *plc;
+  int i;
+
+  for (i = 0; i < PL_COUNT_BUCKETS; i++)
+    {
+      while ((plc = pl_counts[i]))
+	{
+	  pl_counts[i] = plc->next;
+	  free(plc);
+	}
+    }
+}
+
+/* Item count of a playlist, computed once per library revision. rev is
+ * the revision taken before the caller started reading: a count may run
+ * while another statement still reads an older snapshot. The cache is
+ * only used if rev is still current and no transaction is open on this
+ * connection, and a count is only stored if no commit came in while it
+ * was being computed.
+ * Returns -1 for an unknown playlist type.
+ */
+static int
+db_pl_count_cached(int id, int type, const char *smartpl_query, uint32_t rev)
+{
+  struct pl_count *plc;
+  int enabled;
+  int items;
+
+  if ((type != PL_PLAIN) && (type != PL_SMART))
+    return -1;
+
+  pthread_mutex_lock(&db_rev_lck);
+
+  enabled = db_rev_enabled && (db_rev == rev) && sqlite3_get_autocommit(hdl);
+
+  items = -1;
+  if (enabled)
+    {
+      if (pl_count_rev != rev)
+	{
+	  db_pl_count_flush();
+	  pl_count_rev = rev;
+	}
+
+      for (plc = pl_counts[id % PL_COUNT_BUCKETS]; plc; plc = plc->next)
+	{
+	  if (plc->id == id)
+	    break;
+	}
+
+      if (plc)
+	items = plc->items;
+    }
+
+  pthread_mutex_unlock(&db_rev_lck);
+
+  if (items >= 0)
+    return items;
+
+  if (type == PL_PLAIN)
+    items = db_pl_count_items(id);
+  else
+    items = db_smartpl_count_items(smartpl_query);
+
+  if (!enabled)
+    return items;
+
+  plc = (struct pl_count *)malloc(sizeof(struct pl_count));
+  if (!plc)
+    return items;
+
+  plc->id = id;
+  plc->items = items;
+
+  pthread_mutex_lock(&db_rev_lck);
+
+  if ((db_rev == rev) && (pl_count_rev == rev))
+    {
+      plc->next = pl_counts[id % PL_COUNT_BUCKETS];
+      pl_counts[id % PL_COUNT_BUCKETS] = plc;
+      plc = NULL;
+    }
+
+  pthread_mutex_unlock(&db_rev_lck);
+
+  free(plc);
+
+  return items;
+}
+
+void
+db_pl_ping(int id)
+{
+#define Q_TMPL "UPDATE playlists SET db_timestamp = ?, disabled = 0 WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_PL_PING, Q_TMPL);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error pinging playlist %d: %s\n", id, errmsg);
+
+  sqlite3_free(errmsg);
+
+#undef Q_TMPL
+}
+
+static int
+db_pl_id_bypath(char *path, int *id)
+{
+#define Q_TMPL "SELECT id FROM playlists WHERE path = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_PL_ID_BYPATH, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+
+      db_stmt_reset(stmt);
+      return -1;
+    }
+
+  *id = sqlite3_column_int(stmt, 0);
+
+  db_stmt_reset(stmt);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+/* Steps a cached statement with its parameters bound, returns a new pli
+ * filled with the only row of results.
+ */
+static struct playlist_info *
+db_pl_fetch_bystmt(sqlite3_stmt *stmt)
+{
+  struct playlist_info *pli;
+  int ncols;
+  char *cval;
+  uint32_t *ival;
+  char **strval;
+  uint64_t disabled;
+  uint32_t rev;
+  int i;
+  int ret;
+
+  pli = (struct playlist_info *)malloc(sizeof(struct playlist_info));
+  if (!pli)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not allocate struct playlist_info, out of memory\n");
+
+      db_stmt_reset(stmt);
+      return NULL;
+    }
+  memset(pli, 0, sizeof(struct playlist_info));
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_reset(stmt);
+      free(pli);
+      return NULL;
+    }
+
+  ncols = sqlite3_column_count(stmt);
+
+  if (sizeof(pli_cols_map) / sizeof(pli_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: pli column map out of sync with schema\n");
+
+      db_stmt_reset(stmt);
+      /* Can't risk free()ing what's inside the pli in this case... */
+      free(pli);
+      return NULL;
+    }
+
+  for (i = 0; i < ncols; i++)
+    {
+      switch (pli_cols_map[i].type)
+	{
+	  case DB_TYPE_INT:
+	    ival = (uint32_t *) ((char *)pli + pli_cols_map[i].offset);
+
+	    if (pli_cols_map[i].offset == pli_offsetof(disabled))
+	      {
+		disabled = sqlite3_column_int64(stmt, i);
+		*ival = (disabled != 0);
+	      }
+	    else
+	      *ival = sqlite3_column_int(stmt, i);
+	    break;
+
+	  case DB_TYPE_STRING:
+	    strval = (char **) ((char *)pli + pli_cols_map[i].offset);
+
+	    cval = (char *)sqlite3_column_text(stmt, i);
+	    if (cval)
+	      *strval = strdup(cval);
+	    break;
+
+	  default:
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in pli column map\n", pli_cols_map[i].type);
+
+	    db_stmt_reset(stmt);
+	    free_pli(pli, 0);
+	    return NULL;
+	}
+    }
+
+  ret = db_blocking_step(stmt);
+  db_stmt_reset(stmt);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_WARN, L_DB, "Query had more than a single result!\n");
+
+      free_pli(pli, 0);
+      return NULL;
+    }
+
+  /* Nothing is being read anymore, the count starts a new snapshot */
+  db_revision(&rev);
+
+  ret = db_pl_count_cached(pli->id, pli->type, pli->query, rev);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", pli->type);
+
+      free_pli(pli, 0);
+      return NULL;
+    }
+
+  pli->items = ret;
+
+  return pli;
+}
+
+struct playlist_info *
+db_pl_fetch_bypath(char *path)
+{
+#define Q_TMPL "SELECT * FROM playlists WHERE path = ?;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_PL_FETCH_BYPATH, Q_TMPL);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  return db_pl_fetch_bystmt(stmt);
+
+#undef Q_TMPL
+}
+
+struct playlist_info *
+db_pl_fetch_byid(int id)
+{
+#define Q_TMPL "SELECT * FROM playlists WHERE id = ?;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_PL_FETCH_BYID, Q_TMPL);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
+
+  return db_pl_fetch_bystmt(stmt);
+
+#undef Q_TMPL
+}
+
+struct playlist_info *
+db_pl_fetch_bytitlepath(char *title, char *path)
+{
+#define Q_TMPL "SELECT * FROM playlists WHERE title = ? AND path = ?;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_PL_FETCH_BYTITLEPATH, Q_TMPL);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_text(stmt, 1, title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (title '%s', path '%s')\n", Q_TMPL, title, path);
+
+  return db_pl_fetch_bystmt(stmt);
+
+#undef Q_TMPL
+}
+
+int
+db_pl_add(char *title, char *path, int *id)
+{
+#define QDUP_TMPL "SELECT COUNT(*) FROM playlists WHERE title = ? AND path = ?;"
+#define QADD_TMPL "INSERT INTO playlists (title, type, query, db_timestamp, disabled, path, idx, special_id)" \
+                  " VALUES (?, 0, NULL, ?, 0, ?, 0, 0);"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  /* Check duplicates */
+  stmt = db_stmt_get(DB_STMT_PL_DUP, QDUP_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_reset(stmt);
+      return -1;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_reset(stmt);
+
+  if (ret > 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Duplicate playlist with title '%s' path '%s'\n", title, path);
+      return -1;
+    }
+
+  /* Add */
+  stmt = db_stmt_get(DB_STMT_PL_ADD, QADD_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, title, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)time(NULL));
+  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (title '%s', path '%s')\n", QADD_TMPL, title, path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  *id = (int)sqlite3_last_insert_rowid(hdl);
+  if (*id == 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Successful insert but no last_insert_rowid!\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Added playlist %s (path %s) with id %d\n", title, path, *id);
+
+  return 0;
+
+#undef QDUP_TMPL
+#undef QADD_TMPL
+}
+
+/* Adds the items with one statement, in one transaction or as part of
+ * the current scan batch; exactly one of paths and ids is set. Items that
+ * fail are logged and skipped. Returns the number of items added, -1 if
+ * none could be.
+ */
+static int
+db_pl_add_items(int plid, char **paths, int *ids, int nitems)
+{
+#define QPATH_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (?, ?);"
+#define QID_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (?, (SELECT path FROM files WHERE id = ?));"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int in_trans;
+  int added;
+  int i;
+  int ret;
+
+  if (nitems <= 0)
+    return 0;
+
+  if (paths)
+    stmt = db_stmt_get(DB_STMT_PL_ADD_ITEM_BYPATH, QPATH_TMPL);
+  else
+    stmt = db_stmt_get(DB_STMT_PL_ADD_ITEM_BYID, QID_TMPL);
+
+  if (!stmt)
+    return -1;
+
+  in_trans = 0;
+  if (!batch_active && (nitems > 1))
+    {
+      ret = db_exec("BEGIN IMMEDIATE TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not begin playlist %d transaction: %s\n", plid, errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+
+      in_trans = 1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (playlist %d, %d items)\n", (paths) ? QPATH_TMPL : QID_TMPL, plid, nitems);
+
+  added = 0;
+  for (i = 0; i < nitems; i++)
+    {
+      sqlite3_bind_int(stmt, 1, plid);
+
+      if (paths)
+	sqlite3_bind_text(stmt, 2, paths[i], -1, SQLITE_STATIC);
+      else
+	sqlite3_bind_int(stmt, 2, ids[i]);
+
+      ret = db_stmt_exec(stmt, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  if (paths)
+	    DPRINTF(E_LOG, L_DB, "Could not add '%s' to playlist %d: %s\n", paths[i], plid, errmsg);
+	  else
+	    DPRINTF(E_LOG, L_DB, "Could not add file %d to playlist %d: %s\n", ids[i], plid, errmsg);
+
+	  sqlite3_free(errmsg);
+	  continue;
+	}
+
+      added++;
+    }
+
+  if (in_trans)
+    {
+      ret = db_exec("COMMIT TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not commit playlist %d items: %s\n", plid, errmsg);
+
+	  sqlite3_free(errmsg);
+	  sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	  return -1;
+	}
+    }
+
+  db_scan_batch_account();
+
+  return (added > 0) ? added : -1;
+
+#undef QPATH_TMPL
+#undef QID_TMPL
+}
+
+int
+db_pl_add_item_bypath(int plid, char *path)
+{
+  int ret;
+
+  ret = db_pl_add_items(plid, &path, NULL, 1);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+int
+db_pl_add_item_byid(int plid, int fileid)
+{
+  int ret;
+
+  ret = db_pl_add_items(plid, NULL, &fileid, 1);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+int
+db_pl_add_items_bypath(int plid, char **paths, int npaths)
+{
+  return db_pl_add_items(plid, paths, NULL, npaths);
+}
+
+int
+db_pl_add_items_byid(int plid, int *ids, int nids)
+{
+  return db_pl_add_items(plid, NULL, ids, nids);
+}
+
+void
+db_pl_clear_items(int id)
+{
+#define Q_TMPL "DELETE FROM playlistitems WHERE playlistid = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_PL_CLEAR_ITEMS, Q_TMPL);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error clearing playlist %d items: %s\n", id, errmsg);
+
+  sqlite3_free(errmsg);
+
+#undef Q_TMPL
+}
+
+void
+db_pl_delete(int id)
+{
+#define Q_TMPL "DELETE FROM playlists WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  if (id == 1)
+    return;
+
+  stmt = db_stmt_get(DB_STMT_PL_DELETE, Q_TMPL);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error deleting playlist %d: %s\n", id, errmsg);
+
+  sqlite3_free(errmsg);
+
+  db_pl_clear_items(id);
+
+#undef Q_TMPL
+}
+
+void
+db_pl_delete_bypath(char *path)
+{
+  int id;
+  int ret;
+
+  ret = db_pl_id_bypath(path, &id);
+  if (ret < 0)
+    return;
+
+  db_pl_delete(id);
+}
+
+/* Shared by the disable_bypath/bymatch functions below; parameters are
+ * bound as (striplen, disabled, path).
+ */
+static void
+db_pl_disable_bystmt(sqlite3_stmt *stmt, char *path, char *strip, uint32_t cookie)
+{
+  char *errmsg;
+  int64_t disabled;
+  int striplen;
+  int ret;
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  sqlite3_bind_int(stmt, 1, striplen);
+  sqlite3_bind_int64(stmt, 2, disabled);
+  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", sqlite3_sql(stmt), path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error disabling playlist: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+}
+
+void
+db_pl_disable_bypath(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE playlists SET path = substr(path, ?1), disabled = ?2 WHERE path = ?3;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_PL_DISABLE_BYPATH, Q_TMPL);
+  if (!stmt)
+    return;
+
+  db_pl_disable_bystmt(stmt, path, strip, cookie);
+
+#undef Q_TMPL
+}
+
+void
+db_pl_disable_bymatch(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE playlists SET path = substr(path, ?1), disabled = ?2 WHERE path >= ?3 || '/' AND path < ?3 || '0';"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_PL_DISABLE_BYMATCH, Q_TMPL);
+  if (!stmt)
+    return;
+
+  db_pl_disable_bystmt(stmt, path, strip, cookie);
+
+#undef Q_TMPL
+}
+
+int
+db_pl_enable_bycookie(uint32_t cookie, char *path)
+{
+#define Q_TMPL "UPDATE playlists SET path = ? || path, disabled = 0 WHERE disabled = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_PL_ENABLE_BYCOOKIE, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)cookie);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error enabling playlists: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return sqlite3_changes(hdl);
+
+#undef Q_TMPL
+}
+
+
+/* Groups */
+int
+db_groups_clear(void)
+{
+  char *query = "DELETE FROM groups;";
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+}
+
+enum group_type
+db_group_type_byid(int id)
+{
+#define Q_TMPL "SELECT type FROM groups WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_GROUP_TYPE_BYID, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_reset(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_reset(stmt);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+
+/* Remotes */
+static int
+db_pairing_delete_byremote(char *remote_id)
+{
+#define Q_TMPL "DELETE FROM pairings WHERE remote = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_PAIRING_DELETE_BYREMOTE, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, remote_id, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (remote '%s')\n", Q_TMPL, remote_id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error deleting pairing: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_pairing_add(struct pairing_info *pi)
+{
+#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES (?, ?, ?);"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  ret = db_pairing_delete_byremote(pi->remote_id);
+  if (ret < 0)
+    return ret;
+
+  stmt = db_stmt_get(DB_STMT_PAIRING_ADD, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_text(stmt, 1, STR(pi->remote_id), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, STR(pi->name), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, STR(pi->guid), -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (remote '%s')\n", Q_TMPL, pi->remote_id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error adding pairing: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Added playlist %s (path %s) with id %d\n", title, path, *id);
-
   return 0;
 
-#undef QDUP_TMPL
-#undef QADD_TMPL
+#undef Q_TMPL
 }
 
 int
-db_pl_add_item_bypath(int plid, char *path)
+db_pairing_fetch_byguid(struct pairing_info *pi)
 {
-#define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (%d, '%q');"
-  char *query;
-  char *errmsg;
+#define Q_TMPL "SELECT * FROM pairings WHERE guid = ?;"
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, plid, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+  stmt = db_stmt_get(DB_STMT_PAIRING_FETCH_BYGUID, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  sqlite3_bind_text(stmt, 1, pi->guid, -1, SQLITE_STATIC);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (guid '%s')\n", Q_TMPL, pi->guid);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      db_stmt_reset(stmt);
       return -1;
     }
 
-  sqlite3_free(query);
+  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
+  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
+
+  db_stmt_reset(stmt);
 
   return 0;
 
 #undef Q_TMPL
 }
 
+
+/* Speakers */
 int
-db_pl_add_item_byid(int plid, int fileid)
+db_speaker_save(uint64_t id, int selected, int volume)
 {
-#define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (%d, (SELECT path FROM files WHERE id = %d));"
-  char *query;
+#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume) VALUES (?, ?, ?);"
+  sqlite3_stmt *stmt;
   char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, plid, fileid);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+  stmt = db_stmt_get(DB_STMT_SPEAKER_SAVE, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  sqlite3_bind_int64(stmt, 1, (int64_t)id);
+  sqlite3_bind_int(stmt, 2, selected);
+  sqlite3_bind_int(stmt, 3, volume);
 
-  ret = db_exec(query, &errmsg);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %" PRIx64 ")\n", Q_TMPL, id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Error saving speaker state: %s\n", errmsg);
 
       sqlite3_free(errmsg);
-      sqlite3_free(query);
       return -1;
     }
 
-  sqlite3_free(query);
-
   return 0;
 
 #undef Q_TMPL
 }
 
-void
-db_pl_clear_items(int id)
+int
+db_speaker_get(uint64_t id, int *selected, int *volume)
 {
-#define Q_TMPL "DELETE FROM playlistitems WHERE playlistid = %d;"
-  char *query;
-  char *errmsg;
+#define Q_TMPL "SELECT selected, volume FROM speakers WHERE id = ?;"
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
+  stmt = db_stmt_get(DB_STMT_SPEAKER_GET, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %" PRIx64 ")\n", Q_TMPL, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      return;
+      db_stmt_reset(stmt);
+      return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  *selected = sqlite3_column_int(stmt, 0);
+  *volume = sqlite3_column_int(stmt, 1);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error clearing playlist %d items: %s\n", id, errmsg);
+  db_stmt_reset(stmt);
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  return 0;
 
 #undef Q_TMPL
 }
 
 void
-db_pl_delete(int id)
+db_speaker_clear_all(void)
 {
-#define Q_TMPL "DELETE FROM playlists WHERE id = %d;"
-  char *query;
+  char *query = "UPDATE speakers SET selected = 0;";
   char *errmsg;
   int ret;
 
-  if (id == 1)
-    return;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
-    }
-
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
   ret = db_exec(query, &errmsg);
   if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error deleting playlist %d: %s\n", id, errmsg);
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+      sqlite3_free(errmsg);
+    }
+}
 
-  db_pl_clear_items(id);
 
-#undef Q_TMPL
+/* Library revision
+ * Changes to files, playlists and playlist items are logged in the changes
+ * table by the changes_* triggers, against the revision after the current
+ * one. Sealing makes that revision the current one, so anything that
+ * changes afterwards goes to the next revision; clients only ever see
+ * sealed revisions. The scanner seals once it is done with a batch of
+ * changes, other writers right after their own write.
+ *
+ * Unlike db_rev, this one is kept in the database, so the revisions clients
+ * hold stay valid across restarts, and it doesn't move in the middle of a
+ * scan. The change log is pruned as revisions are sealed, deltas from
+ * before db_changes_horizon() get the full list.
+ */
+int
+db_library_revision_get(void)
+{
+  return db_stmt_get_count(DB_STMT_LIBRARY_REV, "SELECT value FROM admin WHERE key = 'library_revision';");
 }
 
-void
-db_pl_delete_bypath(char *path)
+/* Oldest revision a delta can be answered from */
+int
+db_changes_horizon(void)
 {
-  int id;
-  int ret;
+  int rev;
 
-  ret = db_pl_id_bypath(path, &id);
-  if (ret < 0)
-    return;
+  rev = db_library_revision_get();
+  if (rev < 0)
+    return -1;
 
-  db_pl_delete(id);
+  return rev - DB_CHANGES_HORIZON;
 }
 
-static void
-db_pl_disable_byquery(char *query)
+void
+db_library_revision_seal(void)
 {
+#define Q_SEAL "UPDATE admin SET value = value + 1 WHERE key = 'library_revision'" \
+               " AND EXISTS (SELECT 1 FROM changes WHERE rev > CAST(admin.value AS INTEGER));"
+#define Q_PRUNE "DELETE FROM changes WHERE rev <= (SELECT value FROM admin WHERE key = 'library_revision') - ?;"
+  sqlite3_stmt *stmt;
   char *errmsg;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error disabling playlist: %s\n", errmsg);
-
-  sqlite3_free(errmsg);
-}
-
-void
-db_pl_disable_bypath(char *path, char *strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  stmt = db_stmt_get(DB_STMT_LIBRARY_REV_SEAL, Q_SEAL);
+  if (!stmt)
+    return;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_SEAL);
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Error sealing library revision: %s\n", errmsg);
 
+      sqlite3_free(errmsg);
       return;
     }
 
-  db_pl_disable_byquery(query);
+  if (sqlite3_changes(hdl) == 0)
+    return;
 
-  sqlite3_free(query);
+  DPRINTF(E_DBG, L_DB, "Library revision is now %d\n", db_library_revision_get());
 
-#undef Q_TMPL
-}
+  pthread_mutex_lock(&db_rev_lck);
 
-void
-db_pl_disable_bymatch(char *path, char *strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  if (library_update_handler)
+    library_update_handler();
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  pthread_mutex_unlock(&db_rev_lck);
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  stmt = db_stmt_get(DB_STMT_CHANGES_PRUNE, Q_PRUNE);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_int(stmt, 1, DB_CHANGES_KEEP);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_PRUNE);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Error pruning change log: %s\n", errmsg);
 
-      return;
+      sqlite3_free(errmsg);
     }
+  else if (sqlite3_changes(hdl) > 0)
+    DPRINTF(E_DBG, L_DB, "Pruned %d rows from the change log\n", sqlite3_changes(hdl));
+
+#undef Q_PRUNE
+#undef Q_SEAL
+}
 
-  db_pl_disable_byquery(query);
+/* The handler runs in the thread that sealed the revision */
+void
+db_library_set_update_handler(db_library_handler handler)
+{
+  pthread_mutex_lock(&db_rev_lck);
 
-  sqlite3_free(query);
+  library_update_handler = handler;
 
-#undef Q_TMPL
+  pthread_mutex_unlock(&db_rev_lck);
 }
 
+/* Ids of the items of the given kind changed after revision rev, sorted;
+ * deleted items are included. Returns the number of ids, -1 on error
+ */
 int
-db_pl_enable_bycookie(uint32_t cookie, char *path)
+db_changes_fetch_ids(enum change_kind kind, int rev, uint32_t **ids)
 {
-#define Q_TMPL "UPDATE playlists SET path = '%q' || path, disabled = 0 WHERE disabled = %" PRIi64 ";"
-  char *query;
-  char *errmsg;
+#define Q_TMPL "SELECT id FROM changes WHERE kind = ? AND rev > ? ORDER BY id;"
+  sqlite3_stmt *stmt;
+  uint32_t *tmp;
+  int size;
+  int nids;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
-  if (!query)
+  *ids = NULL;
+
+  stmt = db_stmt_get(DB_STMT_CHANGES_IDS, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_int(stmt, 1, kind);
+  sqlite3_bind_int(stmt, 2, rev);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (kind %d, rev %d)\n", Q_TMPL, kind, rev);
+
+  size = 0;
+  nids = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      if (nids == size)
+	{
+	  size = (size > 0) ? 2 * size : 64;
 
-      return -1;
-    }
+	  tmp = (uint32_t *)realloc(*ids, size * sizeof(uint32_t));
+	  if (!tmp)
+	    {
+	      DPRINTF(E_LOG, L_DB, "Out of memory for changed ids\n");
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+	      ret = SQLITE_NOMEM;
+	      break;
+	    }
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+	  *ids = tmp;
+	}
+
+      (*ids)[nids] = (uint32_t)sqlite3_column_int(stmt, 0);
+      nids++;
+    }
+
+  if (ret != SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Error enabling playlists: %s\n", errmsg);
+      if (ret != SQLITE_NOMEM)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      db_stmt_reset(stmt);
+
+      free(*ids);
+      *ids = NULL;
       return -1;
     }
 
-  sqlite3_free(query);
+  db_stmt_reset(stmt);
 
-  return sqlite3_changes(hdl);
+  return nids;
 
 #undef Q_TMPL
 }
 
 
-/* Groups */
+/* Inotify */
 int
-db_groups_clear(void)
+db_watch_clear(void)
 {
-  char *query = "DELETE FROM groups;";
+  char *query = "DELETE FROM inotify;";
   char *errmsg;
   int ret;
 
@@ -2811,320 +4465,348 @@ db_groups_clear(void)
   return 0;
 }
 
-enum group_type
-db_group_type_byid(int id)
-{
-#define Q_TMPL "SELECT type FROM groups WHERE id = '%d';"
-  char *query;
-  sqlite3_stmt *stmt;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      sqlite3_free(query);
-      return 0;
-    }
-
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return 0;
-    }
-
-  ret = sqlite3_column_int(stmt, 0);
-
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
-
-  return ret;
-
-#undef Q_TMPL
-}
-
-/* Remotes */
-static int
-db_pairing_delete_byremote(char *remote_id)
+int
+db_watch_add(struct watch_info *wi)
 {
-#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
-  char *query;
+#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (?, 0, ?);"
+  sqlite3_stmt *stmt;
   char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, remote_id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_get(DB_STMT_WATCH_ADD, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-      return -1;
-    }
+  sqlite3_bind_int(stmt, 1, wi->wd);
+  sqlite3_bind_text(stmt, 2, wi->path, -1, SQLITE_STATIC);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (wd %d, path '%s')\n", Q_TMPL, wi->wd, wi->path);
 
-  ret = db_exec(query, &errmsg);
+  ret = db_stmt_exec(stmt, &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Error deleting pairing: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Error adding watch: %s\n", errmsg);
 
       sqlite3_free(errmsg);
-      sqlite3_free(query);
       return -1;
     }
 
-  sqlite3_free(query);
-
   return 0;
 
 #undef Q_TMPL
 }
 
-int
-db_pairing_add(struct pairing_info *pi)
+/* Runs a cached watch delete statement with its parameters bound */
+static int
+db_watch_delete_bystmt(sqlite3_stmt *stmt)
 {
-#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
-  char *query;
   char *errmsg;
   int ret;
 
-  ret = db_pairing_delete_byremote(pi->remote_id);
-  if (ret < 0)
-    return ret;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", sqlite3_sql(stmt));
 
-  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
-  if (!query)
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Error deleting watch: %s\n", errmsg);
 
+      sqlite3_free(errmsg);
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  return 0;
+}
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Error adding pairing: %s\n", errmsg);
+int
+db_watch_delete_bywd(uint32_t wd)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE wd = ?;"
+  sqlite3_stmt *stmt;
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
-    }
+  stmt = db_stmt_get(DB_STMT_WATCH_DELETE_BYWD, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-  sqlite3_free(query);
+  sqlite3_bind_int(stmt, 1, wd);
 
-  return 0;
+  return db_watch_delete_bystmt(stmt);
 
 #undef Q_TMPL
 }
 
 int
-db_pairing_fetch_byguid(struct pairing_info *pi)
+db_watch_delete_bypath(char *path)
 {
-#define Q_TMPL "SELECT * FROM pairings WHERE guid = '%q';"
-  char *query;
+#define Q_TMPL "DELETE FROM inotify WHERE path = ?;"
   sqlite3_stmt *stmt;
-  int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, pi->guid);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+  stmt = db_stmt_get(DB_STMT_WATCH_DELETE_BYPATH, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
+  return db_watch_delete_bystmt(stmt);
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+#undef Q_TMPL
+}
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
-    }
+int
+db_watch_delete_bymatch(char *path)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE path >= ?1 || '/' AND path < ?1 || '0';"
+  sqlite3_stmt *stmt;
 
-  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
-  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
+  stmt = db_stmt_get(DB_STMT_WATCH_DELETE_BYMATCH, Q_TMPL);
+  if (!stmt)
+    return -1;
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
 
-  return 0;
+  return db_watch_delete_bystmt(stmt);
 
 #undef Q_TMPL
 }
 
+int
+db_watch_delete_bycookie(uint32_t cookie)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE cookie = ?;"
+  sqlite3_stmt *stmt;
+
+  if (cookie == 0)
+    return -1;
+
+  stmt = db_stmt_get(DB_STMT_WATCH_DELETE_BYCOOKIE, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)cookie);
+
+  return db_watch_delete_bystmt(stmt);
+
+#undef Q_TMPL
+}
 
-/* Speakers */
 int
-db_speaker_save(uint64_t id, int selected, int volume)
+db_watch_get_bywd(struct watch_info *wi)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume) VALUES (%" PRIi64 ", %d, %d);"
-  char *query;
-  char *errmsg;
+#define Q_TMPL "SELECT * FROM inotify WHERE wd = ?;"
+  sqlite3_stmt *stmt;
+  char **strval;
+  char *cval;
+  uint32_t *ival;
+  int64_t cookie;
+  int ncols;
+  int i;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id, selected, volume);
-  if (!query)
+  stmt = db_stmt_get(DB_STMT_WATCH_GET_BYWD, Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_int(stmt, 1, wi->wd);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (wd %d)\n", Q_TMPL, wi->wd);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Watch wd %d not found\n", wi->wd);
 
+      db_stmt_reset(stmt);
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ncols = sqlite3_column_count(stmt);
 
-  errmsg = NULL;
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  if (sizeof(wi_cols_map) / sizeof(wi_cols_map[0]) != ncols)
     {
-      DPRINTF(E_LOG, L_DB, "Error saving speaker state: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "BUG: wi column map out of sync with schema\n");
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      db_stmt_reset(stmt);
       return -1;
     }
 
-  sqlite3_free(query);
+  for (i = 0; i < ncols; i++)
+    {
+      switch (wi_cols_map[i].type)
+	{
+	  case DB_TYPE_INT:
+	    ival = (uint32_t *) ((char *)wi + wi_cols_map[i].offset);
+
+	    if (wi_cols_map[i].offset == wi_offsetof(cookie))
+	      {
+		cookie = sqlite3_column_int64(stmt, i);
+		*ival = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
+	      }
+	    else
+	      *ival = sqlite3_column_int(stmt, i);
+	    break;
+
+	  case DB_TYPE_STRING:
+	    strval = (char **) ((char *)wi + wi_cols_map[i].offset);
+
+	    cval = (char *)sqlite3_column_text(stmt, i);
+	    if (cval)
+	      *strval = strdup(cval);
+	    break;
+
+	  default:
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in wi column map\n", wi_cols_map[i].type);
+
+	    db_stmt_reset(stmt);
+	    return -1;
+	}
+    }
+
+  db_stmt_reset(stmt);
 
   return 0;
 
 #undef Q_TMPL
 }
 
-int
-db_speaker_get(uint64_t id, int *selected, int *volume)
+/* Shared by the mark_bypath/bymatch functions below; parameters are
+ * bound as (striplen, cookie, path).
+ */
+static void
+db_watch_mark_bystmt(sqlite3_stmt *stmt, char *path, char *strip, uint32_t cookie)
 {
-#define Q_TMPL "SELECT selected, volume FROM speakers WHERE id = %" PRIi64 ";"
-  sqlite3_stmt *stmt;
-  char *query;
+  char *errmsg;
+  int64_t disabled;
+  int striplen;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
 
-      return -1;
-    }
+  sqlite3_bind_int(stmt, 1, striplen);
+  sqlite3_bind_int64(stmt, 2, disabled);
+  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", sqlite3_sql(stmt), path);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_stmt_exec(stmt, &errmsg);
   if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+    DPRINTF(E_LOG, L_DB, "Error marking watch: %s\n", errmsg);
 
-      ret = -1;
-      goto out;
-    }
+  sqlite3_free(errmsg);
+}
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+void
+db_watch_mark_bypath(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE inotify SET path = substr(path, ?1), cookie = ?2 WHERE path = ?3;"
+  sqlite3_stmt *stmt;
 
-      sqlite3_finalize(stmt);
+  stmt = db_stmt_get(DB_STMT_WATCH_MARK_BYPATH, Q_TMPL);
+  if (!stmt)
+    return;
 
-      ret = -1;
-      goto out;
-    }
+  db_watch_mark_bystmt(stmt, path, strip, cookie);
 
-  *selected = sqlite3_column_int(stmt, 0);
-  *volume = sqlite3_column_int(stmt, 1);
+#undef Q_TMPL
+}
 
-  sqlite3_finalize(stmt);
+void
+db_watch_mark_bymatch(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE inotify SET path = substr(path, ?1), cookie = ?2 WHERE path >= ?3 || '/' AND path < ?3 || '0';"
+  sqlite3_stmt *stmt;
 
-  ret = 0;
+  stmt = db_stmt_get(DB_STMT_WATCH_MARK_BYMATCH, Q_TMPL);
+  if (!stmt)
+    return;
 
- out:
-  sqlite3_free(query);
-  return ret;
+  db_watch_mark_bystmt(stmt, path, strip, cookie);
 
 #undef Q_TMPL
 }
 
 void
-db_speaker_clear_all(void)
+db_watch_move_bycookie(uint32_t cookie, char *path)
 {
-  char *query = "UPDATE speakers SET selected = 0;";
+#define Q_TMPL "UPDATE inotify SET path = ? || path, cookie = 0 WHERE cookie = ?;"
+  sqlite3_stmt *stmt;
   char *errmsg;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (cookie == 0)
+    return;
 
-  ret = db_exec(query, &errmsg);
+  stmt = db_stmt_get(DB_STMT_WATCH_MOVE_BYCOOKIE, Q_TMPL);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)cookie);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", Q_TMPL, path);
+
+  ret = db_stmt_exec(stmt, &errmsg);
   if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+    DPRINTF(E_LOG, L_DB, "Error moving watch: %s\n", errmsg);
 
-      sqlite3_free(errmsg);
-    }
-}
+  sqlite3_free(errmsg);
 
+#undef Q_TMPL
+}
 
-/* Inotify */
 int
-db_watch_clear(void)
+db_watch_cookie_known(uint32_t cookie)
 {
-  char *query = "DELETE FROM inotify;";
-  char *errmsg;
+#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = ?;"
+  sqlite3_stmt *stmt;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (cookie == 0)
+    return 0;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  stmt = db_stmt_get(DB_STMT_WATCH_COOKIE_KNOWN, Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)cookie);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(errmsg);
-      return -1;
+      db_stmt_reset(stmt);
+      return 0;
     }
 
-  return 0;
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_reset(stmt);
+
+  return (ret > 0);
+
+#undef Q_TMPL
 }
 
 int
-db_watch_add(struct watch_info *wi)
+db_watch_enum_start(struct watch_enum *we)
 {
-#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (%d, 0, '%q');"
+#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path >= '%q/' AND path < '%q0';"
+#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
   char *query;
-  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, wi->wd, wi->path);
+  we->stmt = NULL;
+
+  if (we->match)
+    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match, we->match);
+  else if (we->cookie != 0)
+    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
+  else
+    {
+      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
+      return -1;
+    }
+
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
@@ -3132,14 +4814,13 @@ db_watch_add(struct watch_info *wi)
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
 
-  ret = db_exec(query, &errmsg);
+  ret = db_blocking_prepare_v2(query, -1, &we->stmt, NULL);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Error adding watch: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(errmsg);
       sqlite3_free(query);
       return -1;
     }
@@ -3148,441 +4829,493 @@ db_watch_add(struct watch_info *wi)
 
   return 0;
 
-#undef Q_TMPL
+#undef Q_MATCH_TMPL
+#undef Q_COOKIE_TMPL
 }
 
-static int
-db_watch_delete_byquery(char *query)
+void
+db_watch_enum_end(struct watch_enum *we)
 {
-  char *errmsg;
-  int ret;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Error deleting watch: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
-    }
+  if (!we->stmt)
+    return;
 
-  return 0;
+  db_stmt_finalize(we->stmt);
+  we->stmt = NULL;
 }
 
 int
-db_watch_delete_bywd(uint32_t wd)
+db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE wd = %d;"
-  char *query;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, wd);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  *wd = 0;
 
+  if (!we->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
-
-  sqlite3_free(query);
+  ret = db_blocking_step(we->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
+    }
 
-  return ret;
+  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
 
-#undef Q_TMPL
+  return 0;
 }
 
+
+/* File stamps, for the scanner's path index */
 int
-db_watch_delete_bypath(char *path)
+db_file_stamp_enum_start(struct file_stamp_enum *fe)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT id, path, db_timestamp, file_size FROM files WHERE disabled = 0;"
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  fe->stmt = NULL;
+
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", Q_TMPL);
+
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &fe->stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
+  return 0;
 
-  sqlite3_free(query);
+#undef Q_TMPL
+}
 
-  return ret;
+void
+db_file_stamp_enum_end(struct file_stamp_enum *fe)
+{
+  if (!fe->stmt)
+    return;
 
-#undef Q_TMPL
+  db_stmt_finalize(fe->stmt);
+  fe->stmt = NULL;
 }
 
 int
-db_watch_delete_bymatch(char *path)
+db_file_stamp_enum_fetch(struct file_stamp_enum *fe, struct file_stamp *fs)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE path LIKE '%q/%%';"
-  char *query;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  memset(fs, 0, sizeof(struct file_stamp));
+
+  if (!fe->stmt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "File stamp enum not started!\n");
+      return -1;
+    }
 
+  ret = db_blocking_step(fe->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of file stamp enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
+  fs->id = (uint32_t)sqlite3_column_int(fe->stmt, 0);
+  fs->path = (char *)sqlite3_column_text(fe->stmt, 1);
+  fs->stamp = (time_t)sqlite3_column_int64(fe->stmt, 2);
+  fs->size = sqlite3_column_int64(fe->stmt, 3);
 
-  sqlite3_free(query);
+  return 0;
+}
 
-  return ret;
 
-#undef Q_TMPL
+static void
+db_update_hook(void *arg, int op, const char *dbname, const char *table, sqlite3_int64 rowid)
+{
+  if ((strcmp(table, "files") == 0) || (strncmp(table, "playlist", 8) == 0))
+    db_rev_dirty = 1;
 }
 
-int
-db_watch_delete_bycookie(uint32_t cookie)
+/* Called once a commit is visible to other connections, so the library
+ * revision is bumped here rather than in the update hook: anything read
+ * after this returns sees the change.
+ *
+ * Managed checkpointing: replaces SQLite's autocheckpoint. Runs in the
+ * thread that just committed, which during a bulk scan is the scanner.
+ * PASSIVE checkpoints never wait on readers; whatever they can't copy
+ * back is picked up by the next one.
+ */
+static int
+db_wal_hook(void *arg, sqlite3 *db, const char *dbname, int pages)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
+  int log;
+  int ckpt;
   int ret;
 
-  if (cookie == 0)
-    return -1;
-
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
-  if (!query)
+  if (db_rev_dirty)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      pthread_mutex_lock(&db_rev_lck);
+      db_rev++;
+      pthread_mutex_unlock(&db_rev_lck);
 
-      return -1;
+      db_rev_dirty = 0;
     }
 
-  ret = db_watch_delete_byquery(query);
+  if (pages < ((db_wal_checkpoint > 0) ? db_wal_checkpoint : DB_WAL_AUTOCHECKPOINT))
+    return SQLITE_OK;
 
-  sqlite3_free(query);
+  ret = sqlite3_wal_checkpoint_v2(db, dbname, SQLITE_CHECKPOINT_PASSIVE, &log, &ckpt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_WARN, L_DB, "WAL checkpoint failed: %s\n", sqlite3_errmsg(db));
+      return SQLITE_OK;
+    }
 
-  return ret;
+  DPRINTF(E_DBG, L_DB, "WAL checkpoint: %d of %d pages written back\n", ckpt, log);
 
-#undef Q_TMPL
+  return SQLITE_OK;
 }
 
-int
-db_watch_get_bywd(struct watch_info *wi)
+static int
+db_pragma_set(const char *pragma, int64_t value)
 {
-#define Q_TMPL "SELECT * FROM inotify WHERE wd = %d;"
   char *query;
-  sqlite3_stmt *stmt;
-  char **strval;
-  char *cval;
-  uint32_t *ival;
-  int64_t cookie;
-  int ncols;
-  int i;
+  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, wi->wd);
+  query = sqlite3_mprintf("PRAGMA %s = %" PRIi64 ";", pragma, value);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
-
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Watch wd %d not found\n", wi->wd);
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
       return -1;
     }
 
-  ncols = sqlite3_column_count(stmt);
-
-  if (sizeof(wi_cols_map) / sizeof(wi_cols_map[0]) != ncols)
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: wi column map out of sync with schema\n");
+      DPRINTF(E_LOG, L_DB, "Could not set PRAGMA %s: %s\n", pragma, errmsg);
 
-      sqlite3_finalize(stmt);
+      sqlite3_free(errmsg);
       sqlite3_free(query);
       return -1;
     }
 
-  for (i = 0; i < ncols; i++)
-    {
-      switch (wi_cols_map[i].type)
-	{
-	  case DB_TYPE_INT:
-	    ival = (uint32_t *) ((char *)wi + wi_cols_map[i].offset);
-
-	    if (wi_cols_map[i].offset == wi_offsetof(cookie))
-	      {
-		cookie = sqlite3_column_int64(stmt, i);
-		*ival = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
-	      }
-	    else
-	      *ival = sqlite3_column_int(stmt, i);
-	    break;
-
-	  case DB_TYPE_STRING:
-	    strval = (char **) ((char *)wi + wi_cols_map[i].offset);
-
-	    cval = (char *)sqlite3_column_text(stmt, i);
-	    if (cval)
-	      *strval = strdup(cval);
-	    break;
-
-	  default:
-	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in wi column map\n", wi_cols_map[i].type);
-	    sqlite3_finalize(stmt);
-	    sqlite3_free(query);
-	    return -1;
-	}
-    }
-
-  sqlite3_finalize(stmt);
   sqlite3_free(query);
 
   return 0;
-
-#undef Q_TMPL
 }
 
+/* Shape of a statement: its text with string and numeric literals
+ * replaced by ? and whitespace collapsed, so the queries built for
+ * different filters, ids and windows of the same kind add up
+ */
 static void
-db_watch_mark_byquery(char *query)
+db_profile_shape(const char *sql, char *shape, int size)
 {
-  char *errmsg;
-  int ret;
+  const char *p;
+  int ident;
+  int n;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error marking watch: %s\n", errmsg);
+  ident = 0;
+  n = 0;
+  for (p = sql; *p && (n < size - 1); p++)
+    {
+      if (*p == '\'')
+	{
+	  for (p++; *p; p++)
+	    {
+	      if (*p != '\'')
+		continue;
 
-  sqlite3_free(errmsg);
-}
+	      /* '' is an escaped quote */
+	      if (*(p + 1) != '\'')
+		break;
 
-void
-db_watch_mark_bypath(char *path, char *strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+	      p++;
+	    }
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+	  shape[n++] = '?';
+	  ident = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+	  if (!*p)
+	    break;
+	}
+      else if (!ident && isdigit(*p))
+	{
+	  while (isdigit(*(p + 1)) || (*(p + 1) == '.'))
+	    p++;
 
-      return;
-    }
+	  shape[n++] = '?';
+	}
+      else if (isspace(*p))
+	{
+	  if ((n > 0) && (shape[n - 1] != ' '))
+	    shape[n++] = ' ';
 
-  db_watch_mark_byquery(query);
+	  ident = 0;
+	}
+      else
+	{
+	  /* Keeps ?NNN parameters and identifiers ending in digits */
+	  ident = (isalnum(*p) || (*p == '_') || (*p == '?'));
 
-  sqlite3_free(query);
+	  shape[n++] = *p;
+	}
+    }
 
-#undef Q_TMPL
+  shape[n] = '\0';
 }
 
-void
-db_watch_mark_bymatch(char *path, char *strip, uint32_t cookie)
+/* Must be called with profile_lck held */
+static struct profile_shape *
+db_profile_find(const char *shape)
 {
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path LIKE '%q/%%';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  struct profile_shape *ps;
+  uint32_t hash;
+  int i;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  hash = djb_hash((void *)shape, strlen(shape));
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  for (i = hash % PROFILE_SHAPES; profile_shapes[i].shape; i = (i + 1) % PROFILE_SHAPES)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      ps = &profile_shapes[i];
 
-      return;
+      if ((ps->hash == hash) && (strcmp(ps->shape, shape) == 0))
+	return ps;
     }
 
-  db_watch_mark_byquery(query);
+  /* Keep the table sparse, whatever doesn't fit is lumped together */
+  if (profile_nshapes >= (PROFILE_SHAPES * 3) / 4)
+    return &profile_other;
 
-  sqlite3_free(query);
+  ps = &profile_shapes[i];
 
-#undef Q_TMPL
+  ps->shape = strdup(shape);
+  if (!ps->shape)
+    return &profile_other;
+
+  ps->hash = hash;
+  profile_nshapes++;
+
+  return ps;
 }
 
-void
-db_watch_move_bycookie(uint32_t cookie, char *path)
+/* Accounts a finished run to its shape. Runs slower than db_slow_query ms
+ * are logged with their plan; stmt is NULL if it may be gone already.
+ */
+static void
+db_profile_record(struct profile_run *run, sqlite3_stmt *stmt)
 {
-#define Q_TMPL "UPDATE inotify SET path = '%q' || path, cookie = 0 WHERE cookie = %" PRIi64 ";"
-  char *query;
-  char *errmsg;
-  int ret;
+  struct profile_shape *ps;
+  char *plan;
+  uint64_t us;
+  uint64_t v;
+  int i;
 
-  if (cookie == 0)
-    return;
+  us = run->ns / 1000;
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  /* Bucket i counts runs under 2^(i+1) us */
+  for (i = 0, v = us >> 1; v && (i < DB_PROFILE_BUCKETS - 1); v >>= 1)
+    i++;
 
-      return;
-    }
+  pthread_mutex_lock(&profile_lck);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ps = db_profile_find(run->shape);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error moving watch: %s\n", errmsg);
+  ps->count++;
+  ps->total_us += us;
+  if (us > ps->max_us)
+    ps->max_us = us;
+  ps->hist[i]++;
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  pthread_mutex_unlock(&profile_lck);
 
-#undef Q_TMPL
-}
+  run->stmt = NULL;
 
-int
-db_watch_cookie_known(uint32_t cookie)
-{
-#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
-  int ret;
+  if ((db_slow_query <= 0) || (us < (uint64_t)db_slow_query * 1000))
+    return;
 
-  if (cookie == 0)
-    return 0;
+  DPRINTF(E_LOG, L_DB, "Slow query (%" PRIu64 " ms): %s\n", us / 1000, (stmt) ? sqlite3_sql(stmt) : run->shape);
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  if (!stmt)
+    return;
 
-      return 0;
-    }
+  profile_explaining = 1;
+  plan = db_query_explain(sqlite3_sql(stmt));
+  profile_explaining = 0;
 
-  ret = db_get_count(query);
+  if (!plan)
+    return;
 
-  sqlite3_free(query);
+  DPRINTF(E_LOG, L_DB, "Slow query plan: %s\n", plan);
 
-  return (ret > 0);
+  pthread_mutex_lock(&profile_lck);
 
-#undef Q_TMPL
+  ps = db_profile_find(run->shape);
+
+  free(ps->plan);
+  ps->plan = strdup(plan);
+
+  pthread_mutex_unlock(&profile_lck);
+
+  sqlite3_free(plan);
 }
 
-int
-db_watch_enum_start(struct watch_enum *we)
+/* Called after each step. SQLite's own profile callback only has
+ * millisecond resolution, so statements are timed here: a run is the
+ * time spent in sqlite3_step() from the first step to the last one, or
+ * to the reset or finalize in db_profile_end(). Time spent by the caller
+ * between rows is not included.
+ */
+static void
+db_profile_step(sqlite3_stmt *stmt, struct timespec *start, int done)
 {
-#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path LIKE '%q/%%';"
-#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
-  int ret;
+  struct profile_run *run;
+  struct timespec end;
+  int i;
 
-  we->stmt = NULL;
+  if (profile_explaining)
+    return;
 
-  if (we->match)
-    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match);
-  else if (we->cookie != 0)
-    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
-  else
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  run = NULL;
+  for (i = 0; i < PROFILE_RUNS; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
-      return -1;
+      if (profile_runs[i].stmt == stmt)
+	{
+	  run = &profile_runs[i];
+	  break;
+	}
+      else if (!run && !profile_runs[i].stmt)
+	run = &profile_runs[i];
     }
 
-  if (!query)
+  if (!run)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      /* More statements in flight than tracked, account the oldest now */
+      run = &profile_runs[profile_evict];
+      profile_evict = (profile_evict + 1) % PROFILE_RUNS;
 
-      return -1;
+      db_profile_record(run, NULL);
     }
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &we->stmt, NULL);
-  if (ret != SQLITE_OK)
+  if (run->stmt != stmt)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      sqlite3_free(query);
-      return -1;
+      run->stmt = stmt;
+      run->ns = 0;
+      db_profile_shape(sqlite3_sql(stmt), run->shape, sizeof(run->shape));
     }
 
-  sqlite3_free(query);
-
-  return 0;
+  run->ns += (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
 
-#undef Q_MATCH_TMPL
-#undef Q_COOKIE_TMPL
+  if (done)
+    db_profile_record(run, stmt);
 }
 
-void
-db_watch_enum_end(struct watch_enum *we)
+static void
+db_profile_end(sqlite3_stmt *stmt)
 {
-  if (!we->stmt)
+  int i;
+
+  if (!db_profile || profile_explaining)
     return;
 
-  sqlite3_finalize(we->stmt);
-  we->stmt = NULL;
+  for (i = 0; i < PROFILE_RUNS; i++)
+    {
+      if (profile_runs[i].stmt == stmt)
+	{
+	  db_profile_record(&profile_runs[i], stmt);
+	  return;
+	}
+    }
 }
 
-int
-db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+static int
+db_profile_cmp(const void *a, const void *b)
 {
-  int ret;
+  const struct profile_shape *psa = (const struct profile_shape *)a;
+  const struct profile_shape *psb = (const struct profile_shape *)b;
 
-  *wd = 0;
+  return (psa->total_us < psb->total_us) - (psa->total_us > psb->total_us);
+}
 
-  if (!we->stmt)
+/* Calls cb for each statement shape seen so far, most total time first.
+ * The stats are copied out under profile_lck and cb runs without it, so
+ * the statements of other threads aren't held up while they're formatted.
+ */
+void
+db_profile_enum(db_profile_cb cb, void *arg)
+{
+  struct profile_shape *copy;
+  struct db_profile_info dbpi;
+  struct profile_shape *ps;
+  int n;
+  int i;
+
+  copy = (struct profile_shape *)malloc((PROFILE_SHAPES + 1) * sizeof(struct profile_shape));
+  if (!copy)
     {
-      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Out of memory for profile stats\n");
+      return;
     }
 
-  ret = db_blocking_step(we->stmt);
-  if (ret == SQLITE_DONE)
+  pthread_mutex_lock(&profile_lck);
+
+  n = 0;
+  for (i = 0; i < PROFILE_SHAPES; i++)
     {
-      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
-      return 0;
+      if (profile_shapes[i].shape)
+	copy[n++] = profile_shapes[i];
     }
-  else if (ret != SQLITE_ROW)
+
+  if (profile_other.count > 0)
+    copy[n++] = profile_other;
+
+  /* Shapes are never freed, but plans get replaced */
+  for (i = 0; i < n; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-      return -1;
+      if (copy[i].plan)
+	copy[i].plan = strdup(copy[i].plan);
     }
 
-  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+  pthread_mutex_unlock(&profile_lck);
 
-  return 0;
-}
+  qsort(copy, n, sizeof(struct profile_shape), db_profile_cmp);
 
+  for (i = 0; i < n; i++)
+    {
+      ps = &copy[i];
 
-#ifdef DB_PROFILE
-static void
-db_xprofile(void *notused, const char *pquery, sqlite3_uint64 ptime)
-{
-  DPRINTF(E_DBG, L_DB, "SQL PROFILE query: %s\n", pquery);
-  DPRINTF(E_DBG, L_DB, "SQL PROFILE time: %" PRIu64 "\n", (uint64_t)ptime); 
-}
-#endif
+      dbpi.shape = (ps->shape) ? ps->shape : "(other statements)";
+      dbpi.count = ps->count;
+      dbpi.total_us = ps->total_us;
+      dbpi.max_us = ps->max_us;
+      dbpi.hist = ps->hist;
+      dbpi.plan = ps->plan;
+
+      cb(&dbpi, arg);
+    }
 
+  for (i = 0; i < n; i++)
+    free(copy[i].plan);
+
+  free(copy);
+}
 
 int
 db_perthread_init(void)
@@ -3633,9 +5366,31 @@ db_perthread_init(void)
       return -1;
     }
 
-#ifdef DB_PROFILE
-  sqlite3_profile(hdl, db_xprofile, NULL);
-#endif
+  sqlite3_busy_timeout(hdl, DB_BUSY_TIMEOUT);
+
+  ret = sqlite3_create_function(hdl, "scan_seen", 1, SQLITE_UTF8, NULL, db_scan_seen_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not create scan_seen function: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_close(hdl);
+      return -1;
+    }
+
+  /* -1: leave the SQLite default */
+  if (db_pragma_synchronous >= 0)
+    db_pragma_set("synchronous", db_pragma_synchronous);
+
+  if (db_pragma_cache_size >= 0)
+    db_pragma_set("cache_size", db_pragma_cache_size);
+
+  if (db_pragma_mmap_size >= 0)
+    db_pragma_set("mmap_size", db_pragma_mmap_size);
+
+  /* Also takes over SQLite's autocheckpoint */
+  sqlite3_update_hook(hdl, db_update_hook, NULL);
+  sqlite3_wal_hook(hdl, db_wal_hook, NULL);
+
 
   return 0;
 }
@@ -3644,15 +5399,46 @@ void
 db_perthread_deinit(void)
 {
   sqlite3_stmt *stmt;
+  uint64_t total;
+  int i;
 
   if (!hdl)
     return;
 
-  /* Tear down anything that's in flight */
-  while ((stmt = sqlite3_next_stmt(hdl, 0)))
-    sqlite3_finalize(stmt);
+  total = db_stmt_hits + db_stmt_misses;
+  if (total > 0)
+    DPRINTF(E_DBG, L_DB, "Statement cache: %" PRIu64 " hits, %" PRIu64 " misses (%" PRIu64 "%% hit rate)\n",
+	    db_stmt_hits, db_stmt_misses, (db_stmt_hits * 100) / total);
+
+  /* Drop cached statements */
+  for (i = 0; i < DB_STMT_MAX; i++)
+    {
+      if (db_stmts[i])
+	db_stmt_finalize(db_stmts[i]);
+
+      db_stmts[i] = NULL;
+    }
+
+  db_stmt_hits = 0;
+  db_stmt_misses = 0;
+
+  /* Runs not reset or finalized through the helpers */
+  memset(profile_runs, 0, sizeof(profile_runs));
+
+  db_scan_batch_commit();
+  db_scan_generation_end();
+
+  /* Closing disconnects virtual tables first, finalizing the statements
+   * FTS5 keeps for files_fts; only then tear down anything that's still
+   * in flight, so these are not finalized twice
+   */
+  if (sqlite3_close(hdl) == SQLITE_BUSY)
+    {
+      while ((stmt = sqlite3_next_stmt(hdl, 0)))
+	db_stmt_finalize(stmt);
 
-  sqlite3_close(hdl);
+      sqlite3_close(hdl);
+    }
 }
 
 
@@ -3712,7 +5498,12 @@ db_perthread_deinit(void)
   "   tv_network_name    VARCHAR(1024) DEFAULT NULL,"	\
   "   tv_episode_sort    INTEGER NOT NULL,"		\
   "   tv_season_num      INTEGER NOT NULL,"		\
-  "   songalbumid        INTEGER NOT NULL"		\
+  "   songalbumid        INTEGER NOT NULL,"		\
+  "   title_sort         VARCHAR(1024) DEFAULT NULL,"	\
+  "   artist_sort        VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_sort         VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_artist_sort  VARCHAR(1024) DEFAULT NULL,"	\
+  "   title_letter       INTEGER NOT NULL DEFAULT 0"	\
   ");"
 
 #define T_PL					\
@@ -3741,6 +5532,9 @@ db_perthread_deinit(void)
   "   type           INTEGER NOT NULL,"					\
   "   name           VARCHAR(1024) NOT NULL,"				\
   "   persistentid   INTEGER NOT NULL,"					\
+  "   items          INTEGER NOT NULL DEFAULT 0,"			\
+  "   album_artist   VARCHAR(1024) NOT NULL DEFAULT '',"		\
+  "   album_sort     VARCHAR(1024) DEFAULT NULL,"			\
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
@@ -3751,42 +5545,315 @@ db_perthread_deinit(void)
   "   guid           VARCHAR(16) NOT NULL"		\
   ");"
 
-#define T_SPEAKERS					\
-  "CREATE TABLE IF NOT EXISTS speakers("		\
-  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
-  "   selected       INTEGER NOT NULL,"			\
-  "   volume         INTEGER NOT NULL"			\
-  ");"
+#define T_SPEAKERS					\
+  "CREATE TABLE IF NOT EXISTS speakers("		\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   selected       INTEGER NOT NULL,"			\
+  "   volume         INTEGER NOT NULL"			\
+  ");"
+
+#define T_BROWSE					\
+  "CREATE TABLE IF NOT EXISTS browse ("			\
+  "   type           INTEGER NOT NULL,"		\
+  "   sort_key       VARCHAR(1024) NOT NULL,"		\
+  "   name           VARCHAR(1024) NOT NULL,"		\
+  "   count          INTEGER NOT NULL,"		\
+  "PRIMARY KEY (type, sort_key)"			\
+  ");"
+
+#define T_INOTIFY					\
+  "CREATE TABLE IF NOT EXISTS inotify ("		\
+  "   wd          INTEGER PRIMARY KEY NOT NULL,"	\
+  "   cookie      INTEGER NOT NULL,"			\
+  "   path        VARCHAR(4096) NOT NULL"		\
+  ");"
+
+/* Change log, one row per file (kind 0) or playlist (kind 1) with the
+ * revision it last changed in, see db_library_revision_seal()
+ */
+#define T_CHANGES					\
+  "CREATE TABLE IF NOT EXISTS changes ("		\
+  "   kind           INTEGER NOT NULL,"		\
+  "   id             INTEGER NOT NULL,"		\
+  "   rev            INTEGER NOT NULL,"		\
+  "PRIMARY KEY (kind, id)"				\
+  ");"
+
+#define I_PATH							\
+  "CREATE INDEX IF NOT EXISTS idx_path ON files(path, idx);"
+
+#define I_TITLE							\
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort);"
+
+#define I_ALBUM							\
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort, disc, track);"
+
+#define I_ARTIST						\
+  "CREATE INDEX IF NOT EXISTS idx_artist ON files(disabled, artist_sort);"
+
+#define I_ALBUMARTIST						\
+  "CREATE INDEX IF NOT EXISTS idx_album_artist ON files(disabled, album_artist_sort);"
+
+#define I_MEDIAKIND						\
+  "CREATE INDEX IF NOT EXISTS idx_mediakind ON files(disabled, media_kind);"
+
+#define I_SONGALBUMID						\
+  "CREATE INDEX IF NOT EXISTS idx_songalbumid ON files(songalbumid, disabled);"
+
+/* Case-insensitive: playlists made on other systems may not agree on case */
+#define I_FNAME								\
+  "CREATE INDEX IF NOT EXISTS idx_fname ON files(fname COLLATE NOCASE);"
+
+#define I_FILEPATH							\
+  "CREATE INDEX IF NOT EXISTS idx_filepath ON playlistitems(filepath ASC);"
+
+#define I_PLITEMID							\
+  "CREATE INDEX IF NOT EXISTS idx_playlistid ON playlistitems(playlistid, filepath);"
+
+#define I_PL_PATH						\
+  "CREATE INDEX IF NOT EXISTS idx_pl_path ON playlists(path, idx);"
+
+#define I_INOTIFY_PATH						\
+  "CREATE INDEX IF NOT EXISTS idx_inotify_path ON inotify(path);"
+
+#define I_PAIRING				\
+  "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
+
+#define I_GRP_PERSIST				\
+  "CREATE INDEX IF NOT EXISTS idx_grp_persist ON groups(persistentid);"
+
+#define I_GRP_ALBUM				\
+  "CREATE INDEX IF NOT EXISTS idx_grp_album ON groups(type, album_sort, name);"
+
+#define I_CHANGES_REV				\
+  "CREATE INDEX IF NOT EXISTS idx_changes_rev ON changes(rev);"
+
+/* Album groups: items is the number of enabled files in the group */
+#define GROUPS_INSERT(r)						\
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid, items, album_artist, album_sort)" \
+  " VALUES (1, " r ".album, " r ".songalbumid, 0, " r ".album_artist, " r ".album_sort);"
+
+#define GROUPS_COUNT(r, op)						\
+  "   UPDATE groups SET items = items " op " 1 WHERE type = 1 AND persistentid = " r ".songalbumid"
+
+/* A group takes the album name, album artist and sort key of its last
+ * retagged file
+ */
+#define GROUPS_REFRESH							\
+  "   UPDATE groups SET name = COALESCE(NEW.album, name), album_artist = NEW.album_artist, album_sort = NEW.album_sort" \
+  " WHERE type = 1 AND persistentid = NEW.songalbumid"			\
+  " AND (OLD.album IS NOT NEW.album OR OLD.album_artist IS NOT NEW.album_artist" \
+  "      OR OLD.album_sort IS NOT NEW.album_sort);"
+
+#define TRG_GROUPS_INSERT_FILES						\
+  "CREATE TRIGGER update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  GROUPS_INSERT("NEW")							\
+  GROUPS_COUNT("NEW", "+") " AND NEW.disabled = 0;"			\
+  " END;"
+
+#define TRG_GROUPS_UPDATE_FILES						\
+  "CREATE TRIGGER update_groups_update_file"				\
+  " AFTER UPDATE OF songalbumid, disabled, album, album_artist, album_sort ON files FOR EACH ROW" \
+  " BEGIN"								\
+  GROUPS_INSERT("NEW")							\
+  GROUPS_REFRESH							\
+  GROUPS_COUNT("OLD", "-") " AND OLD.disabled = 0"			\
+  " AND (OLD.songalbumid <> NEW.songalbumid OR NEW.disabled <> 0);"	\
+  GROUPS_COUNT("NEW", "+") " AND NEW.disabled = 0"			\
+  " AND (OLD.songalbumid <> NEW.songalbumid OR OLD.disabled <> 0);"	\
+  " END;"
+
+#define TRG_GROUPS_DELETE_FILES						\
+  "CREATE TRIGGER update_groups_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " WHEN OLD.disabled = 0"						\
+  " BEGIN"								\
+  GROUPS_COUNT("OLD", "-") ";"						\
+  " END;"
+
+/* Browse tables: one row per (type, sort_key), count is the number of
+ * enabled audio items with that value.
+ * type: 1 artist, 2 album, 3 genre, 4 composer, 5 album_artist
+ */
+#define BROWSE_MATCH(r)							\
+  "((type = 1 AND sort_key = " r ".artist_sort)"			\
+  " OR (type = 2 AND sort_key = " r ".album_sort)"			\
+  " OR (type = 3 AND sort_key = daap_sortkey(" r ".genre))"		\
+  " OR (type = 4 AND sort_key = daap_sortkey(" r ".composer))"		\
+  " OR (type = 5 AND sort_key = " r ".album_artist_sort))"
+
+#define BROWSE_CHANGED							\
+  "(OLD.artist IS NOT NEW.artist OR OLD.album IS NOT NEW.album"		\
+  " OR OLD.genre IS NOT NEW.genre OR OLD.composer IS NOT NEW.composer"	\
+  " OR OLD.album_artist IS NOT NEW.album_artist"			\
+  " OR OLD.data_kind IS NOT NEW.data_kind OR OLD.disabled IS NOT NEW.disabled)"
+
+#define BROWSE_INSERT(t, key, f, r)					\
+  "   INSERT OR IGNORE INTO browse (type, sort_key, name, count)"	\
+  " SELECT " t ", " key ", " r "." f ", 0 WHERE " r "." f " != '';"
+
+#define BROWSE_ADD(r)							\
+  BROWSE_INSERT("1", r ".artist_sort", "artist", r)			\
+  BROWSE_INSERT("2", r ".album_sort", "album", r)			\
+  BROWSE_INSERT("3", "daap_sortkey(" r ".genre)", "genre", r)		\
+  BROWSE_INSERT("4", "daap_sortkey(" r ".composer)", "composer", r)	\
+  BROWSE_INSERT("5", r ".album_artist_sort", "album_artist", r)		\
+  "   UPDATE browse SET count = count + 1 WHERE " BROWSE_MATCH(r) ";"
+
+#define BROWSE_REMOVE(r)						\
+  "   UPDATE browse SET count = count - 1 WHERE " BROWSE_MATCH(r) ";"	\
+  "   DELETE FROM browse WHERE count <= 0 AND " BROWSE_MATCH(r) ";"
+
+#define TRG_BROWSE_INSERT_FILES						\
+  "CREATE TRIGGER update_browse_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " WHEN NEW.data_kind = 0 AND NEW.disabled = 0"			\
+  " BEGIN"								\
+  BROWSE_ADD("NEW")							\
+  " END;"
+
+#define TRG_BROWSE_DELETE_FILES						\
+  "CREATE TRIGGER update_browse_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " WHEN OLD.data_kind = 0 AND OLD.disabled = 0"			\
+  " BEGIN"								\
+  BROWSE_REMOVE("OLD")							\
+  " END;"
+
+#define TRG_BROWSE_UPDATE_FILES_OLD					\
+  "CREATE TRIGGER update_browse_update_file_old AFTER UPDATE OF"	\
+  " artist, album, genre, composer, album_artist, data_kind, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.data_kind = 0 AND OLD.disabled = 0 AND " BROWSE_CHANGED	\
+  " BEGIN"								\
+  BROWSE_REMOVE("OLD")							\
+  " END;"
+
+#define TRG_BROWSE_UPDATE_FILES_NEW					\
+  "CREATE TRIGGER update_browse_update_file_new AFTER UPDATE OF"	\
+  " artist, album, genre, composer, album_artist, data_kind, disabled ON files FOR EACH ROW" \
+  " WHEN NEW.data_kind = 0 AND NEW.disabled = 0 AND " BROWSE_CHANGED	\
+  " BEGIN"								\
+  BROWSE_ADD("NEW")							\
+  " END;"
+
+/* Change log: changes go to the revision after the current one. Adding
+ * or removing a playlist item changes both the playlist and the file.
+ * Files are updated on every rescan of a modified file, db_timestamp
+ * is in all those updates; songalbumid alone is recomputed at startup
+ * and only logged when it actually changed.
+ */
+#define CHANGES_MARK(kind, id)						\
+  "   INSERT OR REPLACE INTO changes (kind, id, rev)"			\
+  " VALUES (" kind ", " id ", (SELECT value FROM admin WHERE key = 'library_revision') + 1);"
+
+#define CHANGES_MARK_FILE(path)						\
+  "   INSERT OR REPLACE INTO changes (kind, id, rev)"			\
+  " SELECT 0, id, (SELECT value FROM admin WHERE key = 'library_revision') + 1" \
+  " FROM files WHERE path = " path ";"
+
+#define TRG_CHANGES_INSERT_FILES					\
+  "CREATE TRIGGER changes_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  CHANGES_MARK("0", "NEW.id")						\
+  " END;"
+
+#define TRG_CHANGES_UPDATE_FILES					\
+  "CREATE TRIGGER changes_update_file AFTER UPDATE OF"			\
+  " path, db_timestamp, disabled, play_count ON files FOR EACH ROW"	\
+  " BEGIN"								\
+  CHANGES_MARK("0", "NEW.id")						\
+  " END;"
+
+#define TRG_CHANGES_UPDATE_FILES_ALBUM					\
+  "CREATE TRIGGER changes_update_file_album AFTER UPDATE OF songalbumid ON files FOR EACH ROW" \
+  " WHEN OLD.songalbumid <> NEW.songalbumid"				\
+  " BEGIN"								\
+  CHANGES_MARK("0", "NEW.id")						\
+  " END;"
+
+#define TRG_CHANGES_DELETE_FILES					\
+  "CREATE TRIGGER changes_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  CHANGES_MARK("0", "OLD.id")						\
+  " END;"
+
+#define TRG_CHANGES_INSERT_PL						\
+  "CREATE TRIGGER changes_new_playlist AFTER INSERT ON playlists FOR EACH ROW" \
+  " BEGIN"								\
+  CHANGES_MARK("1", "NEW.id")						\
+  " END;"
+
+/* Playlists are pinged on every scan, that's not a change */
+#define TRG_CHANGES_UPDATE_PL						\
+  "CREATE TRIGGER changes_update_playlist AFTER UPDATE ON playlists FOR EACH ROW" \
+  " WHEN OLD.title IS NOT NEW.title OR OLD.query IS NOT NEW.query"	\
+  " OR OLD.disabled IS NOT NEW.disabled OR OLD.path IS NOT NEW.path"	\
+  " BEGIN"								\
+  CHANGES_MARK("1", "NEW.id")						\
+  " END;"
+
+#define TRG_CHANGES_DELETE_PL						\
+  "CREATE TRIGGER changes_delete_playlist AFTER DELETE ON playlists FOR EACH ROW" \
+  " BEGIN"								\
+  CHANGES_MARK("1", "OLD.id")						\
+  " END;"
+
+#define TRG_CHANGES_INSERT_PLITEMS					\
+  "CREATE TRIGGER changes_new_playlistitem AFTER INSERT ON playlistitems FOR EACH ROW" \
+  " BEGIN"								\
+  CHANGES_MARK("1", "NEW.playlistid")					\
+  CHANGES_MARK_FILE("NEW.filepath")					\
+  " END;"
+
+#define TRG_CHANGES_DELETE_PLITEMS					\
+  "CREATE TRIGGER changes_delete_playlistitem AFTER DELETE ON playlistitems FOR EACH ROW" \
+  " BEGIN"								\
+  CHANGES_MARK("1", "OLD.playlistid")					\
+  CHANGES_MARK_FILE("OLD.filepath")					\
+  " END;"
 
-#define T_INOTIFY					\
-  "CREATE TABLE IF NOT EXISTS inotify ("		\
-  "   wd          INTEGER PRIMARY KEY NOT NULL,"	\
-  "   cookie      INTEGER NOT NULL,"			\
-  "   path        VARCHAR(4096) NOT NULL"		\
-  ");"
+/* Search index: trigram full-text index over the text columns clients
+ * search in, see db_filter_search(). Needs FTS5 with the trigram
+ * tokenizer (SQLite 3.34), so it is set up by db_search_init() and not
+ * part of the versioned schema.
+ */
+#define SEARCH_COLS							\
+  "title, artist, album, album_artist, composer, genre"
 
-#define I_PATH							\
-  "CREATE INDEX IF NOT EXISTS idx_path ON files(path, idx);"
+#define SEARCH_VALUES(r)						\
+  r ".title, " r ".artist, " r ".album, " r ".album_artist, " r ".composer, " r ".genre"
 
-#define I_FILEPATH							\
-  "CREATE INDEX IF NOT EXISTS idx_filepath ON playlistitems(filepath ASC);"
+#define T_SEARCH							\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("		\
+  SEARCH_COLS ", content = 'files', content_rowid = 'id', tokenize = 'trigram');"
 
-#define I_PLITEMID							\
-  "CREATE INDEX IF NOT EXISTS idx_playlistid ON playlistitems(playlistid, filepath);"
+#define SEARCH_INSERT(r)						\
+  "   INSERT INTO files_fts (rowid, " SEARCH_COLS ")"			\
+  " VALUES (" r ".id, " SEARCH_VALUES(r) ");"
 
-#define I_PAIRING				\
-  "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
+#define SEARCH_DELETE(r)						\
+  "   INSERT INTO files_fts (files_fts, rowid, " SEARCH_COLS ")"	\
+  " VALUES ('delete', " r ".id, " SEARCH_VALUES(r) ");"
 
-#define TRG_GROUPS_INSERT_FILES						\
-  "CREATE TRIGGER update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
+#define TRG_SEARCH_INSERT_FILES						\
+  "CREATE TRIGGER update_search_new_file AFTER INSERT ON files FOR EACH ROW" \
   " BEGIN"								\
-  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
+  SEARCH_INSERT("NEW")							\
   " END;"
 
-#define TRG_GROUPS_UPDATE_FILES						\
-  "CREATE TRIGGER update_groups_update_file AFTER UPDATE OF songalbumid ON files FOR EACH ROW" \
+#define TRG_SEARCH_DELETE_FILES						\
+  "CREATE TRIGGER update_search_delete_file AFTER DELETE ON files FOR EACH ROW" \
   " BEGIN"								\
-  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
+  SEARCH_DELETE("OLD")							\
+  " END;"
+
+/* Rescans rewrite every column, only reindex what actually changed */
+#define TRG_SEARCH_UPDATE_FILES						\
+  "CREATE TRIGGER update_search_update_file AFTER UPDATE OF " SEARCH_COLS " ON files FOR EACH ROW" \
+  " WHEN OLD.title IS NOT NEW.title OR OLD.artist IS NOT NEW.artist"	\
+  " OR OLD.album IS NOT NEW.album OR OLD.album_artist IS NOT NEW.album_artist" \
+  " OR OLD.composer IS NOT NEW.composer OR OLD.genre IS NOT NEW.genre"	\
+  " BEGIN"								\
+  SEARCH_DELETE("OLD")							\
+  SEARCH_INSERT("NEW")							\
   " END;"
 
 #define Q_PL1								\
@@ -3813,9 +5880,13 @@ db_perthread_deinit(void)
   " VALUES(8, 'Purchased', 0, 'media_kind = 1024', 0, '', 0, 8);"
  */
 
-#define SCHEMA_VERSION 11
+/* Revision 1 is what clients ask for when they know nothing yet */
+#define Q_LIBREV				\
+  "INSERT INTO admin (key, value) VALUES ('library_revision', '2');"
+
+#define SCHEMA_VERSION 20
 #define Q_SCVER					\
-  "INSERT INTO admin (key, value) VALUES ('schema_version', '11');"
+  "INSERT INTO admin (key, value) VALUES ('schema_version', '20');"
 
 struct db_init_query {
   char *query;
@@ -3832,14 +5903,45 @@ static const struct db_init_query db_init_queries[] =
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
+    { T_BROWSE,    "create table browse" },
+    { T_CHANGES,   "create table changes" },
 
     { I_PATH,      "create file path index" },
     { I_FILEPATH,  "create file path index" },
+    { I_FNAME,     "create file name index" },
     { I_PLITEMID,  "create playlist id index" },
     { I_PAIRING,   "create pairing guid index" },
+    { I_PL_PATH,   "create playlist path index" },
+    { I_INOTIFY_PATH, "create inotify path index" },
+
+    { I_TITLE,           "create file title index" },
+    { I_ALBUM,           "create file album index" },
+    { I_ARTIST,          "create file artist index" },
+    { I_MEDIAKIND,       "create file media kind index" },
+    { I_ALBUMARTIST,     "create file album_artist index" },
+    { I_SONGALBUMID,     "create file songalbumid index" },
+    { I_GRP_PERSIST,     "create groups persistentid index" },
+    { I_GRP_ALBUM,       "create groups album index" },
+    { I_CHANGES_REV,     "create changes revision index" },
 
     { TRG_GROUPS_INSERT_FILES,    "create trigger update_groups_new_file" },
     { TRG_GROUPS_UPDATE_FILES,    "create trigger update_groups_update_file" },
+    { TRG_GROUPS_DELETE_FILES,    "create trigger update_groups_delete_file" },
+    { TRG_BROWSE_INSERT_FILES,    "create trigger update_browse_new_file" },
+    { TRG_BROWSE_DELETE_FILES,    "create trigger update_browse_delete_file" },
+    { TRG_BROWSE_UPDATE_FILES_OLD, "create trigger update_browse_update_file_old" },
+    { TRG_BROWSE_UPDATE_FILES_NEW, "create trigger update_browse_update_file_new" },
+    { TRG_CHANGES_INSERT_FILES,   "create trigger changes_new_file" },
+    { TRG_CHANGES_UPDATE_FILES,   "create trigger changes_update_file" },
+    { TRG_CHANGES_UPDATE_FILES_ALBUM, "create trigger changes_update_file_album" },
+    { TRG_CHANGES_DELETE_FILES,   "create trigger changes_delete_file" },
+    { TRG_CHANGES_INSERT_PL,      "create trigger changes_new_playlist" },
+    { TRG_CHANGES_UPDATE_PL,      "create trigger changes_update_playlist" },
+    { TRG_CHANGES_DELETE_PL,      "create trigger changes_delete_playlist" },
+    { TRG_CHANGES_INSERT_PLITEMS, "create trigger changes_new_playlistitem" },
+    { TRG_CHANGES_DELETE_PLITEMS, "create trigger changes_delete_playlistitem" },
+
+    { Q_LIBREV,    "set library revision" },
 
     { Q_PL1,       "create default playlist" },
     { Q_PL2,       "create default smart playlist 'Music'" },
@@ -4142,137 +6244,721 @@ db_upgrade_v11(void)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for speaker IDs\n");
 
-      return -1;
-    }
+      return -1;
+    }
+
+  query = "SELECT value FROM admin WHERE key = 'player:active-spk';";
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      goto out_free_ids;
+    }
+
+  i = 0;
+  ret = 0;
+  while ((qret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      strid = (const char *)sqlite3_column_text(stmt, 0);
+
+      ret = safe_hextou64(strid, spkids + i);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not convert speaker ID: %s\n", strid);
+	  break;
+	}
+
+      i++;
+    }
+
+  db_stmt_finalize(stmt);
+
+  if ((ret == 0) && (qret != SQLITE_DONE))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      goto out_free_ids;
+    }
+  else if (ret < 0)
+    goto out_free_ids;
+
+  /* Get saved volume */
+  query = "SELECT value FROM admin WHERE key = 'player:volume';";
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      goto out_free_ids;
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_finalize(stmt);
+      goto out_free_ids;
+    }
+
+  volume = sqlite3_column_int(stmt, 0);
+
+  db_stmt_finalize(stmt);
+
+  /* Add speakers to the table */
+  for (i = 0; i < count; i++)
+    {
+      query = sqlite3_mprintf(Q_NEWSPK, spkids[i]);
+      if (!query)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+	  goto out_free_ids;
+	}
+
+      DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	DPRINTF(E_LOG, L_DB, "Error adding speaker: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+    }
+
+  free(spkids);
+
+  /* Update with volume */
+  query = sqlite3_mprintf(Q_SPKVOL, volume);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error adding speaker: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+  sqlite3_free(query);
+
+  /* Clear old config keys */
+ clear_vars:
+  query = "DELETE FROM admin WHERE key = 'player:volume' OR key = 'player:active-spk';";
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error adding speaker: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+
+  return 0;
+
+ out_free_ids:
+  free(spkids);
+
+  return -1;
+
+#undef Q_NEWSPK
+#undef Q_SPKVOL
+}
+
+/* Upgrade from schema v11 to v12 */
+
+#define U_V12_IDX_TITLE						\
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title COLLATE DAAP);"
+
+#define U_V12_IDX_ALBUM						\
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album COLLATE DAAP, disc, track);"
+
+#define U_V12_IDX_ARTIST					\
+  "CREATE INDEX IF NOT EXISTS idx_artist ON files(disabled, artist COLLATE DAAP);"
+
+#define U_V12_IDX_MEDIAKIND					\
+  "CREATE INDEX IF NOT EXISTS idx_mediakind ON files(disabled, media_kind);"
+
+#define U_V12_IDX_SONGALBUMID					\
+  "CREATE INDEX IF NOT EXISTS idx_songalbumid ON files(songalbumid, disabled);"
+
+#define U_V12_IDX_BROWSE					\
+  "CREATE INDEX IF NOT EXISTS idx_browse_artist ON files(data_kind, disabled, artist COLLATE DAAP);"	\
+  "CREATE INDEX IF NOT EXISTS idx_browse_album ON files(data_kind, disabled, album COLLATE DAAP);"	\
+  "CREATE INDEX IF NOT EXISTS idx_browse_genre ON files(data_kind, disabled, genre COLLATE DAAP);"	\
+  "CREATE INDEX IF NOT EXISTS idx_browse_composer ON files(data_kind, disabled, composer COLLATE DAAP);"
+
+#define U_V12_IDX_GRP_PERSIST					\
+  "CREATE INDEX IF NOT EXISTS idx_grp_persist ON groups(persistentid);"
+
+#define U_V12_ANALYZE						\
+  "ANALYZE;"
+
+#define U_V12_SCVER						\
+  "UPDATE admin SET value = '12' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v12_queries[] =
+  {
+    { U_V12_IDX_TITLE,       "create file title index" },
+    { U_V12_IDX_ALBUM,       "create file album index" },
+    { U_V12_IDX_ARTIST,      "create file artist index" },
+    { U_V12_IDX_MEDIAKIND,   "create file media kind index" },
+    { U_V12_IDX_SONGALBUMID, "create file songalbumid index" },
+    { U_V12_IDX_BROWSE,      "create browse indices" },
+    { U_V12_IDX_GRP_PERSIST, "create groups persistentid index" },
+    { U_V12_ANALYZE,         "gather index statistics" },
+    { U_V12_SCVER,           "set schema_version to 12" },
+  };
+
+/* Upgrade from schema v12 to v13 */
+
+#define U_V13_BROWSE					\
+  "CREATE TABLE browse ("				\
+  "   type           INTEGER NOT NULL,"		\
+  "   name           VARCHAR(1024) NOT NULL COLLATE DAAP," \
+  "   count          INTEGER NOT NULL,"		\
+  "PRIMARY KEY (type, name)"				\
+  ");"
+
+#define U_V13_BROWSE_FILL(t, f)						\
+  "INSERT INTO browse (type, name, count)"				\
+  " SELECT " t ", " f ", COUNT(*) FROM files"				\
+  " WHERE data_kind = 0 AND disabled = 0 AND " f " != ''"		\
+  " GROUP BY " f " COLLATE DAAP;"
+
+#define U_V13_BROWSE_MATCH(r)						\
+  "((type = 1 AND " r ".artist != '' AND name = " r ".artist)"		\
+  " OR (type = 2 AND " r ".album != '' AND name = " r ".album)"		\
+  " OR (type = 3 AND " r ".genre != '' AND name = " r ".genre)"		\
+  " OR (type = 4 AND " r ".composer != '' AND name = " r ".composer)"	\
+  " OR (type = 5 AND " r ".album_artist != '' AND name = " r ".album_artist))"
+
+#define U_V13_BROWSE_CHANGED						\
+  "(OLD.artist IS NOT NEW.artist OR OLD.album IS NOT NEW.album"		\
+  " OR OLD.genre IS NOT NEW.genre OR OLD.composer IS NOT NEW.composer"	\
+  " OR OLD.album_artist IS NOT NEW.album_artist"			\
+  " OR OLD.data_kind IS NOT NEW.data_kind OR OLD.disabled IS NOT NEW.disabled)"
+
+#define U_V13_BROWSE_ADD(r)						\
+  "   INSERT OR IGNORE INTO browse (type, name, count) SELECT 1, " r ".artist, 0 WHERE " r ".artist != '';" \
+  "   INSERT OR IGNORE INTO browse (type, name, count) SELECT 2, " r ".album, 0 WHERE " r ".album != '';" \
+  "   INSERT OR IGNORE INTO browse (type, name, count) SELECT 3, " r ".genre, 0 WHERE " r ".genre != '';" \
+  "   INSERT OR IGNORE INTO browse (type, name, count) SELECT 4, " r ".composer, 0 WHERE " r ".composer != '';" \
+  "   INSERT OR IGNORE INTO browse (type, name, count) SELECT 5, " r ".album_artist, 0 WHERE " r ".album_artist != '';" \
+  "   UPDATE browse SET count = count + 1 WHERE " U_V13_BROWSE_MATCH(r) ";"
+
+#define U_V13_BROWSE_REMOVE(r)						\
+  "   UPDATE browse SET count = count - 1 WHERE " U_V13_BROWSE_MATCH(r) ";" \
+  "   DELETE FROM browse WHERE count <= 0 AND " U_V13_BROWSE_MATCH(r) ";"
+
+#define U_V13_BROWSE_INSERT_FILES					\
+  "CREATE TRIGGER update_browse_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " WHEN NEW.data_kind = 0 AND NEW.disabled = 0"			\
+  " BEGIN"								\
+  U_V13_BROWSE_ADD("NEW")						\
+  " END;"
+
+#define U_V13_BROWSE_DELETE_FILES					\
+  "CREATE TRIGGER update_browse_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " WHEN OLD.data_kind = 0 AND OLD.disabled = 0"			\
+  " BEGIN"								\
+  U_V13_BROWSE_REMOVE("OLD")						\
+  " END;"
+
+#define U_V13_BROWSE_UPDATE_FILES_OLD					\
+  "CREATE TRIGGER update_browse_update_file_old AFTER UPDATE OF"	\
+  " artist, album, genre, composer, album_artist, data_kind, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.data_kind = 0 AND OLD.disabled = 0 AND " U_V13_BROWSE_CHANGED \
+  " BEGIN"								\
+  U_V13_BROWSE_REMOVE("OLD")						\
+  " END;"
+
+#define U_V13_BROWSE_UPDATE_FILES_NEW					\
+  "CREATE TRIGGER update_browse_update_file_new AFTER UPDATE OF"	\
+  " artist, album, genre, composer, album_artist, data_kind, disabled ON files FOR EACH ROW" \
+  " WHEN NEW.data_kind = 0 AND NEW.disabled = 0 AND " U_V13_BROWSE_CHANGED \
+  " BEGIN"								\
+  U_V13_BROWSE_ADD("NEW")						\
+  " END;"
+
+/* Rebuild indices using the DAAP collation, whose ordering of empty
+ * strings changed
+ */
+#define U_V13_REINDEX					\
+  "REINDEX DAAP;"
+
+#define U_V13_SCVER					\
+  "UPDATE admin SET value = '13' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v13_queries[] =
+  {
+    { U_V13_BROWSE,                  "create table browse" },
+    { U_V13_BROWSE_FILL("1",         "artist"),       "fill artist browse table" },
+    { U_V13_BROWSE_FILL("2",         "album"),        "fill album browse table" },
+    { U_V13_BROWSE_FILL("3",         "genre"),        "fill genre browse table" },
+    { U_V13_BROWSE_FILL("4",         "composer"),     "fill composer browse table" },
+    { U_V13_BROWSE_FILL("5",         "album_artist"), "fill album artist browse table" },
+    { U_V13_BROWSE_INSERT_FILES,     "create trigger update_browse_new_file" },
+    { U_V13_BROWSE_DELETE_FILES,     "create trigger update_browse_delete_file" },
+    { U_V13_BROWSE_UPDATE_FILES_OLD, "create trigger update_browse_update_file_old" },
+    { U_V13_BROWSE_UPDATE_FILES_NEW, "create trigger update_browse_update_file_new" },
+    { U_V13_REINDEX,                 "rebuild DAAP collated indices" },
+    { U_V13_SCVER,                   "set schema_version to 13" },
+  };
+
+/* Upgrade from schema v13 to v14 */
+
+#define U_V14_ADD_SORT(f)						\
+  "ALTER TABLE files ADD COLUMN " f " VARCHAR(1024) DEFAULT NULL;"
+
+#define U_V14_FILL_SORT							\
+  "UPDATE files SET title_sort = daap_sortkey(title), artist_sort = daap_sortkey(artist)," \
+  " album_sort = daap_sortkey(album), album_artist_sort = daap_sortkey(album_artist);"
+
+#define U_V14_DROP_IDX(i)						\
+  "DROP INDEX IF EXISTS " i ";"
+
+#define U_V14_DROP_TRG(t)						\
+  "DROP TRIGGER IF EXISTS " t ";"
+
+#define U_V14_DROP_BROWSE						\
+  "DROP TABLE IF EXISTS browse;"
+
+#define U_V14_BROWSE							\
+  "CREATE TABLE browse ("						\
+  "   type           INTEGER NOT NULL,"					\
+  "   sort_key       VARCHAR(1024) NOT NULL,"				\
+  "   name           VARCHAR(1024) NOT NULL,"				\
+  "   count          INTEGER NOT NULL,"					\
+  "PRIMARY KEY (type, sort_key)"					\
+  ");"
+
+#define U_V14_BROWSE_FILL(t, f, key)					\
+  "INSERT INTO browse (type, sort_key, name, count)"			\
+  " SELECT " t ", " key ", " f ", COUNT(*) FROM files"			\
+  " WHERE data_kind = 0 AND disabled = 0 AND " f " != ''"		\
+  " GROUP BY " key ";"
+
+#define U_V14_IDX_TITLE							\
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort);"
+
+#define U_V14_IDX_ALBUM							\
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort, disc, track);"
+
+#define U_V14_IDX_ARTIST						\
+  "CREATE INDEX IF NOT EXISTS idx_artist ON files(disabled, artist_sort);"
+
+#define U_V14_IDX_ALBUMARTIST						\
+  "CREATE INDEX IF NOT EXISTS idx_album_artist ON files(disabled, album_artist_sort);"
+
+#define U_V14_BROWSE_MATCH(r)						\
+  "((type = 1 AND sort_key = " r ".artist_sort)"			\
+  " OR (type = 2 AND sort_key = " r ".album_sort)"			\
+  " OR (type = 3 AND sort_key = daap_sortkey(" r ".genre))"		\
+  " OR (type = 4 AND sort_key = daap_sortkey(" r ".composer))"		\
+  " OR (type = 5 AND sort_key = " r ".album_artist_sort))"
+
+#define U_V14_BROWSE_CHANGED						\
+  "(OLD.artist IS NOT NEW.artist OR OLD.album IS NOT NEW.album"		\
+  " OR OLD.genre IS NOT NEW.genre OR OLD.composer IS NOT NEW.composer"	\
+  " OR OLD.album_artist IS NOT NEW.album_artist"			\
+  " OR OLD.data_kind IS NOT NEW.data_kind OR OLD.disabled IS NOT NEW.disabled)"
+
+#define U_V14_BROWSE_INSERT(t, key, f, r)				\
+  "   INSERT OR IGNORE INTO browse (type, sort_key, name, count)"	\
+  " SELECT " t ", " key ", " r "." f ", 0 WHERE " r "." f " != '';"
+
+#define U_V14_BROWSE_ADD(r)						\
+  U_V14_BROWSE_INSERT("1", r ".artist_sort", "artist", r)		\
+  U_V14_BROWSE_INSERT("2", r ".album_sort", "album", r)			\
+  U_V14_BROWSE_INSERT("3", "daap_sortkey(" r ".genre)", "genre", r)	\
+  U_V14_BROWSE_INSERT("4", "daap_sortkey(" r ".composer)", "composer", r) \
+  U_V14_BROWSE_INSERT("5", r ".album_artist_sort", "album_artist", r)	\
+  "   UPDATE browse SET count = count + 1 WHERE " U_V14_BROWSE_MATCH(r) ";"
+
+#define U_V14_BROWSE_REMOVE(r)						\
+  "   UPDATE browse SET count = count - 1 WHERE " U_V14_BROWSE_MATCH(r) ";" \
+  "   DELETE FROM browse WHERE count <= 0 AND " U_V14_BROWSE_MATCH(r) ";"
+
+#define U_V14_BROWSE_INSERT_FILES					\
+  "CREATE TRIGGER update_browse_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " WHEN NEW.data_kind = 0 AND NEW.disabled = 0"			\
+  " BEGIN"								\
+  U_V14_BROWSE_ADD("NEW")						\
+  " END;"
+
+#define U_V14_BROWSE_DELETE_FILES					\
+  "CREATE TRIGGER update_browse_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " WHEN OLD.data_kind = 0 AND OLD.disabled = 0"			\
+  " BEGIN"								\
+  U_V14_BROWSE_REMOVE("OLD")						\
+  " END;"
+
+#define U_V14_BROWSE_UPDATE_FILES_OLD					\
+  "CREATE TRIGGER update_browse_update_file_old AFTER UPDATE OF"	\
+  " artist, album, genre, composer, album_artist, data_kind, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.data_kind = 0 AND OLD.disabled = 0 AND " U_V14_BROWSE_CHANGED \
+  " BEGIN"								\
+  U_V14_BROWSE_REMOVE("OLD")						\
+  " END;"
+
+#define U_V14_BROWSE_UPDATE_FILES_NEW					\
+  "CREATE TRIGGER update_browse_update_file_new AFTER UPDATE OF"	\
+  " artist, album, genre, composer, album_artist, data_kind, disabled ON files FOR EACH ROW" \
+  " WHEN NEW.data_kind = 0 AND NEW.disabled = 0 AND " U_V14_BROWSE_CHANGED \
+  " BEGIN"								\
+  U_V14_BROWSE_ADD("NEW")						\
+  " END;"
+
+#define U_V14_ANALYZE							\
+  "ANALYZE;"
+
+#define U_V14_SCVER							\
+  "UPDATE admin SET value = '14' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v14_queries[] =
+  {
+    { U_V14_ADD_SORT("title_sort"),                    "alter table files add column title_sort" },
+    { U_V14_ADD_SORT("artist_sort"),                   "alter table files add column artist_sort" },
+    { U_V14_ADD_SORT("album_sort"),                    "alter table files add column album_sort" },
+    { U_V14_ADD_SORT("album_artist_sort"),             "alter table files add column album_artist_sort" },
+    { U_V14_FILL_SORT,                                 "compute sort keys" },
+
+    { U_V14_DROP_IDX("idx_title"),                     "drop index idx_title" },
+    { U_V14_DROP_IDX("idx_album"),                     "drop index idx_album" },
+    { U_V14_DROP_IDX("idx_artist"),                    "drop index idx_artist" },
+    { U_V14_DROP_IDX("idx_browse_artist"),             "drop index idx_browse_artist" },
+    { U_V14_DROP_IDX("idx_browse_album"),              "drop index idx_browse_album" },
+    { U_V14_DROP_IDX("idx_browse_genre"),              "drop index idx_browse_genre" },
+    { U_V14_DROP_IDX("idx_browse_composer"),           "drop index idx_browse_composer" },
+    { U_V14_IDX_TITLE,                                 "create file title index" },
+    { U_V14_IDX_ALBUM,                                 "create file album index" },
+    { U_V14_IDX_ARTIST,                                "create file artist index" },
+    { U_V14_IDX_ALBUMARTIST,                           "create file album_artist index" },
+
+    { U_V14_DROP_TRG("update_browse_new_file"),        "drop trigger update_browse_new_file" },
+    { U_V14_DROP_TRG("update_browse_delete_file"),     "drop trigger update_browse_delete_file" },
+    { U_V14_DROP_TRG("update_browse_update_file_old"), "drop trigger update_browse_update_file_old" },
+    { U_V14_DROP_TRG("update_browse_update_file_new"), "drop trigger update_browse_update_file_new" },
+    { U_V14_DROP_BROWSE,                               "drop table browse" },
+    { U_V14_BROWSE,                                    "create table browse" },
+    { U_V14_BROWSE_FILL("1",                           "artist", "artist_sort"),             "fill artist browse table" },
+    { U_V14_BROWSE_FILL("2",                           "album", "album_sort"),               "fill album browse table" },
+    { U_V14_BROWSE_FILL("3",                           "genre", "daap_sortkey(genre)"),      "fill genre browse table" },
+    { U_V14_BROWSE_FILL("4",                           "composer", "daap_sortkey(composer)"), "fill composer browse table" },
+    { U_V14_BROWSE_FILL("5",                           "album_artist", "album_artist_sort"), "fill album artist browse table" },
+    { U_V14_BROWSE_INSERT_FILES,                       "create trigger update_browse_new_file" },
+    { U_V14_BROWSE_DELETE_FILES,                       "create trigger update_browse_delete_file" },
+    { U_V14_BROWSE_UPDATE_FILES_OLD,                   "create trigger update_browse_update_file_old" },
+    { U_V14_BROWSE_UPDATE_FILES_NEW,                   "create trigger update_browse_update_file_new" },
+
+    { U_V14_ANALYZE,                                   "analyze" },
+    { U_V14_SCVER,                                     "set schema_version to 14" },
+  };
+
+/* Upgrade from schema v14 to v15 */
+
+#define U_V15_IDX_PL_PATH						\
+  "CREATE INDEX IF NOT EXISTS idx_pl_path ON playlists(path, idx);"
+
+#define U_V15_IDX_INOTIFY_PATH						\
+  "CREATE INDEX IF NOT EXISTS idx_inotify_path ON inotify(path);"
+
+#define U_V15_SCVER							\
+  "UPDATE admin SET value = '15' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v15_queries[] =
+  {
+    { U_V15_IDX_PL_PATH,      "create playlist path index" },
+    { U_V15_IDX_INOTIFY_PATH, "create inotify path index" },
+
+    { U_V15_SCVER,            "set schema_version to 15" },
+  };
+
+/* Upgrade from schema v15 to v16 */
+
+#define U_V16_ADD_GROUPS(col)						\
+  "ALTER TABLE groups ADD COLUMN " col ";"
+
+#define U_V16_FILL_GROUPS						\
+  "UPDATE groups SET album_artist = COALESCE((SELECT f.album_artist FROM files f"	\
+  "   WHERE f.songalbumid = groups.persistentid LIMIT 1), ''),"	\
+  " album_sort = (SELECT f.album_sort FROM files f"			\
+  "   WHERE f.songalbumid = groups.persistentid LIMIT 1) WHERE type = 1;"
+
+#define U_V16_COUNT_GROUPS						\
+  "UPDATE groups SET items = (SELECT COUNT(*) FROM files f"		\
+  " WHERE f.songalbumid = groups.persistentid AND f.disabled = 0) WHERE type = 1;"
+
+#define U_V16_IDX_GRP_ALBUM						\
+  "CREATE INDEX IF NOT EXISTS idx_grp_album ON groups(type, album_sort, name);"
+
+#define U_V16_DROP_TRG(name)						\
+  "DROP TRIGGER IF EXISTS " name ";"
+
+#define U_V16_GROUPS_INSERT(r)						\
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid, items, album_artist, album_sort)" \
+  " VALUES (1, " r ".album, " r ".songalbumid, 0, " r ".album_artist, " r ".album_sort);"
+
+#define U_V16_GROUPS_COUNT(r, op)					\
+  "   UPDATE groups SET items = items " op " 1 WHERE type = 1 AND persistentid = " r ".songalbumid"
+
+#define U_V16_GROUPS_REFRESH						\
+  "   UPDATE groups SET name = COALESCE(NEW.album, name), album_artist = NEW.album_artist, album_sort = NEW.album_sort" \
+  " WHERE type = 1 AND persistentid = NEW.songalbumid"			\
+  " AND (OLD.album IS NOT NEW.album OR OLD.album_artist IS NOT NEW.album_artist" \
+  "      OR OLD.album_sort IS NOT NEW.album_sort);"
+
+#define U_V16_TRG_GROUPS_INSERT						\
+  "CREATE TRIGGER update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V16_GROUPS_INSERT("NEW")						\
+  U_V16_GROUPS_COUNT("NEW", "+") " AND NEW.disabled = 0;"		\
+  " END;"
+
+#define U_V16_TRG_GROUPS_UPDATE						\
+  "CREATE TRIGGER update_groups_update_file"				\
+  " AFTER UPDATE OF songalbumid, disabled, album, album_artist, album_sort ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V16_GROUPS_INSERT("NEW")						\
+  U_V16_GROUPS_REFRESH							\
+  U_V16_GROUPS_COUNT("OLD", "-") " AND OLD.disabled = 0"		\
+  " AND (OLD.songalbumid <> NEW.songalbumid OR NEW.disabled <> 0);"	\
+  U_V16_GROUPS_COUNT("NEW", "+") " AND NEW.disabled = 0"		\
+  " AND (OLD.songalbumid <> NEW.songalbumid OR OLD.disabled <> 0);"	\
+  " END;"
+
+#define U_V16_TRG_GROUPS_DELETE						\
+  "CREATE TRIGGER update_groups_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " WHEN OLD.disabled = 0"						\
+  " BEGIN"								\
+  U_V16_GROUPS_COUNT("OLD", "-") ";"					\
+  " END;"
+
+#define U_V16_SCVER							\
+  "UPDATE admin SET value = '16' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v16_queries[] =
+  {
+    { U_V16_ADD_GROUPS("items INTEGER NOT NULL DEFAULT 0"),             "alter table groups add column items" },
+    { U_V16_ADD_GROUPS("album_artist VARCHAR(1024) NOT NULL DEFAULT ''"), "alter table groups add column album_artist" },
+    { U_V16_ADD_GROUPS("album_sort VARCHAR(1024) DEFAULT NULL"),        "alter table groups add column album_sort" },
+    { U_V16_FILL_GROUPS,                                                "fill album groups" },
+    { U_V16_COUNT_GROUPS,                                               "count album group items" },
+    { U_V16_IDX_GRP_ALBUM,                                              "create groups album index" },
+
+    { U_V16_DROP_TRG("update_groups_new_file"),                         "drop trigger update_groups_new_file" },
+    { U_V16_DROP_TRG("update_groups_update_file"),                      "drop trigger update_groups_update_file" },
+    { U_V16_TRG_GROUPS_INSERT,                                          "create trigger update_groups_new_file" },
+    { U_V16_TRG_GROUPS_UPDATE,                                          "create trigger update_groups_update_file" },
+    { U_V16_TRG_GROUPS_DELETE,                                          "create trigger update_groups_delete_file" },
+
+    { U_V16_SCVER,                                                      "set schema_version to 16" },
+  };
+
+/* Upgrade from schema v16 to v17 */
 
-  query = "SELECT value FROM admin WHERE key = 'player:active-spk';";
+#define U_V17_IDX_FNAME							\
+  "CREATE INDEX IF NOT EXISTS idx_fname ON files(fname COLLATE NOCASE);"
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+#define U_V17_SCVER							\
+  "UPDATE admin SET value = '17' WHERE key = 'schema_version';"
 
-  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+static const struct db_init_query db_upgrade_v17_queries[] =
+  {
+    { U_V17_IDX_FNAME, "create file name index" },
 
-      goto out_free_ids;
-    }
+    { U_V17_SCVER,     "set schema_version to 17" },
+  };
 
-  i = 0;
-  ret = 0;
-  while ((qret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-      strid = (const char *)sqlite3_column_text(stmt, 0);
+/* Upgrade from schema v17 to v18 */
 
-      ret = safe_hextou64(strid, spkids + i);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Could not convert speaker ID: %s\n", strid);
-	  break;
-	}
+#define U_V18_NEW_TABLE_CHANGES						\
+  "CREATE TABLE IF NOT EXISTS changes ("				\
+  "   kind           INTEGER NOT NULL,"				\
+  "   id             INTEGER NOT NULL,"				\
+  "   rev            INTEGER NOT NULL,"				\
+  "PRIMARY KEY (kind, id)"						\
+  ");"
 
-      i++;
-    }
+#define U_V18_IDX_CHANGES_REV						\
+  "CREATE INDEX IF NOT EXISTS idx_changes_rev ON changes(rev);"
 
-  sqlite3_finalize(stmt);
+#define U_V18_CHANGES_MARK(kind, id)					\
+  "   INSERT OR REPLACE INTO changes (kind, id, rev)"			\
+  " VALUES (" kind ", " id ", (SELECT value FROM admin WHERE key = 'library_revision') + 1);"
 
-  if ((ret == 0) && (qret != SQLITE_DONE))
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+#define U_V18_CHANGES_MARK_FILE(path)					\
+  "   INSERT OR REPLACE INTO changes (kind, id, rev)"			\
+  " SELECT 0, id, (SELECT value FROM admin WHERE key = 'library_revision') + 1" \
+  " FROM files WHERE path = " path ";"
 
-      goto out_free_ids;
-    }
-  else if (ret < 0)
-    goto out_free_ids;
+#define U_V18_TRG_CHANGES_INSERT_FILES					\
+  "CREATE TRIGGER changes_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("0", "NEW.id")					\
+  " END;"
 
-  /* Get saved volume */
-  query = "SELECT value FROM admin WHERE key = 'player:volume';";
+#define U_V18_TRG_CHANGES_UPDATE_FILES					\
+  "CREATE TRIGGER changes_update_file AFTER UPDATE OF"			\
+  " path, db_timestamp, disabled, play_count ON files FOR EACH ROW"	\
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("0", "NEW.id")					\
+  " END;"
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+#define U_V18_TRG_CHANGES_UPDATE_FILES_ALBUM				\
+  "CREATE TRIGGER changes_update_file_album AFTER UPDATE OF songalbumid ON files FOR EACH ROW" \
+  " WHEN OLD.songalbumid <> NEW.songalbumid"				\
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("0", "NEW.id")					\
+  " END;"
 
-  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+#define U_V18_TRG_CHANGES_DELETE_FILES					\
+  "CREATE TRIGGER changes_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("0", "OLD.id")					\
+  " END;"
 
-      goto out_free_ids;
-    }
+#define U_V18_TRG_CHANGES_INSERT_PL					\
+  "CREATE TRIGGER changes_new_playlist AFTER INSERT ON playlists FOR EACH ROW" \
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("1", "NEW.id")					\
+  " END;"
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+#define U_V18_TRG_CHANGES_UPDATE_PL					\
+  "CREATE TRIGGER changes_update_playlist AFTER UPDATE ON playlists FOR EACH ROW" \
+  " WHEN OLD.title IS NOT NEW.title OR OLD.query IS NOT NEW.query"	\
+  " OR OLD.disabled IS NOT NEW.disabled OR OLD.path IS NOT NEW.path"	\
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("1", "NEW.id")					\
+  " END;"
 
-      sqlite3_finalize(stmt);
-      goto out_free_ids;
-    }
+#define U_V18_TRG_CHANGES_DELETE_PL					\
+  "CREATE TRIGGER changes_delete_playlist AFTER DELETE ON playlists FOR EACH ROW" \
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("1", "OLD.id")					\
+  " END;"
 
-  volume = sqlite3_column_int(stmt, 0);
+#define U_V18_TRG_CHANGES_INSERT_PLITEMS				\
+  "CREATE TRIGGER changes_new_playlistitem AFTER INSERT ON playlistitems FOR EACH ROW" \
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("1", "NEW.playlistid")				\
+  U_V18_CHANGES_MARK_FILE("NEW.filepath")				\
+  " END;"
 
-  sqlite3_finalize(stmt);
+#define U_V18_TRG_CHANGES_DELETE_PLITEMS				\
+  "CREATE TRIGGER changes_delete_playlistitem AFTER DELETE ON playlistitems FOR EACH ROW" \
+  " BEGIN"								\
+  U_V18_CHANGES_MARK("1", "OLD.playlistid")				\
+  U_V18_CHANGES_MARK_FILE("OLD.filepath")				\
+  " END;"
 
-  /* Add speakers to the table */
-  for (i = 0; i < count; i++)
-    {
-      query = sqlite3_mprintf(Q_NEWSPK, spkids[i]);
-      if (!query)
-	{
-	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+#define U_V18_LIBREV							\
+  "INSERT INTO admin (key, value) VALUES ('library_revision', '2');"
 
-	  goto out_free_ids;
-	}
+#define U_V18_SCVER							\
+  "UPDATE admin SET value = '18' WHERE key = 'schema_version';"
 
-      DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+static const struct db_init_query db_upgrade_v18_queries[] =
+  {
+    { U_V18_NEW_TABLE_CHANGES,              "create table changes" },
+    { U_V18_IDX_CHANGES_REV,                "create changes revision index" },
+    { U_V18_TRG_CHANGES_INSERT_FILES,       "create trigger changes_new_file" },
+    { U_V18_TRG_CHANGES_UPDATE_FILES,       "create trigger changes_update_file" },
+    { U_V18_TRG_CHANGES_UPDATE_FILES_ALBUM, "create trigger changes_update_file_album" },
+    { U_V18_TRG_CHANGES_DELETE_FILES,       "create trigger changes_delete_file" },
+    { U_V18_TRG_CHANGES_INSERT_PL,          "create trigger changes_new_playlist" },
+    { U_V18_TRG_CHANGES_UPDATE_PL,          "create trigger changes_update_playlist" },
+    { U_V18_TRG_CHANGES_DELETE_PL,          "create trigger changes_delete_playlist" },
+    { U_V18_TRG_CHANGES_INSERT_PLITEMS,     "create trigger changes_new_playlistitem" },
+    { U_V18_TRG_CHANGES_DELETE_PLITEMS,     "create trigger changes_delete_playlistitem" },
+    { U_V18_LIBREV,                         "set library revision" },
+
+    { U_V18_SCVER,                          "set schema_version to 18" },
+  };
 
-      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-      if (ret != SQLITE_OK)
-	DPRINTF(E_LOG, L_DB, "Error adding speaker: %s\n", errmsg);
+/* Upgrade from schema v18 to v19 */
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-    }
+#define U_V19_ADD_TITLE_LETTER						\
+  "ALTER TABLE files ADD COLUMN title_letter INTEGER NOT NULL DEFAULT 0;"
 
-  free(spkids);
+#define U_V19_FILL_TITLE_LETTER						\
+  "UPDATE files SET title_letter = daap_sortletter(title);"
 
-  /* Update with volume */
-  query = sqlite3_mprintf(Q_SPKVOL, volume);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+#define U_V19_SCVER							\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version';"
 
-      return -1;
-    }
+static const struct db_init_query db_upgrade_v19_queries[] =
+  {
+    { U_V19_ADD_TITLE_LETTER,  "alter table files add column title_letter" },
+    { U_V19_FILL_TITLE_LETTER, "compute title letters" },
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+    { U_V19_SCVER,             "set schema_version to 19" },
+  };
 
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error adding speaker: %s\n", errmsg);
+/* Upgrade from schema v19 to v20 */
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+#define U_V20_DROP_TRG_GROUPS_UPDATE					\
+  "DROP TRIGGER IF EXISTS update_groups_update_file;"
 
-  /* Clear old config keys */
- clear_vars:
-  query = "DELETE FROM admin WHERE key = 'player:volume' OR key = 'player:active-spk';";
+#define U_V20_GROUPS_INSERT(r)						\
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid, items, album_artist, album_sort)" \
+  " VALUES (1, " r ".album, " r ".songalbumid, 0, " r ".album_artist, " r ".album_sort);"
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+#define U_V20_GROUPS_COUNT(r, op)					\
+  "   UPDATE groups SET items = items " op " 1 WHERE type = 1 AND persistentid = " r ".songalbumid"
 
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error adding speaker: %s\n", errmsg);
+#define U_V20_GROUPS_REFRESH						\
+  "   UPDATE groups SET name = COALESCE(NEW.album, name), album_artist = NEW.album_artist, album_sort = NEW.album_sort" \
+  " WHERE type = 1 AND persistentid = NEW.songalbumid"			\
+  " AND (OLD.album IS NOT NEW.album OR OLD.album_artist IS NOT NEW.album_artist" \
+  "      OR OLD.album_sort IS NOT NEW.album_sort);"
 
-  sqlite3_free(errmsg);
+#define U_V20_TRG_GROUPS_UPDATE						\
+  "CREATE TRIGGER update_groups_update_file"				\
+  " AFTER UPDATE OF songalbumid, disabled, album, album_artist, album_sort ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V20_GROUPS_INSERT("NEW")						\
+  U_V20_GROUPS_REFRESH							\
+  U_V20_GROUPS_COUNT("OLD", "-") " AND OLD.disabled = 0"		\
+  " AND (OLD.songalbumid <> NEW.songalbumid OR NEW.disabled <> 0);"	\
+  U_V20_GROUPS_COUNT("NEW", "+") " AND NEW.disabled = 0"		\
+  " AND (OLD.songalbumid <> NEW.songalbumid OR OLD.disabled <> 0);"	\
+  " END;"
 
-  return 0;
+/* Groups may still hold the tags of a file retagged since */
+#define U_V20_LAST_FILE(col)						\
+  "(SELECT f." col " FROM files f WHERE f.songalbumid = groups.persistentid" \
+  " ORDER BY f.db_timestamp DESC LIMIT 1)"
 
- out_free_ids:
-  free(spkids);
+#define U_V20_FILL_GROUPS						\
+  "UPDATE groups SET name = COALESCE(" U_V20_LAST_FILE("album") ", name)," \
+  " album_artist = COALESCE(" U_V20_LAST_FILE("album_artist") ", album_artist)," \
+  " album_sort = " U_V20_LAST_FILE("album_sort")			\
+  " WHERE type = 1 AND persistentid IN (SELECT songalbumid FROM files);"
 
-  return -1;
+#define U_V20_SCVER							\
+  "UPDATE admin SET value = '20' WHERE key = 'schema_version';"
 
-#undef Q_NEWSPK
-#undef Q_SPKVOL
-}
+static const struct db_init_query db_upgrade_v20_queries[] =
+  {
+    { U_V20_DROP_TRG_GROUPS_UPDATE, "drop trigger update_groups_update_file" },
+    { U_V20_TRG_GROUPS_UPDATE,      "create trigger update_groups_update_file" },
+    { U_V20_FILL_GROUPS,            "refresh album groups" },
+
+    { U_V20_SCVER,                  "set schema_version to 20" },
+  };
 
 static int
 db_check_version(void)
@@ -4298,13 +6984,13 @@ db_check_version(void)
     {
       DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
+      db_stmt_finalize(stmt);
       return -1;
     }
 
   cur_ver = sqlite3_column_int(stmt, 0);
 
-  sqlite3_finalize(stmt);
+  db_stmt_finalize(stmt);
 
   if (cur_ver < SCHEMA_VERSION)
     {
@@ -4384,6 +7070,69 @@ db_check_version(void)
 	    if (ret < 0)
 	      return -1;
 
+	    /* FALLTHROUGH */
+
+	  case 11:
+	    ret = db_generic_upgrade(db_upgrade_v12_queries, sizeof(db_upgrade_v12_queries) / sizeof(db_upgrade_v12_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 12:
+	    ret = db_generic_upgrade(db_upgrade_v13_queries, sizeof(db_upgrade_v13_queries) / sizeof(db_upgrade_v13_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 13:
+	    ret = db_generic_upgrade(db_upgrade_v14_queries, sizeof(db_upgrade_v14_queries) / sizeof(db_upgrade_v14_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 14:
+	    ret = db_generic_upgrade(db_upgrade_v15_queries, sizeof(db_upgrade_v15_queries) / sizeof(db_upgrade_v15_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 15:
+	    ret = db_generic_upgrade(db_upgrade_v16_queries, sizeof(db_upgrade_v16_queries) / sizeof(db_upgrade_v16_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 16:
+	    ret = db_generic_upgrade(db_upgrade_v17_queries, sizeof(db_upgrade_v17_queries) / sizeof(db_upgrade_v17_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 17:
+	    ret = db_generic_upgrade(db_upgrade_v18_queries, sizeof(db_upgrade_v18_queries) / sizeof(db_upgrade_v18_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 18:
+	    ret = db_generic_upgrade(db_upgrade_v19_queries, sizeof(db_upgrade_v19_queries) / sizeof(db_upgrade_v19_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 19:
+	    ret = db_generic_upgrade(db_upgrade_v20_queries, sizeof(db_upgrade_v20_queries) / sizeof(db_upgrade_v20_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
 	    break;
 
 	  default:
@@ -4415,6 +7164,128 @@ db_check_version(void)
 #undef Q_VACUUM
 }
 
+/* WAL mode is persistent, it only needs to be set once on the database */
+static int
+db_set_wal_mode(void)
+{
+#define Q_WAL "PRAGMA journal_mode = WAL;"
+  sqlite3_stmt *stmt;
+  const char *mode;
+  int ret;
+
+  ret = db_blocking_prepare_v2(Q_WAL, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_FATAL, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_finalize(stmt);
+      return -1;
+    }
+
+  /* Not fatal, but readers will now wait on writers and nothing
+   * keyed on the library revision can be cached
+   */
+  mode = (const char *)sqlite3_column_text(stmt, 0);
+  if (!mode || (strcasecmp(mode, "wal") != 0))
+    DPRINTF(E_LOG, L_DB, "Could not switch database to WAL mode, journal mode is %s\n", (mode) ? mode : "unknown");
+  else
+    db_rev_enabled = 1;
+
+  db_stmt_finalize(stmt);
+
+  return 0;
+
+#undef Q_WAL
+}
+
+static const struct db_init_query db_search_drop_queries[] =
+  {
+    { "DROP TRIGGER IF EXISTS update_search_new_file;",    "drop trigger update_search_new_file" },
+    { "DROP TRIGGER IF EXISTS update_search_delete_file;", "drop trigger update_search_delete_file" },
+    { "DROP TRIGGER IF EXISTS update_search_update_file;", "drop trigger update_search_update_file" },
+  };
+
+static const struct db_init_query db_search_build_queries[] =
+  {
+    { TRG_SEARCH_INSERT_FILES, "create trigger update_search_new_file" },
+    { TRG_SEARCH_DELETE_FILES, "create trigger update_search_delete_file" },
+    { TRG_SEARCH_UPDATE_FILES, "create trigger update_search_update_file" },
+
+    { "INSERT INTO files_fts (files_fts) VALUES ('rebuild');", "rebuild search index" },
+  };
+
+/* The search index is optional: without FTS5 trigram support searches
+ * fall back to scanning the files table. Its triggers are (re)created
+ * and the index rebuilt whenever they are missing, i.e. on a new or
+ * upgraded database, or one last opened by a SQLite without FTS5.
+ */
+static int
+db_search_init(void)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name GLOB 'update_search_*';"
+  char *errmsg;
+  int ret;
+
+  db_search_enabled = 0;
+
+  ret = db_exec(T_SEARCH, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "No search index, SQLite lacks FTS5 trigram support: %s\n", errmsg);
+      sqlite3_free(errmsg);
+
+      /* Writes to the files table must not depend on the module */
+      return db_generic_upgrade(db_search_drop_queries, sizeof(db_search_drop_queries) / sizeof(db_search_drop_queries[0]));
+    }
+
+  if (db_get_count(Q_TMPL) != 3)
+    {
+      DPRINTF(E_LOG, L_DB, "Building search index, this may take a while\n");
+
+      ret = db_exec("BEGIN TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not begin search index transaction: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+
+      ret = db_generic_upgrade(db_search_drop_queries, sizeof(db_search_drop_queries) / sizeof(db_search_drop_queries[0]));
+      if (ret == 0)
+	ret = db_generic_upgrade(db_search_build_queries, sizeof(db_search_build_queries) / sizeof(db_search_build_queries[0]));
+
+      if (ret < 0)
+	{
+	  sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	  return -1;
+	}
+
+      ret = db_exec("COMMIT TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not commit search index: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	  return -1;
+	}
+    }
+
+  db_search_enabled = 1;
+
+  return 0;
+
+#undef Q_TMPL
+}
+
 int
 db_init(void)
 {
@@ -4423,6 +7294,14 @@ db_init(void)
   int ret;
 
   db_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_path");
+  db_batch_size = cfg_getint(cfg_getsec(cfg, "general"), "db_batch_size");
+  db_batch_latency = cfg_getint(cfg_getsec(cfg, "general"), "db_batch_latency");
+  db_pragma_synchronous = cfg_getint(cfg_getsec(cfg, "general"), "db_pragma_synchronous");
+  db_pragma_cache_size = cfg_getint(cfg_getsec(cfg, "general"), "db_pragma_cache_size");
+  db_pragma_mmap_size = cfg_getint(cfg_getsec(cfg, "general"), "db_pragma_mmap_size");
+  db_wal_checkpoint = cfg_getint(cfg_getsec(cfg, "general"), "db_wal_checkpoint");
+  db_profile = cfg_getbool(cfg_getsec(cfg, "general"), "db_profile");
+  db_slow_query = cfg_getint(cfg_getsec(cfg, "general"), "db_slow_query");
 
   ret = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
   if (ret != SQLITE_OK)
@@ -4432,13 +7311,6 @@ db_init(void)
       return -1;
     }
 
-  ret = sqlite3_enable_shared_cache(1);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_FATAL, L_DB, "Could not enable SQLite3 shared-cache mode\n");
-      return -1;
-    }
-
   ret = sqlite3_initialize();
   if (ret != SQLITE_OK)
     {
@@ -4450,6 +7322,13 @@ db_init(void)
   if (ret < 0)
     return ret;
 
+  ret = db_set_wal_mode();
+  if (ret < 0)
+    {
+      db_perthread_deinit();
+      return -1;
+    }
+
   ret = db_check_version();
   if (ret < 0)
     {
@@ -4471,6 +7350,10 @@ db_init(void)
 	}
     }
 
+  ret = db_search_init();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Could not set up search index, searches will scan the library\n");
+
   files = db_files_get_count();
   pls = db_pl_get_count();
 
@@ -4484,6 +7367,8 @@ db_init(void)
 void
 db_deinit(void)
 {
+  db_pl_count_flush();
+
   sqlite3_shutdown();
 }
 
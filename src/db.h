@@ -36,6 +36,45 @@ enum query_type {
   Q_GROUPS           = (1 << 7),
   Q_GROUPITEMS       = (1 << 8),
   Q_GROUP_DIRS       = Q_F_BROWSE | (1 << 9),
+  Q_BROWSE_ALBUM_ARTISTS = Q_F_BROWSE | (1 << 10),
+};
+
+/* Kinds of items logged in the changes table */
+enum change_kind {
+  CH_FILE = 0,
+  CH_PL   = 1
+};
+
+#define QC_MAX_KEYS 4
+
+/* Position of a paged query, kept by the caller from one page to the next
+ * so the following page can seek past the last row instead of stepping
+ * over all the rows before it. Zero it before first use, release it with
+ * db_query_cursor_clear().
+ */
+struct query_cursor {
+  /* Query the position belongs to */
+  enum query_type type;
+  enum sort_type sort;
+  int id;
+  int delta;
+  char *filter;
+
+  /* Row index of the next page, -1 if unknown */
+  int pos;
+
+  /* Total number of rows and the library revision it was counted at,
+   * reused by the following pages; -1 if unknown
+   */
+  int results;
+  uint32_t rev;
+
+  /* Sort keys of the last row handed out, text or integer */
+  int nkeys;
+  struct {
+    char *text;
+    int64_t num;
+  } keys[QC_MAX_KEYS];
 };
 
 struct query_params {
@@ -49,11 +88,24 @@ struct query_params {
 
   char *filter;
 
-  /* Query results, filled in by query_start */
+  /* Optional, for Q_ITEMS, Q_PL and Q_PLITEMS: only the rows changed
+   * after this library revision
+   */
+  int delta;
+
+  /* Optional, for Q_ITEMS, Q_PLITEMS and browse queries with a limit */
+  struct query_cursor *cursor;
+
+  /* Query results, filled in once the end of the results is reached */
   int results;
 
   /* Private query context, keep out */
   sqlite3_stmt *stmt;
+  int pos;
+  int start;
+  int end;
+  int keys;
+  uint32_t rev;
   char buf[32];
 };
 
@@ -129,6 +181,13 @@ struct media_file_info {
   char *album_artist;
 
   int64_t songalbumid;
+
+  /* Computed by the database, see daap_sortkey() and daap_sortletter() */
+  char *title_sort;
+  char *artist_sort;
+  char *album_sort;
+  char *album_artist_sort;
+  uint32_t title_letter;
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -189,8 +248,11 @@ struct db_group_info {
 
 #define dbgri_offsetof(field) offsetof(struct db_group_info, field)
 
+/* Strings point into the current result row and are only valid until the
+ * next fetch; integer columns are read natively from the database.
+ */
 struct db_media_file_info {
-  char *id;
+  int64_t id;
   char *path;
   char *fname;
   char *title;
@@ -204,41 +266,46 @@ struct db_media_file_info {
   char *conductor;
   char *grouping;
   char *url;
-  char *bitrate;
-  char *samplerate;
-  char *song_length;
-  char *file_size;
-  char *year;
-  char *track;
-  char *total_tracks;
-  char *disc;
-  char *total_discs;
-  char *bpm;
-  char *compilation;
-  char *rating;
-  char *play_count;
-  char *data_kind;
-  char *item_kind;
+  int64_t bitrate;
+  int64_t samplerate;
+  int64_t song_length;
+  int64_t file_size;
+  int64_t year;
+  int64_t track;
+  int64_t total_tracks;
+  int64_t disc;
+  int64_t total_discs;
+  int64_t bpm;
+  int64_t compilation;
+  int64_t rating;
+  int64_t play_count;
+  int64_t data_kind;
+  int64_t item_kind;
   char *description;
-  char *time_added;
-  char *time_modified;
-  char *time_played;
-  char *db_timestamp;
-  char *disabled;
-  char *sample_count;
+  int64_t time_added;
+  int64_t time_modified;
+  int64_t time_played;
+  int64_t db_timestamp;
+  int64_t disabled;
+  int64_t sample_count;
   char *codectype;
-  char *idx;
-  char *has_video;
-  char *contentrating;
-  char *bits_per_sample;
+  int64_t idx;
+  int64_t has_video;
+  int64_t contentrating;
+  int64_t bits_per_sample;
   char *album_artist;
-  char *media_kind;
-  char *tv_episode_sort;
-  char *tv_season_num;
+  int64_t media_kind;
+  int64_t tv_episode_sort;
+  int64_t tv_season_num;
   char *tv_series_name;
   char *tv_episode_num_str;
   char *tv_network_name;
-  char *songalbumid;
+  int64_t songalbumid;
+  char *title_sort;
+  char *artist_sort;
+  char *album_sort;
+  char *album_artist_sort;
+  int64_t title_letter; /* Index letter of the sort headers, 0 if none */
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
@@ -259,6 +326,35 @@ struct watch_enum {
   sqlite3_stmt *stmt;
 };
 
+/* Path points into the current result row, valid until the next fetch */
+struct file_stamp {
+  uint32_t id;
+  char *path;
+  time_t stamp;
+  int64_t size;
+};
+
+struct file_stamp_enum {
+  /* Private enum context, keep out */
+  sqlite3_stmt *stmt;
+};
+
+/* Latency histogram: bucket i counts runs under 2^(i+1) us, the last
+ * bucket everything slower
+ */
+#define DB_PROFILE_BUCKETS 24
+
+struct db_profile_info {
+  const char *shape;     /* SQL with literals replaced by ? */
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  const uint32_t *hist;  /* DB_PROFILE_BUCKETS entries */
+  const char *plan;      /* plan of the last slow run, or NULL */
+};
+
+typedef void (*db_profile_cb)(struct db_profile_info *dbpi, void *arg);
+
 
 char *
 db_escape_string(const char *str);
@@ -278,6 +374,21 @@ free_pli(struct playlist_info *pli, int content_only);
 void
 db_purge_cruft(time_t ref);
 
+int
+db_scan_batch_begin(void);
+
+int
+db_scan_batch_commit(void);
+
+void
+db_scan_generation_begin(void);
+
+void
+db_scan_generation_end(void);
+
+void
+db_scan_generation_mark(int id);
+
 /* Queries */
 int
 db_query_start(struct query_params *qp);
@@ -285,6 +396,18 @@ db_query_start(struct query_params *qp);
 void
 db_query_end(struct query_params *qp);
 
+char *
+db_query_plan(struct query_params *qp);
+
+int
+db_read_begin(void);
+
+void
+db_read_end(void);
+
+void
+db_query_cursor_clear(struct query_cursor *qc);
+
 int
 db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi);
 
@@ -301,6 +424,9 @@ db_query_fetch_string(struct query_params *qp, char **string);
 int
 db_files_get_count(void);
 
+int
+db_files_get_count_cached(void);
+
 void
 db_files_update_songalbumid(void);
 
@@ -308,7 +434,7 @@ void
 db_file_inc_playcount(int id);
 
 void
-db_file_ping(char *path);
+db_file_ping_byid(int id);
 
 char *
 db_file_path_byid(int id);
@@ -326,11 +452,17 @@ int
 db_file_id_byurl(char *url);
 
 time_t
-db_file_stamp_bypath(char *path);
+db_file_stamp_bypath(char *path, int *id, int64_t *size);
 
 struct media_file_info *
 db_file_fetch_byid(int id);
 
+int
+db_file_fetch_dbmfi_byid(int id, struct db_media_file_info *dbmfi);
+
+void
+db_file_fetch_dbmfi_end(void);
+
 int
 db_file_add(struct media_file_info *mfi);
 
@@ -356,6 +488,9 @@ db_pl_get_count(void);
 void
 db_pl_ping(int id);
 
+struct playlist_info *
+db_pl_fetch_byid(int id);
+
 struct playlist_info *
 db_pl_fetch_bypath(char *path);
 
@@ -371,6 +506,12 @@ db_pl_add_item_bypath(int plid, char *path);
 int
 db_pl_add_item_byid(int plid, int fileid);
 
+int
+db_pl_add_items_bypath(int plid, char **paths, int npaths);
+
+int
+db_pl_add_items_byid(int plid, int *ids, int nids);
+
 void
 db_pl_clear_items(int id);
 
@@ -396,6 +537,24 @@ db_groups_clear(void);
 enum group_type
 db_group_type_byid(int id);
 
+/* Library revision */
+typedef void (*db_library_handler)(void);
+
+int
+db_library_revision_get(void);
+
+void
+db_library_revision_seal(void);
+
+int
+db_changes_horizon(void);
+
+void
+db_library_set_update_handler(db_library_handler handler);
+
+int
+db_changes_fetch_ids(enum change_kind kind, int rev, uint32_t **ids);
+
 /* Remotes */
 int
 db_pairing_add(struct pairing_info *pi);
@@ -456,6 +615,25 @@ db_watch_enum_end(struct watch_enum *we);
 int
 db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd);
 
+/* File stamps */
+int
+db_file_stamp_enum_start(struct file_stamp_enum *fe);
+
+void
+db_file_stamp_enum_end(struct file_stamp_enum *fe);
+
+int
+db_file_stamp_enum_fetch(struct file_stamp_enum *fe, struct file_stamp *fs);
+
+/* Profiling */
+void
+db_profile_enum(db_profile_cb cb, void *arg);
+
+void
+db_stmt_cache_stats(uint64_t *hits, uint64_t *misses);
+
+int
+db_revision(uint32_t *rev);
 
 int
 db_perthread_init(void);
@@ -0,0 +1,1064 @@
+/*
+ * Database benchmark: request latency on the httpd side while the
+ * scanner bulk-loads a library in another thread, or (-m suite) timings
+ * of every query type, sort and typical DAAP filter against a synthetic
+ * library, plus the scanner write paths, in a machine-readable format.
+ * The suite fails if a query plan scans the files table where an index
+ * should be used.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <confuse.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "daap_query.h"
+
+
+/* Latencies are recorded in microseconds */
+struct latency {
+  uint32_t *samples;
+  int count;
+  int size;
+};
+
+static int scan_tracks;
+static int scan_offset;
+static int scan_delay;
+static volatile int scan_done;
+
+/* Synthetic library shape; 0 artists or albums keeps 10 tracks per album
+ * and 10 albums per artist
+ */
+static int lib_artists;
+static int lib_albums;
+static int lib_unicode;
+
+/* Names for the tracks with non-ASCII metadata, lib_unicode percent */
+static const char *unicode_names[] =
+  {
+    "Ærøskøbing", "Ðorđe", "Ñandú", "Ōsaka", "Škoda", "Ünterwegs",
+    "Дмитрий", "Ελένη", "東京事変", "서울", "עברית", "ไทย",
+  };
+
+#define N_UNICODE_NAMES (sizeof(unicode_names) / sizeof(unicode_names[0]))
+
+/* Filters as sent by Remote and iTunes; %s is an artist name */
+static const struct {
+  const char *name;
+  const char *daap;
+} suite_filters[] =
+  {
+    { "music",     "'com.apple.itunes.mediakind:1'" },
+    { "artist",    "'daap.songartist:%s'" },
+    { "browse",    "('com.apple.itunes.mediakind:1','com.apple.itunes.mediakind:32')+'daap.songartist!:'" },
+    { "search",    "('dmap.itemname:*rack 1*','daap.songartist:*rack 1*','daap.songalbum:*rack 1*')" },
+    { "nomatch",   "'dmap.itemname:*zzyzx*'" },
+  };
+
+#define N_SUITE_FILTERS (sizeof(suite_filters) / sizeof(suite_filters[0]))
+
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+synth_artist(int artist, char *buf, size_t len)
+{
+  if ((artist % 100) < lib_unicode)
+    snprintf(buf, len, "%s %d", unicode_names[artist % N_UNICODE_NAMES], artist);
+  else
+    snprintf(buf, len, "Artist %d", artist);
+}
+
+static struct media_file_info *
+synth_mfi(int i)
+{
+  struct media_file_info *mfi;
+  char buf[256];
+  char artist_name[128];
+  int album;
+  int artist;
+
+  mfi = (struct media_file_info *)malloc(sizeof(struct media_file_info));
+  if (!mfi)
+    return NULL;
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  album = (lib_albums > 0) ? i % lib_albums : i / 10;
+  artist = (lib_artists > 0) ? album % lib_artists : album / 10;
+
+  synth_artist(artist, artist_name, sizeof(artist_name));
+
+  snprintf(buf, sizeof(buf), "/bench/%s/Album %d/%02d Track %d.mp3", artist_name, album, i % 10, i);
+  mfi->path = strdup(buf);
+  mfi->fname = strdup(strrchr(buf, '/') + 1);
+
+  if ((i % 100) < lib_unicode)
+    snprintf(buf, sizeof(buf), "%s Track %d", unicode_names[i % N_UNICODE_NAMES], i);
+  else
+    snprintf(buf, sizeof(buf), "Track %d", i);
+  mfi->title = strdup(buf);
+
+  mfi->artist = strdup(artist_name);
+  mfi->album_artist = strdup(artist_name);
+
+  snprintf(buf, sizeof(buf), "Album %d", album);
+  mfi->album = strdup(buf);
+
+  snprintf(buf, sizeof(buf), "Genre %d", i % 20);
+  mfi->genre = strdup(buf);
+
+  snprintf(buf, sizeof(buf), "Composer %d", i % 50);
+  mfi->composer = strdup(buf);
+
+  mfi->type = strdup("mp3");
+  mfi->codectype = strdup("mpeg");
+  mfi->description = strdup("MPEG audio file");
+
+  mfi->track = i % 10 + 1;
+  mfi->disc = 1;
+  mfi->song_length = 180000 + (i % 120) * 1000;
+  mfi->file_size = 5 * 1024 * 1024;
+  mfi->bitrate = 256;
+  mfi->samplerate = 44100;
+  mfi->time_modified = 1000000000 + i;
+  mfi->media_kind = 1;
+
+  return mfi;
+}
+
+/* delay: time spent per track outside of the database, in microseconds,
+ * standing in for metadata extraction
+ */
+static int
+load_tracks(int first, int count, int delay)
+{
+  struct media_file_info *mfi;
+  int i;
+  int ret;
+
+  db_scan_batch_begin();
+
+  for (i = first; i < first + count; i++)
+    {
+      if (delay > 0)
+	usleep(delay);
+
+      mfi = synth_mfi(i);
+      if (!mfi)
+	return -1;
+
+      ret = db_file_add(mfi);
+      free_mfi(mfi, 0);
+
+      if (ret < 0)
+	return -1;
+    }
+
+  db_scan_batch_commit();
+
+  return 0;
+}
+
+static void *
+scan(void *arg)
+{
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_DB, "Scan thread: could not init database\n");
+
+      scan_done = 1;
+      return NULL;
+    }
+
+  load_tracks(scan_offset, scan_tracks, scan_delay);
+
+  db_perthread_deinit();
+
+  scan_done = 1;
+
+  return NULL;
+}
+
+static void
+latency_add(struct latency *l, uint64_t us)
+{
+  uint32_t *s;
+
+  if (l->count == l->size)
+    {
+      l->size = (l->size) ? l->size * 2 : 1024;
+
+      s = (uint32_t *)realloc(l->samples, l->size * sizeof(uint32_t));
+      if (!s)
+	{
+	  l->size = l->count;
+	  return;
+	}
+
+      l->samples = s;
+    }
+
+  l->samples[l->count] = (us > UINT32_MAX) ? UINT32_MAX : us;
+  l->count++;
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+  uint32_t ua = *(const uint32_t *)a;
+  uint32_t ub = *(const uint32_t *)b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static void
+latency_report(const char *phase, struct latency *l, uint64_t elapsed)
+{
+  if (l->count == 0)
+    {
+      printf("%-6s: no requests\n", phase);
+      return;
+    }
+
+  qsort(l->samples, l->count, sizeof(uint32_t), latency_cmp);
+
+  printf("%-6s: %d requests in %.2f s, latency ms p50 %.2f p95 %.2f p99 %.2f max %.2f\n",
+	 phase, l->count, elapsed / 1000000.0,
+	 l->samples[l->count / 2] / 1000.0,
+	 l->samples[(l->count * 95) / 100] / 1000.0,
+	 l->samples[(l->count * 99) / 100] / 1000.0,
+	 l->samples[l->count - 1] / 1000.0);
+}
+
+/* One round of what a client does while browsing: first page of the
+ * song list, artist browse, album groups and the library item count
+ */
+static void
+browse_once(struct latency *l)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  struct db_group_info dbgri;
+  char *str;
+  uint64_t start;
+  int ret;
+
+  start = now_us();
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_ITEMS;
+  qp.sort = S_NAME;
+  qp.idx_type = I_FIRST;
+  qp.limit = 50;
+  ret = db_query_start(&qp);
+  if (ret == 0)
+    while ((db_query_fetch_file(&qp, &dbmfi) == 0) && (dbmfi.id != 0))
+      ; /* EMPTY */
+  db_query_end(&qp);
+  latency_add(l, now_us() - start);
+
+  start = now_us();
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_BROWSE_ARTISTS;
+  ret = db_query_start(&qp);
+  if (ret == 0)
+    while ((db_query_fetch_string(&qp, &str) == 0) && str)
+      ; /* EMPTY */
+  db_query_end(&qp);
+  latency_add(l, now_us() - start);
+
+  start = now_us();
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_GROUPS;
+  qp.idx_type = I_FIRST;
+  qp.limit = 50;
+  ret = db_query_start(&qp);
+  if (ret == 0)
+    while ((db_query_fetch_group(&qp, &dbgri) == 0) && (dbgri.id != 0))
+      ; /* EMPTY */
+  db_query_end(&qp);
+  latency_add(l, now_us() - start);
+
+  start = now_us();
+  db_files_get_count();
+  latency_add(l, now_us() - start);
+}
+
+/* Suite */
+
+static int suite_pl_id;
+static int suite_group_id;
+static int suite_library_id = 1;
+
+/* Queries whose plan wasn't what was expected */
+static int suite_bad_plans;
+
+static const char *sort_names[] = { "none", "name", "album", "artist" };
+
+static const struct {
+  const char *name;
+  enum query_type type;
+  int *id;
+  int sorted;   /* Run with every sort_type */
+  int filtered; /* Filters on the files table apply */
+} suite_queries[] =
+  {
+    { "items",                Q_ITEMS,                NULL,               1, 1 },
+    { "pl",                   Q_PL,                   NULL,               0, 0 },
+    { "plitems_smart",        Q_PLITEMS,              &suite_library_id,  1, 1 },
+    { "plitems_plain",        Q_PLITEMS,              &suite_pl_id,       0, 1 },
+    { "browse_artists",       Q_BROWSE_ARTISTS,       NULL,               0, 1 },
+    { "browse_albums",        Q_BROWSE_ALBUMS,        NULL,               0, 1 },
+    { "browse_genres",        Q_BROWSE_GENRES,        NULL,               0, 1 },
+    { "browse_composers",     Q_BROWSE_COMPOSERS,     NULL,               0, 1 },
+    { "browse_album_artists", Q_BROWSE_ALBUM_ARTISTS, NULL,               0, 1 },
+    { "groups",               Q_GROUPS,               NULL,               0, 1 },
+    { "groupitems",           Q_GROUPITEMS,           &suite_group_id,    0, 0 },
+    { "group_dirs",           Q_GROUP_DIRS,           &suite_group_id,    0, 0 },
+  };
+
+#define N_SUITE_QUERIES (sizeof(suite_queries) / sizeof(suite_queries[0]))
+
+/* Fetches all the rows, returns how many or -1 on error */
+static int
+query_rows(struct query_params *qp)
+{
+  struct db_media_file_info dbmfi;
+  struct db_playlist_info dbpli;
+  struct db_group_info dbgri;
+  char *str;
+  int rows;
+  int ret;
+
+  ret = db_query_start(qp);
+  if (ret < 0)
+    return -1;
+
+  rows = 0;
+  switch (qp->type)
+    {
+      case Q_ITEMS:
+      case Q_PLITEMS:
+      case Q_GROUPITEMS:
+	while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id != 0))
+	  rows++;
+	break;
+
+      case Q_PL:
+	while (((ret = db_query_fetch_pl(qp, &dbpli)) == 0) && dbpli.id)
+	  rows++;
+	break;
+
+      case Q_GROUPS:
+	while (((ret = db_query_fetch_group(qp, &dbgri)) == 0) && dbgri.id)
+	  rows++;
+	break;
+
+      default:
+	while (((ret = db_query_fetch_string(qp, &str)) == 0) && str)
+	  rows++;
+	break;
+    }
+
+  db_query_end(qp);
+
+  return (ret < 0) ? -1 : rows;
+}
+
+/* One line per measurement, tab-separated, times in microseconds:
+ * name runs rows min p50 p95 max
+ * rows is -1 if the operation failed. Resets l for the next measurement.
+ */
+static void
+suite_report(const char *name, struct latency *l, int rows)
+{
+  if (l->count == 0)
+    {
+      printf("%s\t0\t%d\t0\t0\t0\t0\n", name, rows);
+      return;
+    }
+
+  qsort(l->samples, l->count, sizeof(uint32_t), latency_cmp);
+
+  printf("%s\t%d\t%d\t%u\t%u\t%u\t%u\n", name, l->count, rows,
+	 l->samples[0],
+	 l->samples[l->count / 2],
+	 l->samples[(l->count * 95) / 100],
+	 l->samples[l->count - 1]);
+
+  fflush(stdout);
+
+  l->count = 0;
+}
+
+/* True if a step of the plan is a full scan of the files table; steps read
+ * "SCAN f", "SCAN files USING INDEX idx_title" or, with older SQLite,
+ * "SCAN TABLE files AS f"
+ */
+static int
+plan_scans_files(const char *plan)
+{
+  const char *step;
+  const char *table;
+  const char *index;
+  const char *next;
+  size_t len;
+
+  for (step = plan; step; step = strstr(step, "; "))
+    {
+      if (strncmp(step, "; ", 2) == 0)
+	step += 2;
+
+      if (strncmp(step, "SCAN ", 5) != 0)
+	continue;
+
+      table = step + 5;
+      if (strncmp(table, "TABLE ", 6) == 0)
+	table += 6;
+
+      len = strcspn(table, " ;");
+      if (!(((len == 5) && (strncmp(table, "files", 5) == 0)) || ((len == 1) && (table[0] == 'f'))))
+	continue;
+
+      index = strstr(step, "INDEX");
+      next = strstr(step, "; ");
+      if (!index || (next && (index > next)))
+	return 1;
+    }
+
+  return 0;
+}
+
+/* Runs the query through EXPLAIN QUERY PLAN; a full scan of files is only
+ * expected for the unfiltered, unsorted song list, where every row is
+ * wanted anyway
+ */
+static void
+suite_plan_check(const char *name, struct query_params *tmpl)
+{
+  struct query_params qp;
+  char *plan;
+  int scan_ok;
+  int ret;
+
+  qp = *tmpl;
+
+  scan_ok = (qp.type == Q_ITEMS) && (qp.sort == S_NONE) && !qp.filter && (qp.idx_type == I_NONE);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      printf("# %s: could not start query\n", name);
+      suite_bad_plans++;
+      return;
+    }
+
+  plan = db_query_plan(&qp);
+
+  db_query_end(&qp);
+
+  if (!plan)
+    {
+      printf("# %s: no query plan\n", name);
+      suite_bad_plans++;
+      return;
+    }
+
+  if (!scan_ok && plan_scans_files(plan))
+    {
+      printf("# %s: unexpected full scan of files: %s\n", name, plan);
+      suite_bad_plans++;
+    }
+
+  free(plan);
+}
+
+static void
+suite_query(const char *name, struct query_params *tmpl, int runs, struct latency *l)
+{
+  struct query_params qp;
+  uint64_t start;
+  int rows;
+  int i;
+
+  suite_plan_check(name, tmpl);
+
+  rows = -1;
+  for (i = 0; i < runs; i++)
+    {
+      qp = *tmpl;
+
+      start = now_us();
+      rows = query_rows(&qp);
+      latency_add(l, now_us() - start);
+
+      if (rows < 0)
+	break;
+    }
+
+  suite_report(name, l, rows);
+}
+
+static void
+suite_queries_run(char **filters, int runs, struct latency *l)
+{
+  struct query_params qp;
+  char name[128];
+  int q;
+  int f;
+  int sort;
+  int nsorts;
+
+  nsorts = sizeof(sort_names) / sizeof(sort_names[0]);
+
+  for (q = 0; q < N_SUITE_QUERIES; q++)
+    {
+      for (f = -1; f < (int)N_SUITE_FILTERS; f++)
+	{
+	  if ((f >= 0) && (!suite_queries[q].filtered || !filters[f]))
+	    continue;
+
+	  for (sort = 0; sort < ((suite_queries[q].sorted) ? nsorts : 1); sort++)
+	    {
+	      memset(&qp, 0, sizeof(struct query_params));
+	      qp.type = suite_queries[q].type;
+	      qp.sort = sort;
+	      qp.idx_type = I_NONE;
+	      qp.filter = (f >= 0) ? filters[f] : NULL;
+
+	      if (suite_queries[q].id)
+		qp.id = *suite_queries[q].id;
+
+	      snprintf(name, sizeof(name), "query:%s:%s:%s", suite_queries[q].name, sort_names[sort], (f >= 0) ? suite_filters[f].name : "all");
+
+	      suite_query(name, &qp, runs, l);
+	    }
+	}
+    }
+
+  /* What Remote asks for first: a page of the song list */
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_ITEMS;
+  qp.sort = S_NAME;
+  qp.idx_type = I_FIRST;
+  qp.limit = 50;
+
+  suite_query("query:items:name:page", &qp, runs, l);
+}
+
+/* Library writes as done by a bulk scan, timed per operation */
+static int
+suite_writes(int tracks, struct latency *l)
+{
+  struct media_file_info *mfi;
+  char **paths;
+  uint64_t start;
+  int npaths;
+  int i;
+  int ret;
+
+  db_scan_batch_begin();
+
+  for (i = 0; i < tracks; i++)
+    {
+      mfi = synth_mfi(i);
+      if (!mfi)
+	return -1;
+
+      start = now_us();
+      ret = db_file_add(mfi);
+      latency_add(l, now_us() - start);
+
+      free_mfi(mfi, 0);
+
+      if (ret < 0)
+	{
+	  db_scan_batch_commit();
+	  suite_report("write:add", l, -1);
+	  return -1;
+	}
+    }
+
+  db_scan_batch_commit();
+
+  suite_report("write:add", l, tracks);
+
+  /* A plain playlist with every 10th track, for the queries */
+  paths = (char **)malloc((tracks / 10 + 1) * sizeof(char *));
+  if (!paths)
+    return -1;
+
+  npaths = 0;
+  for (i = 0; i < tracks; i += 10)
+    {
+      mfi = synth_mfi(i);
+      if (!mfi)
+	break;
+
+      paths[npaths] = mfi->path;
+      mfi->path = NULL;
+      npaths++;
+
+      free_mfi(mfi, 0);
+    }
+
+  ret = db_pl_add("Bench", "/bench/bench.m3u", &suite_pl_id);
+  if (ret == 0)
+    {
+      start = now_us();
+      ret = db_pl_add_items_bypath(suite_pl_id, paths, npaths);
+      latency_add(l, now_us() - start);
+
+      suite_report("write:pl_add_items", l, ret);
+    }
+
+  for (i = 0; i < npaths; i++)
+    free(paths[i]);
+
+  free(paths);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+/* Rescan: every 10th track updated, all but every 100th seen again,
+ * then the unseen ones purged
+ */
+static void
+suite_rescan(int tracks, struct latency *l)
+{
+  struct media_file_info *mfi;
+  uint64_t start;
+  int before;
+  int id;
+  int i;
+
+  db_scan_batch_begin();
+  db_scan_generation_begin();
+
+  for (i = 0; i < tracks; i += 10)
+    {
+      mfi = synth_mfi(i);
+      if (!mfi)
+	break;
+
+      id = db_file_id_bypath(mfi->path);
+      if (id > 0)
+	{
+	  free(mfi->title);
+	  mfi->title = strdup("Updated");
+	  mfi->id = id;
+	  mfi->db_timestamp = time(NULL);
+
+	  start = now_us();
+	  db_file_update(mfi);
+	  latency_add(l, now_us() - start);
+	}
+
+      free_mfi(mfi, 0);
+    }
+
+  suite_report("write:update", l, tracks / 10);
+
+  for (i = 0; i < tracks; i++)
+    {
+      if ((i % 100) == 99)
+	continue;
+
+      mfi = synth_mfi(i);
+      if (!mfi)
+	break;
+
+      id = db_file_id_bypath(mfi->path);
+      free_mfi(mfi, 0);
+
+      if (id <= 0)
+	continue;
+
+      start = now_us();
+      db_file_ping_byid(id);
+      latency_add(l, now_us() - start);
+    }
+
+  db_scan_batch_commit();
+
+  suite_report("write:ping", l, tracks - tracks / 100);
+
+  before = db_files_get_count();
+
+  /* Everything still there was seen by the generation */
+  start = now_us();
+  db_purge_cruft(time(NULL) + 1);
+  latency_add(l, now_us() - start);
+
+  suite_report("write:purge", l, before - db_files_get_count());
+
+  db_scan_generation_end();
+}
+
+static int
+suite(int tracks, int runs)
+{
+  struct latency l;
+  struct query_params qp;
+  struct db_group_info dbgri;
+  char *filters[N_SUITE_FILTERS];
+  char artist_name[128];
+  char buf[256];
+  uint64_t start;
+  int ret;
+  int i;
+
+  memset(&l, 0, sizeof(struct latency));
+
+  synth_artist(0, artist_name, sizeof(artist_name));
+
+  for (i = 0; i < N_SUITE_FILTERS; i++)
+    {
+      snprintf(buf, sizeof(buf), suite_filters[i].daap, artist_name);
+
+      filters[i] = daap_query_parse_sql(buf);
+      if (!filters[i])
+	DPRINTF(E_LOG, L_MAIN, "Could not parse filter %s, skipping it\n", buf);
+    }
+
+  printf("# tracks %d, artists %d, albums %d, unicode %d%%, runs %d\n", tracks,
+	 lib_artists ? lib_artists : (tracks + 99) / 100,
+	 lib_albums ? lib_albums : (tracks + 9) / 10,
+	 lib_unicode, runs);
+  printf("# name\truns\trows\tmin_us\tp50_us\tp95_us\tmax_us\n");
+
+  ret = suite_writes(tracks, &l);
+  if (ret < 0)
+    goto out;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_GROUPS;
+  qp.idx_type = I_FIRST;
+  qp.limit = 1;
+  ret = db_query_start(&qp);
+  if ((ret == 0) && (db_query_fetch_group(&qp, &dbgri) == 0) && dbgri.id)
+    suite_group_id = atoi(dbgri.id);
+  db_query_end(&qp);
+
+  suite_queries_run(filters, runs, &l);
+
+  for (i = 0; i < runs; i++)
+    {
+      start = now_us();
+      db_files_get_count();
+      latency_add(&l, now_us() - start);
+    }
+
+  suite_report("query:count", &l, db_files_get_count());
+
+  suite_rescan(tracks, &l);
+
+  if (suite_bad_plans > 0)
+    {
+      printf("# %d queries with unexpected plans\n", suite_bad_plans);
+
+      ret = -1;
+      goto out;
+    }
+
+  ret = 0;
+
+ out:
+  for (i = 0; i < N_SUITE_FILTERS; i++)
+    free(filters[i]);
+
+  free(l.samples);
+
+  return ret;
+}
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -c <file>    Use <file> as the configfile\n");
+  printf("  -b <file>    Benchmark database, removed before the run\n");
+  printf("  -p <count>   Tracks in the library before the scan\n");
+  printf("  -n <count>   Tracks added by the concurrent scan\n");
+  printf("  -s <us>      Time spent per scanned track outside of the database\n");
+  printf("  -t <ms>      Duration of the idle phase\n");
+  printf("  -m <mode>    scan (default): latency while scanning;\n");
+  printf("               suite: every query and write path, tab-separated;\n");
+  printf("               fails on query plans missing an index\n");
+  printf("  -r <count>   Runs of each query in the suite\n");
+  printf("  -a <count>   Artists in the library (default: 1 per 100 tracks)\n");
+  printf("  -l <count>   Albums in the library (default: 1 per 10 tracks)\n");
+  printf("  -u <pct>     Share of artists and titles with non-ASCII names\n");
+  printf("\n\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  pthread_t tid;
+  struct latency idle;
+  struct latency busy;
+  char *configfile;
+  char *dbfile;
+  uint64_t start;
+  uint64_t elapsed;
+  int preload;
+  int idle_ms;
+  int runs;
+  int use_suite;
+  int option;
+  int ret;
+
+  configfile = CONFFILE;
+  dbfile = "/tmp/forked-daapd-bench.db";
+  preload = 20000;
+  scan_tracks = 50000;
+  scan_delay = 100;
+  idle_ms = 2000;
+  runs = 5;
+  use_suite = 0;
+
+  while ((option = getopt(argc, argv, "c:b:p:n:s:t:m:r:a:l:u:")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'b':
+	    dbfile = optarg;
+	    break;
+
+	  case 'p':
+	    ret = safe_atoi32(optarg, &preload);
+	    if (ret < 0)
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'n':
+	    ret = safe_atoi32(optarg, &scan_tracks);
+	    if (ret < 0)
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 's':
+	    ret = safe_atoi32(optarg, &scan_delay);
+	    if (ret < 0)
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 't':
+	    ret = safe_atoi32(optarg, &idle_ms);
+	    if (ret < 0)
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'm':
+	    if (strcmp(optarg, "suite") == 0)
+	      use_suite = 1;
+	    else if (strcmp(optarg, "scan") == 0)
+	      use_suite = 0;
+	    else
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'r':
+	    ret = safe_atoi32(optarg, &runs);
+	    if ((ret < 0) || (runs < 1))
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'a':
+	    ret = safe_atoi32(optarg, &lib_artists);
+	    if ((ret < 0) || (lib_artists < 0))
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'l':
+	    ret = safe_atoi32(optarg, &lib_albums);
+	    if ((ret < 0) || (lib_albums < 0))
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'u':
+	    ret = safe_atoi32(optarg, &lib_unicode);
+	    if ((ret < 0) || (lib_unicode < 0) || (lib_unicode > 100))
+	      {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  ret = logger_init(NULL, NULL, E_LOG);
+  if (ret != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+
+      return EXIT_FAILURE;
+    }
+
+  ret = conffile_load(configfile);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Config file errors; please fix your config\n");
+
+      logger_deinit();
+      return EXIT_FAILURE;
+    }
+
+  /* Never touch the real library */
+  cfg_setstr(cfg_getsec(cfg, "general"), "db_path", dbfile);
+  unlink(dbfile);
+
+  ret = db_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Database init failed\n");
+
+      goto out_conffile;
+    }
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Database per-thread init failed\n");
+
+      goto out_db;
+    }
+
+  if (use_suite)
+    {
+      ret = suite(preload, runs);
+      goto out_perthread;
+    }
+
+  start = now_us();
+  ret = load_tracks(0, preload, 0);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Could not load library\n");
+
+      goto out_perthread;
+    }
+  printf("load  : %d tracks in %.2f s\n", preload, (now_us() - start) / 1000000.0);
+
+  memset(&idle, 0, sizeof(struct latency));
+  memset(&busy, 0, sizeof(struct latency));
+
+  start = now_us();
+  while ((elapsed = now_us() - start) < (uint64_t)idle_ms * 1000)
+    browse_once(&idle);
+
+  latency_report("idle", &idle, elapsed);
+
+  scan_offset = preload;
+  scan_done = 0;
+
+  ret = pthread_create(&tid, NULL, scan, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Could not spawn scan thread\n");
+
+      goto out_perthread;
+    }
+
+  start = now_us();
+  while (!scan_done)
+    browse_once(&busy);
+
+  elapsed = now_us() - start;
+
+  pthread_join(tid, NULL);
+
+  latency_report("scan", &busy, elapsed);
+  printf("scan  : %d tracks in %.2f s\n", scan_tracks, elapsed / 1000000.0);
+
+  free(idle.samples);
+  free(busy.samples);
+
+  ret = 0;
+
+ out_perthread:
+  db_perthread_deinit();
+ out_db:
+  db_deinit();
+ out_conffile:
+  conffile_unload();
+  logger_deinit();
+
+  unlink(dbfile);
+
+  return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -200,6 +200,15 @@ fixup_tags(struct media_file_info *mfi)
 }
 
 
+/* A file is unchanged if the library has it with the same size and a
+ * stamp at least as recent as its mtime
+ */
+static int
+file_unchanged(time_t stamp, int64_t dbsize, time_t mtime, off_t size)
+{
+  return ((stamp >= mtime) && (dbsize == size));
+}
+
 static void
 process_media_file(char *file, time_t mtime, off_t size, int compilation)
 {
@@ -207,20 +216,38 @@ process_media_file(char *file, time_t mtime, off_t size, int compilation)
   char *filename;
   char *ext;
   time_t stamp;
+  int64_t dbsize;
+  uint32_t iid;
+  int id;
   int ret;
 
-  stamp = db_file_stamp_bypath(file);
+  /* Unchanged files known to the path index cost no database access */
+  ret = scan_index_get(file, &iid, &stamp, &dbsize);
+  if (ret == 0)
+    {
+      id = iid;
 
-  if (stamp >= mtime)
+      if (file_unchanged(stamp, dbsize, mtime, size))
+	{
+	  db_scan_generation_mark(id);
+	  return;
+	}
+    }
+  else
     {
-      db_file_ping(file);
-      return;
+      stamp = db_file_stamp_bypath(file, &id, &dbsize);
+
+      if (file_unchanged(stamp, dbsize, mtime, size))
+	{
+	  db_file_ping_byid(id);
+	  scan_index_set(file, id, stamp, dbsize);
+	  return;
+	}
     }
 
   memset(&mfi, 0, sizeof(struct media_file_info));
 
-  if (stamp)
-    mfi.id = db_file_id_bypath(file);
+  mfi.id = id;
 
   filename = strrchr(file, '/');
   if (!filename)
@@ -292,9 +319,14 @@ process_media_file(char *file, time_t mtime, off_t size, int compilation)
   unicode_fixup_mfi(&mfi);
 
   if (mfi.id == 0)
-    db_file_add(&mfi);
+    ret = db_file_add(&mfi);
+  else
+    ret = db_file_update(&mfi);
+
+  if (ret == 0)
+    scan_index_set(file, mfi.id, mfi.db_timestamp, size);
   else
-    db_file_update(&mfi);
+    scan_index_remove(file);
 
   free_mfi(&mfi, 1);
 }
@@ -637,6 +669,11 @@ bulk_scan(void)
   playlists = NULL;
   dirstack = NULL;
 
+  db_scan_batch_begin();
+  db_scan_generation_begin();
+
+  scan_index_load();
+
   lib = cfg_getsec(cfg, "library");
 
   ndirs = cfg_size(lib, "directories");
@@ -657,20 +694,34 @@ bulk_scan(void)
       free(deref);
 
       if (scan_exit)
-	return;
+	goto out_commit;
     }
 
   if (playlists)
     process_deferred_playlists();
 
   if (scan_exit)
-    return;
+    goto out_commit;
 
   if (dirstack)
     DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
 
+  db_scan_batch_commit();
+
   DPRINTF(E_DBG, L_SCAN, "Purging old database content\n");
   db_purge_cruft(start);
+  scan_index_purge();
+
+  db_scan_generation_end();
+
+  /* Publish everything this scan changed as a new library revision */
+  db_library_revision_seal();
+
+  return;
+
+ out_commit:
+  db_scan_batch_commit();
+  db_scan_generation_end();
 }
 
 
@@ -723,6 +774,8 @@ filescanner(void *arg)
   if (!scan_exit)
     DPRINTF(E_FATAL, L_SCAN, "Scan event loop terminated ahead of time!\n");
 
+  scan_index_deinit();
+
   db_perthread_deinit();
 
   pthread_exit(NULL);
@@ -744,6 +797,7 @@ process_inotify_dir(struct watch_info *wi, char *path, struct inotify_event *ie)
   if (ie->mask & IN_UNMOUNT)
     {
       db_file_disable_bymatch(path, "", 0);
+      scan_index_remove_bymatch(path);
       db_pl_disable_bymatch(path, "", 0);
     }
 
@@ -805,6 +859,7 @@ process_inotify_dir(struct watch_info *wi, char *path, struct inotify_event *ie)
 	  db_watch_delete_bymatch(path);
 
 	  db_file_disable_bymatch(path, "", 0);
+	  scan_index_remove_bymatch(path);
 	  db_pl_disable_bymatch(path, "", 0);
 	}
     }
@@ -814,6 +869,7 @@ process_inotify_dir(struct watch_info *wi, char *path, struct inotify_event *ie)
       db_watch_mark_bypath(path, path, ie->cookie);
       db_watch_mark_bymatch(path, path, ie->cookie);
       db_file_disable_bymatch(path, path, ie->cookie);
+      scan_index_remove_bymatch(path);
       db_pl_disable_bymatch(path, path, ie->cookie);
     }
 
@@ -856,12 +912,14 @@ process_inotify_file(struct watch_info *wi, char *path, struct inotify_event *ie
   if (ie->mask & IN_DELETE)
     {
       db_file_delete_bypath(path);
+      scan_index_remove(path);
       db_pl_delete_bypath(path);
     }
 
   if (ie->mask & IN_MOVED_FROM)
     {
       db_file_disable_bypath(path, wi->path, ie->cookie);
+      scan_index_remove(path);
       db_pl_disable_bypath(path, wi->path, ie->cookie);
     }
 
@@ -1038,6 +1096,8 @@ inotify_cb(int fd, short event, void *arg)
 
   free(buf);
 
+  db_library_revision_seal();
+
   event_add(&inoev, NULL);
 }
 #endif /* __linux__ */
@@ -1122,6 +1182,7 @@ kqueue_cb(int fd, short event, void *arg)
 
       /* Disable files */
       db_file_disable_bymatch(wi.path, "", 0);
+      scan_index_remove_bymatch(wi.path);
       db_pl_disable_bymatch(wi.path, "", 0);
 
       if (kev.flags & EV_ERROR)
@@ -1221,6 +1282,8 @@ kqueue_cb(int fd, short event, void *arg)
 	DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
     }
 
+  db_library_revision_seal();
+
   event_add(&inoev, NULL);
 }
 #endif /* __FreeBSD__ || __FreeBSD_kernel__ */
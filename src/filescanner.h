@@ -10,6 +10,31 @@ filescanner_init(void);
 void
 filescanner_deinit(void);
 
+/* Path index, see filescanner_index.c */
+int
+scan_index_load(void);
+
+void
+scan_index_deinit(void);
+
+int
+scan_index_get(const char *path, uint32_t *id, time_t *stamp, int64_t *size);
+
+int
+scan_index_lookup(const char *path, uint32_t *id);
+
+void
+scan_index_set(const char *path, uint32_t id, time_t stamp, int64_t size);
+
+void
+scan_index_remove(const char *path);
+
+void
+scan_index_remove_bymatch(const char *path);
+
+void
+scan_index_purge(void);
+
 /* Actual scanners */
 int
 scan_metadata_ffmpeg(char *file, struct media_file_info *mfi);
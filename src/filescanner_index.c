@@ -0,0 +1,648 @@
+/*
+ * In-memory path index for the file scanner
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "logger.h"
+#include "db.h"
+#include "filescanner.h"
+#include "misc.h"
+
+
+/* Maps the path of every enabled file in the library to what the scanner
+ * needs to tell whether the file changed: its id, db_timestamp and size.
+ * It is loaded in one pass over the files table at the start of a bulk
+ * scan, so a rescan only goes to the database for files that changed.
+ *
+ * The index is a cache: a path that isn't in it is looked up in the
+ * database as before, but an entry must never be out of date. Whatever
+ * changes or removes a file in the database updates or removes its entry.
+ *
+ * Entries are stored densely and found through an open-addressed table of
+ * entry numbers with linear probing. Directories are interned, an entry
+ * only keeps its file name; all strings live in one pool.
+ */
+
+#define SLOT_EMPTY      0
+#define SLOT_TOMBSTONE  UINT32_MAX
+
+#define MIN_SLOTS       1024
+
+struct index_entry {
+  uint32_t hash;
+  uint32_t dir;    /* Index in dirs */
+  uint32_t name;   /* Offset of the file name in the pool */
+  uint32_t id;     /* File id, 0 for a free entry */
+  uint32_t gen;    /* Last generation the file was seen in */
+  time_t stamp;
+  int64_t size;
+};
+
+struct index_table {
+  uint32_t *slots; /* Entry number + 1, or SLOT_EMPTY/SLOT_TOMBSTONE */
+  uint32_t nslots;
+  uint32_t used;   /* Slots not empty, tombstones included */
+};
+
+/* Thread: scan (everything here) */
+static struct index_entry *entries;
+static uint32_t nentries;
+static uint32_t entries_size;
+static uint32_t free_entry; /* Entry number + 1 of the first free entry */
+static uint32_t count;
+
+static struct index_table files;
+
+static uint32_t *dirs;      /* Offset of the directory in the pool */
+static uint32_t ndirs;
+static uint32_t dirs_size;
+static struct index_table dirs_table;
+
+static char *pool;
+static size_t pool_len;
+static size_t pool_size;
+
+static uint32_t generation;
+static int loaded;
+
+
+static int
+table_init(struct index_table *t, uint32_t nslots)
+{
+  t->slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+  if (!t->slots)
+    return -1;
+
+  t->nslots = nslots;
+  t->used = 0;
+
+  return 0;
+}
+
+/* Inserts without checking for an existing key */
+static void
+table_put(struct index_table *t, uint32_t hash, uint32_t n)
+{
+  uint32_t i;
+
+  for (i = hash & (t->nslots - 1); ; i = (i + 1) & (t->nslots - 1))
+    {
+      if ((t->slots[i] == SLOT_EMPTY) || (t->slots[i] == SLOT_TOMBSTONE))
+	break;
+    }
+
+  if (t->slots[i] == SLOT_EMPTY)
+    t->used++;
+
+  t->slots[i] = n + 1;
+}
+
+static uint32_t
+pool_add(const char *str, size_t len)
+{
+  char *p;
+  size_t size;
+  uint32_t offset;
+
+  if (pool_len + len + 1 > pool_size)
+    {
+      size = (pool_size) ? pool_size * 2 : 65536;
+      while (pool_len + len + 1 > size)
+	size *= 2;
+
+      if (size > UINT32_MAX)
+	return UINT32_MAX;
+
+      p = (char *)realloc(pool, size);
+      if (!p)
+	return UINT32_MAX;
+
+      pool = p;
+      pool_size = size;
+    }
+
+  offset = pool_len;
+
+  memcpy(pool + pool_len, str, len);
+  pool[pool_len + len] = '\0';
+  pool_len += len + 1;
+
+  return offset;
+}
+
+static int
+dir_match(uint32_t dir, const char *path, size_t len)
+{
+  const char *d;
+
+  d = pool + dirs[dir];
+
+  return ((strncmp(d, path, len) == 0) && (d[len] == '\0'));
+}
+
+static uint32_t
+dir_find(const char *path, size_t len, uint32_t hash)
+{
+  uint32_t i;
+  uint32_t s;
+
+  for (i = hash & (dirs_table.nslots - 1); ; i = (i + 1) & (dirs_table.nslots - 1))
+    {
+      s = dirs_table.slots[i];
+
+      if (s == SLOT_EMPTY)
+	return UINT32_MAX;
+
+      if (dir_match(s - 1, path, len))
+	return s - 1;
+    }
+}
+
+static uint32_t
+dir_intern(const char *path, size_t len)
+{
+  struct index_table t;
+  uint32_t *d;
+  uint32_t hash;
+  uint32_t offset;
+  uint32_t dir;
+  uint32_t i;
+
+  hash = djb_hash((void *)path, len);
+
+  dir = dir_find(path, len, hash);
+  if (dir != UINT32_MAX)
+    return dir;
+
+  /* Directories are never removed, the table only grows */
+  if ((dirs_table.used + 1) * 4 > dirs_table.nslots * 3)
+    {
+      if (table_init(&t, dirs_table.nslots * 2) < 0)
+	return UINT32_MAX;
+
+      for (i = 0; i < ndirs; i++)
+	table_put(&t, djb_hash(pool + dirs[i], strlen(pool + dirs[i])), i);
+
+      free(dirs_table.slots);
+      dirs_table = t;
+    }
+
+  if (ndirs == dirs_size)
+    {
+      d = (uint32_t *)realloc(dirs, (dirs_size * 2) * sizeof(uint32_t));
+      if (!d)
+	return UINT32_MAX;
+
+      dirs = d;
+      dirs_size *= 2;
+    }
+
+  offset = pool_add(path, len);
+  if (offset == UINT32_MAX)
+    return UINT32_MAX;
+
+  dirs[ndirs] = offset;
+  table_put(&dirs_table, hash, ndirs);
+
+  return ndirs++;
+}
+
+/* Returns the slot holding path, or the slot it should go in */
+static uint32_t
+file_find(const char *path, uint32_t hash, int *found)
+{
+  struct index_entry *e;
+  const char *name;
+  uint32_t i;
+  uint32_t s;
+  uint32_t free_slot;
+  size_t dlen;
+
+  *found = 0;
+
+  name = strrchr(path, '/');
+  if (!name)
+    return UINT32_MAX;
+
+  dlen = name - path;
+  name++;
+
+  free_slot = UINT32_MAX;
+  for (i = hash & (files.nslots - 1); ; i = (i + 1) & (files.nslots - 1))
+    {
+      s = files.slots[i];
+
+      if (s == SLOT_EMPTY)
+	return (free_slot != UINT32_MAX) ? free_slot : i;
+
+      if (s == SLOT_TOMBSTONE)
+	{
+	  if (free_slot == UINT32_MAX)
+	    free_slot = i;
+
+	  continue;
+	}
+
+      e = &entries[s - 1];
+      if ((e->hash == hash) && (strcmp(pool + e->name, name) == 0) && dir_match(e->dir, path, dlen))
+	{
+	  *found = 1;
+	  return i;
+	}
+    }
+}
+
+static int
+files_grow(void)
+{
+  struct index_table t;
+  uint32_t nslots;
+  uint32_t i;
+
+  /* Plenty of tombstones: same size, rehashing gets rid of them */
+  nslots = files.nslots;
+  if ((count + 1) * 2 > nslots)
+    nslots *= 2;
+
+  if (table_init(&t, nslots) < 0)
+    return -1;
+
+  for (i = 0; i < nentries; i++)
+    {
+      if (entries[i].id)
+	table_put(&t, entries[i].hash, i);
+    }
+
+  free(files.slots);
+  files = t;
+
+  return 0;
+}
+
+static void
+file_remove_slot(uint32_t slot)
+{
+  uint32_t n;
+
+  n = files.slots[slot] - 1;
+
+  files.slots[slot] = SLOT_TOMBSTONE;
+
+  /* File name stays in the pool until the next load */
+  entries[n].id = 0;
+  entries[n].name = free_entry;
+  free_entry = n + 1;
+
+  count--;
+}
+
+static int
+file_set(const char *path, uint32_t id, time_t stamp, int64_t size)
+{
+  struct index_entry *e;
+  const char *name;
+  uint32_t hash;
+  uint32_t slot;
+  uint32_t n;
+  uint32_t dir;
+  uint32_t offset;
+  int found;
+
+  name = strrchr(path, '/');
+  if (!name)
+    return -1;
+
+  hash = djb_hash((void *)path, strlen(path));
+
+  slot = file_find(path, hash, &found);
+  if (found)
+    {
+      e = &entries[files.slots[slot] - 1];
+
+      e->id = id;
+      e->stamp = stamp;
+      e->size = size;
+      e->gen = generation;
+
+      return 0;
+    }
+
+  if ((files.used + 1) * 4 > files.nslots * 3)
+    {
+      if (files_grow() < 0)
+	return -1;
+
+      slot = file_find(path, hash, &found);
+    }
+
+  dir = dir_intern(path, name - path);
+  if (dir == UINT32_MAX)
+    return -1;
+
+  offset = pool_add(name + 1, strlen(name + 1));
+  if (offset == UINT32_MAX)
+    return -1;
+
+  if (free_entry)
+    {
+      n = free_entry - 1;
+      free_entry = entries[n].name;
+    }
+  else
+    {
+      if (nentries == entries_size)
+	{
+	  e = (struct index_entry *)realloc(entries, (entries_size * 2) * sizeof(struct index_entry));
+	  if (!e)
+	    return -1;
+
+	  entries = e;
+	  entries_size *= 2;
+	}
+
+      n = nentries++;
+    }
+
+  e = &entries[n];
+
+  e->hash = hash;
+  e->dir = dir;
+  e->name = offset;
+  e->id = id;
+  e->stamp = stamp;
+  e->size = size;
+  e->gen = generation;
+
+  if (files.slots[slot] == SLOT_EMPTY)
+    files.used++;
+
+  files.slots[slot] = n + 1;
+  count++;
+
+  return 0;
+}
+
+static size_t
+scan_index_memory(void)
+{
+  return (files.nslots + dirs_table.nslots + dirs_size) * sizeof(uint32_t)
+    + entries_size * sizeof(struct index_entry)
+    + pool_size;
+}
+
+static void
+scan_index_report(const char *what)
+{
+  size_t mem;
+
+  mem = scan_index_memory();
+
+  DPRINTF(E_INFO, L_SCAN, "Path index %s: %u files in %u directories, %zu kB (%" PRIu64 " kB per 100k files)\n",
+	  what, count, ndirs, mem / 1024, (count) ? ((uint64_t)mem * 100000 / count) / 1024 : 0);
+}
+
+
+void
+scan_index_deinit(void)
+{
+  free(files.slots);
+  free(dirs_table.slots);
+  free(entries);
+  free(dirs);
+  free(pool);
+
+  memset(&files, 0, sizeof(struct index_table));
+  memset(&dirs_table, 0, sizeof(struct index_table));
+
+  entries = NULL;
+  nentries = 0;
+  entries_size = 0;
+  free_entry = 0;
+  count = 0;
+
+  dirs = NULL;
+  ndirs = 0;
+  dirs_size = 0;
+
+  pool = NULL;
+  pool_len = 0;
+  pool_size = 0;
+
+  loaded = 0;
+}
+
+/* Starts a new generation: loaded entries are not seen yet */
+int
+scan_index_load(void)
+{
+  struct file_stamp_enum fe;
+  struct file_stamp fs;
+  uint32_t nslots;
+  int nfiles;
+  int ret;
+
+  scan_index_deinit();
+
+  nfiles = db_files_get_count();
+  if (nfiles < 0)
+    nfiles = 0;
+
+  /* Room for the library at less than 3/4 load */
+  for (nslots = MIN_SLOTS; nslots < ((uint32_t)nfiles / 3) * 4 + MIN_SLOTS; nslots *= 2)
+    ; /* EMPTY */
+
+  entries_size = (nfiles > 0) ? nfiles : MIN_SLOTS;
+  dirs_size = MIN_SLOTS;
+
+  entries = (struct index_entry *)malloc(entries_size * sizeof(struct index_entry));
+  dirs = (uint32_t *)malloc(dirs_size * sizeof(uint32_t));
+
+  if (!entries || !dirs || (table_init(&files, nslots) < 0) || (table_init(&dirs_table, MIN_SLOTS) < 0))
+    goto oom;
+
+  ret = db_file_stamp_enum_start(&fe);
+  if (ret < 0)
+    {
+      scan_index_deinit();
+      return -1;
+    }
+
+  while (((ret = db_file_stamp_enum_fetch(&fe, &fs)) == 0) && (fs.id))
+    {
+      if (!fs.path)
+	continue;
+
+      ret = file_set(fs.path, fs.id, fs.stamp, fs.size);
+      if (ret < 0)
+	break;
+    }
+
+  db_file_stamp_enum_end(&fe);
+
+  if (ret < 0)
+    goto oom;
+
+  /* Loaded entries haven't been seen by this scan yet */
+  generation++;
+
+  loaded = 1;
+
+  scan_index_report("loaded");
+
+  return 0;
+
+ oom:
+  DPRINTF(E_LOG, L_SCAN, "Could not load path index, scanning without it\n");
+
+  scan_index_deinit();
+  return -1;
+}
+
+/* Marks the file as seen by the current generation */
+int
+scan_index_get(const char *path, uint32_t *id, time_t *stamp, int64_t *size)
+{
+  struct index_entry *e;
+  uint32_t slot;
+  int found;
+
+  if (!loaded)
+    return -1;
+
+  slot = file_find(path, djb_hash((void *)path, strlen(path)), &found);
+  if (!found)
+    return -1;
+
+  e = &entries[files.slots[slot] - 1];
+
+  e->gen = generation;
+
+  *id = e->id;
+  *stamp = e->stamp;
+  *size = e->size;
+
+  return 0;
+}
+
+/* As scan_index_get(), for resolving playlist entries: the file is not
+ * marked as seen
+ */
+int
+scan_index_lookup(const char *path, uint32_t *id)
+{
+  uint32_t slot;
+  int found;
+
+  if (!loaded)
+    return -1;
+
+  slot = file_find(path, djb_hash((void *)path, strlen(path)), &found);
+  if (!found)
+    return -1;
+
+  *id = entries[files.slots[slot] - 1].id;
+
+  return 0;
+}
+
+void
+scan_index_set(const char *path, uint32_t id, time_t stamp, int64_t size)
+{
+  int ret;
+
+  if (!loaded || (id == 0))
+    return;
+
+  ret = file_set(path, id, stamp, size);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for path index, dropping it\n");
+
+      scan_index_deinit();
+    }
+}
+
+void
+scan_index_remove(const char *path)
+{
+  uint32_t slot;
+  int found;
+
+  if (!loaded)
+    return;
+
+  slot = file_find(path, djb_hash((void *)path, strlen(path)), &found);
+  if (found)
+    file_remove_slot(slot);
+}
+
+/* Removes every file under the directory path */
+void
+scan_index_remove_bymatch(const char *path)
+{
+  const char *d;
+  uint32_t i;
+  size_t len;
+
+  if (!loaded)
+    return;
+
+  len = strlen(path);
+
+  for (i = 0; i < files.nslots; i++)
+    {
+      if ((files.slots[i] == SLOT_EMPTY) || (files.slots[i] == SLOT_TOMBSTONE))
+	continue;
+
+      d = pool + dirs[entries[files.slots[i] - 1].dir];
+
+      if ((strncmp(d, path, len) == 0) && ((d[len] == '\0') || (d[len] == '/')))
+	file_remove_slot(i);
+    }
+}
+
+/* Drops the files not seen by the current generation, once the database
+ * has purged them
+ */
+void
+scan_index_purge(void)
+{
+  uint32_t i;
+
+  if (!loaded)
+    return;
+
+  for (i = 0; i < files.nslots; i++)
+    {
+      if ((files.slots[i] == SLOT_EMPTY) || (files.slots[i] == SLOT_TOMBSTONE))
+	continue;
+
+      if (entries[files.slots[i] - 1].gen != generation)
+	file_remove_slot(i);
+    }
+
+  scan_index_report("after purge");
+}
@@ -270,6 +270,7 @@ static int
 find_track_file(char *location, char *base)
 {
   char *filename;
+  uint32_t id;
   int plen;
   int mfi_id;
 
@@ -287,11 +288,21 @@ find_track_file(char *location, char *base)
   else
     plen -= 1;
 
-  /* Try exact path first */
+  /* Try exact path first, from the path index if it's there */
+  if (scan_index_lookup(location + plen, &id) == 0)
+    {
+      free(location);
+
+      return id;
+    }
+
   filename = m_realpath(location + plen);
   if (filename)
     {
-      mfi_id = db_file_id_bypath(filename);
+      if (scan_index_lookup(filename, &id) == 0)
+	mfi_id = id;
+      else
+	mfi_id = db_file_id_bypath(filename);
 
       free(filename);
 
@@ -598,9 +609,22 @@ process_pl_items(plist_t items, int pl_id)
   avl_node_t *mapnode;
   uint32_t alen;
   uint32_t i;
+  int *ids;
+  int nids;
   int ret;
 
   alen = plist_array_get_size(items);
+  if (alen == 0)
+    return;
+
+  ids = (int *)malloc(alen * sizeof(int));
+  if (!ids)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for playlist items\n");
+      return;
+    }
+
+  nids = 0;
   for (i = 0; i < alen; i++)
     {
       trk = plist_array_get_item(items, i);
@@ -624,10 +648,15 @@ process_pl_items(plist_t items, int pl_id)
 
       map = (struct itml_to_db_map *)mapnode->item;
 
-      ret = db_pl_add_item_byid(pl_id, map->db_id);
-      if (ret < 0)
-	DPRINTF(E_WARN, L_SCAN, "Could not add ID %d to playlist\n", map->db_id);
+      ids[nids] = map->db_id;
+      nids++;
     }
+
+  ret = db_pl_add_items_byid(pl_id, ids, nids);
+  if (ret < nids)
+    DPRINTF(E_WARN, L_SCAN, "Could only add %d of %d items to playlist %d\n", (ret > 0) ? ret : 0, nids, pl_id);
+
+  free(ids);
 }
 
 static int 
@@ -52,8 +52,14 @@ scan_m3u_playlist(char *file)
   char *entry;
   char *filename;
   char *ptr;
+  char **items;
+  char **ptr_items;
   size_t len;
+  uint32_t id;
+  int items_size;
+  int nitems;
   int pl_id;
+  int i;
   int ret;
 
   DPRINTF(E_INFO, L_SCAN, "Processing static playlist: %s\n", file);
@@ -140,6 +146,10 @@ scan_m3u_playlist(char *file)
       return;
     }
 
+  items = NULL;
+  items_size = 0;
+  nitems = 0;
+
   while (fgets(buf, sizeof(buf), fp) != NULL)
     {
       len = strlen(buf);
@@ -183,30 +193,54 @@ scan_m3u_playlist(char *file)
 	  entry = rel_entry;
 	}
 
+      /* Paths in the path index are real paths already */
+      if (scan_index_lookup(entry, &id) == 0)
+	filename = strdup(entry);
+      else
 	filename = m_realpath(entry);
-	if (!filename)
-	  {
-	    DPRINTF(E_WARN, L_SCAN, "Could not determine real path for '%s': %s\n", entry, strerror(errno));
 
-	    continue;
-	  }
+      if (!filename)
+	{
+	  DPRINTF(E_WARN, L_SCAN, "Could not determine real path for '%s': %s\n", entry, strerror(errno));
 
-	ret = db_pl_add_item_bypath(pl_id, filename);
-	if (ret < 0)
-	  DPRINTF(E_WARN, L_SCAN, "Could not add %s to playlist\n", filename);
+	  continue;
+	}
 
-	free(filename);
-    }
+      if (nitems == items_size)
+	{
+	  items_size = (items_size) ? items_size * 2 : 256;
 
-  if (!feof(fp))
-    {
-      DPRINTF(E_LOG, L_SCAN, "Error reading playlist '%s': %s\n", file, strerror(errno));
+	  ptr_items = (char **)realloc(items, items_size * sizeof(char *));
+	  if (!ptr_items)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Out of memory for playlist items\n");
 
-      fclose(fp);
-      return;
+	      free(filename);
+	      break;
+	    }
+
+	  items = ptr_items;
+	}
+
+      items[nitems] = filename;
+      nitems++;
     }
 
+  if (!feof(fp))
+    DPRINTF(E_LOG, L_SCAN, "Error reading playlist '%s': %s\n", file, strerror(errno));
+
   fclose(fp);
 
+  /* Whatever could be read, in one go */
+  ret = db_pl_add_items_bypath(pl_id, items, nitems);
+  if (ret < nitems)
+    DPRINTF(E_WARN, L_SCAN, "Could only add %d of %d entries to playlist '%s'\n", (ret > 0) ? ret : 0, nitems, file);
+
+  for (i = 0; i < nitems; i++)
+    free(items[i]);
+
+  free(items);
+  free(pl_base);
+
   DPRINTF(E_INFO, L_SCAN, "Done processing playlist\n");
 }
@@ -0,0 +1,235 @@
+# Generates a static lookup table with a perfect hash from one table
+# of dmap_fields.def; run with -v table=<name>.
+#
+# Keys are hashed with djb_hash(). The low bits of the hash pick a
+# bucket, and each bucket has a pair of displacements (d0, d1) chosen
+# here so that every key lands in its own slot:
+#   slot = ((hash >> 10) + d0 * ((hash >> 20) | 1) + d1) & (size - 1)
+#
+# Fails if a key is defined twice or if keys can't be told apart by
+# their hash.
+
+function fail(msg)
+{
+  print FILENAME ": " msg > "/dev/stderr"
+  failed = 1
+  exit 1
+}
+
+function djb(s,    h, i)
+{
+  h = 5381
+  for (i = 1; i <= length(s); i++)
+    h = (h * 33 + ord[substr(s, i, 1)]) % 4294967296
+
+  return h
+}
+
+# Tries to place all keys with a table of size slots; returns 1 on success
+function place(size, nbuckets,    i, b, s, k, n, maxn, d0, d1, ok, taken)
+{
+  for (s = 0; s < size; s++)
+    slots[s] = -1
+
+  for (b = 0; b < nbuckets; b++)
+    {
+      bucket_n[b] = 0
+      disp0[b] = 0
+      disp1[b] = 0
+    }
+
+  maxn = 0
+  for (i = 0; i < nkeys; i++)
+    {
+      f1[i] = int(hash[i] / 1024) % size
+      f2[i] = int(hash[i] / 1048576) % size
+      if (f2[i] % 2 == 0)
+	f2[i] = (f2[i] + 1) % size
+
+      b = hash[i] % nbuckets
+      bucket[b, bucket_n[b]++] = i
+      if (bucket_n[b] > maxn)
+	maxn = bucket_n[b]
+    }
+
+  # Largest buckets first, they are the hardest to place
+  for (n = maxn; n > 0; n--)
+    {
+      for (b = 0; b < nbuckets; b++)
+	{
+	  if (bucket_n[b] != n)
+	    continue
+
+	  ok = 0
+	  for (d0 = 0; (d0 < size) && !ok; d0++)
+	    {
+	      for (d1 = 0; (d1 < size) && !ok; d1++)
+		{
+		  ok = 1
+		  for (k = 0; k < n; k++)
+		    {
+		      i = bucket[b, k]
+		      taken[k] = (f1[i] + d0 * f2[i] + d1) % size
+		      if (slots[taken[k]] >= 0)
+			ok = 0
+		      for (s = 0; ok && (s < k); s++)
+			{
+			  if (taken[s] == taken[k])
+			    ok = 0
+			}
+		      if (!ok)
+			break
+		    }
+
+		  if (ok)
+		    {
+		      disp0[b] = d0
+		      disp1[b] = d1
+		    }
+		}
+	    }
+
+	  if (!ok)
+	    return 0
+
+	  for (k = 0; k < n; k++)
+	    slots[taken[k]] = bucket[b, k]
+	}
+    }
+
+  return 1
+}
+
+function ctype(max)
+{
+  return (max < 256) ? "uint8_t" : "uint16_t"
+}
+
+BEGIN {
+  for (i = 1; i < 256; i++)
+    ord[sprintf("%c", i)] = i
+
+  if (table == "")
+    {
+      print "gen_hash.awk: no table given, use -v table=<name>" > "/dev/stderr"
+      failed = 1
+      exit 1
+    }
+
+  nkeys = 0
+  found = 0
+}
+
+/^[ \t]*#/ || /^[ \t]*$/ {
+  next
+}
+
+$1 == "%table" {
+  current = $2
+  if (current == table)
+    {
+      found = 1
+      stype = $3 " " $4
+      keymember = $5
+    }
+  next
+}
+
+current == table {
+  key = $1
+  rest = $0
+  sub(/^[ \t]*[^ \t]+[ \t]+/, "", rest)
+
+  if (key in keyline)
+    fail("duplicate key " key ", lines " keyline[key] " and " FNR)
+  keyline[key] = FNR
+
+  keys[nkeys] = key
+  rests[nkeys] = rest
+  hash[nkeys] = djb(key)
+
+  for (i = 0; i < nkeys; i++)
+    {
+      if (hash[i] == hash[nkeys])
+	fail("hash collision between " keys[i] " and " key)
+    }
+
+  nkeys++
+}
+
+END {
+  if (failed)
+    exit 1
+
+  if (!found || (nkeys == 0))
+    {
+      print "gen_hash.awk: table " table " not found or empty" > "/dev/stderr"
+      exit 1
+    }
+
+  size = 1
+  while (size < nkeys)
+    size *= 2
+
+  nbuckets = 1
+  while (nbuckets * 4 < nkeys)
+    nbuckets *= 2
+
+  # More buckets and slots bring more bits of the hash into play
+  while (!place(size, nbuckets))
+    {
+      if ((size >= 1024) && (nbuckets >= 1024))
+	{
+	  print "gen_hash.awk: could not build a perfect hash for " table > "/dev/stderr"
+	  exit 1
+	}
+
+      if (size < 1024)
+	size *= 2
+      if (nbuckets < 1024)
+	nbuckets *= 2
+    }
+
+  uctable = toupper(table)
+
+  printf "/* Generated from dmap_fields.def by gen_hash.awk, do not edit */\n\n"
+
+  printf "static const %s %s[] =\n  {\n", stype, table
+  for (i = 0; i < nkeys; i++)
+    printf "    { \"%s\", %s },\n", keys[i], rests[i]
+  printf "\n    { NULL }\n  };\n\n"
+
+  printf "#define %s_BUCKETS %d\n", uctable, nbuckets
+  printf "#define %s_SLOTS   %d\n\n", uctable, size
+
+  printf "static const %s %s_disp[%s_BUCKETS][2] =\n  {\n", ctype(size), table, uctable
+  for (b = 0; b < nbuckets; b++)
+    printf "    { %d, %d },\n", disp0[b], disp1[b]
+  printf "  };\n\n"
+
+  # Empty slots point to the terminating entry
+  printf "static const %s %s_slots[%s_SLOTS] =\n  {\n", ctype(nkeys + 1), table, uctable
+  for (s = 0; s < size; s++)
+    {
+      if (s % 16 == 0)
+	printf "    "
+      printf "%d,%s", (slots[s] < 0) ? nkeys : slots[s], ((s % 16 == 15) || (s == size - 1)) ? "\n" : " "
+    }
+  printf "  };\n\n"
+
+  printf "static const %s *\n", stype
+  printf "%s_find(const char *key)\n", table
+  printf "{\n"
+  printf "  const %s *entry;\n", stype
+  printf "  const %s *disp;\n", ctype(size)
+  printf "  uint32_t hash;\n"
+  printf "  uint32_t slot;\n\n"
+  printf "  hash = djb_hash((void *)key, strlen(key));\n\n"
+  printf "  disp = %s_disp[hash & (%s_BUCKETS - 1)];\n", table, uctable
+  printf "  slot = (hash >> 10) + disp[0] * ((hash >> 20) | 1) + disp[1];\n\n"
+  printf "  entry = &%s[%s_slots[slot & (%s_SLOTS - 1)]];\n", table, table, uctable
+  printf "  if (!entry->%s || (strcmp(entry->%s, key) != 0))\n", keymember, keymember
+  printf "    return NULL;\n\n"
+  printf "  return entry;\n"
+  printf "}\n"
+}
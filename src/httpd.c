@@ -78,6 +78,32 @@
 #define STREAM_CHUNK_SIZE (64 * 1024)
 #define WEBFACE_ROOT   DATADIR "/webface/"
 
+struct chunked_ctx {
+  struct evhttp_request *req;
+  struct evbuffer *evbuf;
+  struct evbuffer *outbuf;
+  struct event ev;
+  z_stream strm;
+  int gzip;
+  httpd_chunk_cb cb;
+  void (*free_cb)(void *arg);
+  void *arg;
+};
+
+/* Cached reply, see httpd_cache_send() */
+struct cache_entry {
+  char *key;
+  uint32_t hash;
+
+  uint8_t *body;
+  size_t len;
+  uint8_t *gzbody;
+  size_t gzlen;
+
+  struct cache_entry *next;
+  TAILQ_ENTRY(cache_entry) lru;
+};
+
 struct content_type_map {
   char *ext;
   char *ctype;
@@ -125,6 +151,20 @@ static struct event exitev;
 static struct evhttp *evhttpd;
 static pthread_t tid_httpd;
 
+/* Reply cache, only touched from the httpd thread; holds replies for
+ * cache_rev, the most recently used first in cache_lru
+ */
+#define CACHE_BUCKETS 256
+
+static struct cache_entry *cache[CACHE_BUCKETS];
+static TAILQ_HEAD(cache_lru_head, cache_entry) cache_lru;
+static int cache_entries;
+static size_t cache_size;
+static size_t cache_max;
+static uint32_t cache_rev;
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+
 
 static void
 stream_end(struct stream_ctx *st, int failed)
@@ -605,44 +645,45 @@ httpd_stream_file(struct evhttp_request *req, int id)
 }
 
 /* Thread: httpd */
-void
-httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf)
+static int
+gzip_accepted(struct evhttp_request *req)
 {
-  unsigned char outbuf[128 * 1024];
-  z_stream strm;
-  struct evbuffer *gzbuf;
   const char *param;
-  int flush;
-  int zret;
-  int ret;
-
-  if (!evbuf || (EVBUFFER_LENGTH(evbuf) == 0))
-    {
-      DPRINTF(E_DBG, L_HTTPD, "Not gzipping body-less reply\n");
-
-      goto no_gzip;
-    }
 
   param = evhttp_find_header(req->input_headers, "Accept-Encoding");
   if (!param)
     {
       DPRINTF(E_DBG, L_HTTPD, "Not gzipping; no Accept-Encoding header\n");
 
-      goto no_gzip;
+      return 0;
     }
   else if (!strstr(param, "gzip") && !strstr(param, "*"))
     {
       DPRINTF(E_DBG, L_HTTPD, "Not gzipping; gzip not in Accept-Encoding (%s)\n", param);
 
-      goto no_gzip;
+      return 0;
     }
 
+  return 1;
+}
+
+/* Thread: httpd */
+static struct evbuffer *
+gzip_evbuffer(struct evbuffer *evbuf)
+{
+  unsigned char outbuf[128 * 1024];
+  z_stream strm;
+  struct evbuffer *gzbuf;
+  int flush;
+  int zret;
+  int ret;
+
   gzbuf = evbuffer_new();
   if (!gzbuf)
     {
       DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
 
-      goto no_gzip;
+      return NULL;
     }
 
   strm.zalloc = Z_NULL;
@@ -704,6 +745,36 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
 
   deflateEnd(&strm);
 
+  return gzbuf;
+
+ out_fail_gz:
+  deflateEnd(&strm);
+ out_fail_init:
+  evbuffer_free(gzbuf);
+
+  return NULL;
+}
+
+/* Thread: httpd */
+void
+httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf)
+{
+  struct evbuffer *gzbuf;
+
+  if (!evbuf || (EVBUFFER_LENGTH(evbuf) == 0))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Not gzipping body-less reply\n");
+
+      goto no_gzip;
+    }
+
+  if (!gzip_accepted(req))
+    goto no_gzip;
+
+  gzbuf = gzip_evbuffer(evbuf);
+  if (!gzbuf)
+    goto no_gzip;
+
   evhttp_add_header(req->output_headers, "Content-Encoding", "gzip");
   evhttp_send_reply(req, code, reason, gzbuf);
 
@@ -714,14 +785,508 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
 
   return;
 
- out_fail_gz:
-  deflateEnd(&strm);
- out_fail_init:
-  evbuffer_free(gzbuf);
  no_gzip:
   evhttp_send_reply(req, code, reason, evbuf);
 }
 
+static void
+chunked_free(struct chunked_ctx *cc)
+{
+  if (cc->gzip)
+    deflateEnd(&cc->strm);
+
+  evbuffer_free(cc->outbuf);
+  evbuffer_free(cc->evbuf);
+
+  if (cc->free_cb)
+    cc->free_cb(cc->arg);
+
+  free(cc);
+}
+
+static void
+chunked_end(struct chunked_ctx *cc, int failed)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = cc->req->evcon;
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  if (!failed)
+    evhttp_send_reply_end(cc->req);
+  else if (evcon)
+    {
+      /* The status line is long gone, all we can do is cut the reply short */
+      evhttp_connection_free(evcon);
+    }
+
+  chunked_free(cc);
+}
+
+static void
+chunked_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct chunked_ctx *cc;
+  struct timeval tv;
+  int ret;
+
+  cc = (struct chunked_ctx *)arg;
+
+  evutil_timerclear(&tv);
+  ret = event_add(&cc->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for chunked reply\n");
+
+      chunked_end(cc, 1);
+    }
+}
+
+/* Deflates whatever the producer added so far; zlib holds on to the input
+ * until it has a full block, so most calls produce no output at all
+ */
+static int
+chunked_deflate(struct chunked_ctx *cc, int flush)
+{
+  unsigned char outbuf[STREAM_CHUNK_SIZE];
+  int zret;
+  int ret;
+
+  cc->strm.next_in = EVBUFFER_DATA(cc->evbuf);
+  cc->strm.avail_in = EVBUFFER_LENGTH(cc->evbuf);
+
+  do
+    {
+      cc->strm.next_out = outbuf;
+      cc->strm.avail_out = sizeof(outbuf);
+
+      zret = deflate(&cc->strm, flush);
+      if (zret == Z_STREAM_ERROR)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not deflate data: %s\n", cc->strm.msg);
+
+	  return -1;
+	}
+
+      ret = evbuffer_add(cc->outbuf, outbuf, sizeof(outbuf) - cc->strm.avail_out);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Out of memory adding gzipped data to evbuffer\n");
+
+	  return -1;
+	}
+    }
+  while (cc->strm.avail_out == 0);
+
+  evbuffer_drain(cc->evbuf, EVBUFFER_LENGTH(cc->evbuf));
+
+  if ((flush == Z_FINISH) && (zret != Z_STREAM_END))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Compressed data not finalized!\n");
+
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+chunked_cb(int fd, short event, void *arg)
+{
+  struct chunked_ctx *cc;
+  struct evbuffer *out;
+  struct timeval tv;
+  int more;
+  int ret;
+
+  cc = (struct chunked_ctx *)arg;
+
+  more = cc->cb(cc->evbuf, cc->arg);
+  if (more < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not produce the next part of the reply, dropping connection\n");
+
+      chunked_end(cc, 1);
+      return;
+    }
+
+  if (cc->gzip)
+    {
+      ret = chunked_deflate(cc, (more) ? Z_NO_FLUSH : Z_FINISH);
+      if (ret < 0)
+	{
+	  chunked_end(cc, 1);
+	  return;
+	}
+
+      out = cc->outbuf;
+    }
+  else
+    out = cc->evbuf;
+
+  if (!more)
+    {
+      if (EVBUFFER_LENGTH(out) > 0)
+	evhttp_send_reply_chunk(cc->req, out);
+
+      chunked_end(cc, 0);
+      return;
+    }
+
+  /* Nothing to write yet, go get more data right away */
+  if (EVBUFFER_LENGTH(out) == 0)
+    {
+      evutil_timerclear(&tv);
+      ret = event_add(&cc->ev, &tv);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for chunked reply\n");
+
+	  chunked_end(cc, 1);
+	}
+
+      return;
+    }
+
+  /* Next part gets produced once this one has been written out */
+  evhttp_send_reply_chunk_with_cb(cc->req, out, chunked_resched_cb, cc);
+}
+
+static void
+chunked_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct chunked_ctx *cc;
+
+  cc = (struct chunked_ctx *)arg;
+
+  DPRINTF(E_LOG, L_HTTPD, "Connection failed; stopping chunked reply\n");
+
+  event_del(&cc->ev);
+
+  evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  chunked_free(cc);
+}
+
+/* Thread: httpd */
+int
+httpd_send_reply_chunked(struct evhttp_request *req, int code, const char *reason, httpd_chunk_cb cb, void (*free_cb)(void *arg), void *arg)
+{
+  struct chunked_ctx *cc;
+  struct timeval tv;
+  int zret;
+  int ret;
+
+  /* Without chunked encoding the length must be known beforehand */
+  if ((req->major != 1) || (req->minor != 1))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Not sending chunked reply to HTTP/%d.%d client\n", req->major, req->minor);
+
+      return -1;
+    }
+
+  cc = (struct chunked_ctx *)malloc(sizeof(struct chunked_ctx));
+  if (!cc)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for chunked reply context\n");
+
+      return -1;
+    }
+
+  memset(cc, 0, sizeof(struct chunked_ctx));
+
+  cc->evbuf = evbuffer_new();
+  if (!cc->evbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for chunked reply\n");
+
+      goto out_free_cc;
+    }
+
+  cc->outbuf = evbuffer_new();
+  if (!cc->outbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for chunked reply\n");
+
+      goto out_free_evbuf;
+    }
+
+  cc->gzip = gzip_accepted(req);
+  if (cc->gzip)
+    {
+      cc->strm.zalloc = Z_NULL;
+      cc->strm.zfree = Z_NULL;
+      cc->strm.opaque = Z_NULL;
+
+      zret = deflateInit2(&cc->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      if (zret != Z_OK)
+	{
+	  DPRINTF(E_DBG, L_HTTPD, "zlib setup failed: %s\n", zError(zret));
+
+	  cc->gzip = 0;
+	}
+    }
+
+  cc->req = req;
+  cc->cb = cb;
+  cc->free_cb = free_cb;
+  cc->arg = arg;
+
+  event_set(&cc->ev, -1, EV_TIMEOUT, chunked_cb, cc);
+  event_base_set(evbase_httpd, &cc->ev);
+
+  evutil_timerclear(&tv);
+  ret = event_add(&cc->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not add one-shot event for chunked reply\n");
+
+      goto out_free_outbuf;
+    }
+
+  if (cc->gzip)
+    evhttp_add_header(req->output_headers, "Content-Encoding", "gzip");
+
+  evhttp_send_reply_start(req, code, reason);
+
+  evhttp_connection_set_closecb(req->evcon, chunked_fail_cb, cc);
+
+  return 0;
+
+ out_free_outbuf:
+  if (cc->gzip)
+    deflateEnd(&cc->strm);
+  evbuffer_free(cc->outbuf);
+ out_free_evbuf:
+  evbuffer_free(cc->evbuf);
+ out_free_cc:
+  free(cc);
+
+  return -1;
+}
+
+static size_t
+cache_entry_size(struct cache_entry *ce)
+{
+  return sizeof(struct cache_entry) + strlen(ce->key) + 1 + ce->len + ce->gzlen;
+}
+
+static void
+cache_remove(struct cache_entry *ce)
+{
+  struct cache_entry **pce;
+
+  for (pce = &cache[ce->hash % CACHE_BUCKETS]; *pce != ce; pce = &(*pce)->next)
+    ;
+
+  *pce = ce->next;
+
+  TAILQ_REMOVE(&cache_lru, ce, lru);
+
+  cache_entries--;
+  cache_size -= cache_entry_size(ce);
+
+  free(ce->key);
+  free(ce->body);
+  if (ce->gzbody)
+    free(ce->gzbody);
+  free(ce);
+}
+
+static void
+cache_flush(void)
+{
+  struct cache_entry *ce;
+
+  while ((ce = TAILQ_FIRST(&cache_lru)))
+    cache_remove(ce);
+}
+
+/* Checks the cache still holds replies for the current library revision */
+static int
+cache_check_rev(uint32_t *rev)
+{
+  int ret;
+
+  if (cache_max == 0)
+    return -1;
+
+  ret = db_revision(rev);
+  if (ret < 0)
+    return -1;
+
+  if (*rev != cache_rev)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Library revision %u, flushing %d cached replies\n", *rev, cache_entries);
+
+      cache_flush();
+      cache_rev = *rev;
+    }
+
+  return 0;
+}
+
+/* Thread: httpd */
+int
+httpd_cache_send(struct evhttp_request *req, const char *key, uint32_t *rev)
+{
+  struct cache_entry *ce;
+  struct evbuffer *evbuf;
+  uint32_t hash;
+  int gzip;
+  int ret;
+
+  ret = cache_check_rev(rev);
+  if (ret < 0)
+    return -1;
+
+  hash = djb_hash((void *)key, strlen(key));
+
+  for (ce = cache[hash % CACHE_BUCKETS]; ce; ce = ce->next)
+    {
+      if ((ce->hash == hash) && (strcmp(ce->key, key) == 0))
+	break;
+    }
+
+  if (!ce)
+    {
+      cache_misses++;
+      return -1;
+    }
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for cached reply\n");
+
+      return -1;
+    }
+
+  gzip = (ce->gzbody && gzip_accepted(req));
+  if (gzip)
+    ret = evbuffer_add(evbuf, ce->gzbody, ce->gzlen);
+  else
+    ret = evbuffer_add(evbuf, ce->body, ce->len);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for cached reply\n");
+
+      evbuffer_free(evbuf);
+      return -1;
+    }
+
+  cache_hits++;
+
+  TAILQ_REMOVE(&cache_lru, ce, lru);
+  TAILQ_INSERT_HEAD(&cache_lru, ce, lru);
+
+  DPRINTF(E_DBG, L_HTTPD, "Reply served from cache (%zu bytes%s)\n", EVBUFFER_LENGTH(evbuf), (gzip) ? ", gzipped" : "");
+
+  if (gzip)
+    evhttp_add_header(req->output_headers, "Content-Encoding", "gzip");
+  evhttp_send_reply(req, HTTP_OK, "OK", evbuf);
+
+  evbuffer_free(evbuf);
+
+  return 0;
+}
+
+/* Thread: httpd */
+void
+httpd_send_reply_cache(struct evhttp_request *req, struct evbuffer *evbuf, const char *key, uint32_t rev)
+{
+  struct cache_entry *ce;
+  struct evbuffer *gzbuf;
+  uint32_t cur;
+  size_t size;
+  int ret;
+
+  /* Only replies built entirely from the revision they are keyed on */
+  ret = cache_check_rev(&cur);
+  if ((ret < 0) || (cur != rev) || (EVBUFFER_LENGTH(evbuf) == 0))
+    goto no_cache;
+
+  size = sizeof(struct cache_entry) + strlen(key) + 1 + EVBUFFER_LENGTH(evbuf);
+  if (size > cache_max / 4)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Reply too large for the cache (%zu bytes)\n", EVBUFFER_LENGTH(evbuf));
+
+      goto no_cache;
+    }
+
+  ce = (struct cache_entry *)malloc(sizeof(struct cache_entry));
+  if (!ce)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for cache entry\n");
+
+      goto no_cache;
+    }
+
+  memset(ce, 0, sizeof(struct cache_entry));
+
+  ce->key = strdup(key);
+  ce->body = (uint8_t *)malloc(EVBUFFER_LENGTH(evbuf));
+  if (!ce->key || !ce->body)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for cache entry\n");
+
+      goto out_free_ce;
+    }
+
+  ce->hash = djb_hash((void *)key, strlen(key));
+  ce->len = EVBUFFER_LENGTH(evbuf);
+  memcpy(ce->body, EVBUFFER_DATA(evbuf), ce->len);
+
+  /* Both forms are kept, whatever this client accepts */
+  gzbuf = gzip_evbuffer(evbuf);
+  if (gzbuf)
+    {
+      ce->gzbody = (uint8_t *)malloc(EVBUFFER_LENGTH(gzbuf));
+      if (ce->gzbody)
+	{
+	  ce->gzlen = EVBUFFER_LENGTH(gzbuf);
+	  memcpy(ce->gzbody, EVBUFFER_DATA(gzbuf), ce->gzlen);
+	}
+    }
+
+  size = cache_entry_size(ce);
+  while ((cache_size + size > cache_max) && !TAILQ_EMPTY(&cache_lru))
+    cache_remove(TAILQ_LAST(&cache_lru, cache_lru_head));
+
+  ce->next = cache[ce->hash % CACHE_BUCKETS];
+  cache[ce->hash % CACHE_BUCKETS] = ce;
+  TAILQ_INSERT_HEAD(&cache_lru, ce, lru);
+
+  cache_entries++;
+  cache_size += size;
+
+  if (gzbuf && gzip_accepted(req))
+    {
+      evhttp_add_header(req->output_headers, "Content-Encoding", "gzip");
+      evhttp_send_reply(req, HTTP_OK, "OK", gzbuf);
+
+      evbuffer_drain(evbuf, EVBUFFER_LENGTH(evbuf));
+    }
+  else
+    evhttp_send_reply(req, HTTP_OK, "OK", evbuf);
+
+  if (gzbuf)
+    evbuffer_free(gzbuf);
+
+  return;
+
+ out_free_ce:
+  if (ce->key)
+    free(ce->key);
+  if (ce->body)
+    free(ce->body);
+  free(ce);
+ no_cache:
+  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+}
+
 /* Thread: httpd */
 static int
 path_is_legal(char *path)
@@ -753,21 +1318,12 @@ redirect_to_index(struct evhttp_request *req, char *uri)
 }
 
 /* Thread: httpd */
-static void
-serve_file(struct evhttp_request *req, char *uri)
+static int
+check_admin_auth(struct evhttp_request *req)
 {
-  char *ext;
-  char path[PATH_MAX];
-  char *deref;
-  char *ctype;
   char *passwd;
-  struct evbuffer *evbuf;
-  struct stat sb;
-  int fd;
-  int i;
   int ret;
 
-  /* Check authentication */
   passwd = cfg_getstr(cfg_getsec(cfg, "general"), "admin_password");
   if (passwd)
     {
@@ -775,7 +1331,7 @@ serve_file(struct evhttp_request *req, char *uri)
 
       ret = httpd_basic_auth(req, "admin", passwd, PACKAGE " web interface");
       if (ret != 0)
-	return;
+	return -1;
 
       DPRINTF(E_DBG, L_HTTPD, "Authentication successful\n");
     }
@@ -787,10 +1343,100 @@ serve_file(struct evhttp_request *req, char *uri)
 	  DPRINTF(E_LOG, L_HTTPD, "Remote web interface request denied; no password set\n");
 
 	  evhttp_send_error(req, 403, "Forbidden");
-	  return;
+	  return -1;
 	}
     }
 
+  return 0;
+}
+
+/* Thread: httpd */
+static void
+db_stats_add(struct db_profile_info *dbpi, void *arg)
+{
+  struct evbuffer *evbuf;
+  int i;
+
+  evbuf = (struct evbuffer *)arg;
+
+  evbuffer_add_printf(evbuf, "%s\n", dbpi->shape);
+  evbuffer_add_printf(evbuf, "  count %" PRIu64 ", total %" PRIu64 " ms, avg %" PRIu64 " us, max %" PRIu64 " us\n",
+		      dbpi->count, dbpi->total_us / 1000, dbpi->total_us / dbpi->count, dbpi->max_us);
+
+  evbuffer_add_printf(evbuf, "  latency");
+  for (i = 0; i < DB_PROFILE_BUCKETS; i++)
+    {
+      if (dbpi->hist[i] == 0)
+	continue;
+
+      if (i < DB_PROFILE_BUCKETS - 1)
+	evbuffer_add_printf(evbuf, " <%" PRIu64 "us:%u", (uint64_t)1 << (i + 1), dbpi->hist[i]);
+      else
+	evbuffer_add_printf(evbuf, " >=%" PRIu64 "us:%u", (uint64_t)1 << i, dbpi->hist[i]);
+    }
+  evbuffer_add_printf(evbuf, "\n");
+
+  if (dbpi->plan)
+    evbuffer_add_printf(evbuf, "  plan %s\n", dbpi->plan);
+
+  evbuffer_add_printf(evbuf, "\n");
+}
+
+/* Thread: httpd */
+static void
+serve_db_stats(struct evhttp_request *req)
+{
+  struct evbuffer *evbuf;
+  uint64_t hits;
+  uint64_t misses;
+  int ret;
+
+  ret = check_admin_auth(req);
+  if (ret < 0)
+    return;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not create evbuffer for database stats\n");
+
+      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+      return;
+    }
+
+  db_stmt_cache_stats(&hits, &misses);
+  evbuffer_add_printf(evbuf, "# statement cache (httpd thread): %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+
+  evbuffer_add_printf(evbuf, "# reply cache (revision %u): %" PRIu64 " hits, %" PRIu64 " misses, %d replies, %zu of %zu bytes\n\n",
+		      cache_rev, cache_hits, cache_misses, cache_entries, cache_size, cache_max);
+
+  db_profile_enum(db_stats_add, evbuf);
+
+  evhttp_add_header(req->output_headers, "Content-Type", "text/plain; charset=utf-8");
+
+  evhttp_send_reply(req, HTTP_OK, "OK", evbuf);
+
+  evbuffer_free(evbuf);
+}
+
+/* Thread: httpd */
+static void
+serve_file(struct evhttp_request *req, char *uri)
+{
+  char *ext;
+  char path[PATH_MAX];
+  char *deref;
+  char *ctype;
+  struct evbuffer *evbuf;
+  struct stat sb;
+  int fd;
+  int i;
+  int ret;
+
+  ret = check_admin_auth(req);
+  if (ret < 0)
+    return;
+
   ret = snprintf(path, sizeof(path), "%s%s", WEBFACE_ROOT, uri + 1); /* skip starting '/' */
   if ((ret < 0) || (ret >= sizeof(path)))
     {
@@ -970,6 +1616,14 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
 
   DPRINTF(E_DBG, L_HTTPD, "HTTP request: %s\n", uri);
 
+  /* Matched on the decoded path, without the query string */
+  if ((strcmp(uri, "/stats/db") == 0) || (strcmp(uri, "/stats/db/") == 0))
+    {
+      serve_db_stats(req);
+
+      goto out;
+    }
+
   /* Serve web interface files */
   serve_file(req, uri);
 
@@ -1204,6 +1858,9 @@ httpd_init(void)
 
   httpd_exit = 0;
 
+  cache_max = cfg_getint(cfg_getsec(cfg, "library"), "reply_cache_size") * 1024 * 1024;
+  TAILQ_INIT(&cache_lru);
+
   evbase_httpd = event_base_new();
   if (!evbase_httpd)
     {
@@ -1364,6 +2021,8 @@ httpd_deinit(void)
   dacp_deinit();
   daap_deinit();
 
+  cache_flush();
+
 #ifdef USE_EVENTFD
   close(exit_efd);
 #else
@@ -2,16 +2,41 @@
 #ifndef __HTTPD_H__
 #define __HTTPD_H__
 
+#include <stdint.h>
 #include <event.h>
 #include "evhttp/evhttp.h"
 
 
+/* Produces the next part of a chunked reply into evbuf; returns 1 if more
+ * is to come, 0 once the reply is complete and -1 on error
+ */
+typedef int (*httpd_chunk_cb)(struct evbuffer *evbuf, void *arg);
+
+
 void
 httpd_stream_file(struct evhttp_request *req, int id);
 
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf);
 
+/* Sends the reply as cb produces it, gzipped if the client accepts it;
+ * free_cb(arg) is called once the reply is done with. Returns -1 without
+ * sending anything if the reply can't be chunked, arg is then left to the
+ * caller.
+ */
+int
+httpd_send_reply_chunked(struct evhttp_request *req, int code, const char *reason, httpd_chunk_cb cb, void (*free_cb)(void *arg), void *arg);
+
+/* Reply cache for replies that only change with the library. On a miss,
+ * rev is the library revision the reply is to be built from and stored
+ * with httpd_send_reply_cache().
+ */
+int
+httpd_cache_send(struct evhttp_request *req, const char *key, uint32_t *rev);
+
+void
+httpd_send_reply_cache(struct evhttp_request *req, struct evbuffer *evbuf, const char *key, uint32_t rev);
+
 char *
 httpd_fixup_uri(struct evhttp_request *req);
 
@@ -26,6 +26,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/queue.h>
@@ -36,7 +38,13 @@
 #include <inttypes.h>
 #include <ctype.h>
 
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_EVENTFD)
+# define USE_EVENTFD
+# include <sys/eventfd.h>
+#endif
+
 #include <uninorm.h>
+#include <unistr.h>
 
 #include <event.h>
 #include "evhttp/evhttp.h"
@@ -60,25 +68,49 @@ extern struct event_base *evbase_httpd;
 /* Session timeout in seconds */
 #define DAAP_SESSION_TIMEOUT 1800
 
+/* Amount of DMAP data produced at a time for a streamed song list */
+#define DAAP_STREAM_CHUNK_SIZE (64 * 1024)
+
+/* Compiled meta lists kept around; the cache starts over when full */
+#define META_PLAN_BUCKETS 16
+#define META_PLAN_MAX 64
+
 
 struct uri_map {
   regex_t preg;
   char *regexp;
   void (*handler)(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query);
+  /* Reply only depends on the request and the library */
+  int cacheable;
 };
 
 struct daap_session {
   int id;
 
   struct event timeout;
+
+  /* Position in the last paged song or browse list */
+  struct query_cursor cursor;
 };
 
 struct daap_update_request {
   struct evhttp_request *req;
 
+  /* Revision the client has */
+  int rev;
+
   struct daap_update_request *next;
 };
 
+/* Ids changed since the revision of a delta update; those the query
+ * doesn't return anymore are sent as deleted
+ */
+struct daap_delta {
+  uint32_t *ids;
+  uint8_t *sent;
+  int nids;
+};
+
 struct dmap_field {
   char *tag;
   char *desc;
@@ -86,13 +118,61 @@ struct dmap_field {
 };
 
 struct dmap_field_map {
-  uint32_t hash;
+  char *desc;
   const struct dmap_field *field;
   ssize_t mfi_offset;
   ssize_t pli_offset;
   ssize_t gri_offset;
 };
 
+/* Items a meta list is compiled for */
+enum meta_kind {
+  META_SONGS,
+  META_PLAYLISTS,
+  META_GROUPS
+};
+
+enum meta_op_type {
+  MOP_FIELD = 0,
+  MOP_CODECTYPE,  /* ascd: a string in dbmfi, sent as a literal */
+  MOP_SMART_PL    /* aeSP and aePS, from the playlist type */
+};
+
+/* Value sent instead of the database's when the song is transcoded */
+enum meta_override {
+  MOV_NONE = 0,
+  MOV_TYPE,
+  MOV_BITRATE,
+  MOV_DESCRIPTION
+};
+
+struct meta_op {
+  const struct dmap_field *field;
+  ssize_t offset;
+  enum meta_op_type type;
+  enum meta_override override;
+};
+
+/* A meta list resolved once into the fields to send for each item, in
+ * order, see daap_meta_plan_get()
+ */
+struct meta_plan {
+  enum meta_kind kind;
+  char *meta; /* NULL for all fields */
+  int refs;
+
+  /* Songs: sent ahead of the other fields */
+  int want_mikd;
+  int want_asdk;
+  /* Songs: some fields depend on transcoding */
+  int has_override;
+
+  struct meta_op *ops;
+  int nops;
+
+  struct meta_plan *next;
+};
+
 struct sort_ctx {
   struct evbuffer *headerlist;
   int16_t mshc;
@@ -101,6 +181,25 @@ struct sort_ctx {
   uint32_t misc_mshn;
 };
 
+struct songlist_stream {
+  struct evhttp_request *req;
+  char *tag;
+
+  struct meta_plan *plan;
+  struct sort_ctx *sctx;
+  struct evbuffer *song;
+
+  int header_sent;
+
+  /* Songs of the list and the length of their mlit blocks, as read in one
+   * pass before the reply was started
+   */
+  int *ids;
+  size_t *lens;
+  int nsongs;
+  int next;
+};
+
 
 static const struct dmap_field dmap_abal = { "abal", "daap.browsealbumlisting",                DMAP_TYPE_LIST };
 static const struct dmap_field dmap_abar = { "abar", "daap.browseartistlisting",               DMAP_TYPE_LIST };
@@ -262,261 +361,17 @@ static const struct dmap_field dmap_mupd = { "mupd", "dmap.updateresponse",
 static const struct dmap_field dmap_musr = { "musr", "dmap.serverrevision",                    DMAP_TYPE_UINT };
 static const struct dmap_field dmap_muty = { "muty", "dmap.updatetype",                        DMAP_TYPE_UBYTE };
 
-static struct dmap_field_map dmap_fields[] =
-  {
-    { 0, &dmap_miid,
-      dbmfi_offsetof(id),                 dbpli_offsetof(id),     -1 },
-    { 0, &dmap_minm,
-      dbmfi_offsetof(title),              dbpli_offsetof(title), dbgri_offsetof(itemname) },
-    { 0, &dmap_mikd,
-      dbmfi_offsetof(item_kind),          -1,                    -1 },
-    { 0, &dmap_mper,
-      dbmfi_offsetof(id),                 dbpli_offsetof(id),    dbgri_offsetof(persistentid) },
-    { 0, &dmap_mcon,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mcti,
-      dbmfi_offsetof(id),                 -1,                    -1 },
-    { 0, &dmap_mpco,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mstt,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msts,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mimc,
-      dbmfi_offsetof(total_tracks),       dbpli_offsetof(items), dbgri_offsetof(itemcount) },
-    { 0, &dmap_mctc,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mrco,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mtco,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mlcl,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mlit,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mbcl,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mdcl,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msrv,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msau,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mslr,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mpro,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msal,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msup,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mspi,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msex,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msbr,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msqy,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msix,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msrs,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mstm,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_msdc,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mlog,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mlid,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mupd,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_musr,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_muty,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mudl,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mccr,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mcnm,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mcna,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_mcty,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_apro,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_avdb,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_abro,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_abal,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_abar,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_abcp,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_abgn,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_adbs,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_asal,
-      dbmfi_offsetof(album),              -1,                    -1 },
-    { 0, &dmap_asai,
-      dbmfi_offsetof(songalbumid),        -1,                    -1 },
-    { 0, &dmap_asaa,
-      dbmfi_offsetof(album_artist),       -1,                    dbgri_offsetof(songalbumartist) },
-    { 0, &dmap_asar,
-      dbmfi_offsetof(artist),             -1,                    -1 },
-    { 0, &dmap_asbt,
-      dbmfi_offsetof(bpm),                -1,                    -1 },
-    { 0, &dmap_asbr,
-      dbmfi_offsetof(bitrate),            -1,                    -1 },
-    { 0, &dmap_ascm,
-      dbmfi_offsetof(comment),            -1,                    -1 },
-    { 0, &dmap_asco,
-      dbmfi_offsetof(compilation),        -1,                    -1 },
-    { 0, &dmap_ascp,
-      dbmfi_offsetof(composer),           -1,                    -1 },
-    { 0, &dmap_asda,
-      dbmfi_offsetof(time_added),         -1,                    -1 },
-    { 0, &dmap_asdm,
-      dbmfi_offsetof(time_modified),      -1,                    -1 },
-    { 0, &dmap_asdc,
-      dbmfi_offsetof(total_discs),        -1,                    -1 },
-    { 0, &dmap_asdn,
-      dbmfi_offsetof(disc),               -1,                    -1 },
-    { 0, &dmap_asdb,
-      dbmfi_offsetof(disabled),           -1,                    -1 },
-    { 0, &dmap_aseq,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_asfm,
-      dbmfi_offsetof(type),               -1,                    -1 },
-    { 0, &dmap_asgn,
-      dbmfi_offsetof(genre),              -1,                    -1 },
-    { 0, &dmap_asdt,
-      dbmfi_offsetof(description),        -1,                    -1 },
-    { 0, &dmap_asrv,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_assr,
-      dbmfi_offsetof(samplerate),         -1,                    -1 },
-    { 0, &dmap_assz,
-      dbmfi_offsetof(file_size),          -1,                    -1 },
-    { 0, &dmap_asst,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_assp,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_astm,
-      dbmfi_offsetof(song_length),        -1,                    -1 },
-    { 0, &dmap_astc,
-      dbmfi_offsetof(total_tracks),       -1,                    -1 },
-    { 0, &dmap_astn,
-      dbmfi_offsetof(track),              -1,                    -1 },
-    { 0, &dmap_asur,
-      dbmfi_offsetof(rating),             -1,                    -1 },
-    { 0, &dmap_asyr,
-      dbmfi_offsetof(year),               -1,                    -1 },
-    { 0, &dmap_asdk,
-      dbmfi_offsetof(data_kind),          -1,                    -1 },
-    { 0, &dmap_asul,
-      dbmfi_offsetof(url),                -1,                    -1 },
-    { 0, &dmap_aply,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_abpl,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_apso,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_arsv,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_arif,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeNV,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeSP,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aePS,
-      -1,                                 -1,                    -1 },
-
-    /* iTunes 4.5+ */
-    { 0, &dmap_ascd,
-      dbmfi_offsetof(codectype),          -1,                    -1 },
-    { 0, &dmap_ascs,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_agrp,
-      dbmfi_offsetof(grouping),           -1,                    -1 },
-    { 0, &dmap_aeSV,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aePI,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeCI,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeGI,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeAI,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeSI,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeSF,
-      -1,                                 -1,                    -1 },
-
-    /* iTunes 5.0+ */
-    { 0, &dmap_ascr,
-      dbmfi_offsetof(contentrating),      -1,                    -1 },
-#if 0
-    { 0, DMAP_TYPE_BYTE,    "f" "\x8d" "ch", "dmap.haschildcontainers",
-      -1,                                 -1,                    -1 },
-#endif
-
-    /* iTunes 6.0.2+ */
-    { 0, &dmap_aeHV,
-      dbmfi_offsetof(has_video),          -1,                    -1 },
-
-    /* iTunes 6.0.4+ */
-    { 0, &dmap_msas,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_asct,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_ascn,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aslc,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_asky,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_apsm,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aprm,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aePC,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aePP,
-      -1,                                 -1,                    -1 },
-    { 0, &dmap_aeMK,
-      dbmfi_offsetof(media_kind),         -1,                    -1 },
-    { 0, &dmap_aeMk,
-      dbmfi_offsetof(media_kind),         -1,                    -1 },
-    { 0, &dmap_aeSN,
-      dbmfi_offsetof(tv_series_name),     -1,                    -1 },
-    { 0, &dmap_aeNN,
-      dbmfi_offsetof(tv_network_name),    -1,                    -1 },
-    { 0, &dmap_aeEN,
-      dbmfi_offsetof(tv_episode_num_str), -1,                    -1 },
-    { 0, &dmap_aeES,
-      dbmfi_offsetof(tv_episode_sort),    -1,                    -1 },
-    { 0, &dmap_aeSU,
-      dbmfi_offsetof(tv_season_num),      -1,                    -1 },
-
-    { 0, NULL,
-      -1,                                 -1,                    -1 }
-  };
+/* Generated from dmap_fields.def */
+#include "dmap_fields_hash.h"
 
 /* Default meta tags if not provided in the query */
 static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dmap.containeritemid,dmap.parentcontainerid";
 static char *default_meta_pl = "dmap.itemid,dmap.itemname,dmap.persistentid,com.apple.itunes.smart-playlist";
 static char *default_meta_group = "dmap.itemname,dmap.persistentid,daap.songalbumartist";
 
-static avl_tree_t *dmap_fields_hash;
+/* Compiled meta lists, by kind and meta string */
+static struct meta_plan *meta_plans[META_PLAN_BUCKETS];
+static int meta_plans_count;
 
 /* DAAP session tracking */
 static avl_tree_t *daap_sessions;
@@ -525,6 +380,23 @@ static int next_session_id;
 /* Update requests */
 static struct daap_update_request *update_requests;
 
+/* Library update */
+#ifdef USE_EVENTFD
+static int update_efd;
+#else
+static int update_pipe[2];
+#endif
+static struct event updateev;
+
+/* Song lists of libraries with at least that many tracks are streamed */
+static int songlist_stream_tracks;
+
+/* Cache key and library revision of the request being handled, if its
+ * reply can be cached; see daap_send_reply()
+ */
+static char *reply_cache_key;
+static uint32_t reply_cache_rev;
+
 
 /* Session handling */
 static int
@@ -550,6 +422,7 @@ daap_session_free(void *item)
   s = (struct daap_session *)item;
 
   evtimer_del(&s->timeout);
+  db_query_cursor_clear(&s->cursor);
   free(s);
 }
 
@@ -704,47 +577,299 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
   free(ur);
 }
 
+static void
+update_reply(struct evhttp_request *req, struct evbuffer *evbuf, int rev)
+{
+  int ret;
 
-/* DMAP fields helpers */
+  ret = evbuffer_expand(evbuf, 32);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not expand evbuffer for DAAP update reply\n");
+
+      dmap_send_error(req, "mupd", "Out of memory");
+      return;
+    }
+
+  /* Send back current revision */
+  dmap_add_container(evbuf, "mupd", 24);
+  dmap_add_int(evbuf, "mstt", 200); /* 12 */
+  dmap_add_int(evbuf, "musr", rev); /* 12 */
+
+  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+}
+
+/* Answers the pending update requests once a new library revision has
+ * been sealed
+ */
+static void
+libraryupdate_cb(int fd, short what, void *arg)
+{
+  struct daap_update_request *ur;
+  struct daap_update_request *prev;
+  struct daap_update_request *next;
+  struct evbuffer *evbuf;
+  int rev;
+  int ret;
+
+#ifdef USE_EVENTFD
+  eventfd_t count;
+
+  ret = eventfd_read(update_efd, &count);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not read library update event counter: %s\n", strerror(errno));
+
+      goto readd;
+    }
+#else
+  int dummy;
+
+  read(update_pipe[0], &dummy, sizeof(dummy));
+#endif
+
+  if (!update_requests)
+    goto readd;
+
+  rev = db_library_revision_get();
+
+  prev = NULL;
+  for (ur = update_requests; ur && (rev > 0); ur = next)
+    {
+      next = ur->next;
+
+      if (ur->rev == rev)
+	{
+	  prev = ur;
+	  continue;
+	}
+
+      if (prev)
+	prev->next = next;
+      else
+	update_requests = next;
+
+      DPRINTF(E_DBG, L_DAAP, "Update request: library revision %d -> %d\n", ur->rev, rev);
+
+      if (ur->req->evcon)
+	evhttp_connection_set_closecb(ur->req->evcon, NULL, NULL);
+
+      evbuf = evbuffer_new();
+      if (evbuf)
+	{
+	  update_reply(ur->req, evbuf, rev);
+
+	  evbuffer_free(evbuf);
+	}
+      else
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not allocate evbuffer for DAAP update reply\n");
+
+	  dmap_send_error(ur->req, "mupd", "Out of memory");
+	}
+
+      free(ur);
+    }
+
+ readd:
+  ret = event_add(&updateev, NULL);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DAAP, "Couldn't re-add event for library update\n");
+}
+
+/* Thread: any, whichever sealed the revision */
+static void
+daap_library_update_handler(void)
+{
+  int ret;
+
+#ifdef USE_EVENTFD
+  ret = eventfd_write(update_efd, 1);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DAAP, "Could not send library update event: %s\n", strerror(errno));
+#else
+  int dummy = 42;
+
+  ret = write(update_pipe[1], &dummy, sizeof(dummy));
+  if (ret != sizeof(dummy))
+    DPRINTF(E_LOG, L_DAAP, "Could not write to library update fd: %s\n", strerror(errno));
+#endif
+}
+
+
+/* Delta update helpers */
 static int
-dmap_field_map_compare(const void *aa, const void *bb)
+delta_id_compare(const void *aa, const void *bb)
 {
-  struct dmap_field_map *a = (struct dmap_field_map *)aa;
-  struct dmap_field_map *b = (struct dmap_field_map *)bb;
+  uint32_t a = *(const uint32_t *)aa;
+  uint32_t b = *(const uint32_t *)bb;
 
-  if (a->hash < b->hash)
+  if (a < b)
     return -1;
 
-  if (a->hash > b->hash)
+  if (a > b)
     return 1;
 
   return 0;
 }
 
-static struct dmap_field_map *
-dmap_find_field(uint32_t hash)
+static int
+daap_delta_start(struct daap_delta *dd, enum change_kind kind, int rev)
 {
-  struct dmap_field_map dfm;
-  avl_node_t *node;
+  memset(dd, 0, sizeof(struct daap_delta));
 
-  dfm.hash = hash;
+  if (rev <= 0)
+    return 0;
 
-  node = avl_search(dmap_fields_hash, &dfm);
-  if (!node)
-    return NULL;
+  dd->nids = db_changes_fetch_ids(kind, rev, &dd->ids);
+  if (dd->nids < 0)
+    {
+      dd->nids = 0;
+      return -1;
+    }
+
+  if (dd->nids == 0)
+    return 0;
+
+  dd->sent = (uint8_t *)calloc(dd->nids, sizeof(uint8_t));
+  if (!dd->sent)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for delta update\n");
+
+      free(dd->ids);
+      dd->ids = NULL;
+      dd->nids = 0;
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+daap_delta_sent(struct daap_delta *dd, uint32_t id)
+{
+  uint32_t *p;
+
+  if (dd->nids == 0)
+    return;
+
+  p = (uint32_t *)bsearch(&id, dd->ids, dd->nids, sizeof(uint32_t), delta_id_compare);
+  if (p)
+    dd->sent[p - dd->ids] = 1;
+}
+
+/* With an index window, the changed items outside of it are not in the
+ * reply but are still there; one pass over the query without the window
+ * tells them apart from the deleted ones
+ */
+static int
+daap_delta_unwindowed(struct daap_delta *dd, struct query_params *qp)
+{
+  struct query_params wqp;
+  struct db_media_file_info dbmfi;
+  struct db_playlist_info dbpli;
+  uint32_t id;
+  int ret;
+
+  if ((dd->nids == 0) || ((qp->offset == 0) && (qp->limit < 0)))
+    return 0;
+
+  memset(&wqp, 0, sizeof(struct query_params));
+  wqp.type = qp->type;
+  wqp.idx_type = I_NONE;
+  wqp.sort = S_NONE;
+  wqp.id = qp->id;
+  wqp.filter = qp->filter;
+  wqp.delta = qp->delta;
+
+  ret = db_query_start(&wqp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
+
+      return -1;
+    }
+
+  if (wqp.type == Q_PL)
+    {
+      while (((ret = db_query_fetch_pl(&wqp, &dbpli)) == 0) && (dbpli.id))
+	{
+	  if (safe_atou32(dbpli.id, &id) == 0)
+	    daap_delta_sent(dd, id);
+	}
+    }
+  else
+    {
+      while (((ret = db_query_fetch_file(&wqp, &dbmfi)) == 0) && (dbmfi.id))
+	daap_delta_sent(dd, (uint32_t)dbmfi.id);
+    }
+
+  db_query_end(&wqp);
+
+  return ret;
+}
+
+/* Size of the mudl block, 0 if there's nothing to delete */
+static int
+daap_delta_deleted_size(struct daap_delta *dd)
+{
+  int ndel;
+  int i;
+
+  ndel = 0;
+  for (i = 0; i < dd->nids; i++)
+    {
+      if (!dd->sent[i])
+	ndel++;
+    }
+
+  return (ndel > 0) ? 8 + 12 * ndel : 0;
+}
+
+static void
+daap_delta_add_deleted(struct evbuffer *evbuf, struct daap_delta *dd)
+{
+  int len;
+  int i;
+
+  len = daap_delta_deleted_size(dd);
+  if (len == 0)
+    return;
+
+  dmap_add_container(evbuf, "mudl", len - 8);
 
-  return (struct dmap_field_map *)node->item;
+  for (i = 0; i < dd->nids; i++)
+    {
+      if (!dd->sent[i])
+	dmap_add_int(evbuf, "miid", dd->ids[i]); /* 12 */
+    }
 }
 
 static void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval)
+daap_delta_free(struct daap_delta *dd)
+{
+  if (dd->ids)
+    free(dd->ids);
+
+  if (dd->sent)
+    free(dd->sent);
+}
+
+
+/* DMAP fields helpers */
+union dmap_value {
+  int32_t v_i32;
+  uint32_t v_u32;
+  int64_t v_i64;
+  uint64_t v_u64;
+};
+
+/* Converts strval or intval to the value of df, returns the length of the
+ * encoded field; 0 if the field is left out
+ */
+static int
+dmap_field_prepare(const struct dmap_field *df, char *strval, int64_t intval, union dmap_value *val)
 {
-  union {
-    int32_t v_i32;
-    uint32_t v_u32;
-    int64_t v_i64;
-    uint64_t v_u64;
-  } val;
   int ret;
 
   if (strval && (df->type != DMAP_TYPE_STRING))
@@ -755,120 +880,160 @@ dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval
 	  case DMAP_TYPE_UBYTE:
 	  case DMAP_TYPE_USHORT:
 	  case DMAP_TYPE_UINT:
-	    ret = safe_atou32(strval, &val.v_u32);
+	    ret = safe_atou32(strval, &val->v_u32);
 	    if (ret < 0)
-	      val.v_u32 = 0;
+	      val->v_u32 = 0;
 	    break;
 
 	  case DMAP_TYPE_BYTE:
 	  case DMAP_TYPE_SHORT:
 	  case DMAP_TYPE_INT:
-	    ret = safe_atoi32(strval, &val.v_i32);
+	    ret = safe_atoi32(strval, &val->v_i32);
 	    if (ret < 0)
-	      val.v_i32 = 0;
+	      val->v_i32 = 0;
 	    break;
 
 	  case DMAP_TYPE_ULONG:
-	    ret = safe_atou64(strval, &val.v_u64);
+	    ret = safe_atou64(strval, &val->v_u64);
 	    if (ret < 0)
-	      val.v_u64 = 0;
+	      val->v_u64 = 0;
 	    break;
 
 	  case DMAP_TYPE_LONG:
-	    ret = safe_atoi64(strval, &val.v_i64);
+	    ret = safe_atoi64(strval, &val->v_i64);
 	    if (ret < 0)
-	      val.v_i64 = 0;
+	      val->v_i64 = 0;
 	    break;
 
 	  /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST not handled here */
 	  default:
 	    DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
-	    return;
+	    return 0;
 	}
     }
   else if (!strval && (df->type != DMAP_TYPE_STRING))
     {
+      /* Out of range values are dropped, like they are when parsed from strings */
       switch (df->type)
 	{
 	  case DMAP_TYPE_DATE:
 	  case DMAP_TYPE_UBYTE:
 	  case DMAP_TYPE_USHORT:
 	  case DMAP_TYPE_UINT:
-	    val.v_u32 = intval;
+	    if ((intval < 0) || (intval > UINT32_MAX))
+	      val->v_u32 = 0;
+	    else
+	      val->v_u32 = intval;
 	    break;
 
 	  case DMAP_TYPE_BYTE:
 	  case DMAP_TYPE_SHORT:
 	  case DMAP_TYPE_INT:
-	    val.v_i32 = intval;
+	    if ((intval < INT32_MIN) || (intval > INT32_MAX))
+	      val->v_i32 = 0;
+	    else
+	      val->v_i32 = intval;
 	    break;
 
 	  case DMAP_TYPE_ULONG:
-	    val.v_u64 = intval;
+	    val->v_u64 = intval;
 	    break;
 
 	  case DMAP_TYPE_LONG:
-	    val.v_i64 = intval;
+	    val->v_i64 = intval;
 	    break;
 
 	  /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST not handled here */
 	  default:
 	    DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
-	    return;
+	    return 0;
 	}
     }
 
   switch (df->type)
     {
       case DMAP_TYPE_UBYTE:
-	if (val.v_u32)
-	  dmap_add_char(evbuf, df->tag, val.v_u32);
+	return (val->v_u32) ? 9 : 0;
+
+      case DMAP_TYPE_BYTE:
+	return (val->v_i32) ? 9 : 0;
+
+      case DMAP_TYPE_USHORT:
+	return (val->v_u32) ? 10 : 0;
+
+      case DMAP_TYPE_SHORT:
+	return (val->v_i32) ? 10 : 0;
+
+      case DMAP_TYPE_DATE:
+      case DMAP_TYPE_UINT:
+	return (val->v_u32) ? 12 : 0;
+
+      case DMAP_TYPE_INT:
+	return (val->v_i32) ? 12 : 0;
+
+      case DMAP_TYPE_ULONG:
+	return (val->v_u64) ? 16 : 0;
+
+      case DMAP_TYPE_LONG:
+	return (val->v_i64) ? 16 : 0;
+
+      case DMAP_TYPE_STRING:
+	return (strval) ? 8 + strlen(strval) : 0;
+
+      default:
+	return 0;
+    }
+}
+
+static void
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval)
+{
+  union dmap_value val;
+
+  if (dmap_field_prepare(df, strval, intval, &val) == 0)
+    return;
+
+  switch (df->type)
+    {
+      case DMAP_TYPE_UBYTE:
+	dmap_add_char(evbuf, df->tag, val.v_u32);
 	break;
 
       case DMAP_TYPE_BYTE:
-	if (val.v_i32)
-	  dmap_add_char(evbuf, df->tag, val.v_i32);
+	dmap_add_char(evbuf, df->tag, val.v_i32);
 	break;
 
       case DMAP_TYPE_USHORT:
-	if (val.v_u32)
-	  dmap_add_short(evbuf, df->tag, val.v_u32);
+	dmap_add_short(evbuf, df->tag, val.v_u32);
 	break;
 
       case DMAP_TYPE_SHORT:
-	if (val.v_i32)
-	  dmap_add_short(evbuf, df->tag, val.v_i32);
+	dmap_add_short(evbuf, df->tag, val.v_i32);
 	break;
 
       case DMAP_TYPE_DATE:
       case DMAP_TYPE_UINT:
-	if (val.v_u32)
-	  dmap_add_int(evbuf, df->tag, val.v_u32);
+	dmap_add_int(evbuf, df->tag, val.v_u32);
 	break;
 
       case DMAP_TYPE_INT:
-	if (val.v_i32)
-	  dmap_add_int(evbuf, df->tag, val.v_i32);
+	dmap_add_int(evbuf, df->tag, val.v_i32);
 	break;
 
       case DMAP_TYPE_ULONG:
-	if (val.v_u64)
-	  dmap_add_long(evbuf, df->tag, val.v_u64);
+	dmap_add_long(evbuf, df->tag, val.v_u64);
 	break;
 
       case DMAP_TYPE_LONG:
-	if (val.v_i64)
-	  dmap_add_long(evbuf, df->tag, val.v_i64);
+	dmap_add_long(evbuf, df->tag, val.v_i64);
 	break;
 
       case DMAP_TYPE_STRING:
-	if (strval)
-	  dmap_add_string(evbuf, df->tag, strval);
+	dmap_add_string(evbuf, df->tag, strval);
 	break;
 
-      case DMAP_TYPE_VERSION:
-      case DMAP_TYPE_LIST:
-	return;
+      default:
+	break;
     }
 }
 
@@ -921,29 +1086,36 @@ daap_sort_context_free(struct sort_ctx *ctx)
   free(ctx);
 }
 
+/* Index letter of a string for the sort headers, 0 for the misc category;
+ * same as daap_sortletter() in the database. Only the first character is
+ * decomposed: canonical reordering never moves an ASCII character, so it
+ * gives the first character of the NFD form.
+ */
 static int
-daap_sort_build(struct sort_ctx *ctx, char *str)
+daap_sort_letter(const char *str)
 {
-  uint8_t *ret;
-  size_t len;
-  char fl;
+  ucs4_t decomposition[UC_DECOMPOSITION_MAX_LENGTH];
+  ucs4_t uc;
 
-  len = strlen(str);
-  ret = u8_normalize(UNINORM_NFD, (uint8_t *)str, len, NULL, &len);
-  if (!ret)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Could not normalize string for sort header\n");
+  if (*str == '\0')
+    return 0;
 
-      return -1;
-    }
+  u8_mbtouc(&uc, (const uint8_t *)str, strlen(str));
 
-  fl = ret[0];
-  free(ret);
+  while (uc_canonical_decomposition(uc, decomposition) > 0)
+    uc = decomposition[0];
 
-  if (isascii(fl) && isalpha(fl))
-    {
-      fl = toupper(fl);
+  if (!isascii(uc) || !isalpha(uc))
+    return 0;
 
+  return toupper(uc);
+}
+
+static void
+daap_sort_build(struct sort_ctx *ctx, int fl)
+{
+  if (fl)
+    {
       /* Init */
       if (ctx->mshc == -1)
 	ctx->mshc = fl;
@@ -969,8 +1141,6 @@ daap_sort_build(struct sort_ctx *ctx, char *str)
       /* Non-ASCII, goes to misc category */
       ctx->misc_mshn++;
     }
-
-  return 0;
 }
 
 static int
@@ -1105,64 +1275,382 @@ get_query_params(struct evkeyvalq *query, int *sort_headers, struct query_params
       if (!qp->filter)
 	DPRINTF(E_LOG, L_DAAP, "Ignoring improper DAAP query\n");
     }
+
+  /* Delta update from the client's revision; anything we can't answer
+   * with a delta, like a revision from before a database reset or older
+   * than the change log goes back, gets the full list
+   */
+  qp->delta = 0;
+  param = evhttp_find_header(query, "delta");
+  if (param)
+    {
+      ret = safe_atoi32(param, &qp->delta);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DAAP, "Parameter delta not an integer\n");
+
+      if ((ret < 0) || (qp->delta > db_library_revision_get()) || (qp->delta < db_changes_horizon()))
+	qp->delta = 0;
+    }
 }
 
+/* Meta plans */
 static void
-parse_meta(struct evhttp_request *req, char *tag, const char *param, uint32_t **out_meta, int *out_nmeta)
+daap_meta_plan_release(struct meta_plan *plan)
 {
-  char *ptr;
-  char *meta;
+  plan->refs--;
+  if (plan->refs > 0)
+    return;
+
+  if (plan->meta)
+    free(plan->meta);
+
+  free(plan->ops);
+  free(plan);
+}
+
+static void
+daap_meta_plan_flush(void)
+{
+  struct meta_plan *plan;
+  int i;
+
+  for (i = 0; i < META_PLAN_BUCKETS; i++)
+    {
+      while ((plan = meta_plans[i]))
+	{
+	  meta_plans[i] = plan->next;
+
+	  daap_meta_plan_release(plan);
+	}
+    }
+
+  meta_plans_count = 0;
+}
+
+/* Adds the field to the plan if it can be sent for the kind of item */
+static void
+daap_meta_plan_add(struct meta_plan *plan, const struct dmap_field_map *dfm)
+{
+  struct meta_op *op;
+  ssize_t offset;
+
+  switch (plan->kind)
+    {
+      case META_SONGS:
+	offset = dfm->mfi_offset;
+	break;
+
+      case META_PLAYLISTS:
+	offset = dfm->pli_offset;
+	break;
+
+      case META_GROUPS:
+	offset = dfm->gri_offset;
+	break;
+
+      default:
+	return;
+    }
+
+  /* dmap.itemcount - always added to playlists and groups */
+  if ((plan->kind != META_SONGS) && (dfm->field == &dmap_mimc))
+    return;
+
+  op = &plan->ops[plan->nops];
+  op->field = dfm->field;
+  op->offset = offset;
+  op->type = MOP_FIELD;
+  op->override = MOV_NONE;
+
+  /* com.apple.itunes.smart-playlist - type = 1 AND id != 1 */
+  if ((plan->kind == META_PLAYLISTS) && (dfm->field == &dmap_aeSP))
+    {
+      op->type = MOP_SMART_PL;
+      plan->nops++;
+      return;
+    }
+
+  /* Not in the item's struct */
+  if (offset < 0)
+    return;
+
+  if (plan->kind == META_SONGS)
+    {
+      /* Will be prepended to the list */
+      if (dfm->field == &dmap_mikd)
+	{
+	  plan->want_mikd = 1;
+	  return;
+	}
+      else if (dfm->field == &dmap_asdk)
+	{
+	  plan->want_asdk = 1;
+	  return;
+	}
+
+      /* Here's one exception ... codectype (ascd) is actually an integer */
+      if (dfm->field == &dmap_ascd)
+	op->type = MOP_CODECTYPE;
+
+      switch (offset)
+	{
+	  case dbmfi_offsetof(type):
+	    op->override = MOV_TYPE;
+	    break;
+
+	  case dbmfi_offsetof(bitrate):
+	    op->override = MOV_BITRATE;
+	    break;
+
+	  case dbmfi_offsetof(description):
+	    op->override = MOV_DESCRIPTION;
+	    break;
+
+	  default:
+	    break;
+	}
+
+      if ((op->type == MOP_FIELD) && (op->override != MOV_NONE))
+	plan->has_override = 1;
+    }
+
+  plan->nops++;
+}
+
+static struct meta_plan *
+daap_meta_plan_compile(enum meta_kind kind, const char *param)
+{
+  struct meta_plan *plan;
+  const struct dmap_field_map *dfm;
   char *metastr;
-  uint32_t *hashes;
+  char *meta;
+  char *ptr;
   int nmeta;
   int i;
 
-  *out_nmeta = -1;
+  plan = (struct meta_plan *)malloc(sizeof(struct meta_plan));
+  if (!plan)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for meta plan\n");
+
+      return NULL;
+    }
+
+  memset(plan, 0, sizeof(struct meta_plan));
+
+  plan->kind = kind;
+  plan->refs = 1;
+
+  if (param)
+    {
+      plan->meta = strdup(param);
+
+      nmeta = 1;
+      for (ptr = strchr(param, ','); ptr; ptr = strchr(ptr + 1, ','))
+	nmeta++;
+    }
+  else
+    {
+      for (nmeta = 0; dmap_fields[nmeta].field; nmeta++)
+	;
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Asking for %d meta tags\n", nmeta);
+
+  plan->ops = (struct meta_op *)malloc(nmeta * sizeof(struct meta_op));
+  if (!plan->ops || (param && !plan->meta))
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for meta plan\n");
+
+      goto oom;
+    }
+
+  /* No specific meta tags requested, send out everything */
+  if (!param)
+    {
+      for (i = 0; i < nmeta; i++)
+	daap_meta_plan_add(plan, &dmap_fields[i]);
+
+      return plan;
+    }
 
   metastr = strdup(param);
   if (!metastr)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not duplicate meta parameter; out of memory\n");
 
-      dmap_send_error(req, tag, "Out of memory");
-      return;
+      goto oom;
     }
 
-  nmeta = 1;
-  ptr = metastr;
-  while ((ptr = strchr(ptr + 1, ',')))
-    nmeta++;
+  i = 0;
+  for (meta = strtok_r(metastr, ",", &ptr); meta; meta = strtok_r(NULL, ",", &ptr))
+    {
+      i++;
 
-  DPRINTF(E_DBG, L_DAAP, "Asking for %d meta tags\n", nmeta);
+      dfm = dmap_fields_find(meta);
+      if (!dfm)
+	{
+	  DPRINTF(E_WARN, L_DAAP, "Could not find requested meta field (%d)\n", i);
+	  continue;
+	}
+
+      daap_meta_plan_add(plan, dfm);
+    }
+
+  free(metastr);
+
+  DPRINTF(E_DBG, L_DAAP, "Compiled %d meta tags into %d fields\n", i, plan->nops);
 
-  hashes = (uint32_t *)malloc((nmeta + 1) * sizeof(uint32_t));
-  if (!hashes)
+  return plan;
+
+ oom:
+  daap_meta_plan_release(plan);
+
+  return NULL;
+}
+
+/* Returns the compiled meta list param for the kind of item, NULL param
+ * meaning all fields. Compiled lists are cached, as clients send the same
+ * few over and over. Release with daap_meta_plan_release().
+ */
+static struct meta_plan *
+daap_meta_plan_get(enum meta_kind kind, const char *param)
+{
+  struct meta_plan *plan;
+  uint32_t hash;
+
+  hash = ((param) ? djb_hash((void *)param, strlen(param)) : 0) + kind;
+  hash %= META_PLAN_BUCKETS;
+
+  for (plan = meta_plans[hash]; plan; plan = plan->next)
     {
-      DPRINTF(E_LOG, L_DAAP, "Could not allocate meta array; out of memory\n");
+      if (plan->kind != kind)
+	continue;
 
-      dmap_send_error(req, tag, "Out of memory");
+      if ((plan->meta && param && (strcmp(plan->meta, param) == 0))
+	  || (!plan->meta && !param))
+	break;
+    }
 
-      free(metastr);
-      return;
+  if (!plan)
+    {
+      plan = daap_meta_plan_compile(kind, param);
+      if (!plan)
+	return NULL;
+
+      if (meta_plans_count >= META_PLAN_MAX)
+	daap_meta_plan_flush();
+
+      plan->next = meta_plans[hash];
+      meta_plans[hash] = plan;
+      meta_plans_count++;
+    }
+
+  plan->refs++;
+
+  return plan;
+}
+
+static int
+query_param_compare(const void *aa, const void *bb)
+{
+  const struct evkeyval *a;
+  const struct evkeyval *b;
+  int ret;
+
+  a = *(const struct evkeyval **)aa;
+  b = *(const struct evkeyval **)bb;
+
+  ret = strcmp(a->key, b->key);
+  if (ret != 0)
+    return ret;
+
+  return strcmp(a->value, b->value);
+}
+
+/* Reply cache key: the URI with its parameters in a fixed order, minus the
+ * session-id, plus the headers transcode_needed() looks at. The meta list
+ * keeps its order, it's the order of the fields in the reply.
+ */
+static char *
+daap_cache_key(struct evhttp_request *req, char **uri, struct evkeyvalq *query)
+{
+  struct evbuffer *keybuf;
+  struct evkeyval *param;
+  struct evkeyval **params;
+  const char *header;
+  char *key;
+  int nparams;
+  int i;
+
+  nparams = 0;
+  TAILQ_FOREACH(param, query, next)
+    nparams++;
+
+  params = (struct evkeyval **)malloc((nparams + 1) * sizeof(struct evkeyval *));
+  if (!params)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for cache key\n");
+
+      return NULL;
     }
-  memset(hashes, 0, (nmeta + 1) * sizeof(uint32_t));
 
-  meta = strtok_r(metastr, ",", &ptr);
-  for (i = 0; i < nmeta; i++)
+  nparams = 0;
+  TAILQ_FOREACH(param, query, next)
     {
-      hashes[i] = djb_hash(meta, strlen(meta));
+      if (strcmp(param->key, "session-id") != 0)
+	params[nparams++] = param;
+    }
 
-      meta = strtok_r(NULL, ",", &ptr);
-      if (!meta)
-	break;
+  qsort(params, nparams, sizeof(struct evkeyval *), query_param_compare);
+
+  keybuf = evbuffer_new();
+  if (!keybuf)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not create evbuffer for cache key\n");
+
+      free(params);
+      return NULL;
     }
 
-  DPRINTF(E_DBG, L_DAAP, "Found %d meta tags\n", nmeta);
+  for (i = 0; uri[i]; i++)
+    evbuffer_add_printf(keybuf, "/%s", uri[i]);
 
-  *out_nmeta = nmeta;
-  *out_meta = hashes;
+  for (i = 0; i < nparams; i++)
+    evbuffer_add_printf(keybuf, "%c%s=%s", (i == 0) ? '?' : '&', params[i]->key, params[i]->value);
 
-  free(metastr);
+  free(params);
+
+  header = evhttp_find_header(req->input_headers, "User-Agent");
+  evbuffer_add_printf(keybuf, "\n%s", (header) ? header : "");
+
+  header = evhttp_find_header(req->input_headers, "Accept-Codecs");
+  evbuffer_add_printf(keybuf, "\n%s", (header) ? header : "");
+
+  key = (char *)malloc(EVBUFFER_LENGTH(keybuf) + 1);
+  if (key)
+    {
+      memcpy(key, EVBUFFER_DATA(keybuf), EVBUFFER_LENGTH(keybuf));
+      key[EVBUFFER_LENGTH(keybuf)] = '\0';
+    }
+  else
+    DPRINTF(E_LOG, L_DAAP, "Out of memory for cache key\n");
+
+  evbuffer_free(keybuf);
+
+  return key;
+}
+
+/* Sends a successful reply, storing it in the reply cache if the request
+ * allows it
+ */
+static void
+daap_send_reply(struct evhttp_request *req, struct evbuffer *evbuf)
+{
+  if (reply_cache_key)
+    httpd_send_reply_cache(req, evbuf, reply_cache_key, reply_cache_rev);
+  else
+    httpd_send_reply(req, HTTP_OK, "OK", evbuf);
 }
 
 
@@ -1366,7 +1854,7 @@ daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   struct daap_session *s;
   struct daap_update_request *ur;
   const char *param;
-  int current_rev = 2;
+  int current_rev;
   int reqd_rev;
   int ret;
 
@@ -1392,24 +1880,21 @@ daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
       return;
     }
 
-  if (reqd_rev == 1) /* Or revision is not valid */
+  current_rev = db_library_revision_get();
+  if (current_rev < 0)
     {
-      ret = evbuffer_expand(evbuf, 32);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Could not expand evbuffer for DAAP update reply\n");
-
-	  dmap_send_error(req, "mupd", "Out of memory");
-	  return;
-	}
-
-      /* Send back current revision */
-      dmap_add_container(evbuf, "mupd", 24);
-      dmap_add_int(evbuf, "mstt", 200);         /* 12 */
-      dmap_add_int(evbuf, "musr", current_rev); /* 12 */
+      DPRINTF(E_LOG, L_DAAP, "Could not get library revision\n");
 
-      httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+      dmap_send_error(req, "mupd", "Could not get library revision");
+      return;
+    }
 
+  /* Revision 1 on first contact; any other revision but the current one
+   * is out of date, or from before a database reset
+   */
+  if (reqd_rev != current_rev)
+    {
+      update_reply(req, evbuf, current_rev);
       return;
     }
 
@@ -1423,94 +1908,518 @@ daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
       return;
     }
 
-  /* NOTE: we may need to keep reqd_rev in there too */
   ur->req = req;
+  ur->rev = reqd_rev;
+
+  ur->next = update_requests;
+  update_requests = ur;
+
+  /* If the connection fails before we have an update to push out
+   * to the client, we need to know.
+   */
+  evhttp_connection_set_closecb(req->evcon, update_fail_cb, ur);
+}
+
+static void
+daap_reply_activity(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
+{
+  /* That's so nice, thanks for letting us know */
+  evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", evbuf);
+}
+
+static void
+daap_reply_dblist(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
+{
+  struct daap_session *s;
+  cfg_t *lib;
+  char *name;
+  int namelen;
+  int count;
+  int ret;
+
+  s = daap_session_find(req, query, evbuf);
+  if (!s)
+    return;
+
+  lib = cfg_getsec(cfg, "library");
+  name = cfg_getstr(lib, "name");
+  namelen = strlen(name);
+
+  ret = evbuffer_expand(evbuf, 129 + namelen);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not expand evbuffer for DAAP dblist reply\n");
+
+      dmap_send_error(req, "avdb", "Out of memory");
+      return;
+    }
+
+  dmap_add_container(evbuf, "avdb", 121 + namelen);
+  dmap_add_int(evbuf, "mstt", 200);     /* 12 */
+  dmap_add_char(evbuf, "muty", 0);      /* 9 */
+  dmap_add_int(evbuf, "mtco", 1);       /* 12 */
+  dmap_add_int(evbuf, "mrco", 1);       /* 12 */
+  dmap_add_container(evbuf, "mlcl", 68 + namelen);
+  dmap_add_container(evbuf, "mlit", 60 + namelen);
+  dmap_add_int(evbuf, "miid", 1);       /* 12 */
+  dmap_add_long(evbuf, "mper", 1);      /* 16 */
+  dmap_add_string(evbuf, "minm", name); /* 8 + namelen */
+
+  count = db_files_get_count();
+  dmap_add_int(evbuf, "mimc", count); /* 12 */
+
+  count = db_pl_get_count();
+  dmap_add_int(evbuf, "mctc", count); /* 12 */
+
+  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+}
+
+/* Gets the value of op for the current song, returns 0 if the field is left out */
+static int
+daap_songlist_value(struct meta_op *op, struct db_media_file_info *dbmfi, int transcode, char **strval, int64_t *intval)
+{
+  /* Strings are strings, everything else is an integer in dbmfi */
+  if (op->field->type == DMAP_TYPE_STRING)
+    {
+      *strval = *(char **) ((char *)dbmfi + op->offset);
+
+      if (!*strval || (**strval == '\0'))
+	return 0;
+
+      *intval = 0;
+    }
+  else
+    {
+      *strval = NULL;
+      *intval = *(int64_t *) ((char *)dbmfi + op->offset);
+    }
+
+  if (transcode)
+    {
+      switch (op->override)
+	{
+	  case MOV_TYPE:
+	    *strval = "wav";
+	    break;
+
+	  case MOV_BITRATE:
+	    if (dbmfi->samplerate <= 0)
+	      *intval = 1411;
+	    else
+	      *intval = (dbmfi->samplerate * 8) / 250;
+	    break;
+
+	  case MOV_DESCRIPTION:
+	    *strval = "wav audio file";
+	    break;
+
+	  default:
+	    break;
+	}
+    }
+
+  return 1;
+}
+
+/* Adds the mlit block of the current song to songlist, song is scratch space */
+static int
+daap_songlist_add(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, struct evhttp_request *req, struct meta_plan *plan)
+{
+  struct meta_op *op;
+  char *strval;
+  int transcode;
+  int64_t intval;
+  int32_t val;
+  int i;
+  int ret;
+
+  if (plan->has_override)
+    transcode = transcode_needed(req->input_headers, dbmfi->codectype);
+  else
+    transcode = 0;
+
+  for (i = 0; i < plan->nops; i++)
+    {
+      op = &plan->ops[i];
+
+      if (op->type == MOP_CODECTYPE)
+	{
+	  if (dbmfi->codectype && (dbmfi->codectype[0] != '\0'))
+	    dmap_add_literal(song, op->field->tag, dbmfi->codectype, 4);
+	  continue;
+	}
+
+      if (daap_songlist_value(op, dbmfi, transcode, &strval, &intval))
+	dmap_add_field(song, op->field, strval, intval);
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Done with song\n");
+
+  val = 0;
+  if (plan->want_mikd)
+    val += 9;
+  if (plan->want_asdk)
+    val += 9;
+
+  dmap_add_container(songlist, "mlit", EVBUFFER_LENGTH(song) + val);
+
+  /* Prepend mikd & asdk if needed */
+  if (plan->want_mikd)
+    {
+      /* dmap.itemkind must come first */
+      dmap_add_char(songlist, "mikd", dbmfi->item_kind);
+    }
+  if (plan->want_asdk)
+    dmap_add_char(songlist, "asdk", dbmfi->data_kind);
+
+  ret = evbuffer_add_buffer(songlist, song);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not add song to song list for DAAP song list reply\n");
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Length of the mlit block daap_songlist_add() makes of the current song */
+static size_t
+daap_songlist_len(struct db_media_file_info *dbmfi, struct evhttp_request *req, struct meta_plan *plan)
+{
+  struct meta_op *op;
+  union dmap_value val;
+  char *strval;
+  int transcode;
+  int64_t intval;
+  size_t len;
+  int i;
+
+  if (plan->has_override)
+    transcode = transcode_needed(req->input_headers, dbmfi->codectype);
+  else
+    transcode = 0;
+
+  /* mlit header */
+  len = 8;
+
+  for (i = 0; i < plan->nops; i++)
+    {
+      op = &plan->ops[i];
+
+      if (op->type == MOP_CODECTYPE)
+	{
+	  if (dbmfi->codectype && (dbmfi->codectype[0] != '\0'))
+	    len += 12;
+	  continue;
+	}
+
+      if (daap_songlist_value(op, dbmfi, transcode, &strval, &intval))
+	len += dmap_field_prepare(op->field, strval, intval, &val);
+    }
+
+  if (plan->want_mikd)
+    len += 9;
+  if (plan->want_asdk)
+    len += 9;
+
+  return len;
+}
+
+static void
+daap_songlist_stream_free(void *arg)
+{
+  struct songlist_stream *ss;
+
+  ss = (struct songlist_stream *)arg;
+
+  daap_meta_plan_release(ss->plan);
+
+  if (ss->sctx)
+    daap_sort_context_free(ss->sctx);
+
+  evbuffer_free(ss->song);
+
+  if (ss->ids)
+    free(ss->ids);
+  if (ss->lens)
+    free(ss->lens);
+
+  free(ss);
+}
+
+/* Sizing pass over the song list, the container lengths go out first. The
+ * songs are read in one go, nothing of the query is kept open while the
+ * reply is under way.
+ */
+static int
+daap_songlist_stream_prepare(struct songlist_stream *ss, struct query_params *qp)
+{
+  struct db_media_file_info dbmfi;
+  size_t listlen;
+  size_t *lens;
+  int *ids;
+  int size;
+  int results;
+  int ret;
+
+  /* The count and the rows come from the same snapshot */
+  ret = db_read_begin();
+  if (ret < 0)
+    return -1;
+
+  ret = db_query_start(qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
+
+      db_read_end();
+      return -1;
+    }
+
+  size = 0;
+  listlen = 0;
+  while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
+    {
+      if (ss->nsongs == size)
+	{
+	  size = (size) ? 2 * size : 1024;
+
+	  ids = (int *)realloc(ss->ids, size * sizeof(int));
+	  if (ids)
+	    ss->ids = ids;
+
+	  lens = (size_t *)realloc(ss->lens, size * sizeof(size_t));
+	  if (lens)
+	    ss->lens = lens;
+
+	  if (!ids || !lens)
+	    {
+	      DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
+
+	      ret = -100;
+	      break;
+	    }
+	}
+
+      ss->ids[ss->nsongs] = dbmfi.id;
+      ss->lens[ss->nsongs] = daap_songlist_len(&dbmfi, ss->req, ss->plan);
+
+      listlen += ss->lens[ss->nsongs];
+      ss->nsongs++;
+
+      if (ss->sctx)
+	daap_sort_build(ss->sctx, dbmfi.title_letter);
+    }
+
+  results = qp->results;
+
+  db_query_end(qp);
+  db_read_end();
+
+  if (ret < 0)
+    return ret;
+
+  dmap_add_container(ss->song, ss->tag, listlen + ((ss->sctx) ? EVBUFFER_LENGTH(ss->sctx->headerlist) : 0) + 53);
+  dmap_add_int(ss->song, "mstt", 200);        /* 12 */
+  dmap_add_char(ss->song, "muty", 0);         /* 9 */
+  dmap_add_int(ss->song, "mtco", results);    /* 12 */
+  dmap_add_int(ss->song, "mrco", ss->nsongs); /* 12 */
+  dmap_add_container(ss->song, "mlcl", listlen);
+
+  return 0;
+}
+
+/* Produces the song list DAAP_STREAM_CHUNK_SIZE at a time, reading the songs
+ * by id. The library can change between the sizing pass and this one; as the
+ * lengths have been sent already, the reply is dropped if a song is gone or
+ * doesn't have the same length anymore.
+ */
+static int
+daap_songlist_stream_cb(struct evbuffer *evbuf, void *arg)
+{
+  struct songlist_stream *ss;
+  struct db_media_file_info dbmfi;
+  size_t len;
+  int ret;
+
+  ss = (struct songlist_stream *)arg;
+
+  if (!ss->header_sent)
+    {
+      ret = evbuffer_add_buffer(evbuf, ss->song);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add header to DAAP song list reply\n");
+
+	  return -1;
+	}
+
+      ss->header_sent = 1;
+    }
+
+  ret = 0;
+  while ((ss->next < ss->nsongs) && (EVBUFFER_LENGTH(evbuf) < DAAP_STREAM_CHUNK_SIZE))
+    {
+      ret = db_file_fetch_dbmfi_byid(ss->ids[ss->next], &dbmfi);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Error fetching results\n");
+
+	  break;
+	}
+
+      if (!dbmfi.id || (daap_songlist_len(&dbmfi, ss->req, ss->plan) != ss->lens[ss->next]))
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Library changed while streaming song list\n");
+
+	  ret = -1;
+	  break;
+	}
+
+      len = EVBUFFER_LENGTH(evbuf);
+
+      ret = daap_songlist_add(evbuf, ss->song, &dbmfi, ss->req, ss->plan);
+      if (ret < 0)
+	break;
+
+      if (EVBUFFER_LENGTH(evbuf) - len != ss->lens[ss->next])
+	{
+	  DPRINTF(E_LOG, L_DAAP, "BUG: song list length mismatch for id %d\n", ss->ids[ss->next]);
+
+	  ret = -1;
+	  break;
+	}
+
+      ss->next++;
+    }
+
+  /* Don't hold on to the row, the next chunk is for a later event loop pass */
+  db_file_fetch_dbmfi_end();
+
+  if (ret < 0)
+    return -1;
+
+  if (ss->next < ss->nsongs)
+    return 1;
+
+  DPRINTF(E_DBG, L_DAAP, "Done streaming song list\n");
+
+  if (ss->sctx)
+    {
+      ret = daap_sort_finalize(ss->sctx, evbuf);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add sort headers to DAAP song list reply\n");
 
-  ur->next = update_requests;
-  update_requests = ur;
+	  return -1;
+	}
+    }
 
-  /* If the connection fails before we have an update to push out
-   * to the client, we need to know.
-   */
-  evhttp_connection_set_closecb(req->evcon, update_fail_cb, ur);
+  return 0;
 }
 
-static void
-daap_reply_activity(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
+/* Size of the list a song list request asks for, from counts kept per
+ * library revision rather than a fresh COUNT for every request
+ */
+static int
+daap_songlist_size(struct query_params *qp)
 {
-  /* That's so nice, thanks for letting us know */
-  evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", evbuf);
+  struct playlist_info *pli;
+  int items;
+
+  if (qp->type != Q_PLITEMS)
+    return db_files_get_count_cached();
+
+  pli = db_pl_fetch_byid(qp->id);
+  if (!pli)
+    return -1;
+
+  items = pli->items;
+  free_pli(pli, 0);
+
+  return items;
 }
 
+/* Takes over qp, plan, sctx and song; the reply has been sent or is under
+ * way when this returns
+ */
 static void
-daap_reply_dblist(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
+daap_songlist_stream(struct evhttp_request *req, char *tag, struct query_params *qp, struct meta_plan *plan, struct sort_ctx *sctx, struct evbuffer *song)
 {
-  struct daap_session *s;
-  cfg_t *lib;
-  char *name;
-  int namelen;
-  int count;
+  struct songlist_stream *ss;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
-    return;
+  ss = (struct songlist_stream *)malloc(sizeof(struct songlist_stream));
+  if (!ss)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
 
-  lib = cfg_getsec(cfg, "library");
-  name = cfg_getstr(lib, "name");
-  namelen = strlen(name);
+      dmap_send_error(req, tag, "Out of memory");
+
+      if (qp->filter)
+	free(qp->filter);
+      daap_meta_plan_release(plan);
+      if (sctx)
+	daap_sort_context_free(sctx);
+      evbuffer_free(song);
+      return;
+    }
+
+  memset(ss, 0, sizeof(struct songlist_stream));
+
+  ss->req = req;
+  ss->tag = tag;
+  ss->plan = plan;
+  ss->sctx = sctx;
+  ss->song = song;
+
+  ret = daap_songlist_stream_prepare(ss, qp);
+
+  if (qp->filter)
+    free(qp->filter);
 
-  ret = evbuffer_expand(evbuf, 129 + namelen);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_DAAP, "Could not expand evbuffer for DAAP dblist reply\n");
+      if (ret == -100)
+	dmap_send_error(req, tag, "Out of memory");
+      else
+	dmap_send_error(req, tag, "Could not start query");
 
-      dmap_send_error(req, "avdb", "Out of memory");
-      return;
+      goto out_free_ss;
     }
 
-  dmap_add_container(evbuf, "avdb", 121 + namelen);
-  dmap_add_int(evbuf, "mstt", 200);     /* 12 */
-  dmap_add_char(evbuf, "muty", 0);      /* 9 */
-  dmap_add_int(evbuf, "mtco", 1);       /* 12 */
-  dmap_add_int(evbuf, "mrco", 1);       /* 12 */
-  dmap_add_container(evbuf, "mlcl", 68 + namelen);
-  dmap_add_container(evbuf, "mlit", 60 + namelen);
-  dmap_add_int(evbuf, "miid", 1);       /* 12 */
-  dmap_add_long(evbuf, "mper", 1);      /* 16 */
-  dmap_add_string(evbuf, "minm", name); /* 8 + namelen */
+  DPRINTF(E_DBG, L_DAAP, "Streaming song list, %d songs\n", ss->nsongs);
 
-  count = db_files_get_count();
-  dmap_add_int(evbuf, "mimc", count); /* 12 */
+  ret = httpd_send_reply_chunked(req, HTTP_OK, "OK", daap_songlist_stream_cb, daap_songlist_stream_free, ss);
+  if (ret < 0)
+    {
+      dmap_send_error(req, tag, "Out of memory");
 
-  count = db_pl_get_count();
-  dmap_add_int(evbuf, "mctc", count); /* 12 */
+      goto out_free_ss;
+    }
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+  return;
+
+ out_free_ss:
+  daap_songlist_stream_free(ss);
 }
 
 static void
-daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf, int playlist, struct evkeyvalq *query)
+daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf, struct daap_session *s, int playlist, struct evkeyvalq *query)
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
+  struct daap_delta dd;
   struct evbuffer *song;
   struct evbuffer *songlist;
-  struct dmap_field_map *dfm;
   struct sort_ctx *sctx;
+  struct meta_plan *plan;
   const char *param;
   char *tag;
-  char **strval;
-  char *ptr;
-  uint32_t *meta;
-  int nmeta;
   int sort_headers;
   int nsongs;
-  int transcode;
-  int want_mikd;
-  int want_asdk;
-  int32_t val;
-  int i;
+  int dellen;
   int ret;
 
   DPRINTF(E_DBG, L_DAAP, "Fetching song list for playlist %d\n", playlist);
@@ -1576,20 +2485,13 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 	param = default_meta_plsongs;
     }
 
-  if (param)
+  plan = daap_meta_plan_get(META_SONGS, param);
+  if (!plan)
     {
-      parse_meta(req, tag, param, &meta, &nmeta);
-      if (nmeta < 0)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
+      DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 
-	  goto out_song_free;
-	}
-    }
-  else
-    {
-      meta = NULL;
-      nmeta = 0;
+      dmap_send_error(req, tag, "Out of memory");
+      goto out_song_free;
     }
 
   memset(&qp, 0, sizeof(struct query_params));
@@ -1616,6 +2518,32 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
   else
     qp.type = Q_ITEMS;
 
+  /* Large full lists are sent a chunk at a time from a list of ids instead
+   * of being built in memory first; chunked replies need HTTP/1.1
+   */
+  if ((songlist_stream_tracks > 0) && (qp.offset == 0) && (qp.limit < 0) && (qp.delta == 0)
+      && (req->major == 1) && (req->minor == 1)
+      && (daap_songlist_size(&qp) >= songlist_stream_tracks))
+    {
+      evbuffer_free(songlist);
+
+      daap_songlist_stream(req, tag, &qp, plan, sctx, song);
+      return;
+    }
+
+  qp.cursor = &s->cursor;
+
+  ret = daap_delta_start(&dd, CH_FILE, qp.delta);
+  if (ret < 0)
+    {
+      dmap_send_error(req, tag, "Could not start query");
+
+      if (sort_headers)
+	daap_sort_context_free(sctx);
+
+      goto out_query_free;
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1623,164 +2551,27 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
       dmap_send_error(req, tag, "Could not start query");
 
+      daap_delta_free(&dd);
+
       if (sort_headers)
 	daap_sort_context_free(sctx);
 
       goto out_query_free;
     }
 
-  want_mikd = 0;
-  want_asdk = 0;
   nsongs = 0;
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
       nsongs++;
 
-      transcode = transcode_needed(req->input_headers, dbmfi.codectype);
-
-      i = -1;
-      while (1)
-	{
-	  i++;
-
-	  /* Specific meta tags requested (or default list) */
-	  if (nmeta > 0)
-	    {
-	      if (i == nmeta)
-		break;
-
-	      dfm = dmap_find_field(meta[i]);
-
-	      if (!dfm)
-		{
-		  DPRINTF(E_WARN, L_DAAP, "Could not find requested meta field (%d)\n", i + 1);
-		  continue;
-		}
-	    }
-	  /* No specific meta tags requested, send out everything */
-	  else
-	    {
-	      /* End of list */
-	      if (!dmap_fields[i].field)
-		break;
-
-	      dfm = &dmap_fields[i];
-	    }
-
-	  /* Not in struct media_file_info */
-	  if (dfm->mfi_offset < 0)
-	    continue;
-
-	  /* Will be prepended to the list */
-	  if (dfm->field == &dmap_mikd)
-	    {
-	      /* item kind */
-	      want_mikd = 1;
-	      continue;
-	    }
-	  else if (dfm->field == &dmap_asdk)
-	    {
-	      /* data kind */
-	      want_asdk = 1;
-	      continue;
-	    }
-
-	  DPRINTF(E_DBG, L_DAAP, "Investigating %s\n", dfm->field->desc);
-
-	  strval = (char **) ((char *)&dbmfi + dfm->mfi_offset);
-
-	  if (!(*strval) || (**strval == '\0'))
-            continue;
-
-	  /* Here's one exception ... codectype (ascd) is actually an integer */
-	  if (dfm->field == &dmap_ascd)
-	    {
-	      dmap_add_literal(song, dfm->field->tag, *strval, 4);
-	      continue;
-	    }
-
-	  val = 0;
-
-	  if (transcode)
-            {
-              switch (dfm->mfi_offset)
-                {
-		  case dbmfi_offsetof(type):
-		    ptr = "wav";
-		    strval = &ptr;
-		    break;
-
-		  case dbmfi_offsetof(bitrate):
-		    val = 0;
-		    ret = safe_atoi32(dbmfi.samplerate, &val);
-		    if ((ret < 0) || (val == 0))
-		      val = 1411;
-		    else
-		      val = (val * 8) / 250;
-
-		    ptr = NULL;
-		    strval = &ptr;
-		    break;
-
-		  case dbmfi_offsetof(description):
-		    ptr = "wav audio file";
-		    strval = &ptr;
-		    break;
-
-		  default:
-		    break;
-                }
-            }
-
-	  dmap_add_field(song, dfm->field, *strval, val);
-
-	  DPRINTF(E_DBG, L_DAAP, "Done with meta tag %s (%s)\n", dfm->field->desc, *strval);
-	}
+      daap_delta_sent(&dd, (uint32_t)dbmfi.id);
 
       if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, dbmfi.title);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
-
-	      ret = -100;
-	      break;
-	    }
-   	}
+	daap_sort_build(sctx, dbmfi.title_letter);
 
-      DPRINTF(E_DBG, L_DAAP, "Done with song\n");
-
-      val = 0;
-      if (want_mikd)
-	val += 9;
-      if (want_asdk)
-	val += 9;
-
-      dmap_add_container(songlist, "mlit", EVBUFFER_LENGTH(song) + val);
-
-      /* Prepend mikd & asdk if needed */
-      if (want_mikd)
-	{
-	  /* dmap.itemkind must come first */
-	  ret = safe_atoi32(dbmfi.item_kind, &val);
-	  if (ret < 0)
-	    val = 2; /* music by default */
-	  dmap_add_char(songlist, "mikd", val);
-	}
-      if (want_asdk)
-	{
-	  ret = safe_atoi32(dbmfi.data_kind, &val);
-	  if (ret < 0)
-	    val = 0;
-	  dmap_add_char(songlist, "asdk", val);
-	}
-
-      ret = evbuffer_add_buffer(songlist, song);
+      ret = daap_songlist_add(songlist, song, &dbmfi, req, plan);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_DAAP, "Could not add song to song list for DAAP song list reply\n");
-
 	  ret = -100;
 	  break;
 	}
@@ -1788,8 +2579,10 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
   DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
 
-  if (nmeta > 0)
-    free(meta);
+  if (ret == 0)
+    ret = daap_delta_unwindowed(&dd, &qp);
+
+  daap_meta_plan_release(plan);
 
   evbuffer_free(song);
 
@@ -1808,17 +2601,22 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
       db_query_end(&qp);
 
+      daap_delta_free(&dd);
+
       if (sort_headers)
 	daap_sort_context_free(sctx);
 
       goto out_list_free;
     }
 
+  /* Deleted items of a delta update (mudl) go after the list */
+  dellen = daap_delta_deleted_size(&dd);
+
   /* Add header to evbuf, add songlist to evbuf */
   if (sort_headers)
-    dmap_add_container(evbuf, tag, EVBUFFER_LENGTH(songlist) + EVBUFFER_LENGTH(sctx->headerlist) + 53);
+    dmap_add_container(evbuf, tag, EVBUFFER_LENGTH(songlist) + dellen + EVBUFFER_LENGTH(sctx->headerlist) + 53);
   else
-    dmap_add_container(evbuf, tag, EVBUFFER_LENGTH(songlist) + 53);
+    dmap_add_container(evbuf, tag, EVBUFFER_LENGTH(songlist) + dellen + 53);
   dmap_add_int(evbuf, "mstt", 200);    /* 12 */
   dmap_add_char(evbuf, "muty", 0);     /* 9 */
   dmap_add_int(evbuf, "mtco", qp.results); /* 12 */
@@ -1835,12 +2633,17 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
       dmap_send_error(req, tag, "Out of memory");
 
+      daap_delta_free(&dd);
+
       if (sort_headers)
 	daap_sort_context_free(sctx);
 
       return;
     }
 
+  daap_delta_add_deleted(evbuf, &dd);
+  daap_delta_free(&dd);
+
   if (sort_headers)
     {
       ret = daap_sort_finalize(sctx, evbuf);
@@ -1855,13 +2658,12 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 	}
     }
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+  daap_send_reply(req, evbuf);
 
   return;
 
  out_query_free:
-  if (nmeta > 0)
-    free(meta);
+  daap_meta_plan_release(plan);
 
   if (qp.filter)
     free(qp.filter);
@@ -1882,7 +2684,7 @@ daap_reply_dbsonglist(struct evhttp_request *req, struct evbuffer *evbuf, char *
   if (!s)
     return;
 
-  daap_reply_songlist_generic(req, evbuf, -1, query);
+  daap_reply_songlist_generic(req, evbuf, s, -1, query);
 }
 
 static void
@@ -1904,7 +2706,7 @@ daap_reply_plsonglist(struct evhttp_request *req, struct evbuffer *evbuf, char *
       return;
     }
 
-  daap_reply_songlist_generic(req, evbuf, playlist, query);
+  daap_reply_songlist_generic(req, evbuf, s, playlist, query);
 }
 
 static void
@@ -1912,15 +2714,17 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
 {
   struct query_params qp;
   struct db_playlist_info dbpli;
+  struct daap_delta dd;
   struct daap_session *s;
   struct evbuffer *playlistlist;
   struct evbuffer *playlist;
-  struct dmap_field_map *dfm;
+  struct meta_plan *plan;
+  struct meta_op *op;
   const char *param;
   char **strval;
-  uint32_t *meta;
-  int nmeta;
   int npls;
+  int dellen;
+  uint32_t id;
   int32_t val;
   int i;
   int ret;
@@ -1984,11 +2788,12 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
       param = default_meta_pl;
     }
 
-  parse_meta(req, "aply", param, &meta, &nmeta);
-  if (nmeta < 0)
+  plan = daap_meta_plan_get(META_PLAYLISTS, param);
+  if (!plan)
     {
       DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 
+      dmap_send_error(req, "aply", "Out of memory");
       goto out_pl_free;
     }
 
@@ -1996,12 +2801,21 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
   get_query_params(query, NULL, &qp);
   qp.type = Q_PL;
 
+  ret = daap_delta_start(&dd, CH_PL, qp.delta);
+  if (ret < 0)
+    {
+      dmap_send_error(req, "aply", "Could not start query");
+      goto out_query_free;
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
 
       dmap_send_error(req, "aply", "Could not start query");
+
+      daap_delta_free(&dd);
       goto out_query_free;
     }
 
@@ -2010,21 +2824,16 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
     {
       npls++;
 
-      for (i = 0; i < nmeta; i++)
-	{
-	  dfm = dmap_find_field(meta[i]);
-	  if (!dfm)
-	    {
-	      DPRINTF(E_WARN, L_DAAP, "Could not find requested meta field (%d)\n", i + 1);
-	      continue;
-	    }
+      ret = safe_atou32(dbpli.id, &id);
+      if (ret == 0)
+	daap_delta_sent(&dd, id);
 
-	  /* dmap.itemcount - always added */
-	  if (dfm->field == &dmap_mimc)
-	    continue;
+      for (i = 0; i < plan->nops; i++)
+	{
+	  op = &plan->ops[i];
 
 	  /* com.apple.itunes.smart-playlist - type = 1 AND id != 1 */
-	  if (dfm->field == &dmap_aeSP)
+	  if (op->type == MOP_SMART_PL)
 	    {
 	      val = 0;
 	      ret = safe_atoi32(dbpli.type, &val);
@@ -2046,18 +2855,12 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
 	      continue;
 	    }
 
-	  /* Not in struct playlist_info */
-	  if (dfm->pli_offset < 0)
-	    continue;
-
-          strval = (char **) ((char *)&dbpli + dfm->pli_offset);
+          strval = (char **) ((char *)&dbpli + op->offset);
 
           if (!(*strval) || (**strval == '\0'))
             continue;
 
-	  dmap_add_field(playlist, dfm->field, *strval, 0);
-
-	  DPRINTF(E_DBG, L_DAAP, "Done with meta tag %s (%s)\n", dfm->field->desc, *strval);
+	  dmap_add_field(playlist, op->field, *strval, 0);
 	}
 
       /* Item count (mimc) */
@@ -2090,7 +2893,10 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
 
   DPRINTF(E_DBG, L_DAAP, "Done with playlist list, %d playlists\n", npls);
 
-  free(meta);
+  if (ret == 0)
+    ret = daap_delta_unwindowed(&dd, &qp);
+
+  daap_meta_plan_release(plan);
   evbuffer_free(playlist);
 
   if (qp.filter)
@@ -2107,11 +2913,16 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
 	}
 
       db_query_end(&qp);
+
+      daap_delta_free(&dd);
       goto out_list_free;
     }
 
+  /* Deleted playlists of a delta update (mudl) go after the list */
+  dellen = daap_delta_deleted_size(&dd);
+
   /* Add header to evbuf, add playlistlist to evbuf */
-  dmap_add_container(evbuf, "aply", EVBUFFER_LENGTH(playlistlist) + 53);
+  dmap_add_container(evbuf, "aply", EVBUFFER_LENGTH(playlistlist) + dellen + 53);
   dmap_add_int(evbuf, "mstt", 200); /* 12 */
   dmap_add_char(evbuf, "muty", 0);  /* 9 */
   dmap_add_int(evbuf, "mtco", qp.results); /* 12 */
@@ -2127,15 +2938,20 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
       DPRINTF(E_LOG, L_DAAP, "Could not add playlist list to DAAP playlists reply\n");
 
       dmap_send_error(req, "aply", "Out of memory");
+
+      daap_delta_free(&dd);
       return;
     }
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+  daap_delta_add_deleted(evbuf, &dd);
+  daap_delta_free(&dd);
+
+  daap_send_reply(req, evbuf);
 
   return;
 
  out_query_free:
-  free(meta);
+  daap_meta_plan_release(plan);
   if (qp.filter)
     free(qp.filter);
 
@@ -2154,12 +2970,11 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   struct daap_session *s;
   struct evbuffer *group;
   struct evbuffer *grouplist;
-  struct dmap_field_map *dfm;
+  struct meta_plan *plan;
+  struct meta_op *op;
   struct sort_ctx *sctx;
   const char *param;
   char **strval;
-  uint32_t *meta;
-  int nmeta;
   int sort_headers;
   int ngrp;
   int32_t val;
@@ -2229,11 +3044,12 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
       param = default_meta_group;
     }
 
-  parse_meta(req, tag, param, &meta, &nmeta);
-  if (nmeta < 0)
+  plan = daap_meta_plan_get(META_GROUPS, param);
+  if (!plan)
     {
       DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 
+      dmap_send_error(req, tag, "Out of memory");
       goto out_group_free;
     }
 
@@ -2272,44 +3088,20 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
     {
       ngrp++;
 
-      for (i = 0; i < nmeta; i++)
+      for (i = 0; i < plan->nops; i++)
 	{
-	  dfm = dmap_find_field(meta[i]);
-	  if (!dfm)
-	    {
-	      DPRINTF(E_WARN, L_DAAP, "Could not find requested meta field (%d)\n", i + 1);
-	      continue;
-	    }
+	  op = &plan->ops[i];
 
-	  /* dmap.itemcount - always added */
-	  if (dfm->field == &dmap_mimc)
-	    continue;
-
-	  /* Not in struct group_info */
-	  if (dfm->gri_offset < 0)
-	    continue;
-
-          strval = (char **) ((char *)&dbgri + dfm->gri_offset);
+          strval = (char **) ((char *)&dbgri + op->offset);
 
           if (!(*strval) || (**strval == '\0'))
             continue;
 
-	  dmap_add_field(group, dfm->field, *strval, 0);
-
-	  DPRINTF(E_DBG, L_DAAP, "Done with meta tag %s (%s)\n", dfm->field->desc, *strval);
+	  dmap_add_field(group, op->field, *strval, 0);
 	}
 
       if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, dbgri.itemname);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP groups reply\n");
-
-	      ret = -100;
-	      break;
-	    }
-	}
+	daap_sort_build(sctx, daap_sort_letter(dbgri.itemname));
 
       /* Item count, always added (mimc) */
       val = 0;
@@ -2341,7 +3133,7 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 
   DPRINTF(E_DBG, L_DAAP, "Done with group list, %d groups\n", ngrp);
 
-  free(meta);
+  daap_meta_plan_release(plan);
   evbuffer_free(group);
 
   if (qp.filter)
@@ -2407,12 +3199,12 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 	}
     }
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+  daap_send_reply(req, evbuf);
 
   return;
 
  out_query_free:
-  free(meta);
+  daap_meta_plan_release(plan);
   if (qp.filter)
     free(qp.filter);
 
@@ -2502,6 +3294,8 @@ daap_reply_browse(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 
   get_query_params(query, &sort_headers, &qp);
 
+  qp.cursor = &s->cursor;
+
   sctx = NULL;
   if (sort_headers)
     {
@@ -2541,15 +3335,7 @@ daap_reply_browse(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
       nitems++;
 
       if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, browse_item);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP browse reply\n");
-
-	      break;
-	    }
-	}
+	daap_sort_build(sctx, daap_sort_letter(browse_item));
 
       dmap_add_string(itemlist, "mlit", browse_item);
     }
@@ -2612,7 +3398,7 @@ daap_reply_browse(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 	}
     }
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf);
+  daap_send_reply(req, evbuf);
 }
 
 /* NOTE: We only handle artwork at the moment */
@@ -2879,11 +3665,13 @@ static struct uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/browse/[^/]+$",
-      .handler = daap_reply_browse
+      .handler = daap_reply_browse,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items$",
-      .handler = daap_reply_dbsonglist
+      .handler = daap_reply_dbsonglist,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+[.][^/]+$",
@@ -2895,15 +3683,18 @@ static struct uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers$",
-      .handler = daap_reply_playlists
+      .handler = daap_reply_playlists,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers/[[:digit:]]+/items$",
-      .handler = daap_reply_plsonglist
+      .handler = daap_reply_plsonglist,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups$",
-      .handler = daap_reply_groups
+      .handler = daap_reply_groups,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups/[[:digit:]]+/extra_data/artwork$",
@@ -3091,8 +3882,32 @@ daap_request(struct evhttp_request *req)
    */
   evhttp_add_header(req->output_headers, "Content-Type", "application/x-dmap-tagged");
 
+  if (daap_handlers[handler].cacheable)
+    {
+      /* The session is checked here as well, cached replies don't get
+       * as far as the handler
+       */
+      if (!daap_session_find(req, &query, evbuf))
+	goto out;
+
+      reply_cache_key = daap_cache_key(req, uri_parts, &query);
+      if (reply_cache_key)
+	{
+	  ret = httpd_cache_send(req, reply_cache_key, &reply_cache_rev);
+	  if (ret == 0)
+	    goto out;
+	}
+    }
+
   daap_handlers[handler].handler(req, evbuf, uri_parts, &query);
 
+ out:
+  if (reply_cache_key)
+    {
+      free(reply_cache_key);
+      reply_cache_key = NULL;
+    }
+
   evbuffer_free(evbuf);
   evhttp_clear_headers(&query);
   free(uri);
@@ -3135,17 +3950,35 @@ int
 daap_init(void)
 {
   char buf[64];
-  avl_node_t *node;
-  struct dmap_field_map *dfm;
   int i;
   int ret;
 
   next_session_id = 100; /* gotta start somewhere, right? */
   update_requests = NULL;
 
-  ret = daap_query_init();
+#ifdef USE_EVENTFD
+  update_efd = eventfd(0, EFD_CLOEXEC);
+  if (update_efd < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not create update eventfd: %s\n", strerror(errno));
+
+      return -1;
+    }
+#else
+# if defined(__linux__)
+  ret = pipe2(update_pipe, O_CLOEXEC);
+# else
+  ret = pipe(update_pipe);
+# endif
   if (ret < 0)
-    return ret;
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not create update pipe: %s\n", strerror(errno));
+
+      return -1;
+    }
+#endif /* USE_EVENTFD */
+
+  songlist_stream_tracks = cfg_getint(cfg_getsec(cfg, "library"), "songlist_stream_tracks");
 
   for (i = 0; daap_handlers[i].handler; i++)
     {
@@ -3167,50 +4000,28 @@ daap_init(void)
       goto daap_avl_alloc_fail;
     }
 
-  dmap_fields_hash = avl_alloc_tree(dmap_field_map_compare, NULL);
-  if (!dmap_fields_hash)
-    {
-      DPRINTF(E_FATAL, L_DAAP, "DAAP init could not allocate DMAP fields AVL tree\n");
-
-      goto dmap_avl_alloc_fail;
-    }
-
-  for (i = 0; dmap_fields[i].field; i++)
-    {
-      dmap_fields[i].hash = djb_hash(dmap_fields[i].field->desc, strlen(dmap_fields[i].field->desc));
-
-      node = avl_insert(dmap_fields_hash, &dmap_fields[i]);
-      if (!node)
-	{
-	  if (errno != EEXIST)
-	    DPRINTF(E_FATAL, L_DAAP, "DAAP init failed; AVL insert error: %s\n", strerror(errno));
-	  else
-	    {
-	      node = avl_search(dmap_fields_hash, &dmap_fields[i]);
-	      dfm = node->item;
-
-	      DPRINTF(E_FATAL, L_DAAP, "DAAP init failed; WARNING: duplicate hash key\n");
-	      DPRINTF(E_FATAL, L_DAAP, "Hash %x, string %s\n", dmap_fields[i].hash, dmap_fields[i].field->desc);
-
-	      DPRINTF(E_FATAL, L_DAAP, "Hash %x, string %s\n", dfm->hash, dfm->field->desc);
-	    }
+#ifdef USE_EVENTFD
+  event_set(&updateev, update_efd, EV_READ, libraryupdate_cb, NULL);
+#else
+  event_set(&updateev, update_pipe[0], EV_READ, libraryupdate_cb, NULL);
+#endif
+  event_base_set(evbase_httpd, &updateev);
+  event_add(&updateev, NULL);
 
-	  goto dmap_avl_insert_fail;
-	}
-    }
+  db_library_set_update_handler(daap_library_update_handler);
 
   return 0;
 
- dmap_avl_insert_fail:
-  avl_free_tree(dmap_fields_hash);
- dmap_avl_alloc_fail:
-  avl_free_tree(daap_sessions);
  daap_avl_alloc_fail:
   for (i = 0; daap_handlers[i].handler; i++)
     regfree(&daap_handlers[i].preg);
  regexp_fail:
-  daap_query_deinit();
-
+#ifdef USE_EVENTFD
+  close(update_efd);
+#else
+  close(update_pipe[0]);
+  close(update_pipe[1]);
+#endif
   return -1;
 }
 
@@ -3220,13 +4031,14 @@ daap_deinit(void)
   struct daap_update_request *ur;
   int i;
 
-  daap_query_deinit();
+  db_library_set_update_handler(NULL);
 
   for (i = 0; daap_handlers[i].handler; i++)
     regfree(&daap_handlers[i].preg);
 
   avl_free_tree(daap_sessions);
-  avl_free_tree(dmap_fields_hash);
+
+  daap_meta_plan_flush();
 
   for (ur = update_requests; update_requests; ur = update_requests)
     {
@@ -3240,4 +4052,13 @@ daap_deinit(void)
 
       free(ur);
     }
+
+  event_del(&updateev);
+
+#ifdef USE_EVENTFD
+  close(update_efd);
+#else
+  close(update_pipe[0]);
+  close(update_pipe[1]);
+#endif
 }
@@ -39,7 +39,6 @@
 
 #include <event.h>
 #include "evhttp/evhttp.h"
-#include <avl.h>
 
 #include "logger.h"
 #include "misc.h"
@@ -78,7 +77,6 @@ typedef void (*dacp_propget)(struct evbuffer *evbuf, struct player_status *statu
 typedef void (*dacp_propset)(const char *value, struct evkeyvalq *query);
 
 struct dacp_prop_map {
-  uint32_t hash;
   char *desc;
   dacp_propget propget;
   dacp_propset propset;
@@ -117,21 +115,8 @@ dacp_propset_repeatstate(const char *value, struct evkeyvalq *query);
 static void
 dacp_propset_userrating(const char *value, struct evkeyvalq *query);
 
-static struct dacp_prop_map dacp_props[] =
-  {
-    { 0, "dmcp.volume",                 dacp_propget_volume,                 dacp_propset_volume },
-    { 0, "dacp.playerstate",            dacp_propget_playerstate,            NULL },
-    { 0, "dacp.nowplaying",             dacp_propget_nowplaying,             NULL },
-    { 0, "dacp.playingtime",            dacp_propget_playingtime,            dacp_propset_playingtime },
-    { 0, "dacp.volumecontrollable",     dacp_propget_volumecontrollable,     NULL },
-    { 0, "dacp.availableshufflestates", dacp_propget_availableshufflestates, NULL },
-    { 0, "dacp.availablerepeatstates",  dacp_propget_availablerepeatstates,  NULL },
-    { 0, "dacp.shufflestate",           dacp_propget_shufflestate,           dacp_propset_shufflestate },
-    { 0, "dacp.repeatstate",            dacp_propget_repeatstate,            dacp_propset_repeatstate },
-    { 0, "dacp.userrating",             NULL,                                dacp_propset_userrating },
-
-    { 0, NULL, NULL, NULL }
-  };
+/* Generated from dmap_fields.def */
+#include "dacp_props_hash.h"
 
 
 /* Play status update */
@@ -146,9 +131,6 @@ static int current_rev;
 /* Play status update requests */
 static struct dacp_update_request *update_requests;
 
-/* Properties */
-static avl_tree_t *dacp_props_hash;
-
 /* Seek timer */
 static struct event seek_timer;
 static int seek_target;
@@ -395,43 +377,13 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
 
 
 /* Properties helpers */
-static int
-dacp_prop_map_compare(const void *aa, const void *bb)
-{
-  struct dacp_prop_map *a = (struct dacp_prop_map *)aa;
-  struct dacp_prop_map *b = (struct dacp_prop_map *)bb;
-
-  if (a->hash < b->hash)
-    return -1;
-
-  if (a->hash > b->hash)
-    return 1;
-
-  return 0;
-}
-
-static struct dacp_prop_map *
-dacp_find_prop(uint32_t hash)
-{
-  struct dacp_prop_map dpm;
-  avl_node_t *node;
-
-  dpm.hash = hash;
-
-  node = avl_search(dacp_props_hash, &dpm);
-  if (!node)
-    return NULL;
-
-  return (struct dacp_prop_map *)node->item;
-}
-
 static void
-parse_properties(struct evhttp_request *req, char *tag, const char *param, uint32_t **out_prop, int *out_nprop)
+parse_properties(struct evhttp_request *req, char *tag, const char *param, const struct dacp_prop_map ***out_prop, int *out_nprop)
 {
   char *ptr;
   char *prop;
   char *propstr;
-  uint32_t *hashes;
+  const struct dacp_prop_map **props;
   int nprop;
   int i;
 
@@ -453,8 +405,8 @@ parse_properties(struct evhttp_request *req, char *tag, const char *param, uint3
 
   DPRINTF(E_DBG, L_DACP, "Asking for %d properties\n", nprop);
 
-  hashes = (uint32_t *)malloc((nprop + 1) * sizeof(uint32_t));
-  if (!hashes)
+  props = (const struct dacp_prop_map **)malloc((nprop + 1) * sizeof(struct dacp_prop_map *));
+  if (!props)
     {
       DPRINTF(E_LOG, L_DACP, "Could not allocate properties array; out of memory\n");
 
@@ -463,22 +415,20 @@ parse_properties(struct evhttp_request *req, char *tag, const char *param, uint3
       free(propstr);
       return;
     }
-  memset(hashes, 0, (nprop + 1) * sizeof(uint32_t));
+  memset(props, 0, (nprop + 1) * sizeof(struct dacp_prop_map *));
 
   prop = strtok_r(propstr, ",", &ptr);
-  for (i = 0; i < nprop; i++)
+  for (i = 0; (i < nprop) && prop; i++)
     {
-      hashes[i] = djb_hash(prop, strlen(prop));
+      props[i] = dacp_props_find(prop);
 
       prop = strtok_r(NULL, ",", &ptr);
-      if (!prop)
-        break;
     }
 
   DPRINTF(E_DBG, L_DACP, "Found %d properties\n", nprop);
 
   *out_nprop = nprop;
-  *out_prop = hashes;
+  *out_prop = props;
 
   free(propstr);
 }
@@ -722,6 +672,7 @@ dacp_propset_userrating(const char *value, struct evkeyvalq *query)
    * skip unicode_fixup_mfi() before the update
    */
   db_file_update(mfi);
+  db_library_revision_seal();
 
   free_mfi(mfi, 0);
 }
@@ -1296,11 +1247,11 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
 {
   struct player_status status;
   struct daap_session *s;
-  struct dacp_prop_map *dpm;
+  const struct dacp_prop_map *dpm;
+  const struct dacp_prop_map **prop;
   struct media_file_info *mfi;
   struct evbuffer *proplist;
   const char *param;
-  uint32_t *prop;
   int nprop;
   int i;
   int ret;
@@ -1353,7 +1304,7 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
 
   for (i = 0; i < nprop; i++)
     {
-      dpm = dacp_find_prop(prop[i]);
+      dpm = prop[i];
       if (!dpm)
 	{
 	  DPRINTF(E_LOG, L_DACP, "Could not find requested property (%d)\n", i + 1);
@@ -1401,9 +1352,8 @@ static void
 dacp_reply_setproperty(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
   struct daap_session *s;
-  struct dacp_prop_map *dpm;
+  const struct dacp_prop_map *dpm;
   struct evkeyval *param;
-  uint32_t hash;
 
   s = daap_session_find(req, query, evbuf);
   if (!s)
@@ -1420,10 +1370,7 @@ dacp_reply_setproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
 
   TAILQ_FOREACH(param, query, next)
     {
-      hash = djb_hash(param->key, strlen(param->key));
-
-      dpm = dacp_find_prop(hash);
-
+      dpm = dacp_props_find(param->key);
       if (!dpm)
 	{
 	  DPRINTF(E_SPAM, L_DACP, "Unknown DACP property %s\n", param->key);
@@ -1785,8 +1732,6 @@ int
 dacp_init(void)
 {
   char buf[64];
-  avl_node_t *node;
-  struct dacp_prop_map *dpm;
   int i;
   int ret;
 
@@ -1827,38 +1772,6 @@ dacp_init(void)
         }
     }
 
-  dacp_props_hash = avl_alloc_tree(dacp_prop_map_compare, NULL);
-  if (!dacp_props_hash)
-    {
-      DPRINTF(E_FATAL, L_DACP, "DACP init could not allocate DACP props AVL tree\n");
-
-      goto dacp_avl_alloc_fail;
-    }
-
-  for (i = 0; dacp_props[i].desc; i++)
-    {
-      dacp_props[i].hash = djb_hash(dacp_props[i].desc, strlen(dacp_props[i].desc));
-
-      node = avl_insert(dacp_props_hash, &dacp_props[i]);
-      if (!node)
-        {
-          if (errno != EEXIST)
-            DPRINTF(E_FATAL, L_DACP, "DACP init failed; AVL insert error: %s\n", strerror(errno));
-          else
-            {
-              node = avl_search(dacp_props_hash, &dacp_props[i]);
-              dpm = node->item;
-
-              DPRINTF(E_FATAL, L_DACP, "DACP init failed; WARNING: duplicate hash key\n");
-              DPRINTF(E_FATAL, L_DACP, "Hash %x, string %s\n", dacp_props[i].hash, dacp_props[i].desc);
-
-              DPRINTF(E_FATAL, L_DACP, "Hash %x, string %s\n", dpm->hash, dpm->desc);
-            }
-
-          goto dacp_avl_insert_fail;
-        }
-    }
-
 #ifdef USE_EVENTFD
   event_set(&updateev, update_efd, EV_READ, playstatusupdate_cb, NULL);
 #else
@@ -1871,11 +1784,6 @@ dacp_init(void)
 
   return 0;
 
- dacp_avl_insert_fail:
-  avl_free_tree(dacp_props_hash);
- dacp_avl_alloc_fail:
-  for (i = 0; dacp_handlers[i].handler; i++)
-    regfree(&dacp_handlers[i].preg);
  regexp_fail:
 #ifdef USE_EVENTFD
   close(update_efd);
@@ -1912,8 +1820,6 @@ dacp_deinit(void)
 
   event_del(&updateev);
 
-  avl_free_tree(dacp_props_hash);
-
 #ifdef USE_EVENTFD
   close(update_efd);
 #else
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <regex.h>
@@ -55,6 +56,8 @@
 #define F_ID       (1 << 2)
 #define F_DETAILED (1 << 3)
 #define F_ALWAYS   (F_FULL | F_BROWSE | F_ID | F_DETAILED)
+/* Not a mode; integer field in struct db_media_file_info */
+#define F_INT      (1 << 4)
 
 struct field_map {
   char *field;
@@ -83,7 +86,7 @@ static const struct field_map pl_fields[] =
 
 static const struct field_map rsp_fields[] =
   {
-    { "id",            dbmfi_offsetof(id),            F_ALWAYS },
+    { "id",            dbmfi_offsetof(id),            F_ALWAYS | F_INT },
     { "path",          dbmfi_offsetof(path),          F_DETAILED },
     { "fname",         dbmfi_offsetof(fname),         F_DETAILED },
     { "title",         dbmfi_offsetof(title),         F_ALWAYS },
@@ -96,32 +99,32 @@ static const struct field_map rsp_fields[] =
     { "orchestra",     dbmfi_offsetof(orchestra),     F_DETAILED | F_FULL },
     { "conductor",     dbmfi_offsetof(conductor),     F_DETAILED | F_FULL },
     { "url",           dbmfi_offsetof(url),           F_DETAILED | F_FULL },
-    { "bitrate",       dbmfi_offsetof(bitrate),       F_DETAILED | F_FULL },
-    { "samplerate",    dbmfi_offsetof(samplerate),    F_DETAILED | F_FULL },
-    { "song_length",   dbmfi_offsetof(song_length),   F_DETAILED | F_FULL },
-    { "file_size",     dbmfi_offsetof(file_size),     F_DETAILED | F_FULL },
-    { "year",          dbmfi_offsetof(year),          F_DETAILED | F_FULL },
-    { "track",         dbmfi_offsetof(track),         F_DETAILED | F_FULL | F_BROWSE },
-    { "total_tracks",  dbmfi_offsetof(total_tracks),  F_DETAILED | F_FULL },
-    { "disc",          dbmfi_offsetof(disc),          F_DETAILED | F_FULL | F_BROWSE },
-    { "total_discs",   dbmfi_offsetof(total_discs),   F_DETAILED | F_FULL },
-    { "bpm",           dbmfi_offsetof(bpm),           F_DETAILED | F_FULL },
-    { "compilation",   dbmfi_offsetof(compilation),   F_DETAILED | F_FULL },
-    { "rating",        dbmfi_offsetof(rating),        F_DETAILED | F_FULL },
-    { "play_count",    dbmfi_offsetof(play_count),    F_DETAILED | F_FULL },
-    { "data_kind",     dbmfi_offsetof(data_kind),     F_DETAILED },
-    { "item_kind",     dbmfi_offsetof(item_kind),     F_DETAILED },
+    { "bitrate",       dbmfi_offsetof(bitrate),       F_DETAILED | F_FULL | F_INT },
+    { "samplerate",    dbmfi_offsetof(samplerate),    F_DETAILED | F_FULL | F_INT },
+    { "song_length",   dbmfi_offsetof(song_length),   F_DETAILED | F_FULL | F_INT },
+    { "file_size",     dbmfi_offsetof(file_size),     F_DETAILED | F_FULL | F_INT },
+    { "year",          dbmfi_offsetof(year),          F_DETAILED | F_FULL | F_INT },
+    { "track",         dbmfi_offsetof(track),         F_DETAILED | F_FULL | F_BROWSE | F_INT },
+    { "total_tracks",  dbmfi_offsetof(total_tracks),  F_DETAILED | F_FULL | F_INT },
+    { "disc",          dbmfi_offsetof(disc),          F_DETAILED | F_FULL | F_BROWSE | F_INT },
+    { "total_discs",   dbmfi_offsetof(total_discs),   F_DETAILED | F_FULL | F_INT },
+    { "bpm",           dbmfi_offsetof(bpm),           F_DETAILED | F_FULL | F_INT },
+    { "compilation",   dbmfi_offsetof(compilation),   F_DETAILED | F_FULL | F_INT },
+    { "rating",        dbmfi_offsetof(rating),        F_DETAILED | F_FULL | F_INT },
+    { "play_count",    dbmfi_offsetof(play_count),    F_DETAILED | F_FULL | F_INT },
+    { "data_kind",     dbmfi_offsetof(data_kind),     F_DETAILED | F_INT },
+    { "item_kind",     dbmfi_offsetof(item_kind),     F_DETAILED | F_INT },
     { "description",   dbmfi_offsetof(description),   F_DETAILED | F_FULL },
-    { "time_added",    dbmfi_offsetof(time_added),    F_DETAILED | F_FULL },
-    { "time_modified", dbmfi_offsetof(time_modified), F_DETAILED | F_FULL },
-    { "time_played",   dbmfi_offsetof(time_played),   F_DETAILED | F_FULL },
-    { "db_timestamp",  dbmfi_offsetof(db_timestamp),  F_DETAILED },
-    { "disabled",      dbmfi_offsetof(disabled),      F_ALWAYS },
-    { "sample_count",  dbmfi_offsetof(sample_count),  F_DETAILED },
+    { "time_added",    dbmfi_offsetof(time_added),    F_DETAILED | F_FULL | F_INT },
+    { "time_modified", dbmfi_offsetof(time_modified), F_DETAILED | F_FULL | F_INT },
+    { "time_played",   dbmfi_offsetof(time_played),   F_DETAILED | F_FULL | F_INT },
+    { "db_timestamp",  dbmfi_offsetof(db_timestamp),  F_DETAILED | F_INT },
+    { "disabled",      dbmfi_offsetof(disabled),      F_ALWAYS | F_INT },
+    { "sample_count",  dbmfi_offsetof(sample_count),  F_DETAILED | F_INT },
     { "codectype",     dbmfi_offsetof(codectype),     F_ALWAYS },
-    { "idx",           dbmfi_offsetof(idx),           F_DETAILED },
-    { "has_video",     dbmfi_offsetof(has_video),     F_DETAILED },
-    { "contentrating", dbmfi_offsetof(contentrating), F_DETAILED },
+    { "idx",           dbmfi_offsetof(idx),           F_DETAILED | F_INT },
+    { "has_video",     dbmfi_offsetof(has_video),     F_DETAILED | F_INT },
+    { "contentrating", dbmfi_offsetof(contentrating), F_DETAILED | F_INT },
     { NULL,            0,                             0 }
   };
 
@@ -351,6 +354,8 @@ rsp_reply_db(struct evhttp_request *req, char **uri, struct evkeyvalq *query)
   mxml_node_t *status;
   mxml_node_t *pls;
   mxml_node_t *pl;
+  mxml_node_t *count;
+  mxml_node_t *total;
   mxml_node_t *node;
   int i;
   int ret;
@@ -385,11 +390,9 @@ rsp_reply_db(struct evhttp_request *req, char **uri, struct evkeyvalq *query)
   node = mxmlNewElement(status, "errorstring");
   mxmlNewText(node, 0, "");
 
-  node = mxmlNewElement(status, "records");
-  mxmlNewTextf(node, 0, "%d", qp.results);
-
-  node = mxmlNewElement(status, "totalrecords");
-  mxmlNewTextf(node, 0, "%d", qp.results);
+  /* Filled in once all results have been fetched */
+  count = mxmlNewElement(status, "records");
+  total = mxmlNewElement(status, "totalrecords");
 
   /* Playlists block (all playlists) */
   while (((ret = db_query_fetch_pl(&qp, &dbpli)) == 0) && (dbpli.id))
@@ -419,6 +422,9 @@ rsp_reply_db(struct evhttp_request *req, char **uri, struct evkeyvalq *query)
       return;
     }
 
+  mxmlNewTextf(count, 0, "%d", qp.results);
+  mxmlNewTextf(total, 0, "%d", qp.results);
+
   /* HACK
    * Add a dummy empty string to the playlists element if there is no data
    * to return - this prevents mxml from sending out an empty <playlists/>
@@ -443,11 +449,13 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
   mxml_node_t *status;
   mxml_node_t *items;
   mxml_node_t *item;
+  mxml_node_t *count;
+  mxml_node_t *total;
   mxml_node_t *node;
   int mode;
   int records;
   int transcode;
-  int32_t bitrate;
+  int64_t intval;
   int i;
   int ret;
 
@@ -497,13 +505,6 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
       return;
     }
 
-  if (qp.offset > qp.results)
-    records = 0;
-  else if (qp.limit > (qp.results - qp.offset))
-    records = qp.results - qp.offset;
-  else
-    records = qp.limit;
-
   /* We'd use mxmlNewXML(), but then we can't put any attributes
    * on the root node and we need some.
    */
@@ -520,11 +521,9 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
   node = mxmlNewElement(status, "errorstring");
   mxmlNewText(node, 0, "");
 
-  node = mxmlNewElement(status, "records");
-  mxmlNewTextf(node, 0, "%d", records);
-
-  node = mxmlNewElement(status, "totalrecords");
-  mxmlNewTextf(node, 0, "%d", qp.results);
+  /* Filled in once all results have been fetched */
+  count = mxmlNewElement(status, "records");
+  total = mxmlNewElement(status, "totalrecords");
 
   /* Items block (all items) */
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
@@ -539,6 +538,26 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 	  if (!(rsp_fields[i].flags & mode))
 	    continue;
 
+	  /* Integers are sent out as they are, transcoding doesn't touch them
+	   * except for the bitrate
+	   */
+	  if (rsp_fields[i].flags & F_INT)
+	    {
+	      intval = *(int64_t *) ((char *)&dbmfi + rsp_fields[i].offset);
+
+	      if (transcode && (rsp_fields[i].offset == dbmfi_offsetof(bitrate)))
+		{
+		  if (dbmfi.samplerate <= 0)
+		    intval = 1411;
+		  else
+		    intval = (dbmfi.samplerate * 8) / 250;
+		}
+
+	      node = mxmlNewElement(item, rsp_fields[i].field);
+	      mxmlNewTextf(node, 0, "%" PRIi64, intval);
+	      continue;
+	    }
+
 	  strval = (char **) ((char *)&dbmfi + rsp_fields[i].offset);
 
 	  if (!(*strval) || (strlen(*strval) == 0))
@@ -556,17 +575,6 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 		    mxmlNewText(node, 0, "wav");
 		    break;
 
-		  case dbmfi_offsetof(bitrate):
-		    bitrate = 0;
-		    ret = safe_atoi32(dbmfi.samplerate, &bitrate);
-		    if ((ret < 0) || (bitrate == 0))
-		      bitrate = 1411;
-		    else
-		      bitrate = (bitrate * 8) / 250;
-
-		    mxmlNewTextf(node, 0, "%d", bitrate);
-		    break;
-
 		  case dbmfi_offsetof(description):
 		    mxmlNewText(node, 0, "wav audio file");
 		    break;
@@ -599,6 +607,16 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
       return;
     }
 
+  if (qp.offset > qp.results)
+    records = 0;
+  else if (qp.limit > (qp.results - qp.offset))
+    records = qp.results - qp.offset;
+  else
+    records = qp.limit;
+
+  mxmlNewTextf(count, 0, "%d", records);
+  mxmlNewTextf(total, 0, "%d", qp.results);
+
   /* HACK
    * Add a dummy empty string to the items element if there is no data
    * to return - this prevents mxml from sending out an empty <items/>
@@ -620,6 +638,8 @@ rsp_reply_browse(struct evhttp_request *req, char **uri, struct evkeyvalq *query
   mxml_node_t *reply;
   mxml_node_t *status;
   mxml_node_t *items;
+  mxml_node_t *count;
+  mxml_node_t *total;
   mxml_node_t *node;
   int records;
   int ret;
@@ -665,13 +685,6 @@ rsp_reply_browse(struct evhttp_request *req, char **uri, struct evkeyvalq *query
       return;
     }
 
-  if (qp.offset > qp.results)
-    records = 0;
-  else if (qp.limit > (qp.results - qp.offset))
-    records = qp.results - qp.offset;
-  else
-    records = qp.limit;
-
   /* We'd use mxmlNewXML(), but then we can't put any attributes
    * on the root node and we need some.
    */
@@ -688,11 +701,9 @@ rsp_reply_browse(struct evhttp_request *req, char **uri, struct evkeyvalq *query
   node = mxmlNewElement(status, "errorstring");
   mxmlNewText(node, 0, "");
 
-  node = mxmlNewElement(status, "records");
-  mxmlNewTextf(node, 0, "%d", records);
-
-  node = mxmlNewElement(status, "totalrecords");
-  mxmlNewTextf(node, 0, "%d", qp.results);
+  /* Filled in once all results have been fetched */
+  count = mxmlNewElement(status, "records");
+  total = mxmlNewElement(status, "totalrecords");
 
   /* Items block (all items) */
   while (((ret = db_query_fetch_string(&qp, &browse_item)) == 0) && (browse_item))
@@ -714,6 +725,16 @@ rsp_reply_browse(struct evhttp_request *req, char **uri, struct evkeyvalq *query
       return;
     }
 
+  if (qp.offset > qp.results)
+    records = 0;
+  else if (qp.limit > (qp.results - qp.offset))
+    records = qp.results - qp.offset;
+  else
+    records = qp.limit;
+
+  mxmlNewTextf(count, 0, "%d", records);
+  mxmlNewTextf(total, 0, "%d", qp.results);
+
   /* HACK
    * Add a dummy empty string to the items element if there is no data
    * to return - this prevents mxml from sending out an empty <items/>
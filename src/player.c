@@ -545,19 +545,11 @@ player_queue_make(struct query_params *qp, const char *sort)
       return NULL;
     }
 
-  DPRINTF(E_DBG, L_PLAYER, "Player queue query returned %d items\n", qp->results);
-
   q_head = NULL;
   q_tail = NULL;
   while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
     {
-      ret = safe_atou32(dbmfi.id, &id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_PLAYER, "Invalid song id in query result!\n");
-
-	  continue;
-	}
+      id = dbmfi.id;
 
       ps = (struct player_source *)malloc(sizeof(struct player_source));
       if (!ps)
@@ -589,6 +581,8 @@ player_queue_make(struct query_params *qp, const char *sort)
       DPRINTF(E_DBG, L_PLAYER, "Added song id %d (%s)\n", id, dbmfi.title);
     }
 
+  DPRINTF(E_DBG, L_PLAYER, "Player queue query returned %d items\n", qp->results);
+
   db_query_end(qp);
 
   if (ret < 0)